@@ -0,0 +1,136 @@
+#pragma once
+
+//
+// Replaces the global allocation functions to keep track of the number and
+// the size of the heap allocations made by the process.
+// It must be included by exactly one translation unit of each benchmark.
+//
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+namespace alloc_counter {
+
+//! Number of allocations.
+static std::atomic<uint64_t> allocations{0};
+//! Number of bytes allocated.
+static std::atomic<uint64_t> bytes{0};
+//! Allocations with a size greater or equal to `large_threshold`.
+static std::atomic<uint64_t> large_allocations{0};
+//! Size from which an allocation will be counted as large.
+static std::atomic<std::size_t> large_threshold{std::size_t(-1)};
+//! Size of the largest allocation.
+static std::atomic<std::size_t> largest{0};
+//! Number of bytes currently allocated.
+static std::atomic<int64_t> live_bytes{0};
+//! Highest value of `live_bytes` since the last reset.
+static std::atomic<int64_t> peak_bytes{0};
+
+//! Every allocation is prefixed with its size, so it can be subtracted on release.
+constexpr std::size_t header_size = alignof(std::max_align_t);
+
+//! A snapshot of the counters.
+struct Counters
+{
+        uint64_t allocations;
+        uint64_t bytes;
+        uint64_t large_allocations;
+
+        Counters operator-(const Counters &other) const
+        {
+                return {allocations - other.allocations,
+                        bytes - other.bytes,
+                        large_allocations - other.large_allocations};
+        }
+};
+
+inline Counters
+snapshot()
+{
+        return {allocations.load(), bytes.load(), large_allocations.load()};
+}
+
+//! Start measuring the peak memory usage from the current usage.
+inline void
+reset_peak()
+{
+        peak_bytes = live_bytes.load();
+}
+
+inline void *
+allocate(std::size_t size)
+{
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        bytes.fetch_add(size, std::memory_order_relaxed);
+
+        if (size >= large_threshold.load(std::memory_order_relaxed))
+                large_allocations.fetch_add(1, std::memory_order_relaxed);
+
+        auto current = largest.load(std::memory_order_relaxed);
+        while (size > current && !largest.compare_exchange_weak(current, size))
+                ;
+
+        const int64_t live = live_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+        int64_t peak       = peak_bytes.load(std::memory_order_relaxed);
+        while (live > peak && !peak_bytes.compare_exchange_weak(peak, live))
+                ;
+
+        if (auto ptr = static_cast<char *>(std::malloc(header_size + size))) {
+                *reinterpret_cast<std::size_t *>(ptr) = size;
+                return ptr + header_size;
+        }
+
+        throw std::bad_alloc();
+}
+
+inline void
+release(void *ptr)
+{
+        if (ptr == nullptr)
+                return;
+
+        auto base = static_cast<char *>(ptr) - header_size;
+        live_bytes.fetch_sub(*reinterpret_cast<std::size_t *>(base), std::memory_order_relaxed);
+
+        std::free(base);
+}
+}
+
+void *
+operator new(std::size_t size)
+{
+        return alloc_counter::allocate(size);
+}
+
+void *
+operator new[](std::size_t size)
+{
+        return alloc_counter::allocate(size);
+}
+
+void
+operator delete(void *ptr) noexcept
+{
+        alloc_counter::release(ptr);
+}
+
+void
+operator delete[](void *ptr) noexcept
+{
+        alloc_counter::release(ptr);
+}
+
+void
+operator delete(void *ptr, std::size_t) noexcept
+{
+        alloc_counter::release(ptr);
+}
+
+void
+operator delete[](void *ptr, std::size_t) noexcept
+{
+        alloc_counter::release(ptr);
+}
@@ -0,0 +1,144 @@
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "client.hpp"
+#include "client_pool.hpp"
+
+//
+// Measures the memory used by each account when many accounts sync from one
+// process. In the pool mode the clients are created by a `ClientPool` and share
+// its caches & keep-alive connections. In the standalone mode the clients only
+// share the io_service, and each one has its own caches & connections.
+//
+// A fixed number of initial syncs is kept in flight, every chain of requests
+// going through the accounts one after the other.
+//
+// Usage: client_pool [pool|standalone] [accounts] [requests in flight] [threads]
+//
+
+using namespace mtx::client;
+
+using ErrType = std::experimental::optional<errors::ClientError>;
+
+//! Read a field (in kB, or a count) of /proc/self/status.
+long
+proc_status(const std::string &field)
+{
+        std::ifstream status("/proc/self/status");
+
+        std::string line;
+        while (std::getline(status, line)) {
+                if (line.compare(0, field.size() + 1, field + ":") == 0)
+                        return std::stol(line.substr(field.size() + 1));
+        }
+
+        return -1;
+}
+
+int
+main(int argc, char **argv)
+{
+        const std::string mode     = argc > 1 ? argv[1] : "pool";
+        const int accounts_num     = argc > 2 ? std::stoi(argv[2]) : 10000;
+        const int in_flight        = argc > 3 ? std::stoi(argv[3]) : 64;
+        const unsigned int threads = argc > 4 ? std::stoi(argv[4]) : 2;
+        const auto rss_before      = proc_status("VmRSS");
+
+        std::unique_ptr<ClientPool> pool;
+
+        boost::asio::io_service ios(threads);
+        std::unique_ptr<boost::asio::io_service::work> work;
+        std::vector<std::thread> workers;
+
+        if (mode == "pool") {
+                pool.reset(new ClientPool(ThreadOptions{threads, ThreadingModel::Shared, 0}));
+        } else {
+                work.reset(new boost::asio::io_service::work(ios));
+                for (unsigned int i = 0; i < threads; ++i)
+                        workers.emplace_back([&ios]() { ios.run(); });
+        }
+
+        const auto rss_started = proc_status("VmRSS");
+
+        std::vector<std::shared_ptr<Client>> accounts;
+        for (int i = 0; i < accounts_num; ++i) {
+                auto client = pool ? pool->create_client("localhost")
+                                   : std::make_shared<Client>(ios, "localhost");
+
+                client->set_access_token("token_" + std::to_string(i));
+                accounts.push_back(client);
+        }
+
+        const auto rss_created = proc_status("VmRSS");
+
+        std::atomic<int> completed(0);
+        std::atomic<int> failed(0);
+
+        std::function<void(int)> sync_account = [&](int account) {
+                auto client = accounts[account];
+
+                client->sync("",
+                             "",
+                             false,
+                             0,
+                             [&, client, account](const mtx::responses::Sync &res, ErrType err) {
+                                     if (err)
+                                             failed += 1;
+                                     else
+                                             client->set_next_batch_token(res.next_batch);
+
+                                     completed += 1;
+
+                                     if (account + in_flight < accounts_num)
+                                             sync_account(account + in_flight);
+                             });
+        };
+
+        const auto started_at = std::chrono::steady_clock::now();
+
+        for (int i = 0; i < std::min(in_flight, accounts_num); ++i)
+                sync_account(i);
+
+        while (completed != accounts_num)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started_at;
+        const auto rss_synced                       = proc_status("VmRSS");
+
+        uint64_t connections = 0;
+        if (pool) {
+                for (const auto &conn_pool : pool->connection_pools())
+                        connections += conn_pool->stats().created;
+        } else {
+                for (const auto &client : accounts)
+                        connections += client->connection_pool()->stats().created;
+        }
+
+        std::cout << "mode:                " << mode << "\n"
+                  << "accounts:            " << accounts_num << "\n"
+                  << "syncs:               " << completed << " (" << failed << " failed)\n"
+                  << "connections opened:  " << connections << "\n"
+                  << "shared RSS:          " << rss_started - rss_before << " kB\n"
+                  << "RSS per account:     " << (rss_created - rss_started) * 1024.0 / accounts_num
+                  << " bytes (idle)\n"
+                  << "RSS per account:     " << (rss_synced - rss_started) * 1024.0 / accounts_num
+                  << " bytes (after sync)\n"
+                  << "syncs/s:             " << completed / elapsed.count() << "\n";
+
+        if (pool)
+                pool->close();
+
+        for (auto &client : accounts)
+                client->close();
+
+        work.reset();
+        for (auto &thread : workers)
+                thread.join();
+
+        return 0;
+}
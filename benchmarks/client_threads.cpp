@@ -0,0 +1,141 @@
+#include <sys/resource.h>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "client.hpp"
+
+//
+// Compares the cost of running many clients in one process, when every client
+// starts its own threads and when all of them share a single io_service run by
+// a few threads. Each client creates rooms one after the other, like a bot would.
+//
+// Run each mode in its own process:
+// The thread count is per client in the dedicated mode (the default being one per
+// hardware thread) and for the whole process in the shared mode.
+//
+// Usage: client_threads [dedicated|shared] [clients] [requests per client] [threads]
+//
+
+using namespace mtx::client;
+
+using ErrType = std::experimental::optional<errors::ClientError>;
+
+//! Read a field (in kB, or a count) of /proc/self/status.
+long
+proc_status(const std::string &field)
+{
+        std::ifstream status("/proc/self/status");
+
+        std::string line;
+        while (std::getline(status, line)) {
+                if (line.compare(0, field.size() + 1, field + ":") == 0)
+                        return std::stol(line.substr(field.size() + 1));
+        }
+
+        return -1;
+}
+
+long
+context_switches()
+{
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+
+        return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+int
+main(int argc, char **argv)
+{
+        const std::string mode     = argc > 1 ? argv[1] : "shared";
+        const int clients_num      = argc > 2 ? std::stoi(argv[2]) : 100;
+        const int requests_num     = argc > 3 ? std::stoi(argv[3]) : 20;
+        const unsigned int threads = argc > 4 ? std::stoi(argv[4]) : 0;
+
+        // The shared io_service uses two threads unless told otherwise.
+        const unsigned int shared_threads = threads > 0 ? threads : 2;
+
+        boost::asio::io_service ios(shared_threads);
+        std::unique_ptr<boost::asio::io_service::work> work;
+        std::vector<std::thread> shared_pool;
+
+        if (mode == "shared") {
+                work.reset(new boost::asio::io_service::work(ios));
+                for (unsigned int i = 0; i < shared_threads; ++i)
+                        shared_pool.emplace_back([&ios]() { ios.run(); });
+        }
+
+        ThreadOptions options;
+        options.threads = threads;
+
+        std::vector<std::shared_ptr<Client>> clients;
+        for (int i = 0; i < clients_num; ++i) {
+                if (mode == "shared")
+                        clients.push_back(std::make_shared<Client>(ios, "localhost"));
+                else
+                        clients.push_back(std::make_shared<Client>("localhost", options));
+        }
+
+        // Let the threads settle before taking the idle measurements.
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+        const auto idle_threads = proc_status("Threads");
+        const auto idle_rss     = proc_status("VmRSS");
+        const auto idle_virtual = proc_status("VmSize");
+
+        std::atomic<int> completed(0);
+        std::atomic<int> failed(0);
+
+        mtx::requests::CreateRoom req;
+        req.name = "Bot room";
+
+        std::function<void(std::shared_ptr<Client>, int)> create_rooms =
+          [&](std::shared_ptr<Client> client, int remaining) {
+                  client->create_room(
+                    req, [&, client, remaining](const mtx::responses::CreateRoom &, ErrType err) {
+                            if (err)
+                                    failed += 1;
+
+                            completed += 1;
+
+                            if (remaining > 1)
+                                    create_rooms(client, remaining - 1);
+                    });
+          };
+
+        const auto switches_before = context_switches();
+        const auto started_at      = std::chrono::steady_clock::now();
+
+        for (auto &client : clients)
+                create_rooms(client, requests_num);
+
+        while (completed != clients_num * requests_num)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started_at;
+        const auto switches = context_switches() - switches_before;
+
+        std::cout << "mode:              " << mode << "\n"
+                  << "clients:           " << clients_num << "\n"
+                  << "requests:          " << completed << " (" << failed << " failed)\n"
+                  << "threads:           " << idle_threads << "\n"
+                  << "idle RSS:          " << idle_rss << " kB\n"
+                  << "idle virtual:      " << idle_virtual << " kB\n"
+                  << "context switches:  " << switches << "\n"
+                  << "requests/s:        " << completed / elapsed.count() << "\n";
+
+        for (auto &client : clients)
+                client->close();
+
+        work.reset();
+        for (auto &thread : shared_pool)
+                thread.join();
+
+        return 0;
+}
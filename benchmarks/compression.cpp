@@ -0,0 +1,223 @@
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include <zlib.h>
+
+#if defined(MTXCLIENT_HAS_ZSTD)
+#include <zstd.h>
+#endif
+
+#include "alloc_counter.hpp"
+#include "content_encoding.hpp"
+#include "session.hpp"
+#include "sync_parser.hpp"
+
+//
+// Compares the transfer size and the CPU cost of the content encodings on a
+// /sync response: how much smaller the body gets, how long it takes to decode
+// and parse it as it's received, and the estimated time to get it over a link
+// of the given bandwidth. Also compares the peak memory usage of decoding while
+// parsing with inflating the whole body first.
+//
+// Usage: compression <recorded /sync response> [bandwidth in Mbit/s] [iterations]
+//
+
+using namespace mtx::client;
+
+using Clock = std::chrono::steady_clock;
+
+//! The size of the reads from the socket.
+constexpr std::size_t read_size = 16 * 1024;
+
+struct Codec
+{
+        std::string name;
+        std::string encoding;
+        std::function<std::string(const std::string &)> compress;
+};
+
+std::string
+gzip(const std::string &data, int level)
+{
+        z_stream stream{};
+        deflateInit2(&stream, level, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY);
+
+        std::string out(deflateBound(&stream, data.size()), '\0');
+
+        stream.next_in   = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+        stream.avail_in  = data.size();
+        stream.next_out  = reinterpret_cast<Bytef *>(&out[0]);
+        stream.avail_out = out.size();
+
+        deflate(&stream, Z_FINISH);
+        out.resize(stream.total_out);
+        deflateEnd(&stream);
+
+        return out;
+}
+
+#if defined(MTXCLIENT_HAS_ZSTD)
+std::string
+zstd(const std::string &data, int level)
+{
+        std::string out(ZSTD_compressBound(data.size()), '\0');
+        out.resize(ZSTD_compress(&out[0], out.size(), data.data(), data.size(), level));
+
+        return out;
+}
+#endif
+
+//! Feed the body to the decoder in reads of `read_size`, as it would be received.
+void
+decode(ContentDecoder &decoder, const std::string &body, const ContentDecoder::Sink &sink)
+{
+        boost::system::error_code ec;
+
+        decoder.reset();
+        for (std::size_t pos = 0; pos < body.size() && !ec; pos += read_size)
+                decoder.decode(body.data() + pos, std::min(read_size, body.size() - pos), sink, ec);
+
+        if (!ec)
+                decoder.finish(ec);
+        if (ec)
+                std::cerr << "decoding failed: " << ec.message() << "\n";
+}
+
+struct Result
+{
+        std::chrono::microseconds time;
+        int64_t peak_bytes;
+};
+
+template<class Run>
+Result
+measure(int iterations, Run run)
+{
+        alloc_counter::reset_peak();
+        const auto baseline = alloc_counter::live_bytes.load();
+        const auto start    = Clock::now();
+
+        for (int i = 0; i < iterations; ++i)
+                run();
+
+        const auto elapsed = Clock::now() - start;
+
+        return {std::chrono::duration_cast<std::chrono::microseconds>(elapsed) / iterations,
+                alloc_counter::peak_bytes - baseline};
+}
+
+void
+check(const mtx::responses::Sync &sync)
+{
+        if (sync.next_batch.empty())
+                std::cerr << "empty next_batch\n";
+}
+
+int
+main(int argc, char **argv)
+{
+        if (argc < 2) {
+                std::cerr << "usage: " << argv[0] << " <sync.json> [Mbit/s] [iterations]\n";
+                return 1;
+        }
+
+        const double mbits   = argc > 2 ? std::stod(argv[2]) : 10;
+        const int iterations = argc > 3 ? std::stoi(argv[3]) : 10;
+
+        std::ifstream file(argv[1]);
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+
+        const std::string data = buffer.str();
+
+        std::cout << "payload: " << data.size() / 1024 << " KiB, " << mbits << " Mbit/s, "
+                  << iterations << " iterations\n";
+
+        const auto transfer_time = [mbits](std::size_t size) {
+                return std::chrono::microseconds(static_cast<int64_t>(size * 8 / mbits));
+        };
+
+        // Parsing the plain body, as it's received.
+        const auto plain = measure(iterations, [&data]() {
+                SyncParser parser;
+                for (std::size_t pos = 0; pos < data.size(); pos += read_size)
+                        parser.feed(data.data() + pos, std::min(read_size, data.size() - pos));
+                check(parser.finish());
+        });
+
+        std::cout << "identity:\n"
+                  << "  transfer:            " << transfer_time(data.size()).count() / 1000
+                  << " ms\n"
+                  << "  parse:               " << plain.time.count() / 1000 << " ms\n"
+                  << "  total:               "
+                  << (transfer_time(data.size()) + plain.time).count() / 1000 << " ms\n"
+                  << "  peak memory:         " << plain.peak_bytes / 1024 << " KiB\n";
+
+        std::vector<Codec> codecs = {
+          {"gzip -1", "gzip", [](const std::string &d) { return gzip(d, 1); }},
+          {"gzip -6", "gzip", [](const std::string &d) { return gzip(d, 6); }},
+          {"gzip -9", "gzip", [](const std::string &d) { return gzip(d, 9); }},
+#if defined(MTXCLIENT_HAS_ZSTD)
+          {"zstd -3", "zstd", [](const std::string &d) { return zstd(d, 3); }},
+          {"zstd -19", "zstd", [](const std::string &d) { return zstd(d, 19); }},
+#endif
+        };
+
+        for (const auto &codec : codecs) {
+                const auto start      = Clock::now();
+                const auto compressed = codec.compress(data);
+                const auto compress_time =
+                  std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start);
+
+                auto decoder = make_content_decoder(codec.encoding, max_body_size);
+
+                const auto decode_only = measure(iterations, [&]() {
+                        decode(*decoder, compressed, [](const char *, std::size_t) {});
+                });
+
+                // What the client does: the decoded chunks go straight to the parser.
+                const auto streaming = measure(iterations, [&]() {
+                        SyncParser parser;
+                        decode(*decoder, compressed, [&parser](const char *d, std::size_t n) {
+                                parser.feed(d, n);
+                        });
+                        check(parser.finish());
+                });
+
+                // The alternative: inflate the whole body, then parse it.
+                const auto inflate_all = measure(iterations, [&]() {
+                        std::string body;
+                        decode(*decoder, compressed, [&body](const char *d, std::size_t n) {
+                                body.append(d, n);
+                        });
+
+                        SyncParser parser;
+                        parser.feed(body);
+                        check(parser.finish());
+                });
+
+                const auto transfer = transfer_time(compressed.size());
+
+                std::cout << codec.name << ":\n"
+                          << "  size:                " << compressed.size() / 1024 << " KiB ("
+                          << compressed.size() * 100 / data.size() << "%)\n"
+                          << "  compress (server):   " << compress_time.count() / 1000
+                          << " ms\n"
+                          << "  transfer:            " << transfer.count() / 1000 << " ms\n"
+                          << "  decode:              " << decode_only.time.count() / 1000
+                          << " ms\n"
+                          << "  decode + parse:      " << streaming.time.count() / 1000
+                          << " ms\n"
+                          << "  total:               " << (transfer + streaming.time).count() / 1000
+                          << " ms\n"
+                          << "  peak memory:         " << streaming.peak_bytes / 1024
+                          << " KiB streaming, " << inflate_all.peak_bytes / 1024
+                          << " KiB inflating first\n";
+        }
+
+        return 0;
+}
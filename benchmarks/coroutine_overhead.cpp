@@ -0,0 +1,120 @@
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <thread>
+
+#include "alloc_counter.hpp"
+#include "client.hpp"
+
+//
+// Compares the overhead of a request made through the callback API and through
+// the awaitable API. The same client sends the requests one after the other on
+// a single thread, so the difference comes from the way the completion reaches
+// the caller: the number of heap allocations and the time per request.
+//
+// Requires a build with BUILD_LIB_COROUTINES.
+//
+// Usage: coroutine_overhead [homeserver] [requests]
+//
+
+using namespace mtx::client;
+
+using ErrType = std::experimental::optional<errors::ClientError>;
+
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+
+struct Result
+{
+        alloc_counter::Counters allocs;
+        std::chrono::duration<double, std::micro> elapsed;
+};
+
+void
+report(const std::string &name, const Result &result, int requests)
+{
+        std::cout << name << ":\n"
+                  << "  allocations/request:  " << double(result.allocs.allocations) / requests
+                  << "\n"
+                  << "  bytes/request:        " << double(result.allocs.bytes) / requests << "\n"
+                  << "  us/request:           " << result.elapsed.count() / requests << "\n";
+}
+
+Result
+run_callbacks(boost::asio::io_service &ios, std::shared_ptr<Client> client, int requests)
+{
+        mtx::requests::CreateRoom req;
+        req.name = "Benchmark";
+
+        std::function<void(int)> create_room = [&](int remaining) {
+                client->create_room(req,
+                                    [&, remaining](const mtx::responses::CreateRoom &, ErrType) {
+                                            if (remaining > 1)
+                                                    create_room(remaining - 1);
+                                    });
+        };
+
+        const auto before     = alloc_counter::snapshot();
+        const auto started_at = std::chrono::steady_clock::now();
+
+        create_room(requests);
+
+        ios.restart();
+        ios.run();
+
+        return {alloc_counter::snapshot() - before, std::chrono::steady_clock::now() - started_at};
+}
+
+Result
+run_coroutine(boost::asio::io_service &ios, std::shared_ptr<Client> client, int requests)
+{
+        const auto before     = alloc_counter::snapshot();
+        const auto started_at = std::chrono::steady_clock::now();
+
+        boost::asio::co_spawn(
+          ios,
+          [client, requests]() -> boost::asio::awaitable<void> {
+                  mtx::requests::CreateRoom req;
+                  req.name = "Benchmark";
+
+                  for (int i = 0; i < requests; ++i)
+                          co_await client->create_room(req, boost::asio::use_awaitable);
+          },
+          boost::asio::detached);
+
+        ios.restart();
+        ios.run();
+
+        return {alloc_counter::snapshot() - before, std::chrono::steady_clock::now() - started_at};
+}
+
+int
+main(int argc, char **argv)
+{
+        const std::string server = argc > 1 ? argv[1] : "localhost";
+        const int requests       = argc > 2 ? std::stoi(argv[2]) : 1000;
+
+        boost::asio::io_service ios(1);
+        auto client = std::make_shared<Client>(ios, server);
+
+        // Warm up the caches & open the keep-alive connection.
+        run_callbacks(ios, client, 10);
+
+        report("callback", run_callbacks(ios, client, requests), requests);
+        report("coroutine", run_coroutine(ios, client, requests), requests);
+
+        client->close();
+
+        return 0;
+}
+
+#else
+
+int
+main()
+{
+        std::cerr << "coroutine_overhead requires a build with BUILD_LIB_COROUTINES\n";
+        return 1;
+}
+
+#endif
@@ -0,0 +1,231 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "alloc_counter.hpp"
+#include "client.hpp"
+#include "mock_homeserver.hpp"
+
+//
+// Measures the throughput, the latency, the CPU time & the allocations of each
+// endpoint at several concurrency levels, against the mock homeserver. The
+// server runs in a child process, so that only the client is measured. With a
+// fixed seed & request count, the runs are reproducible on the same machine.
+//
+// Usage: endpoints [requests per run] [latency in ms] [error rate] [sync rooms]
+//
+
+using namespace mtx::client;
+using namespace mtx::client::testing;
+
+using ErrType = std::experimental::optional<errors::ClientError>;
+using Clock   = std::chrono::steady_clock;
+
+//! Sends a request & calls the function with whether it succeeded.
+using Send = std::function<void(std::function<void(bool ok)> done)>;
+
+struct Result
+{
+        double requests_per_second = 0;
+        std::chrono::microseconds p50{0}, p99{0}, p999{0};
+        double cpu_us_per_request      = 0;
+        double allocations_per_request = 0;
+        int failures                   = 0;
+};
+
+//! User & system time of the process.
+std::chrono::microseconds
+cpu_time()
+{
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+
+        return std::chrono::seconds(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+               std::chrono::microseconds(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+//! Send `requests` requests, keeping `concurrency` of them in flight.
+Result
+run(int requests, int concurrency, const Send &send)
+{
+        std::vector<Clock::duration> latencies(requests);
+        std::atomic<int> started(0), completed(0), failures(0);
+        std::promise<void> all_done;
+
+        std::function<void()> next = [&]() {
+                const int i = started++;
+                if (i >= requests)
+                        return;
+
+                const auto sent_at = Clock::now();
+                send([&, i, sent_at](bool ok) {
+                        latencies[i] = Clock::now() - sent_at;
+                        if (!ok)
+                                ++failures;
+
+                        if (++completed == requests)
+                                all_done.set_value();
+                        else
+                                next();
+                });
+        };
+
+        const auto allocations = alloc_counter::allocations.load();
+        const auto cpu_start   = cpu_time();
+        const auto start       = Clock::now();
+
+        for (int i = 0; i < concurrency; ++i)
+                next();
+
+        all_done.get_future().wait();
+
+        const auto elapsed = Clock::now() - start;
+
+        Result result;
+        result.cpu_us_per_request = double((cpu_time() - cpu_start).count()) / requests;
+        result.allocations_per_request =
+          double(alloc_counter::allocations.load() - allocations) / requests;
+        result.requests_per_second =
+          requests / std::chrono::duration_cast<std::chrono::duration<double>>(elapsed).count();
+        result.failures = failures;
+
+        std::sort(latencies.begin(), latencies.end());
+        const auto percentile = [&latencies](double q) {
+                const auto index = std::min(latencies.size() - 1, size_t(q * latencies.size()));
+                return std::chrono::duration_cast<std::chrono::microseconds>(latencies[index]);
+        };
+
+        result.p50  = percentile(0.5);
+        result.p99  = percentile(0.99);
+        result.p999 = percentile(0.999);
+
+        return result;
+}
+
+//! Start the server in a child process, and return its port.
+unsigned short
+start_server(const MockOptions &options, pid_t &child)
+{
+        int fds[2];
+        if (pipe(fds) != 0)
+                return 0;
+
+        child = fork();
+        if (child == 0) {
+                close(fds[0]);
+
+                MockHomeserver server(options);
+                const auto port = server.port();
+                if (write(fds[1], &port, sizeof(port)) != sizeof(port))
+                        _exit(1);
+
+                // Serve until the benchmark is over.
+                pause();
+                _exit(0);
+        }
+
+        close(fds[1]);
+
+        unsigned short port = 0;
+        if (read(fds[0], &port, sizeof(port)) != sizeof(port))
+                port = 0;
+
+        close(fds[0]);
+        return port;
+}
+
+int
+main(int argc, char **argv)
+{
+        const int requests = argc > 1 ? std::stoi(argv[1]) : 2000;
+
+        MockOptions options;
+        options.latency    = std::chrono::milliseconds(argc > 2 ? std::stoi(argv[2]) : 0);
+        options.error_rate = argc > 3 ? std::stod(argv[3]) : 0;
+        options.sync_rooms = argc > 4 ? std::stoul(argv[4]) : 10;
+
+        pid_t child     = 0;
+        const auto port = start_server(options, child);
+        if (port == 0) {
+                std::cerr << "Couldn't start the mock homeserver\n";
+                return 1;
+        }
+
+        auto client = std::make_shared<Client>("localhost:" + std::to_string(port));
+        client->login("alice", "secret", boost::asio::use_future).get();
+
+        mtx::requests::CreateRoom room;
+        room.name = "Name";
+
+        const std::vector<std::pair<std::string, Send>> endpoints = {
+          {"login",
+           [&client](auto done) {
+                   client->login("alice", "secret", [done](mtx::responses::Login &&, ErrType err) {
+                           done(!err);
+                   });
+           }},
+          {"sync",
+           [&client](auto done) {
+                   client->sync("", "", false, 0, [done](mtx::responses::Sync &&, ErrType err) {
+                           done(!err);
+                   });
+           }},
+          {"createRoom",
+           [&client, &room](auto done) {
+                   client->create_room(room, [done](mtx::responses::CreateRoom &&, ErrType err) {
+                           done(!err);
+                   });
+           }},
+          {"join",
+           [&client](auto done) {
+                   client->join_room("!room0:localhost", [done](nlohmann::json &&, ErrType err) {
+                           done(!err);
+                   });
+           }}};
+
+        std::cout << requests << " requests per run, " << options.latency.count()
+                  << " ms latency, " << options.error_rate * 100 << "% errors, "
+                  << options.sync_rooms << " rooms per sync\n\n";
+        std::cout << std::left << std::setw(12) << "endpoint" << std::right << std::setw(6)
+                  << "conc" << std::setw(10) << "req/s" << std::setw(10) << "p50 us"
+                  << std::setw(10) << "p99 us" << std::setw(10) << "p999 us" << std::setw(12)
+                  << "CPU us/req" << std::setw(12) << "allocs/req" << std::setw(10)
+                  << "failures\n";
+
+        for (const auto &endpoint : endpoints) {
+                for (int concurrency : {1, 8, 64}) {
+                        // Warm up the connections & the recycled sessions.
+                        run(concurrency * 4, concurrency, endpoint.second);
+
+                        const auto result = run(requests, concurrency, endpoint.second);
+
+                        std::cout << std::left << std::setw(12) << endpoint.first << std::right
+                                  << std::setw(6) << concurrency << std::setw(10)
+                                  << int(result.requests_per_second) << std::setw(10)
+                                  << result.p50.count() << std::setw(10) << result.p99.count()
+                                  << std::setw(10) << result.p999.count() << std::setw(12)
+                                  << std::fixed << std::setprecision(1)
+                                  << result.cpu_us_per_request << std::setw(12)
+                                  << result.allocations_per_request << std::setw(9)
+                                  << result.failures << "\n";
+                }
+        }
+
+        client->close();
+
+        kill(child, SIGTERM);
+        waitpid(child, nullptr, 0);
+
+        return 0;
+}
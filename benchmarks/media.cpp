@@ -0,0 +1,127 @@
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "alloc_counter.hpp"
+#include "client.hpp"
+
+//
+// Measures the time & the peak heap usage of uploading a file and downloading
+// it back from the homeserver at localhost: into memory (which is what buffering
+// the whole response costs), streamed into a file, and streamed into a file in
+// segments requested in parallel (if the server supports ranges).
+//
+// Usage: media [size in MiB] [iterations]
+//
+
+using namespace mtx::client;
+
+struct Result
+{
+        std::chrono::milliseconds time{0};
+        int64_t peak_bytes = 0;
+};
+
+template<class Run>
+Result
+measure(int iterations, Run run)
+{
+        Result result;
+
+        for (int i = 0; i < iterations; ++i) {
+                alloc_counter::reset_peak();
+                const auto baseline = alloc_counter::live_bytes.load();
+                const auto start    = std::chrono::steady_clock::now();
+
+                run();
+
+                result.time += std::chrono::duration_cast<std::chrono::milliseconds>(
+                  std::chrono::steady_clock::now() - start);
+                result.peak_bytes =
+                  std::max(result.peak_bytes, alloc_counter::peak_bytes - baseline);
+        }
+
+        result.time /= iterations;
+        return result;
+}
+
+void
+print(const std::string &name, const Result &result, uint64_t size)
+{
+        const auto seconds = std::max<int64_t>(result.time.count(), 1) / 1000.0;
+
+        std::cout << "  " << name << ": " << result.time.count() << " ms, "
+                  << size / (1024 * 1024) / seconds << " MiB/s, " << result.peak_bytes / 1024
+                  << " KiB peak\n";
+}
+
+int
+main(int argc, char **argv)
+{
+        const uint64_t size  = (argc > 1 ? std::stoull(argv[1]) : 64) * 1024 * 1024;
+        const int iterations = argc > 2 ? std::stoi(argv[2]) : 3;
+
+        const std::string source = "media_bench_source.bin";
+        const std::string target = "media_bench_target.bin";
+
+        {
+                std::ofstream file(source, std::ios::binary);
+                std::string block(1024 * 1024, 'x');
+                for (uint64_t written = 0; written < size; written += block.size())
+                        file.write(block.data(), std::min<uint64_t>(block.size(), size - written));
+        }
+
+        auto client = std::make_shared<Client>("localhost");
+        std::string uri;
+
+        std::cout << size / (1024 * 1024) << " MiB:\n";
+
+        print("upload         ",
+              measure(iterations,
+                      [&]() {
+                              uri = client
+                                      ->upload_file(
+                                        source, "application/octet-stream", boost::asio::use_future)
+                                      .get()
+                                      .content_uri;
+                      }),
+              size);
+
+        print("to memory      ",
+              measure(iterations,
+                      [&]() {
+                              std::string content;
+                              auto sink = std::make_shared<CallbackSink>(
+                                [&content](uint64_t, const char *data, std::size_t n) {
+                                        content.append(data, n);
+                                });
+
+                              client->download(uri, sink, {}, boost::asio::use_future).get();
+                      }),
+              size);
+
+        for (unsigned int parallel : {1, 4}) {
+                DownloadOptions options;
+                options.parallel_segments = parallel;
+
+                print(parallel == 1 ? "to file        " : "to file, 4 x 4M",
+                      measure(iterations,
+                              [&]() {
+                                      std::remove(target.c_str());
+                                      client
+                                        ->download_file(
+                                          uri, target, options, boost::asio::use_future)
+                                        .get();
+                              }),
+                      size);
+        }
+
+        client->close();
+
+        std::remove(source.c_str());
+        std::remove(target.c_str());
+
+        return 0;
+}
@@ -0,0 +1,338 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "alloc_counter.hpp"
+#include "client.hpp"
+#include "mock_homeserver.hpp"
+#include "traffic_replay.hpp"
+
+//
+// Replays a recording of the traffic of a client (see `TrafficRecorder`) against
+// the mock homeserver, which serves the recorded responses from a child process.
+//
+// With a time scale, the requests are sent at their recorded times, scaled, and
+// the server takes the recorded durations, scaled, to answer them. With a scale
+// of 0, the recording is replayed as fast as possible, keeping `concurrency`
+// requests in flight, `passes` times over.
+//
+// The requests of the endpoints the driver doesn't know are skipped.
+//
+// Usage: replay <recording> [time scale] [concurrency] [passes]
+//
+
+using namespace mtx::client;
+using namespace mtx::client::testing;
+
+using ErrType = std::experimental::optional<errors::ClientError>;
+using Clock   = std::chrono::steady_clock;
+
+//! Sends a request & calls the function with whether it succeeded.
+using Send = std::function<void(std::function<void(bool ok)> done)>;
+
+//! User & system time of the process.
+std::chrono::microseconds
+cpu_time()
+{
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+
+        return std::chrono::seconds(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+               std::chrono::microseconds(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+//! The parameters of the query of a target.
+std::map<std::string, std::string>
+query_params(const std::string &target)
+{
+        std::map<std::string, std::string> params;
+
+        auto pos = target.find('?');
+        while (pos != std::string::npos) {
+                const auto start = pos + 1;
+                pos              = target.find('&', start);
+
+                const auto param = target.substr(start, pos - start);
+                const auto equal = param.find('=');
+                if (equal != std::string::npos)
+                        params[param.substr(0, equal)] = param.substr(equal + 1);
+        }
+
+        return params;
+}
+
+bool
+starts_with(const std::string &value, const std::string &prefix)
+{
+        return value.compare(0, prefix.size(), prefix) == 0;
+}
+
+bool
+ends_with(const std::string &value, const std::string &suffix)
+{
+        return value.size() >= suffix.size() &&
+               value.compare(value.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+//! The endpoint of the client sending the recorded request, if there is one.
+Send
+make_send(std::shared_ptr<Client> client, const TrafficRecord &record)
+{
+        namespace http = boost::beast::http;
+
+        const std::string prefix = "/_matrix/client/r0";
+        if (!starts_with(record.target, prefix))
+                return nullptr;
+
+        const auto query = std::min(record.target.find('?'), record.target.size());
+        const auto path  = record.target.substr(prefix.size(), query - prefix.size());
+
+        if (record.method == http::verb::get && path == "/sync") {
+                auto params           = query_params(record.target);
+                const auto filter     = params["filter"];
+                const auto since      = params["since"];
+                const bool full_state = params["full_state"] == "true";
+
+                // The server answers after the recorded duration, whatever the timeout.
+                return [client, filter, since, full_state](auto done) {
+                        client->sync(filter,
+                                     since,
+                                     full_state,
+                                     0,
+                                     [done](mtx::responses::Sync &&, ErrType err) { done(!err); });
+                };
+        }
+
+        if (record.method != http::verb::post)
+                return nullptr;
+
+        if (path == "/login")
+                return [client](auto done) {
+                        // The password has been redacted, and the server doesn't check it.
+                        client->login("alice",
+                                      "REDACTED",
+                                      [done](mtx::responses::Login &&, ErrType err) {
+                                              done(!err);
+                                      });
+                };
+
+        if (path == "/logout")
+                return [client](auto done) {
+                        client->logout([done](mtx::responses::Logout &&, ErrType err) {
+                                done(!err);
+                        });
+                };
+
+        if (path == "/createRoom")
+                return [client](auto done) {
+                        client->create_room(mtx::requests::CreateRoom{},
+                                            [done](mtx::responses::CreateRoom &&, ErrType err) {
+                                                    done(!err);
+                                            });
+                };
+
+        if (starts_with(path, "/join/")) {
+                const auto room = path.substr(6);
+
+                return [client, room](auto done) {
+                        client->join_room(room, [done](nlohmann::json &&, ErrType err) {
+                                done(!err);
+                        });
+                };
+        }
+
+        if (starts_with(path, "/rooms/") &&
+            (ends_with(path, "/join") || ends_with(path, "/leave"))) {
+                const bool is_join = ends_with(path, "/join");
+                const auto room    = mtx::identifiers::parse<mtx::identifiers::Room>(
+                  path.substr(7, path.rfind('/') - 7));
+
+                return [client, room, is_join](auto done) {
+                        const auto callback = [done](nlohmann::json &&, ErrType err) {
+                                done(!err);
+                        };
+
+                        if (is_join)
+                                client->join_room(room, callback);
+                        else
+                                client->leave_room(room, callback);
+                };
+        }
+
+        return nullptr;
+}
+
+//! Start the server in a child process, and return its port.
+unsigned short
+start_server(const MockOptions &options, pid_t &child)
+{
+        int fds[2];
+        if (pipe(fds) != 0)
+                return 0;
+
+        child = fork();
+        if (child == 0) {
+                close(fds[0]);
+
+                MockHomeserver server(options);
+                const auto port = server.port();
+                if (write(fds[1], &port, sizeof(port)) != sizeof(port))
+                        _exit(1);
+
+                // Serve until the benchmark is over.
+                pause();
+                _exit(0);
+        }
+
+        close(fds[1]);
+
+        unsigned short port = 0;
+        if (read(fds[0], &port, sizeof(port)) != sizeof(port))
+                port = 0;
+
+        close(fds[0]);
+        return port;
+}
+
+int
+main(int argc, char **argv)
+{
+        if (argc < 2) {
+                std::cerr << "Usage: " << argv[0]
+                          << " <recording> [time scale] [concurrency] [passes]\n";
+                return 1;
+        }
+
+        const double time_scale = argc > 2 ? std::stod(argv[2]) : 1;
+        const int concurrency   = argc > 3 ? std::stoi(argv[3]) : 8;
+        const int passes        = argc > 4 ? std::stoi(argv[4]) : 1;
+
+        boost::system::error_code ec;
+        auto replay = TrafficReplay::load(argv[1], time_scale, ec);
+        if (!replay) {
+                std::cerr << argv[1] << ": " << ec.message() << "\n";
+                return 1;
+        }
+
+        MockOptions options;
+        options.responder = replay->responder();
+
+        pid_t child     = 0;
+        const auto port = start_server(options, child);
+        if (port == 0) {
+                std::cerr << "Couldn't start the mock homeserver\n";
+                return 1;
+        }
+
+        auto client = std::make_shared<Client>("localhost:" + std::to_string(port));
+
+        // The requests to send & their recorded starts.
+        std::vector<std::pair<Clock::duration, Send>> sends;
+        int skipped = 0;
+
+        for (int pass = 0; pass < passes; ++pass) {
+                for (const auto &record : replay->records()) {
+                        if (auto send = make_send(client, record))
+                                sends.emplace_back(std::chrono::duration_cast<Clock::duration>(
+                                                     record.start * time_scale),
+                                                   std::move(send));
+                        else
+                                ++skipped;
+                }
+        }
+
+        const int requests = sends.size();
+        if (requests == 0) {
+                std::cerr << "Nothing to replay\n";
+                return 1;
+        }
+
+        std::vector<Clock::duration> latencies(requests);
+        std::atomic<int> started(0), completed(0), failures(0);
+        std::promise<void> all_done;
+
+        const auto send = [&](int i, std::function<void()> then) {
+                const auto sent_at = Clock::now();
+
+                sends[i].second([&, i, sent_at, then](bool ok) {
+                        latencies[i] = Clock::now() - sent_at;
+                        if (!ok)
+                                ++failures;
+
+                        if (++completed == requests)
+                                all_done.set_value();
+                        else if (then)
+                                then();
+                });
+        };
+
+        std::function<void()> next = [&]() {
+                const int i = started++;
+                if (i < requests)
+                        send(i, next);
+        };
+
+        const auto allocations = alloc_counter::allocations.load();
+        const auto cpu_start   = cpu_time();
+        const auto start       = Clock::now();
+
+        if (time_scale > 0) {
+                // At the recorded times, whatever the number of requests in flight.
+                for (int i = 0; i < requests; ++i) {
+                        std::this_thread::sleep_until(start + sends[i].first);
+                        send(i, nullptr);
+                }
+        } else {
+                for (int i = 0; i < concurrency; ++i)
+                        next();
+        }
+
+        all_done.get_future().wait();
+
+        const auto elapsed = Clock::now() - start;
+        const auto seconds =
+          std::chrono::duration_cast<std::chrono::duration<double>>(elapsed).count();
+
+        std::sort(latencies.begin(), latencies.end());
+        const auto percentile = [&latencies](double q) {
+                const auto index = std::min(latencies.size() - 1, size_t(q * latencies.size()));
+                return std::chrono::duration_cast<std::chrono::microseconds>(latencies[index])
+                  .count();
+        };
+
+        std::cout << requests << " requests replayed (" << skipped << " skipped), time scale "
+                  << time_scale;
+        if (time_scale <= 0)
+                std::cout << ", " << concurrency << " in flight";
+        std::cout << "\n\n";
+
+        std::cout << std::fixed << std::setprecision(1);
+        std::cout << "req/s        " << requests / seconds << "\n";
+        std::cout << "p50 us       " << percentile(0.5) << "\n";
+        std::cout << "p99 us       " << percentile(0.99) << "\n";
+        std::cout << "p999 us      " << percentile(0.999) << "\n";
+        std::cout << "CPU us/req   " << double((cpu_time() - cpu_start).count()) / requests
+                  << "\n";
+        std::cout << "allocs/req   "
+                  << double(alloc_counter::allocations.load() - allocations) / requests << "\n";
+        std::cout << "failures     " << failures << "\n";
+
+        client->close();
+
+        kill(child, SIGTERM);
+        waitpid(child, nullptr, 0);
+
+        return failures == 0 ? 0 : 1;
+}
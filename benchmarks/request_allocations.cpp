@@ -0,0 +1,132 @@
+#include <functional>
+#include <iostream>
+#include <string>
+
+#include "alloc_counter.hpp"
+#include "client.hpp"
+
+//
+// Counts the heap allocations made by each request once the client has warmed up.
+// The requests are sent one after the other on a single thread & a keep-alive
+// connection, so only the allocations of the requests themselves are counted.
+//
+// The transport requests are raw sessions, so they show what the client allocates
+// for sending a request & receiving its response. The createRoom requests add the
+// JSON serialization of the request & the deserialization of the response.
+//
+// Both are run with the sessions recycled and with a pool that doesn't keep any.
+//
+// Usage: request_allocations [homeserver] [requests]
+//
+
+using namespace mtx::client;
+
+using ErrType = std::experimental::optional<errors::ClientError>;
+
+void
+report(const std::string &name, const alloc_counter::Counters &allocs, int requests)
+{
+        std::cout << name << ":\n"
+                  << "  allocations/request:  " << double(allocs.allocations) / requests << "\n"
+                  << "  bytes/request:        " << double(allocs.bytes) / requests << "\n";
+}
+
+//! Send GET requests through sessions taken from the pool of the client.
+alloc_counter::Counters
+run_transport(boost::asio::io_service &ios, std::shared_ptr<Client> client, int requests)
+{
+        std::function<void(int)> send = [&](int remaining) {
+                auto session = client->session_pool()->acquire(
+                  ios,
+                  0,
+                  "localhost",
+                  client->next_request_id(),
+                  [&send, remaining](RequestID, HttpResponse, const boost::system::error_code &) {
+                          if (remaining > 1)
+                                  send(remaining - 1);
+                  },
+                  [](RequestID, const boost::system::error_code ec) {
+                          std::cerr << "request failed: " << ec.message() << "\n";
+                  });
+
+                session->request.method(boost::beast::http::verb::get);
+                session->request.target("/_matrix/client/r0/sync");
+                session->request.set(boost::beast::http::field::host, "localhost");
+                session->request.set(boost::beast::http::field::authorization,
+                                     "Bearer benchmark");
+                session->request.prepare_payload();
+
+                client->do_request(session);
+        };
+
+        const auto before = alloc_counter::snapshot();
+
+        send(requests);
+
+        ios.restart();
+        ios.run();
+
+        return alloc_counter::snapshot() - before;
+}
+
+alloc_counter::Counters
+run_create_room(boost::asio::io_service &ios, std::shared_ptr<Client> client, int requests)
+{
+        mtx::requests::CreateRoom req;
+        req.name = "Benchmark";
+
+        std::function<void(int)> create_room = [&](int remaining) {
+                client->create_room(req,
+                                    [&, remaining](const mtx::responses::CreateRoom &, ErrType) {
+                                            if (remaining > 1)
+                                                    create_room(remaining - 1);
+                                    });
+        };
+
+        const auto before = alloc_counter::snapshot();
+
+        create_room(requests);
+
+        ios.restart();
+        ios.run();
+
+        return alloc_counter::snapshot() - before;
+}
+
+void
+run(const std::string &name,
+    const std::string &server,
+    int requests,
+    std::shared_ptr<SessionPool> sessions)
+{
+        boost::asio::io_service ios(1);
+
+        auto services     = make_client_services({&ios});
+        services.sessions = sessions;
+
+        auto client = std::make_shared<Client>(server, services);
+        client->set_access_token("benchmark");
+
+        // Warm up the caches, the buffers & open the keep-alive connection.
+        run_transport(ios, client, 10);
+        run_create_room(ios, client, 10);
+
+        report(name + " transport", run_transport(ios, client, requests), requests);
+        report(name + " createRoom", run_create_room(ios, client, requests), requests);
+
+        for (auto &pool : services.pools)
+                pool->clear();
+        sessions->clear();
+}
+
+int
+main(int argc, char **argv)
+{
+        const std::string server = argc > 1 ? argv[1] : "localhost";
+        const int requests       = argc > 2 ? std::stoi(argv[2]) : 1000;
+
+        run("recycled", server, requests, std::make_shared<SessionPool>());
+        run("not recycled", server, requests, std::make_shared<SessionPool>(0));
+
+        return 0;
+}
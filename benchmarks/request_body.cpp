@@ -0,0 +1,113 @@
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "alloc_counter.hpp"
+#include "request_body.hpp"
+#include "session.hpp"
+
+//
+// Compares dumping a JSON request into a string with serializing it chunk by
+// chunk while it's written (`JsonBody`), for growing CreateRoom-like requests
+// with many initial state events. The document is built beforehand in both
+// cases; only the memory needed on top of it is measured.
+//
+// Usage: request_body [iterations]
+//
+
+using namespace mtx::client;
+
+struct Result
+{
+        std::chrono::microseconds time{0};
+        int64_t peak_bytes = 0;
+};
+
+//! Run `prepare` outside of the measure, then `run` with its result. What `run` returns
+//! is destroyed outside of the measure too, as destroying a document allocates.
+template<class Prepare, class Run>
+Result
+measure(int iterations, Prepare prepare, Run run)
+{
+        Result result;
+
+        for (int i = 0; i < iterations; ++i) {
+                auto input = prepare();
+
+                alloc_counter::reset_peak();
+                const auto baseline = alloc_counter::live_bytes.load();
+                const auto start    = std::chrono::steady_clock::now();
+
+                const auto output = run(std::move(input));
+
+                result.time += std::chrono::duration_cast<std::chrono::microseconds>(
+                  std::chrono::steady_clock::now() - start);
+                result.peak_bytes =
+                  std::max(result.peak_bytes, alloc_counter::peak_bytes - baseline);
+        }
+
+        result.time /= iterations;
+        return result;
+}
+
+nlohmann::json
+create_room(int events)
+{
+        nlohmann::json initial_state = nlohmann::json::array();
+        for (int i = 0; i < events; ++i) {
+                const auto user = std::to_string(i);
+
+                initial_state.push_back(
+                  {{"type", "m.room.member"},
+                   {"state_key", "@user" + user + ":example.com"},
+                   {"content", {{"membership", "invite"}, {"displayname", "User " + user}}}});
+        }
+
+        return {{"name", "Name"}, {"topic", "Topic"}, {"initial_state", initial_state}};
+}
+
+void
+print(const std::string &name, const Result &result)
+{
+        std::cout << "  " << name << ": " << result.time.count() << " us, "
+                  << result.peak_bytes / 1024 << " KiB peak\n";
+}
+
+int
+main(int argc, char **argv)
+{
+        const int iterations = argc > 1 ? std::stoi(argv[1]) : 10;
+
+        // Stands for the socket.
+        std::size_t sent = 0;
+        std::string chunk;
+
+        for (int events : {10, 1000, 100000}) {
+                const auto document = create_room(events);
+                const auto copy     = [&document]() { return document; };
+
+                std::cout << events << " events, " << document.dump().size() / 1024 << " KiB:\n";
+
+                print("dump    ", measure(iterations, copy, [&sent](nlohmann::json doc) {
+                              const auto body = doc.dump();
+                              sent += body.size();
+
+                              return doc;
+                      }));
+
+                print("streamed", measure(iterations, copy, [&sent, &chunk](nlohmann::json doc) {
+                              auto body = std::make_unique<JsonBody>(std::move(doc));
+                              boost::system::error_code ec;
+
+                              // The client writes the chunks into the socket.
+                              chunk.resize(std::min<uint64_t>(body->size(), max_body_chunk_size));
+                              while (const auto n = body->read(&chunk[0], chunk.size(), ec))
+                                      sent += n;
+
+                              return body;
+                      }));
+        }
+
+        return sent > 0 ? 0 : 1;
+}
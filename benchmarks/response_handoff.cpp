@@ -0,0 +1,97 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include "alloc_counter.hpp"
+#include "client.hpp"
+
+//
+// Counts the heap allocations made for every /sync request.
+//
+// The largest allocation of the warm-up request is assumed to be the buffer of the
+// response body. Every request should allocate exactly one buffer of that size;
+// additional ones are copies of the body on its way to the JSON parser.
+//
+// Usage: response_handoff [homeserver] [username] [password] [iterations]
+//
+
+using namespace mtx::client;
+
+using ErrType = std::experimental::optional<errors::ClientError>;
+
+void
+wait_for(std::atomic<bool> &done)
+{
+        while (!done)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        done = false;
+}
+
+int
+main(int argc, char **argv)
+{
+        const std::string server   = argc > 1 ? argv[1] : "localhost";
+        const std::string username = argc > 2 ? argv[2] : "alice";
+        const std::string password = argc > 3 ? argv[3] : "secret";
+        const int iterations       = argc > 4 ? std::stoi(argv[4]) : 100;
+
+        auto client = std::make_shared<Client>(server);
+
+        std::atomic<bool> done(false);
+        bool failed = false;
+
+        client->login(username, password, [&](const mtx::responses::Login &, ErrType err) {
+                failed = static_cast<bool>(err);
+                done   = true;
+        });
+        wait_for(done);
+
+        if (failed) {
+                std::cerr << "login failed\n";
+                client->close();
+                return 1;
+        }
+
+        auto sync = [&]() {
+                client->sync("", "", false, 0, [&](const mtx::responses::Sync &, ErrType err) {
+                        failed |= static_cast<bool>(err);
+                        done = true;
+                });
+                wait_for(done);
+        };
+
+        // Warm up the connection, the caches & find the size of the body buffer.
+        alloc_counter::largest = 0;
+        sync();
+        alloc_counter::large_threshold = alloc_counter::largest * 9 / 10;
+
+        const auto start_time = std::chrono::steady_clock::now();
+        const auto start      = alloc_counter::snapshot();
+
+        for (int i = 0; i < iterations; ++i)
+                sync();
+
+        const auto diff    = alloc_counter::snapshot() - start;
+        const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - start_time);
+
+        client->close();
+
+        if (failed) {
+                std::cerr << "sync failed\n";
+                return 1;
+        }
+
+        std::cout << "requests:                        " << iterations << "\n"
+                  << "body size (approx.):             " << alloc_counter::large_threshold * 10 / 9
+                  << " bytes\n"
+                  << "allocations / request:           " << diff.allocations / iterations << "\n"
+                  << "allocated bytes / request:       " << diff.bytes / iterations << "\n"
+                  << "body-sized allocations / request: "
+                  << static_cast<double>(diff.large_allocations) / iterations << "\n"
+                  << "latency / request:               " << elapsed.count() / iterations
+                  << " us\n";
+
+        return 0;
+}
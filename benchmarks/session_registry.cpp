@@ -0,0 +1,142 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "session_registry.hpp"
+
+//
+// Measures the throughput of registering, looking up (as a cancellation does)
+// and removing sessions from many threads at once, for the sharded registry
+// and for a single std::map guarded by a mutex.
+//
+// Usage: session_registry_bench [operations per thread] [max threads]
+//
+
+using namespace mtx::client;
+
+//! The registry that was used by the client before the sharded one.
+class MapRegistry
+{
+public:
+        void insert(std::shared_ptr<Session> s)
+        {
+                std::unique_lock<std::mutex> lock(mutex_);
+                sessions_[s->id] = s;
+        }
+
+        std::shared_ptr<Session> erase(RequestID id)
+        {
+                std::unique_lock<std::mutex> lock(mutex_);
+
+                auto it = sessions_.find(id);
+                if (it == sessions_.end())
+                        return nullptr;
+
+                auto s = it->second;
+                sessions_.erase(it);
+
+                return s;
+        }
+
+        std::shared_ptr<Session> find(RequestID id) const
+        {
+                std::unique_lock<std::mutex> lock(mutex_);
+
+                auto it = sessions_.find(id);
+                return it == sessions_.end() ? nullptr : it->second;
+        }
+
+private:
+        std::map<RequestID, std::shared_ptr<Session>> sessions_;
+        mutable std::mutex mutex_;
+};
+
+//! Number of requests each thread keeps in flight.
+constexpr std::size_t in_flight = 64;
+
+template<class Registry>
+double
+run(unsigned int threads_num, int operations, const std::vector<std::vector<RequestID>> &ids)
+{
+        Registry registry;
+
+        // The sessions are created upfront, only the registry is measured.
+        std::vector<std::vector<std::shared_ptr<Session>>> sessions(threads_num);
+        for (unsigned int t = 0; t < threads_num; ++t) {
+                for (const auto &id : ids[t])
+                        sessions[t].push_back(
+                          std::make_shared<Session>("localhost", id, nullptr, nullptr));
+        }
+
+        std::atomic<unsigned int> ready(0);
+        std::atomic<bool> go(false);
+
+        std::vector<std::thread> threads;
+        for (unsigned int t = 0; t < threads_num; ++t) {
+                threads.emplace_back([&, t]() {
+                        const auto &own = sessions[t];
+
+                        ready += 1;
+                        while (!go)
+                                std::this_thread::yield();
+
+                        for (int i = 0; i < operations; ++i) {
+                                const auto &s = own[i % own.size()];
+
+                                // Keep a window of requests registered at the same time.
+                                if (i >= static_cast<int>(in_flight))
+                                        registry.erase(own[(i - in_flight) % own.size()]->id);
+
+                                registry.insert(s);
+                                registry.find(s->id);
+                        }
+
+                        for (const auto &s : own)
+                                registry.erase(s->id);
+                });
+        }
+
+        while (ready != threads_num)
+                std::this_thread::yield();
+
+        const auto started_at = std::chrono::steady_clock::now();
+        go                    = true;
+
+        for (auto &thread : threads)
+                thread.join();
+
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started_at;
+
+        // Every iteration performs an insert, a lookup & an erase.
+        return 3.0 * operations * threads_num / elapsed.count();
+}
+
+int
+main(int argc, char **argv)
+{
+        const int operations           = argc > 1 ? std::stoi(argv[1]) : 200000;
+        const unsigned int max_threads = argc > 2
+                                           ? std::stoi(argv[2])
+                                           : std::max(1U, std::thread::hardware_concurrency());
+
+        std::vector<std::vector<RequestID>> ids(max_threads);
+        for (unsigned int t = 0; t < max_threads; ++t) {
+                for (std::size_t i = 0; i < 2 * in_flight; ++i)
+                        ids[t].push_back((RequestID(t) << 32) | i);
+        }
+
+        std::cout << "threads\tmap + mutex (Mops/s)\tsharded (Mops/s)\n";
+
+        for (unsigned int threads_num = 1; threads_num <= max_threads; threads_num *= 2) {
+                const auto map     = run<MapRegistry>(threads_num, operations, ids);
+                const auto sharded = run<SessionRegistry>(threads_num, operations, ids);
+
+                std::cout << threads_num << "\t" << map / 1e6 << "\t\t\t" << sharded / 1e6 << "\n";
+        }
+
+        return 0;
+}
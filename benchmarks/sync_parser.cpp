@@ -0,0 +1,89 @@
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "alloc_counter.hpp"
+#include "sync_parser.hpp"
+
+//
+// Compares the DOM based parsing of a /sync response with SyncParser,
+// in terms of time and peak memory usage.
+//
+// Usage: sync_parser <recorded /sync response> [iterations]
+//
+
+using namespace mtx::client;
+
+struct Result
+{
+        std::chrono::microseconds time_per_parse;
+        int64_t peak_bytes;
+        uint64_t allocations;
+};
+
+template<class Parse>
+Result
+measure(const std::string &data, int iterations, Parse parse)
+{
+        const auto start_allocs = alloc_counter::snapshot();
+        const auto start_time   = std::chrono::steady_clock::now();
+
+        alloc_counter::reset_peak();
+        const auto baseline = alloc_counter::live_bytes.load();
+
+        for (int i = 0; i < iterations; ++i) {
+                mtx::responses::Sync sync = parse(data);
+
+                if (sync.next_batch.empty())
+                        std::cerr << "empty next_batch\n";
+        }
+
+        const auto elapsed = std::chrono::steady_clock::now() - start_time;
+
+        return {std::chrono::duration_cast<std::chrono::microseconds>(elapsed) / iterations,
+                alloc_counter::peak_bytes - baseline,
+                (alloc_counter::snapshot() - start_allocs).allocations / iterations};
+}
+
+void
+print(const std::string &name, const Result &result)
+{
+        std::cout << name << ":\n"
+                  << "  time / parse:        " << result.time_per_parse.count() << " us\n"
+                  << "  peak memory:         " << result.peak_bytes / 1024 << " KiB\n"
+                  << "  allocations / parse: " << result.allocations << "\n";
+}
+
+int
+main(int argc, char **argv)
+{
+        if (argc < 2) {
+                std::cerr << "usage: " << argv[0] << " <sync.json> [iterations]\n";
+                return 1;
+        }
+
+        const int iterations = argc > 2 ? std::stoi(argv[2]) : 10;
+
+        std::ifstream file(argv[1]);
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+
+        const std::string data = buffer.str();
+
+        std::cout << "payload: " << data.size() / 1024 << " KiB, " << iterations
+                  << " iterations\n";
+
+        print("DOM", measure(data, iterations, [](const std::string &data) {
+                      mtx::responses::Sync sync = json::parse(data);
+                      return sync;
+              }));
+
+        print("SyncParser", measure(data, iterations, [](const std::string &data) {
+                      SyncParser parser;
+                      parser.feed(data);
+                      return parser.finish();
+              }));
+
+        return 0;
+}
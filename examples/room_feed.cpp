@@ -6,6 +6,7 @@
 #include "client.hpp"
 #include "errors.hpp"
 #include "mtx.hpp"
+#include "sync_loop.hpp"
 
 //
 // Simple usage example of the /login & /sync endpoints which
@@ -80,70 +81,14 @@ print_message(const TimelineEvent &event)
                 cout << get_sender(event) << ": " << get_body(event) << "\n";
 }
 
-// Callback to executed after a /sync request completes.
+// Called by the sync loop for each /sync response, in order.
 void
-sync_handler(shared_ptr<Client> client, const mtx::responses::Sync &res, ErrType err)
+sync_handler(const mtx::responses::Sync &res)
 {
-        if (err) {
-                cout << "sync error:\n";
-                print_errors(err);
-
-                client->sync(
-                  "",
-                  client->next_batch_token(),
-                  false,
-                  30000,
-                  std::bind(&sync_handler, client, std::placeholders::_1, std::placeholders::_2));
-
-                return;
-        }
-
         for (const auto room : res.rooms.join) {
                 for (const auto msg : room.second.timeline.events)
                         print_message(msg);
         }
-
-        client->set_next_batch_token(res.next_batch);
-
-        client->sync(
-          "",
-          client->next_batch_token(),
-          false,
-          30000,
-          std::bind(&sync_handler, client, std::placeholders::_1, std::placeholders::_2));
-}
-
-// Callback to executed after the first (initial) /sync request completes.
-void
-initial_sync_handler(shared_ptr<Client> client, const mtx::responses::Sync &res, ErrType err)
-{
-        if (err) {
-                cout << "error during initial sync:\n";
-                print_errors(err);
-
-                if (err->status_code != boost::beast::http::status::ok) {
-                        cout << "retrying initial sync ...\n";
-                        client->sync("",
-                                     "",
-                                     false,
-                                     0,
-                                     std::bind(&initial_sync_handler,
-                                               client,
-                                               std::placeholders::_1,
-                                               std::placeholders::_2));
-                }
-
-                return;
-        }
-
-        client->set_next_batch_token(res.next_batch);
-
-        client->sync(
-          "",
-          client->next_batch_token(),
-          false,
-          30000,
-          std::bind(&sync_handler, client, std::placeholders::_1, std::placeholders::_2));
 }
 
 int
@@ -161,24 +106,28 @@ main()
 
         auto client = std::make_shared<Client>(server);
 
-        client->login(username, password, [client](const mtx::responses::Login &res, ErrType err) {
-                if (err) {
-                        cout << "There was an error during login: " << err->matrix_error.error
-                             << "\n";
-                        return;
-                }
-
-                cout << "Logged in as: " << res.user_id.toString() << "\n";
-                client->set_access_token(res.access_token);
-
-                client->sync(
-                  "",
-                  "",
-                  false,
-                  0,
-                  std::bind(
-                    &initial_sync_handler, client, std::placeholders::_1, std::placeholders::_2));
-        });
+        SyncLoop::Options options;
+        options.on_error = [](const mtx::client::errors::ClientError &err) {
+                cout << "sync error:\n";
+                print_errors(err);
+        };
+
+        // The loop takes care of the next batch token & retries failed requests.
+        auto sync_loop = std::make_shared<SyncLoop>(client, &sync_handler, options);
+
+        client->login(
+          username, password, [client, sync_loop](const mtx::responses::Login &res, ErrType err) {
+                  if (err) {
+                          cout << "There was an error during login: " << err->matrix_error.error
+                               << "\n";
+                          return;
+                  }
+
+                  cout << "Logged in as: " << res.user_id.toString() << "\n";
+                  client->set_access_token(res.access_token);
+
+                  sync_loop->start();
+          });
 
         client->close();
 
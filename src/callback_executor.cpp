@@ -0,0 +1,103 @@
+#include "callback_executor.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+using namespace mtx::client;
+
+CallbackExecutor::CallbackExecutor(unsigned int threads, std::size_t max_queued)
+  : state_{std::make_shared<State>(std::max<std::size_t>(1, max_queued))}
+{
+        for (unsigned int i = 0; i < std::max(1u, threads); ++i)
+                threads_.emplace_back(&CallbackExecutor::run, state_);
+}
+
+CallbackExecutor::~CallbackExecutor()
+{
+        stop();
+}
+
+bool
+CallbackExecutor::try_post(std::function<void()> function)
+{
+        std::unique_lock<std::mutex> lock(state_->mutex);
+
+        if (state_->is_stopped)
+                return false;
+
+        if (state_->queue.size() >= state_->max_queued) {
+                state_->stats.overflows += 1;
+                return false;
+        }
+
+        state_->queue.push_back(std::move(function));
+        state_->stats.max_queue_depth =
+          std::max(state_->stats.max_queue_depth, state_->queue.size());
+        lock.unlock();
+
+        state_->cv.notify_one();
+
+        return true;
+}
+
+void
+CallbackExecutor::stop()
+{
+        std::unique_lock<std::mutex> lock(state_->mutex);
+        state_->is_stopped = true;
+        lock.unlock();
+
+        state_->cv.notify_all();
+
+        for (auto &thread : threads_) {
+                if (!thread.joinable())
+                        continue;
+
+                // The last reference might be released by a callback. The thread only
+                // uses the state once the callback returns, which it keeps alive.
+                if (thread.get_id() == std::this_thread::get_id())
+                        thread.detach();
+                else
+                        thread.join();
+        }
+}
+
+CallbackExecutor::Stats
+CallbackExecutor::stats() const
+{
+        std::unique_lock<std::mutex> lock(state_->mutex);
+
+        auto stats        = state_->stats;
+        stats.queue_depth = state_->queue.size();
+
+        return stats;
+}
+
+void
+CallbackExecutor::run(std::shared_ptr<State> state)
+{
+        std::unique_lock<std::mutex> lock(state->mutex);
+
+        while (true) {
+                state->cv.wait(
+                  lock, [&state]() { return state->is_stopped || !state->queue.empty(); });
+
+                if (state->queue.empty())
+                        break;
+
+                auto function = std::move(state->queue.front());
+                state->queue.pop_front();
+                lock.unlock();
+
+                try {
+                        function();
+                } catch (const std::exception &e) {
+                        std::cout << e.what() << ": Callback failed\n";
+                }
+
+                function = nullptr;
+
+                lock.lock();
+                state->stats.executed += 1;
+        }
+}
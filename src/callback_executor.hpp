@@ -0,0 +1,83 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mtx {
+namespace client {
+
+//! Runs the callbacks of the requests on its own threads, so that the slow ones don't
+//! hold up the network threads (see `Client::set_callback_executor`). With more than
+//! one thread, the callbacks can run concurrently & out of order.
+//!
+//! At most `max_queued` callbacks wait to be run. Once the queue is full, the callbacks
+//! run on the network threads as if there were no executor, instead of blocking them:
+//! a callback waiting for another request would never see it complete otherwise.
+class CallbackExecutor
+{
+public:
+        //! Counters describing the activity of the executor.
+        struct Stats
+        {
+                //! Number of callbacks run by the executor.
+                uint64_t executed = 0;
+                //! Number of callbacks that were refused because the queue was full.
+                uint64_t overflows = 0;
+                //! Number of callbacks waiting to be run.
+                std::size_t queue_depth = 0;
+                //! Highest number of callbacks that were waiting at the same time.
+                std::size_t max_queue_depth = 0;
+        };
+
+        explicit CallbackExecutor(unsigned int threads = 1, std::size_t max_queued = 1024);
+        ~CallbackExecutor();
+
+        CallbackExecutor(const CallbackExecutor &) = delete;
+        CallbackExecutor &operator=(const CallbackExecutor &) = delete;
+
+        //! Queue a function, unless the queue is full or the executor has been stopped.
+        bool try_post(std::function<void()> function);
+        //! Run the functions already queued, and wait for the threads to exit.
+        void stop();
+
+        //! Retrieve a snapshot of the counters.
+        Stats stats() const;
+
+private:
+        //! The queue, shared with the threads. A callback can release the last reference
+        //! to the executor, so the threads outlive it.
+        struct State
+        {
+                explicit State(std::size_t max_queued)
+                  : max_queued{max_queued}
+                {}
+
+                const std::size_t max_queued;
+
+                //! Functions waiting to be run.
+                std::deque<std::function<void()>> queue;
+                //! Whether the executor has been stopped.
+                bool is_stopped = false;
+
+                Stats stats;
+
+                //! Used to synchronize access to the queue.
+                std::mutex mutex;
+                //! Wakes up the threads.
+                std::condition_variable cv;
+        };
+
+        static void run(std::shared_ptr<State> state);
+
+        const std::shared_ptr<State> state_;
+        std::vector<std::thread> threads_;
+};
+}
+}
@@ -1,3 +1,6 @@
+#include <array>
+#include <limits>
+
 #include <boost/bind.hpp>
 
 #include "client.hpp"
@@ -9,94 +12,426 @@
 using namespace mtx::client;
 using namespace boost::beast;
 
-Client::Client(const std::string &server)
-  : resolver_{ios_}
+namespace {
+
+//! Bind a handler of an asio operation to the strand of the session. The
+//! operation is allocated from the handler memory of the session.
+template<class Handler>
+auto
+bind_session(const std::shared_ptr<Session> &s, Handler handler)
+{
+        return boost::asio::bind_executor(
+          *s->strand, make_alloc_handler(s->handler_memory, std::move(handler)));
+}
+
+//! The target of the request (e.g "/_matrix/client/r0/sync?since=s1").
+boost::beast::string_view
+request_target(const Session &s)
+{
+        if (s.request_line_size == 0)
+                return s.request.target();
+
+        // Between the method & the version of the request line.
+        const auto &head = s.request_head;
+        const auto start = head.find(' ') + 1;
+        const auto end   = head.rfind(' ', s.request_line_size);
+
+        return boost::beast::string_view(head.data() + start, end - start);
+}
+
+//! Whether sending the request twice has the same effect as sending it once.
+bool
+is_idempotent(http::verb method)
+{
+        return method == http::verb::get || method == http::verb::head ||
+               method == http::verb::put || method == http::verb::delete_ ||
+               method == http::verb::options;
+}
+
+//! Name of a phase in the traces & the metrics (e.g "connect").
+const char *
+phase_name(RequestPhase phase)
+{
+        return to_string(static_cast<RequestTiming>(phase));
+}
+
+//! Traces & times the run of a handler of a request, if the request is traced or
+//! watched for stalls.
+class HandlerScope
+{
+public:
+        HandlerScope(const Session &s,
+                     const char *name,
+                     StallDetector::Stall::Kind kind = StallDetector::Stall::Kind::Handler,
+                     bool is_watched                 = true)
+          : s_{s}
+          , detector_{is_watched ? s.stall_detector.get() : nullptr}
+          , span_{s.tracer.get(), name, s.id, phase_name(s.phase)}
+        {
+                if (detector_)
+                        detector_->enter(
+                          frame_, kind, name, s.id, s.context, std::chrono::steady_clock::now());
+        }
+        ~HandlerScope()
+        {
+                std::chrono::steady_clock::duration duration;
+                if (!detector_ ||
+                    !detector_->leave(frame_, std::chrono::steady_clock::now(), duration))
+                        return;
+
+                StallDetector::Stall stall;
+                stall.kind     = frame_.kind;
+                stall.name     = frame_.name;
+                stall.request  = s_.id;
+                stall.context  = s_.context;
+                stall.duration = duration;
+                endpoint_label(request_target(s_), stall.endpoint);
+
+                detector_->report(stall);
+        }
+
+        HandlerScope(const HandlerScope &) = delete;
+        HandlerScope &operator=(const HandlerScope &) = delete;
+
+private:
+        const Session &s_;
+        StallDetector *detector_;
+        TraceSpan span_;
+        StallDetector::Frame frame_;
+};
+
+//! Wrap a callback that isn't invoked by an asio operation (e.g by the connection
+//! pool or the DNS cache), so that it still runs on the strand of the session.
+template<class Handler>
+auto
+on_strand(std::shared_ptr<Session> s, Handler handler)
+{
+        return [s, handler](auto... args) {
+                boost::asio::dispatch(*s->strand,
+                                      make_alloc_handler(s->handler_memory, [handler, args...]() {
+                                              handler(args...);
+                                      }));
+        };
+}
+}
+
+Client::Client(const std::string &server,
+               std::shared_ptr<boost::asio::ssl::context> ssl_ctx,
+               ThreadingModel threading)
+  : Client(server, ThreadOptions{0, threading, 0}, ssl_ctx)
+{}
+
+Client::Client(const std::string &server,
+               const ThreadOptions &options,
+               std::shared_ptr<boost::asio::ssl::context> ssl_ctx)
+  : threads_{new IoServicePool(options)}
   , server_{server}
 {
-        work_.reset(new boost::asio::io_service::work(ios_));
+        use_services(make_client_services(threads_->contexts(), ssl_ctx));
+}
+
+Client::Client(boost::asio::io_service &ios,
+               const std::string &server,
+               std::shared_ptr<boost::asio::ssl::context> ssl_ctx)
+  : server_{server}
+{
+        use_services(make_client_services({&ios}, ssl_ctx));
+}
+
+Client::Client(const std::string &server, const ClientServices &services)
+  : owns_services_{false}
+  // An account rarely has more than a few requests in progress.
+  , sessions_{1}
+  , server_{server}
+{
+        use_services(services);
+}
+
+ClientServices
+mtx::client::make_client_services(const std::vector<boost::asio::io_service *> &contexts,
+                                  std::shared_ptr<boost::asio::ssl::context> ssl_ctx)
+{
+        ClientServices services;
+        services.contexts = contexts;
+        services.ssl_ctx  = ssl_ctx;
+
+        if (!services.ssl_ctx)
+                services.ssl_ctx = std::make_shared<boost::asio::ssl::context>(
+                  boost::asio::ssl::context::sslv23_client);
+
+        services.tls_sessions = std::make_shared<TlsSessionCache>(*services.ssl_ctx);
+
+        for (auto ios : contexts)
+                services.pools.push_back(
+                  std::make_shared<ConnectionPool>(*ios, services.ssl_ctx, services.tls_sessions));
 
-        const auto threads_num = std::max(1U, std::thread::hardware_concurrency());
+        services.dns      = std::make_shared<DnsCache>(*contexts.front());
+        services.sessions = std::make_shared<SessionPool>();
+        services.metrics  = std::make_shared<ClientMetrics>();
 
-        for (unsigned int i = 0; i < threads_num; ++i)
-                thread_group_.add_thread(new boost::thread([this]() { ios_.run(); }));
+        return services;
+}
+
+void
+Client::use_services(const ClientServices &services)
+{
+        contexts_     = services.contexts;
+        ssl_ctx_      = services.ssl_ctx;
+        tls_sessions_ = services.tls_sessions;
+        pools_        = services.pools;
+        dns_          = services.dns;
+        session_pool_ = services.sessions;
+        metrics_      = services.metrics ? services.metrics : std::make_shared<ClientMetrics>();
+}
+
+Client::~Client()
+{
+        // The detector can be kept by the caller, or by the watchdog while it probes.
+        if (auto detector = std::atomic_load(&own_stall_detector_))
+                detector->stop();
 }
 
 void
 Client::close()
 {
-        // Destroy work object. This allows the I/O thread to
-        // exit the event loop when there are no more pending
-        // asynchronous operations.
-        work_.reset(nullptr);
+        // The watchdog would keep probing the event loops. A shared detector is left to
+        // the other clients.
+        if (auto detector = std::atomic_load(&own_stall_detector_))
+                detector->stop();
+
+        if (threads_)
+                threads_->stop();
+
+        // The connections of shared pools are still used by the other clients.
+        if (!owns_services_)
+                return;
+
+        session_pool_->clear();
+
+        // Idle connections don't have pending operations so
+        // they have to be closed explicitly.
+        for (auto &pool : pools_)
+                pool->clear();
+}
+
+std::shared_ptr<StallDetector>
+Client::detect_stalls(const StallDetector::Options &options)
+{
+        auto detector = std::make_shared<StallDetector>(contexts_, options);
+        detector->start();
+
+        std::atomic_store(&stall_detector_, detector);
+
+        if (auto previous = std::atomic_exchange(&own_stall_detector_, detector))
+                previous->stop();
+
+        return detector;
+}
+
+void
+Client::on_connection(std::shared_ptr<Session> s, std::shared_ptr<Connection> conn)
+{
+        HandlerScope scope(*s, "on_connection");
+
+        // The request was aborted while it was waiting for a connection.
+        if (s->is_completed)
+                return pools_[s->context]->release(conn);
+
+        s->connection           = conn;
+        s->is_reused_connection = conn->is_established;
 
-        // Wait for the worker threads to exit.
-        thread_group_.join_all();
+        if (conn->is_established)
+                return write_request(s);
+
+        start_phase(s, RequestPhase::Resolve);
+
+        dns_->resolve(host_,
+                      port_,
+                      on_strand(s,
+                                std::bind(&Client::on_resolve,
+                                          shared_from_this(),
+                                          s,
+                                          std::placeholders::_1,
+                                          std::placeholders::_2)));
 }
 
 void
 Client::on_resolve(std::shared_ptr<Session> s,
                    boost::system::error_code ec,
-                   boost::asio::ip::tcp::resolver::results_type results)
+                   DnsCache::Endpoints endpoints)
 {
+        HandlerScope scope(*s, "on_resolve");
+
+        // The lookup can't be interrupted, so the request
+        // has already failed if it was aborted meanwhile.
+        if (s->is_completed)
+                return;
+
         if (ec)
-                return s->on_failure(s->id, ec);
+                return fail_request(s, ec);
 
-        // Add new session to the list of active sessions so that we can access
-        // it if the user decides to cancel the corresponding request before
-        // it completes.
-        // Because active sessions list can be accessed from multiple threads,
-        //
-        // we guard it with a mutex to avoid data corruption.
-        std::unique_lock<std::mutex> lock(active_sessions_guard_);
-        active_sessions_[s->id] = s;
-        lock.unlock();
+        start_phase(s, RequestPhase::Connect);
 
-        boost::asio::async_connect(
-          s->socket.next_layer(),
-          results.begin(),
-          results.end(),
-          std::bind(&Client::on_connect, shared_from_this(), s, std::placeholders::_1));
+        s->cancel_connect = async_connect_happy_eyeballs(
+          *contexts_[s->context],
+          s->connection->socket.next_layer(),
+          endpoints,
+          connect_attempt_delay_,
+          on_strand(s,
+                    std::bind(&Client::on_connect, shared_from_this(), s, std::placeholders::_1)));
 }
 
 void
 Client::on_connect(std::shared_ptr<Session> s, boost::system::error_code ec)
 {
-        if (ec) {
-                remove_session(s);
-                return s->on_failure(s->id, ec);
+        HandlerScope scope(*s, "on_connect");
+
+        s->cancel_connect = nullptr;
+
+        if (ec || s->abort_reason) {
+                // None of the addresses was reachable, they might have changed.
+                if (ec && !s->abort_reason)
+                        dns_->invalidate(host_, port_);
+
+                return fail_request(s, ec);
         }
 
-        // Check if the request is already cancelled and we shouldn't move forward.
-        std::unique_lock<std::mutex> cancel_lock(s->cancel_guard);
-        if (s->is_cancelled)
-                return on_request_complete(s);
+        start_phase(s, RequestPhase::Handshake);
 
         // Perform the SSL handshake
-        s->socket.async_handshake(
+        s->connection->socket.async_handshake(
           boost::asio::ssl::stream_base::client,
-          std::bind(&Client::on_handshake, shared_from_this(), s, std::placeholders::_1));
+          bind_session(
+            s, std::bind(&Client::on_handshake, shared_from_this(), s, std::placeholders::_1)));
 }
 
 void
 Client::on_handshake(std::shared_ptr<Session> s, boost::system::error_code ec)
 {
-        if (ec) {
-                remove_session(s);
-                return s->on_failure(s->id, ec);
+        HandlerScope scope(*s, "on_handshake");
+
+        if (ec || s->abort_reason) {
+                // Don't try to resume the same session again.
+                if (ec && !s->abort_reason)
+                        tls_sessions_->remove(server_);
+
+                return fail_request(s, ec);
         }
 
+        tls_sessions_->on_handshake(s->connection->socket.native_handle());
+        s->connection->is_established = true;
+
+        write_request(s);
+}
+
+void
+Client::write_request(std::shared_ptr<Session> s)
+{
         // Check if the request is already cancelled and we shouldn't move forward.
-        std::unique_lock<std::mutex> cancel_lock(s->cancel_guard);
-        if (s->is_cancelled)
+        if (s->abort_reason)
                 return on_request_complete(s);
 
-        boost::beast::http::async_write(s->socket,
-                                        s->request,
-                                        std::bind(&Client::on_write,
-                                                  shared_from_this(),
-                                                  s,
-                                                  std::placeholders::_1,
-                                                  std::placeholders::_2));
+        start_phase(s, RequestPhase::Write);
+
+        if (s->header_fields) {
+                const auto &head = s->request_head;
+                auto body        = boost::asio::buffer(s->request.body());
+
+                // The first chunk of a streamed body goes out with the header.
+                if (s->body_source) {
+                        boost::system::error_code ec;
+                        s->body_source->rewind(ec);
+                        s->body_remaining = s->body_source->size();
+                        // It's sent again from the start when the request is retried.
+                        s->recorded_request.clear();
+
+                        if (ec || !read_body_chunk(s, ec))
+                                return fail_request(s, ec);
+
+                        body = boost::asio::buffer(s->body_chunk);
+                }
+
+                // The shared fields are spliced between the request line & the rest of
+                // the header, without being copied.
+                const std::array<boost::asio::const_buffer, 4> buffers{
+                  {boost::asio::buffer(head.data(), s->request_line_size),
+                   boost::asio::buffer(*s->header_fields),
+                   boost::asio::buffer(head.data() + s->request_line_size,
+                                       head.size() - s->request_line_size),
+                   body}};
+
+                return boost::asio::async_write(s->connection->socket,
+                                                buffers,
+                                                bind_session(s,
+                                                             std::bind(&Client::on_write,
+                                                                       shared_from_this(),
+                                                                       s,
+                                                                       std::placeholders::_1,
+                                                                       std::placeholders::_2)));
+        }
+
+        boost::beast::http::async_write(
+          s->connection->socket,
+          s->request,
+          bind_session(s,
+                       std::bind(&Client::on_write,
+                                 shared_from_this(),
+                                 s,
+                                 std::placeholders::_1,
+                                 std::placeholders::_2)));
+}
+
+bool
+Client::read_body_chunk(std::shared_ptr<Session> s, boost::system::error_code &ec)
+{
+        // Small bodies only take as much storage as they need.
+        const auto capacity =
+          static_cast<std::size_t>(std::min<uint64_t>(s->body_remaining, max_body_chunk_size));
+        s->body_chunk.resize(capacity);
+
+        std::size_t size = 0;
+        while (size < capacity && !ec) {
+                const auto n = s->body_source->read(&s->body_chunk[size], capacity - size, ec);
+                if (n == 0)
+                        break;
+
+                size += n;
+        }
+
+        if (ec)
+                return false;
+
+        // The source has to provide the size it announced.
+        if (size < capacity) {
+                ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+                return false;
+        }
+
+        if (s->recorder)
+                s->recorded_request.append(s->body_chunk);
+
+        s->body_remaining -= size;
+        return true;
+}
+
+void
+Client::write_body_chunk(std::shared_ptr<Session> s)
+{
+        boost::system::error_code ec;
+        if (!read_body_chunk(s, ec))
+                return fail_request(s, ec);
+
+        // The write limit applies to each chunk, so a large body can take as long as it needs.
+        start_phase(s, RequestPhase::Write);
+
+        boost::asio::async_write(s->connection->socket,
+                                 boost::asio::buffer(s->body_chunk),
+                                 bind_session(s,
+                                              std::bind(&Client::on_write,
+                                                        shared_from_this(),
+                                                        s,
+                                                        std::placeholders::_1,
+                                                        std::placeholders::_2)));
 }
 
 void
@@ -106,22 +441,50 @@ Client::on_write(std::shared_ptr<Session> s,
 {
         boost::ignore_unused(bytes_transferred);
 
+        HandlerScope scope(*s, "on_write");
+
         if (ec) {
-                remove_session(s);
-                return s->on_failure(s->id, ec);
+                if (retry_on_stale_connection(s, ec))
+                        return;
+
+                return fail_request(s, ec);
         }
 
-        std::unique_lock<std::mutex> cancel_lock(s->cancel_guard);
-        if (s->is_cancelled)
+        s->timings.bytes_sent += bytes_transferred;
+
+        if (s->abort_reason)
                 return on_request_complete(s);
 
+        if (s->body_remaining > 0)
+                return write_body_chunk(s);
+
+        start_phase(s, RequestPhase::Read);
+
+        // Hand the header & the body over to their consumers, or the body to the decoder,
+        // while it's being received. The arrival of the first part of the response
+        // is measured the same way.
+        if (s->on_body || s->on_header || s->accepts_encoding || s->metrics)
+                return http::async_read_some(
+                  s->connection->socket,
+                  s->output_buf,
+                  *s->parser,
+                  bind_session(s,
+                               std::bind(&Client::on_read_some,
+                                         shared_from_this(),
+                                         s,
+                                         std::placeholders::_1,
+                                         std::placeholders::_2)));
+
         // Receive the HTTP response
-        http::async_read(
-          s->socket,
-          s->output_buf,
-          s->parser,
-          std::bind(
-            &Client::on_read, shared_from_this(), s, std::placeholders::_1, std::placeholders::_2));
+        http::async_read(s->connection->socket,
+                         s->output_buf,
+                         *s->parser,
+                         bind_session(s,
+                                      std::bind(&Client::on_read,
+                                                shared_from_this(),
+                                                s,
+                                                std::placeholders::_1,
+                                                std::placeholders::_2)));
 }
 
 void
@@ -131,187 +494,701 @@ Client::on_read(std::shared_ptr<Session> s,
 {
         boost::ignore_unused(bytes_transferred);
 
-        if (ec)
+        HandlerScope scope(*s, "on_read");
+
+        if (ec) {
+                if (retry_on_stale_connection(s, ec))
+                        return;
+
                 s->error_code = ec;
+        }
 
         on_request_complete(s);
 }
 
+void
+Client::on_read_some(std::shared_ptr<Session> s,
+                     boost::system::error_code ec,
+                     std::size_t bytes_transferred)
+{
+        HandlerScope scope(*s, "on_read_some");
+
+        if (ec)
+                return on_read(s, ec, bytes_transferred);
+
+        if (s->metrics) {
+                auto &timings = s->timings;
+                timings.bytes_received += bytes_transferred;
+
+                if (!timings.has_first_byte) {
+                        timings.first_byte =
+                          std::chrono::steady_clock::now() - timings.phase_started_at;
+                        timings.has_first_byte = true;
+                }
+        }
+
+        auto &response = s->parser->get();
+
+        if (s->parser->is_header_done() && !s->is_header_inspected) {
+                start_decoding(s, ec);
+
+                if (!ec && s->on_header)
+                        s->on_header(response, ec);
+
+                if (ec)
+                        return on_read(s, ec, bytes_transferred);
+        }
+
+        if (s->parser->is_header_done() && !response.body().empty()) {
+                auto &body = response.body();
+
+                if (s->is_decoding) {
+                        // The compressed data is dropped once decoded, so it's never stored whole.
+                        s->decoder->decode(body.data(),
+                                           body.size(),
+                                           [&s, this](const char *data, std::size_t size) {
+                                                   if (s->on_body && !s->error_response)
+                                                           consume_body(s, data, size);
+                                                   else
+                                                           s->decoded_body.append(data, size);
+                                           },
+                                           ec);
+                        body.clear();
+
+                        if (ec)
+                                return on_read(s, ec, bytes_transferred);
+                } else if (s->on_body && !s->error_response) {
+                        consume_body(s, body.data(), body.size());
+
+                        // Only the last read is ever stored (see `ResponseBody`).
+                        body.clear();
+                }
+        }
+
+        if (s->parser->is_done()) {
+                if (s->is_decoding)
+                        finish_decoding(s, ec);
+
+                return on_read(s, ec, bytes_transferred);
+        }
+
+        if (s->abort_reason)
+                return on_request_complete(s);
+
+        http::async_read_some(s->connection->socket,
+                              s->output_buf,
+                              *s->parser,
+                              bind_session(s,
+                                           std::bind(&Client::on_read_some,
+                                                     shared_from_this(),
+                                                     s,
+                                                     std::placeholders::_1,
+                                                     std::placeholders::_2)));
+}
+
+void
+Client::start_decoding(std::shared_ptr<Session> s, boost::system::error_code &ec)
+{
+        const auto &response = s->parser->get();
+
+        s->is_header_inspected = true;
+        // Error responses are accumulated as usual, so they can be parsed.
+        s->error_response =
+          http::to_status_class(response.result()) != http::status_class::successful;
+
+        const auto encoding = response[http::field::content_encoding];
+        if (is_identity_encoding(encoding))
+                return;
+
+        // The decoder of the previous response is reused if it's for the same encoding.
+        if (s->decoder && boost::beast::iequals(s->decoder->encoding(), encoding))
+                s->decoder->reset();
+        else
+                s->decoder = make_content_decoder(encoding, max_body_size);
+
+        if (!s->decoder) {
+                ec = DecodeError::UnsupportedEncoding;
+                return;
+        }
+
+        s->is_decoding = true;
+}
+
+void
+Client::finish_decoding(std::shared_ptr<Session> s, boost::system::error_code &ec)
+{
+        s->decoder->finish(ec);
+        if (ec)
+                return;
+
+        auto &response = s->parser->get();
+
+        // The decoded body keeps the storage of the compressed chunks for the next response.
+        response.body().swap(s->decoded_body);
+        response.erase(http::field::content_encoding);
+        response.erase(http::field::content_length);
+}
+
+void
+Client::consume_body(std::shared_ptr<Session> s, const char *data, std::size_t size)
+{
+        if (s->recorder)
+                s->recorded_response.append(data, size);
+
+        if (s->has_body_failed)
+                return;
+
+        const auto started_at =
+          s->metrics ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+
+        try {
+                s->on_body(data, size);
+        } catch (std::exception &e) {
+                s->has_body_failed = true;
+                std::cout << e.what() << ": Couldn't parse response\n";
+        }
+
+        if (s->metrics)
+                s->timings.parse += std::chrono::steady_clock::now() - started_at;
+}
+
+bool
+Client::retry_on_stale_connection(std::shared_ptr<Session> s, boost::system::error_code ec)
+{
+        // The server is allowed to close an idle keep-alive connection at any time.
+        // If that happened before it sent anything back, the request can be safely
+        // sent again on a fresh connection.
+        if (!s->is_reused_connection || s->parser->got_some() || s->abort_reason)
+                return false;
+
+        // Once the whole request has been written, the server may have acted on it even
+        // though it didn't answer, so only the idempotent ones are retried (RFC 7230
+        // §6.3.1). The others (e.g /createRoom) fail.
+        if (s->phase != RequestPhase::Write && !is_idempotent(s->request.method()))
+                return false;
+
+        if (ec != boost::asio::error::eof && ec != boost::asio::error::connection_reset &&
+            ec != boost::asio::error::broken_pipe &&
+            ec != boost::asio::ssl::error::stream_truncated)
+                return false;
+
+        auto &pool = pools_[s->context];
+
+        pool->drop(s->connection);
+        s->connection.reset();
+        s->is_reused_connection = false;
+        s->output_buf.consume(s->output_buf.size());
+
+        start_phase(s, RequestPhase::Queued);
+
+        pool->acquire(
+          server_,
+          on_strand(
+            s, std::bind(&Client::on_connection, shared_from_this(), s, std::placeholders::_1)));
+
+        return true;
+}
+
 void
 Client::do_request(std::shared_ptr<Session> s)
 {
-        resolver_.async_resolve(server_,
-                                "443",
-                                std::bind(&Client::on_resolve,
-                                          shared_from_this(),
-                                          s,
-                                          std::placeholders::_1,
-                                          std::placeholders::_2));
+        // The sessions from the pool come with their strand & timers.
+        if (!s->strand) {
+                // Spread the requests over the io_services.
+                s->context = next_context_.fetch_add(1) % contexts_.size();
+
+                auto &ios        = *contexts_[s->context];
+                s->strand        = std::make_unique<Strand>(ios.get_executor());
+                s->request_timer = std::make_unique<boost::asio::steady_timer>(ios);
+                s->phase_timer   = std::make_unique<boost::asio::steady_timer>(ios);
+        }
+
+        // Add new session to the list of active sessions so that we can access
+        // it if the user decides to cancel the corresponding request before
+        // it completes.
+        sessions_.insert(s);
+
+        if (s->metrics) {
+                auto &timings            = s->timings;
+                timings.started_at       = std::chrono::steady_clock::now();
+                timings.phase_started_at = timings.started_at;
+                timings.phases_entered   = 1u << static_cast<unsigned int>(RequestPhase::Queued);
+        }
+
+        if (s->tracer)
+                s->traced_phase_started_at = std::chrono::steady_clock::now();
+
+        // From now on the session is only accessed from its strand.
+        boost::asio::dispatch(
+          *s->strand,
+          make_alloc_handler(s->handler_memory,
+                             std::bind(&Client::start_request, shared_from_this(), s)));
 }
 
 void
-Client::cancel_request(RequestID request_id)
+Client::start_request(std::shared_ptr<Session> s)
 {
-        std::unique_lock<std::mutex> lock(active_sessions_guard_);
+        HandlerScope scope(*s, "start_request");
 
-        auto it = active_sessions_.find(request_id);
-        if (it != active_sessions_.end()) {
-                std::unique_lock<std::mutex> cancel_lock(it->second->cancel_guard);
-                it->second->is_cancelled = true;
+        // Cancelled before it even started.
+        if (s->is_completed)
+                return;
+
+        if (s->timeouts.total.count() > 0) {
+                s->request_timer->expires_after(s->timeouts.total);
+                s->request_timer->async_wait(bind_session(
+                  s,
+                  std::bind(
+                    &Client::on_request_timeout, shared_from_this(), s, std::placeholders::_1)));
         }
+
+        pools_[s->context]->acquire(
+          server_,
+          on_strand(
+            s, std::bind(&Client::on_connection, shared_from_this(), s, std::placeholders::_1)));
 }
 
 void
-Client::remove_session(std::shared_ptr<Session> s)
+Client::cancel_request(RequestID request_id)
 {
-        // Shutting down the connection. This method may
-        // fail in case the socket is not connected. We don't
-        // care about the error code if this function fails.
+        auto s = sessions_.find(request_id);
+        if (!s)
+                return;
+
+        boost::asio::dispatch(*s->strand,
+                              std::bind(&Client::abort_request,
+                                        shared_from_this(),
+                                        s,
+                                        boost::system::error_code(
+                                          boost::asio::error::operation_aborted)));
+}
+
+void
+Client::abort_request(std::shared_ptr<Session> s, boost::system::error_code reason)
+{
+        if (s->is_completed || s->abort_reason)
+                return;
+
+        HandlerScope scope(*s, "abort_request");
+
+        s->abort_reason = reason;
+        s->is_cancelled = reason == boost::asio::error::operation_aborted;
+
+        switch (s->phase) {
+        case RequestPhase::Queued:
+        case RequestPhase::Resolve:
+                // No socket operation is in progress.
+                return fail_request(s, reason);
+        case RequestPhase::Connect:
+                if (s->cancel_connect)
+                        s->cancel_connect();
+                return;
+        default:
+                break;
+        }
+
+        // Closing the socket completes the pending operation right away
+        // with an error, instead of waiting for the server.
         boost::system::error_code ignored_ec;
+        s->connection->socket.next_layer().close(ignored_ec);
+}
+
+void
+Client::start_phase(std::shared_ptr<Session> s, RequestPhase phase)
+{
+        if (s->metrics || s->tracer) {
+                const auto now = std::chrono::steady_clock::now();
 
-        s->socket.async_shutdown([s](boost::system::error_code ec) {
-                if (ec == boost::asio::error::eof) {
-                        // Rationale:
-                        // http://stackoverflow.com/questions/25587403/boost-asio-ssl-async-shutdown-always-finishes-with-an-error
-                        ec.assign(0, ec.category());
+                if (s->metrics) {
+                        end_phase(*s, now);
+                        s->timings.phases_entered |= 1u << static_cast<unsigned int>(phase);
                 }
 
-                if (ec)
-                        // TODO: propagate the error.
-                        std::cout << "shutdown: " << ec << std::endl;
-        });
+                if (s->tracer)
+                        trace_phase(*s, now);
+        }
+
+        s->phase = phase;
+
+        std::chrono::milliseconds timeout{0};
+
+        switch (phase) {
+        case RequestPhase::Queued:
+                break;
+        case RequestPhase::Resolve:
+                timeout = s->timeouts.resolve;
+                break;
+        case RequestPhase::Connect:
+                timeout = s->timeouts.connect;
+                break;
+        case RequestPhase::Handshake:
+                timeout = s->timeouts.handshake;
+                break;
+        case RequestPhase::Write:
+                timeout = s->timeouts.write;
+                break;
+        case RequestPhase::Read:
+                timeout = s->timeouts.read;
+                break;
+        }
+
+        if (timeout.count() <= 0) {
+                s->phase_timer->cancel();
+                return;
+        }
+
+        s->phase_timer->expires_after(timeout);
+        s->phase_timer->async_wait(bind_session(
+          s,
+          std::bind(
+            &Client::on_phase_timeout, shared_from_this(), s, phase, std::placeholders::_1)));
+}
+
+void
+Client::on_request_timeout(std::shared_ptr<Session> s, boost::system::error_code ec)
+{
+        if (ec == boost::asio::error::operation_aborted)
+                return;
+
+        abort_request(s, boost::asio::error::timed_out);
+}
+
+void
+Client::on_phase_timeout(std::shared_ptr<Session> s,
+                         RequestPhase phase,
+                         boost::system::error_code ec)
+{
+        if (ec == boost::asio::error::operation_aborted)
+                return;
+
+        // The request has moved on, or the timer was re-armed for the same phase.
+        if (s->phase != phase || s->phase_timer->expiry() > std::chrono::steady_clock::now())
+                return;
+
+        abort_request(s, boost::asio::error::timed_out);
+}
 
+void
+Client::remove_session(std::shared_ptr<Session> s)
+{
         // Remove the session from the map of active sessions.
-        std::unique_lock<std::mutex> lock(active_sessions_guard_);
+        sessions_.erase(s->id);
+
+        if (!s->connection)
+                return;
 
-        auto it = active_sessions_.find(s->id);
-        if (it != active_sessions_.end())
-                active_sessions_.erase(it);
+        // The connection can only be reused if the whole response has been
+        // consumed and the server didn't ask us to close it.
+        const bool can_reuse = !s->error_code && !s->abort_reason && s->parser->is_done() &&
+                               s->parser->get().keep_alive();
 
-        lock.unlock();
+        if (can_reuse)
+                pools_[s->context]->release(s->connection);
+        else
+                pools_[s->context]->drop(s->connection);
+
+        s->connection.reset();
 }
 
 void
-Client::on_request_complete(std::shared_ptr<Session> s)
+Client::fail_request(std::shared_ptr<Session> s, boost::system::error_code ec)
 {
+        if (s->is_completed)
+                return;
+
+        s->is_completed = true;
+        s->request_timer->cancel();
+        s->phase_timer->cancel();
+
+        if (s->abort_reason)
+                ec = s->abort_reason;
+
         remove_session(s);
 
-        boost::system::error_code ec;
+        complete_request(s, 0, ec);
+}
 
-        if (s->error_code == 0 && s->is_cancelled) {
-                ec = boost::asio::error::operation_aborted;
-                s->on_failure(s->id, ec);
+void
+Client::on_request_complete(std::shared_ptr<Session> s)
+{
+        if (s->is_completed)
                 return;
-        } else {
-                ec = s->error_code;
-        }
 
-        s->on_success(s->id, s->parser.get(), ec);
+        s->is_completed = true;
+        s->request_timer->cancel();
+        s->phase_timer->cancel();
+
+        remove_session(s);
+
+        if (s->recorder && !s->abort_reason && !s->error_code)
+                record_traffic(s);
+
+        // A response that wasn't received in full counts as a failure.
+        const auto status = s->abort_reason || s->error_code ? 0 : s->parser->get().result_int();
+
+        complete_request(s, status, s->abort_reason);
 }
 
-//
-// Client API endpoints
-//
+//! The callback can release the last reference to the client, on the thread of the executor.
+//! The session is released first, as it can't outlive the event loops of the client.
+struct Client::DeferredCallback
+{
+        void operator()() const { client->run_callback(session, status, failure, endpoint, true); }
+
+        std::shared_ptr<Client> client;
+        //! Declared after the client, so that it's destroyed before it.
+        std::shared_ptr<Session> session;
+        unsigned int status;
+        boost::system::error_code failure;
+        std::size_t endpoint;
+};
 
 void
-Client::login(
-  const std::string &user,
-  const std::string &password,
-  std::function<void(const mtx::responses::Login &response,
-                     std::experimental::optional<mtx::client::errors::ClientError>)> callback)
+Client::complete_request(std::shared_ptr<Session> s,
+                         unsigned int status,
+                         boost::system::error_code failure)
 {
-        mtx::requests::Login req;
-        req.user     = user;
-        req.password = password;
+        if (!s->metrics && !s->tracer && !s->stall_detector && !s->callback_executor) {
+                if (failure)
+                        return s->on_failure(s->id, failure);
 
-        post<mtx::requests::Login, mtx::responses::Login>(
-          "/login",
-          req,
-          [this, callback](const mtx::responses::Login &resp,
-                           std::experimental::optional<mtx::client::errors::ClientError> err) {
-                  if (!err && resp.access_token.size()) {
-                          access_token_ = resp.access_token;
-                  }
-                  callback(resp, err);
-          },
-          false);
+                return s->on_success(s->id, s->parser->release(), s->error_code);
+        }
+
+        const auto now      = std::chrono::steady_clock::now();
+        const auto endpoint = s->metrics ? record_metrics(s, status, now) : 0;
+
+        if (s->tracer)
+                trace_phase(*s, now);
+
+        // The session is kept alive by the callback, until it has been run.
+        if (s->callback_executor &&
+            s->callback_executor->try_post(
+              DeferredCallback{shared_from_this(), s, status, failure, endpoint}))
+                return;
+
+        run_callback(s, status, failure, endpoint, false);
 }
 
 void
-Client::logout(
-  std::function<void(const mtx::responses::Logout &response,
-                     std::experimental::optional<mtx::client::errors::ClientError>)> callback)
+Client::run_callback(std::shared_ptr<Session> s,
+                     unsigned int status,
+                     boost::system::error_code failure,
+                     std::size_t endpoint,
+                     bool is_deferred)
 {
-        mtx::requests::Logout req;
+        const auto callback_started_at = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::duration callback_parse{0};
 
-        post<mtx::requests::Logout, mtx::responses::Logout>(
-          "/logout",
-          req,
-          [this, callback](const mtx::responses::Logout &res,
-                           std::experimental::optional<mtx::client::errors::ClientError> err) {
-                  if (!err) {
-                          // Clear the now invalid access token when logout is successful
-                          access_token_.clear();
-                  }
-                  // Pass up response and error to supplied callback
-                  callback(res, err);
-          });
+        {
+                // Off the network threads, a slow callback doesn't hold up anything.
+                HandlerScope scope(
+                  *s, "callback", StallDetector::Stall::Kind::Callback, !is_deferred);
+
+                if (failure) {
+                        s->on_failure(s->id, failure);
+                } else {
+                        ParseTimer::Scope timer(s->metrics ? &callback_parse : nullptr);
+                        s->on_success(s->id, s->parser->release(), s->error_code);
+                }
+        }
+
+        if (!s->metrics)
+                return;
+
+        const auto callback = std::chrono::steady_clock::now() - callback_started_at;
+        s->metrics->record_callback(
+          endpoint, status != 0, s->timings.parse + callback_parse, callback - callback_parse);
 }
 
 void
-Client::create_room(const mtx::requests::CreateRoom &room_options,
-                    std::function<void(const mtx::responses::CreateRoom &, RequestErr)> callback)
+Client::end_phase(Session &s, std::chrono::steady_clock::time_point now)
 {
-        post<mtx::requests::CreateRoom, mtx::responses::CreateRoom>(
-          "/createRoom", room_options, callback);
+        auto &timings = s.timings;
+
+        timings.phases[static_cast<std::size_t>(s.phase)] += now - timings.phase_started_at;
+        timings.phase_started_at = now;
 }
 
-void
-Client::join_room(const mtx::identifiers::Room &room_id,
-                  std::function<void(const nlohmann::json &, RequestErr)> callback)
+std::size_t
+Client::record_metrics(std::shared_ptr<Session> s,
+                       unsigned int status,
+                       std::chrono::steady_clock::time_point now)
 {
-        auto api_path = "/rooms/" + room_id.toString() + "/join";
+        end_phase(*s, now);
+        s->timings.total = now - s->timings.started_at;
 
-        post<std::string, nlohmann::json>(api_path, "", callback);
+        return s->metrics->record(request_target(*s), s->timings, status);
 }
 
 void
-Client::join_room(const std::string &room,
-                  std::function<void(const nlohmann::json &, RequestErr)> callback)
+Client::trace_phase(Session &s, std::chrono::steady_clock::time_point now)
 {
-        auto api_path = "/join/" + room;
+        s.tracer->phase(phase_name(s.phase), s.id, s.traced_phase_started_at, now);
+        s.traced_phase_started_at = now;
+}
 
-        post<std::string, nlohmann::json>(api_path, "", callback);
+void
+Client::record_traffic(std::shared_ptr<Session> s)
+{
+        const auto &response = s->parser->get();
+
+        TrafficRecord record;
+        record.start = std::chrono::duration_cast<std::chrono::microseconds>(
+          s->started_at - s->recorder->started_at());
+        record.duration = std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - s->started_at);
+        record.method = s->request.method();
+        record.status = response.result_int();
+
+        const auto target = request_target(*s);
+        record.target.assign(target.data(), target.size());
+
+        record.request_body = s->body_source ? std::move(s->recorded_request) : s->request.body();
+        // The body has been decoded & its size can change when it's replayed, so only
+        // the fields describing its content are kept.
+        for (const auto &field : response) {
+                switch (field.name()) {
+                case http::field::connection:
+                case http::field::content_encoding:
+                case http::field::content_length:
+                case http::field::date:
+                case http::field::keep_alive:
+                case http::field::set_cookie:
+                case http::field::transfer_encoding:
+                        continue;
+                default:
+                        break;
+                }
+
+                const auto name  = field.name_string();
+                const auto value = field.value();
+                record.response_fields.append(name.data(), name.size())
+                  .append(": ")
+                  .append(value.data(), value.size())
+                  .append("\r\n");
+        }
+
+        const bool is_streamed = s->on_body && !s->error_response;
+        record.response_body   = is_streamed ? std::move(s->recorded_response) : response.body();
+
+        s->recorder->write(std::move(record));
 }
 
 void
-Client::leave_room(const mtx::identifiers::Room &room_id,
-                   std::function<void(const nlohmann::json &, RequestErr)> callback)
+Client::prepare_request(std::shared_ptr<Session> session,
+                        http::verb method,
+                        const std::string &endpoint,
+                        bool requires_auth,
+                        const char *api)
+{
+        auto headers = std::atomic_load(&headers_);
+
+        // Shares the ownership of the template, without allocating.
+        session->header_fields =
+          std::shared_ptr<const std::string>(headers, &headers->fields(requires_auth));
+        session->request.method(method);
+        session->accepts_encoding = headers->accepts_encoding();
+
+        session->metrics           = metrics_enabled_ ? metrics_.get() : nullptr;
+        session->tracer            = std::atomic_load(&tracer_);
+        session->stall_detector    = std::atomic_load(&stall_detector_);
+        session->callback_executor = std::atomic_load(&callback_executor_);
+        session->recorder          = std::atomic_load(&recorder_);
+        if (session->recorder)
+                session->started_at = std::chrono::steady_clock::now();
+
+        // The string keeps its capacity when the session is recycled.
+        auto &head             = session->request_head;
+        const auto method_name = http::to_string(method);
+
+        head.clear();
+        head.append(method_name.data(), method_name.size())
+          .append(" ")
+          .append(api)
+          .append(endpoint)
+          .append(" HTTP/1.1\r\n");
+        session->request_line_size = head.size();
+
+        // Like `prepare_payload`, only the methods that expect a body announce its size.
+        if (method != http::verb::get) {
+                const auto &source = session->body_source;
+
+                head.append("Content-Type: ")
+                  .append(source ? source->content_type() : "application/json")
+                  .append("\r\nContent-Length: ")
+                  .append(std::to_string(source ? source->size() : session->request.body().size()))
+                  .append("\r\n");
+        }
+
+        head.append("\r\n");
+}
+
+RequestID
+Client::get_range(const std::string &endpoint, RangeRequest range)
 {
-        auto api_path = "/rooms/" + room_id.toString() + "/leave";
+        auto session = create_session<nlohmann::json>(
+          [on_complete = std::move(range.on_complete)](nlohmann::json &&, RequestErr err) {
+                  on_complete(err);
+          },
+          // The body of a successful response has been passed to `on_body`.
+          [](const std::string &) { return nlohmann::json{}; });
+
+        session->on_header = std::move(range.on_header);
+        session->on_body   = std::move(range.on_body);
+        // The content is written elsewhere, so it may be larger than any other response.
+        session->parser->body_limit(std::numeric_limits<uint64_t>::max());
 
-        post<std::string, nlohmann::json>(api_path, "", callback);
+        prepare_request(session, http::verb::get, endpoint, false, media_api);
+
+        // A range applies to the content as it's sent, so it can't be compressed.
+        auto headers = std::atomic_load(&headers_);
+        session->header_fields =
+          std::shared_ptr<const std::string>(headers, &headers->identity_fields());
+        session->accepts_encoding = false;
+
+        // Before the empty line ending the header.
+        auto &head        = session->request_head;
+        std::string field = "Range: bytes=" + std::to_string(range.first) + "-";
+        if (range.last)
+                field += std::to_string(*range.last);
+        field += "\r\n";
+        head.insert(head.size() - 2, field);
+
+        const auto id = session->id;
+        do_request(session);
+
+        return id;
 }
 
 void
-Client::sync(const std::string &filter,
-             const std::string &since,
-             bool full_state,
-             uint16_t timeout,
-             std::function<void(const mtx::responses::Sync &, RequestErr)> callback)
+Client::set_access_token(const std::string &token)
 {
-        std::map<std::string, std::string> params;
+        std::lock_guard<std::mutex> lock(headers_mutex_);
+
+        access_token_ = token;
 
-        if (!filter.empty())
-                params.emplace("filter", filter);
+        // The requests being prepared on other threads keep using the previous template.
+        std::atomic_store(&headers_,
+                          std::make_shared<const HeaderTemplate>(
+                            server_, token, compression_ ? supported_encodings() : ""));
+}
 
-        if (!since.empty())
-                params.emplace("since", since);
+void
+Client::set_compression(bool enabled)
+{
+        std::lock_guard<std::mutex> lock(headers_mutex_);
 
-        if (full_state)
-                params.emplace("full_state", "true");
+        compression_ = enabled;
 
-        params.emplace("timeout", std::to_string(timeout));
+        std::atomic_store(&headers_,
+                          std::make_shared<const HeaderTemplate>(
+                            server_, access_token_, enabled ? supported_encodings() : ""));
+}
 
-        get<mtx::responses::Sync>("/sync?" + utils::query_params(params), callback);
+bool
+Client::compression() const
+{
+        std::lock_guard<std::mutex> lock(headers_mutex_);
+        return compression_;
 }
@@ -1,75 +1,246 @@
 #pragma once
 
+#include <atomic>
 #include <experimental/optional>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <thread>
+#include <utility>
+#include <vector>
 
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
 #include <boost/beast.hpp>
-#include <boost/thread/thread.hpp>
 #include <json.hpp>
 
+#include "callback_executor.hpp"
+#include "completion.hpp"
+#include "connection_pool.hpp"
+#include "dns_cache.hpp"
 #include "errors.hpp"
+#include "header_template.hpp"
+#include "io_service_pool.hpp"
+#include "media.hpp"
+#include "metrics.hpp"
 #include "mtx/requests.hpp"
 #include "mtx/responses.hpp"
+#include "request_body.hpp"
+#include "request_tracer.hpp"
 #include "session.hpp"
+#include "session_pool.hpp"
+#include "session_registry.hpp"
+#include "stall_detector.hpp"
+#include "sync_parser.hpp"
+#include "tls_session_cache.hpp"
+#include "traffic_recorder.hpp"
 #include "utils.hpp"
 
 namespace mtx {
 namespace client {
 
+//! The event loops & the caches that several clients can share.
+struct ClientServices
+{
+        //! The io_services that run the requests.
+        std::vector<boost::asio::io_service *> contexts;
+        //! SSL context shared by all the connections.
+        std::shared_ptr<boost::asio::ssl::context> ssl_ctx;
+        //! TLS sessions of the previous connections.
+        std::shared_ptr<TlsSessionCache> tls_sessions;
+        //! Keep-alive connections, one pool per io_service.
+        std::vector<std::shared_ptr<ConnectionPool>> pools;
+        //! Used to resolve DNS names.
+        std::shared_ptr<DnsCache> dns;
+        //! The sessions of the finished requests, ready to be reused.
+        std::shared_ptr<SessionPool> sessions;
+        //! The measures of the requests.
+        std::shared_ptr<ClientMetrics> metrics;
+};
+
+//! Create the caches for the given io_services. A default SSL context
+//! will be created if none is given.
+ClientServices
+make_client_services(const std::vector<boost::asio::io_service *> &contexts,
+                     std::shared_ptr<boost::asio::ssl::context> ssl_ctx = nullptr);
+
 //! The main object that the user will interact.
 class Client : public std::enable_shared_from_this<Client>
 {
 public:
-        Client(const std::string &server = "");
+        //! The server is a host name, followed by a port if it's not 443 (e.g "localhost:8448").
+        //! The SSL context is shared by all the connections of the client.
+        //! A default one will be created if none is given.
+        Client(const std::string &server                          = "",
+               std::shared_ptr<boost::asio::ssl::context> ssl_ctx = nullptr,
+               ThreadingModel threading                           = ThreadingModel::Shared);
+        //! Start the network threads as described by the options.
+        Client(const std::string &server,
+               const ThreadOptions &threads,
+               std::shared_ptr<boost::asio::ssl::context> ssl_ctx = nullptr);
+        //! Run the requests on an io_service owned by the caller, which has to run it.
+        //! No thread is started, so any number of clients can share a few threads.
+        Client(boost::asio::io_service &ios,
+               const std::string &server                          = "",
+               std::shared_ptr<boost::asio::ssl::context> ssl_ctx = nullptr);
+        //! Use the event loops & caches of other clients. Only the tokens and the
+        //! requests in progress belong to this client (see `ClientPool`).
+        Client(const std::string &server, const ClientServices &services);
+        //! Stops the watchdog of the stall detector, which probes the event loops.
+        ~Client();
 
         //! Wait for the client to close.
         void close();
-        //! Cancels the request.
+        //! Cancels the request. Its socket is closed right away, so the failure
+        //! callback is called with `operation_aborted` without waiting for the server.
         void cancel_request(RequestID request_id);
         //! Make a new request.
         void do_request(std::shared_ptr<Session> session);
+        //! Allocate a unique id for a session created outside of the client.
+        RequestID next_request_id() { return next_request_id_.fetch_add(1); }
         //! Return the number of pending requests.
-        int active_sessions() const { return active_sessions_.size(); }
-        //! Add an access token.
-        void set_access_token(const std::string &token) { access_token_ = token; }
+        int active_sessions() const { return sessions_.size(); }
+        //! Retrieve the pool of keep-alive connections used by the client.
+        //! With `ThreadingModel::PerThread` this is the pool of the first thread.
+        std::shared_ptr<ConnectionPool> connection_pool() const { return pools_.front(); }
+        //! Retrieve the pools of keep-alive connections, one per io_service.
+        std::vector<std::shared_ptr<ConnectionPool>> connection_pools() const { return pools_; }
+        //! Retrieve the cache of TLS sessions used to resume the handshakes.
+        std::shared_ptr<TlsSessionCache> tls_session_cache() const { return tls_sessions_; }
+        //! Retrieve the cache of resolved DNS names.
+        std::shared_ptr<DnsCache> dns_cache() const { return dns_; }
+        //! Retrieve the pool recycling the sessions of the finished requests.
+        std::shared_ptr<SessionPool> session_pool() const { return session_pool_; }
+        //! Add an access token. The requests made from now on will use it.
+        void set_access_token(const std::string &token);
+        //! Let the server compress the responses of the requests made from now on
+        //! (gzip, deflate & zstd when available). They are decoded while they're received.
+        void set_compression(bool enabled);
+        //! Whether the responses may be compressed.
+        bool compression() const;
+        //! The latency of the phases of the requests, their parse & callback times and the
+        //! bytes sent & received, by endpoint, summed up over the network threads. The
+        //! clients sharing their services (see `ClientPool`) share their metrics. A request
+        //! is counted before its callback is called, and its parse & callback times are
+        //! added once the callback returns.
+        MetricsSnapshot metrics() const { return metrics_->snapshot(); }
+        //! Measure the requests made from now on, which is the default.
+        void set_metrics_enabled(bool enabled) { metrics_enabled_ = enabled; }
+        //! Write the requests made from now on & their responses to the recorder, to be
+        //! replayed later. The bodies are kept in memory until the requests are complete,
+        //! including the ones that are otherwise streamed. Pass nullptr to stop recording.
+        void set_recorder(std::shared_ptr<TrafficRecorder> recorder)
+        {
+                std::atomic_store(&recorder_, std::move(recorder));
+        }
+        //! Retrieve the recorder of the requests, if any.
+        std::shared_ptr<TrafficRecorder> recorder() const { return std::atomic_load(&recorder_); }
+        //! Trace the handlers, the callbacks & the phases of the requests made from now on
+        //! into the tracer, to see where the individual requests spend their time. Pass
+        //! nullptr to stop tracing.
+        void set_tracer(std::shared_ptr<RequestTracer> tracer)
+        {
+                std::atomic_store(&tracer_, std::move(tracer));
+        }
+        //! Retrieve the tracer of the requests, if any.
+        std::shared_ptr<RequestTracer> tracer() const { return std::atomic_load(&tracer_); }
+        //! Watch the event loops of the client, and the handlers & the callbacks of the
+        //! requests made from now on, for the work that holds up the network threads
+        //! (see `StallDetector`). The previous detector started by the client is stopped,
+        //! and so is this one when the client is closed.
+        std::shared_ptr<StallDetector> detect_stalls(const StallDetector::Options &options);
+        //! Watch the requests made from now on with a detector shared with other clients.
+        //! Pass nullptr to stop watching them. The client doesn't stop it when it's closed.
+        void set_stall_detector(std::shared_ptr<StallDetector> detector)
+        {
+                std::atomic_store(&stall_detector_, std::move(detector));
+        }
+        //! Retrieve the stall detector of the requests, if any.
+        std::shared_ptr<StallDetector> stall_detector() const
+        {
+                return std::atomic_load(&stall_detector_);
+        }
+        //! Run the callbacks of the requests made from now on on the executor, instead of
+        //! the network threads, so that the heavy ones don't hold up the other requests.
+        //! Pass nullptr to run them on the network threads again.
+        void set_callback_executor(std::shared_ptr<CallbackExecutor> executor)
+        {
+                std::atomic_store(&callback_executor_, std::move(executor));
+        }
+        //! Retrieve the executor of the callbacks, if any.
+        std::shared_ptr<CallbackExecutor> callback_executor() const
+        {
+                return std::atomic_load(&callback_executor_);
+        }
         //! Update the next batch token.
         void set_next_batch_token(const std::string &token) { next_batch_token_ = token; }
         //! Retrieve the current next batch token.
         std::string next_batch_token() const { return next_batch_token_; }
-
-        using RequestErr = std::experimental::optional<mtx::client::errors::ClientError>;
+        //! Set the time limits of the requests made from now on. The read limit of
+        //! /sync is extended by the long-poll timeout of each request.
+        void set_timeouts(const RequestTimeouts &timeouts) { timeouts_ = timeouts; }
+        //! Retrieve the time limits of the requests.
+        RequestTimeouts timeouts() const { return timeouts_; }
+        //! Request a range of some content of the media API (e.g "/download/server/id").
+        //! Its body is passed to `on_body` as it's received, without being stored, so
+        //! it can be of any size.
+        RequestID get_range(const std::string &endpoint, RangeRequest range);
+
+        using RequestErr = mtx::client::RequestErr;
+
+        //
+        // The endpoints accept either a callback, which is invoked with the response & the
+        // error on a network thread, or an Asio completion token with the signature
+        // `void(std::exception_ptr, Response)`:
+        //
+        //     client->sync("", since, false, 0, [](const Sync &res, RequestErr err) {});
+        //     std::future<Sync> res = client->sync("", since, false, 0, use_future);
+        //     Sync res = co_await client->sync("", since, false, 0, use_awaitable);
+        //
+        // The handlers of the completion tokens are invoked through their associated
+        // executor, and a failed request completes with an `errors::ClientException`.
+        //
 
         //! Perfom login.
-        void login(const std::string &username,
+        template<class CompletionToken>
+        auto login(const std::string &username,
                    const std::string &password,
-                   std::function<void(const mtx::responses::Login &response, RequestErr err)>);
+                   CompletionToken &&token);
         //! Perform logout.
-        void logout(std::function<void(const mtx::responses::Logout &response, RequestErr err)>);
+        template<class CompletionToken>
+        auto logout(CompletionToken &&token);
         //! Create a room with the given options.
-        void create_room(
-          const mtx::requests::CreateRoom &room_options,
-          std::function<void(const mtx::responses::CreateRoom &response, RequestErr err)>);
+        template<class CompletionToken>
+        auto create_room(const mtx::requests::CreateRoom &room_options, CompletionToken &&token);
         //! Join a room by its room_id.
-        void join_room(const mtx::identifiers::Room &room_id,
-                       std::function<void(const nlohmann::json &res, RequestErr err)>);
+        template<class CompletionToken>
+        auto join_room(const mtx::identifiers::Room &room_id, CompletionToken &&token);
         //! Join a room by an alias or a room_id.
-        void join_room(const std::string &room,
-                       std::function<void(const nlohmann::json &res, RequestErr err)>);
+        template<class CompletionToken>
+        auto join_room(const std::string &room, CompletionToken &&token);
         //! Leave a room by its room_id.
-        void leave_room(const mtx::identifiers::Room &room_id,
-                        std::function<void(const nlohmann::json &res, RequestErr err)>);
+        template<class CompletionToken>
+        auto leave_room(const mtx::identifiers::Room &room_id, CompletionToken &&token);
         //! Invite a user to a room.
         /* void invite_user(); */
         //! Perform sync.
-        void sync(const std::string &filter,
+        template<class CompletionToken>
+        auto sync(const std::string &filter,
+                  const std::string &since,
+                  bool full_state,
+                  uint16_t timeout,
+                  CompletionToken &&token);
+        //! Perform sync, parsing the response while it's being downloaded. Every room is
+        //! passed to its handler (on a network thread) as soon as it has been received.
+        //! The rooms without a handler and the rest of the response are passed to the callback.
+        //! With a plain callback, it returns the id of the request (see `cancel_request`).
+        template<class CompletionToken>
+        auto sync(const std::string &filter,
                   const std::string &since,
                   bool full_state,
                   uint16_t timeout,
-                  std::function<void(const mtx::responses::Sync &res, RequestErr err)>);
+                  SyncRoomHandlers room_handlers,
+                  CompletionToken &&token);
         //! Paginate through room messages.
         /* void get_messages(); */
         //! Send a message into a room.
@@ -79,12 +250,32 @@ public:
 
         /* void download_room_avatar(); */
         /* void download_user_avatar(); */
-        /* void download_media(); */
 
-        /* void upload_image(); */
-        /* void upload_file(); */
-        /* void upload_audio(); */
-        /* void upload_video(); */
+        //! Download some content (given by its mxc:// URI) into the sink, streaming it.
+        template<class CompletionToken>
+        auto download(const std::string &mxc_uri,
+                      std::shared_ptr<MediaSink> sink,
+                      const DownloadOptions &options,
+                      CompletionToken &&token);
+        //! Download some content into a file, which is created if needed. With
+        //! `options.resume`, the content already in the file is kept.
+        template<class CompletionToken>
+        auto download_file(const std::string &mxc_uri,
+                           const std::string &path,
+                           const DownloadOptions &options,
+                           CompletionToken &&token);
+
+        //! Upload some content (an image, a file, an audio or a video), read while it's
+        //! being sent. Wrap it in a `ProgressBody` to follow the progress.
+        template<class CompletionToken>
+        auto upload(std::shared_ptr<BodySource> content,
+                    const std::string &filename,
+                    CompletionToken &&token);
+        //! Upload a file, read while it's being sent.
+        template<class CompletionToken>
+        auto upload_file(const std::string &path,
+                         const std::string &content_type,
+                         CompletionToken &&token);
 
         /* void upload_filter(); */
 
@@ -93,28 +284,115 @@ public:
         /* void read_event(); */
 
 private:
-        template<class Request, class Response>
-        void post(
-          const std::string &endpoint,
-          const Request &req,
-          std::function<void(const Response &,
-                             std::experimental::optional<mtx::client::errors::ClientError>)>,
-          bool requires_auth = true);
-
-        template<class Response>
-        void get(const std::string &endpoint,
-                 std::function<void(const Response &,
-                                    std::experimental::optional<mtx::client::errors::ClientError>)>,
-                 bool requires_auth = true);
+        //! The prefixes of the endpoints.
+        static constexpr const char *client_api = "/_matrix/client/r0";
+        static constexpr const char *media_api  = "/_matrix/media/r0";
+
+        // The callbacks are taken by their own type, and only type-erased once they are
+        // stored in the session. They are invoked with an rvalue response, so it can be
+        // moved out by the caller.
+
+        template<class Request, class Response, class Callback>
+        void post(const std::string &endpoint,
+                  const Request &req,
+                  Callback callback,
+                  bool requires_auth = true);
 
         template<class Response, class Callback>
-        std::shared_ptr<Session> create_session(const Callback &callback);
+        void post_body(const std::string &endpoint,
+                       std::shared_ptr<BodySource> body,
+                       Callback callback,
+                       const char *api    = client_api,
+                       bool requires_auth = true);
+
+        template<class Response, class Callback>
+        void get(const std::string &endpoint, Callback callback, bool requires_auth = true);
+
+        template<class Response, class Callback, class Deserialize>
+        std::shared_ptr<Session> create_session(Callback callback, Deserialize deserialize);
+
+        template<class Response, class Callback>
+        std::shared_ptr<Session> create_session(Callback callback)
+        {
+                return create_session<Response>(std::move(callback),
+                                                &utils::deserialize<Response>);
+        }
+
+        template<class Callback>
+        void login_request(const std::string &username,
+                           const std::string &password,
+                           Callback callback);
+        template<class Callback>
+        void logout_request(Callback callback);
+        template<class Callback>
+        RequestID sync_request(const std::string &filter,
+                               const std::string &since,
+                               bool full_state,
+                               uint16_t timeout,
+                               SyncRoomHandlers room_handlers,
+                               Callback callback);
+
+        //! Start a request by passing a callback to `start`. A plain callback is passed as
+        //! is & what `start` returns is returned, while a completion token is turned into
+        //! a `CompletionCallback`.
+        template<class Response, class CompletionToken, class Start>
+        auto async_request(CompletionToken &&token, Start start);
+
+        //! Write the request line & the fields specific to the request, which will be
+        //! sent around the header template of the client. The body must be already set.
+        void prepare_request(std::shared_ptr<Session> session,
+                             boost::beast::http::verb method,
+                             const std::string &endpoint,
+                             bool requires_auth,
+                             const char *api = client_api);
 
         void remove_session(std::shared_ptr<Session> s);
         void on_request_complete(std::shared_ptr<Session> s);
+        //! Record the finished request & call its callback, or hand it over to the
+        //! executor of the callbacks. The failure callback is called if `failure` is set.
+        //! The status of a request that failed without a response is 0.
+        void complete_request(std::shared_ptr<Session> s,
+                              unsigned int status,
+                              boost::system::error_code failure);
+        //! The call of a callback, queued to the callback executor.
+        struct DeferredCallback;
+        //! Call the callback of the finished request, and record the time it took.
+        void run_callback(std::shared_ptr<Session> s,
+                          unsigned int status,
+                          boost::system::error_code failure,
+                          std::size_t endpoint,
+                          bool is_deferred);
+        //! Complete the request with an error that occurred before a response was received.
+        void fail_request(std::shared_ptr<Session> s, boost::system::error_code ec);
+        //! Fail a request that couldn't be started. The callback is called from an event
+        //! loop, like the ones of the requests that were sent, so never before the function
+        //! that started the request has returned.
+        template<class Response, class Callback>
+        void post_failure(Callback callback, boost::system::error_code ec);
+        //! Abort the operation in progress, or fail the request right away if
+        //! there is nothing to interrupt.
+        void abort_request(std::shared_ptr<Session> s, boost::system::error_code reason);
+        //! Move to the next phase & arm its deadline.
+        void start_phase(std::shared_ptr<Session> s, RequestPhase phase);
+        void start_request(std::shared_ptr<Session> s);
+        //! Start using the given event loops & caches.
+        void use_services(const ClientServices &services);
+        void on_request_timeout(std::shared_ptr<Session> s, boost::system::error_code ec);
+        void on_phase_timeout(std::shared_ptr<Session> s,
+                              RequestPhase phase,
+                              boost::system::error_code ec);
+        void on_connection(std::shared_ptr<Session> s, std::shared_ptr<Connection> conn);
+        void write_request(std::shared_ptr<Session> s);
+        //! Read the next chunk of a streamed body into `body_chunk`.
+        bool read_body_chunk(std::shared_ptr<Session> s, boost::system::error_code &ec);
+        //! Write the next chunk of a streamed body.
+        void write_body_chunk(std::shared_ptr<Session> s);
+        //! Retry the request on a new connection when a reused one turned out to be closed,
+        //! if the server can't have acted on it.
+        bool retry_on_stale_connection(std::shared_ptr<Session> s, boost::system::error_code ec);
         void on_resolve(std::shared_ptr<Session> s,
                         boost::system::error_code ec,
-                        boost::asio::ip::tcp::resolver::results_type results);
+                        DnsCache::Endpoints endpoints);
         void on_connect(std::shared_ptr<Session> s, boost::system::error_code ec);
         void on_handshake(std::shared_ptr<Session> s, boost::system::error_code ec);
         void on_write(std::shared_ptr<Session> s,
@@ -123,155 +401,547 @@ private:
         void on_read(std::shared_ptr<Session> s,
                      boost::system::error_code ec,
                      std::size_t bytes_transferred);
-
-        boost::asio::io_service ios_;
+        void on_read_some(std::shared_ptr<Session> s,
+                          boost::system::error_code ec,
+                          std::size_t bytes_transferred);
+        //! Set up the decoding of the body, if the response is compressed.
+        void start_decoding(std::shared_ptr<Session> s, boost::system::error_code &ec);
+        //! Make the decoded body the body of the response.
+        void finish_decoding(std::shared_ptr<Session> s, boost::system::error_code &ec);
+        //! Hand a part of the body over to `on_body`, unless it has failed before.
+        void consume_body(std::shared_ptr<Session> s, const char *data, std::size_t size);
+        //! Add the time spent since the last change of phase to the current one.
+        void end_phase(Session &s, std::chrono::steady_clock::time_point now);
+        //! Record the metrics of the request, right before its callback is called. The
+        //! status of a request that failed without a response is 0. Returns the index
+        //! of its endpoint in the metrics.
+        std::size_t record_metrics(std::shared_ptr<Session> s,
+                                   unsigned int status,
+                                   std::chrono::steady_clock::time_point now);
+        //! Trace the phase the request is in, up to now, and start tracing the next one.
+        void trace_phase(Session &s, std::chrono::steady_clock::time_point now);
+        //! Write the complete request & its response to the recorder of the session.
+        void record_traffic(std::shared_ptr<Session> s);
+
+        //! The io_services that run the requests. There is a single one
+        //! unless each thread has its own.
+        std::vector<boost::asio::io_service *> contexts_;
+        //! The io_services & threads started by the client.
+        std::unique_ptr<IoServicePool> threads_;
+        //! Whether the connection pools belong to this client only.
+        bool owns_services_ = true;
+        //! The io_service that will run the next request.
+        std::atomic<std::size_t> next_context_{0};
+        //! SSL context shared by all the connections.
+        std::shared_ptr<boost::asio::ssl::context> ssl_ctx_;
+        //! TLS sessions of the previous connections.
+        std::shared_ptr<TlsSessionCache> tls_sessions_;
+        //! Keep-alive connections to the homeserver, one pool per io_service.
+        std::vector<std::shared_ptr<ConnectionPool>> pools_;
+        //! The sessions of the finished requests.
+        std::shared_ptr<SessionPool> session_pool_;
+        //! The measures of the requests.
+        std::shared_ptr<ClientMetrics> metrics_;
+        //! Whether the new requests are measured.
+        std::atomic<bool> metrics_enabled_{true};
 
         //! Keeps tracks for the active sessions.
-        std::map<RequestID, std::shared_ptr<Session>> active_sessions_;
-        //! Used to synchronize access to `active_sessions_`.
-        std::mutex active_sessions_guard_;
-        //! Used to prevent the event loop from shutting down.
-        std::unique_ptr<boost::asio::io_service::work> work_;
-        //! Worker threads for the requests.
-        boost::thread_group thread_group_;
+        SessionRegistry sessions_;
+        //! The id of the next request.
+        std::atomic<RequestID> next_request_id_{1};
         //! Used to resolve DNS names.
-        boost::asio::ip::tcp::resolver resolver_;
-        //! The homeserver to connect to.
+        std::shared_ptr<DnsCache> dns_;
+        //! Delay before racing the next address of the server (as recommended by RFC 8305).
+        std::chrono::milliseconds connect_attempt_delay_{250};
+        //! Time limits of the new requests.
+        RequestTimeouts timeouts_;
+        //! The homeserver to connect to, with its port if it's not 443.
         std::string server_;
+        //! The name & the port the homeserver is resolved from.
+        std::string host_ = utils::split_host_port(server_).first;
+        std::string port_ = utils::split_host_port(server_).second;
         //! The access token that would be used for authentication.
         std::string access_token_;
+        //! Whether the server may compress the responses.
+        bool compression_ = false;
+        //! The header fields rendered with the current access token.
+        std::shared_ptr<const HeaderTemplate> headers_ =
+          std::make_shared<const HeaderTemplate>(server_, access_token_);
+        //! Used to synchronize the changes of the access token & the compression, so that
+        //! the template published by one of them isn't missing the other.
+        mutable std::mutex headers_mutex_;
         //! The token that will be used as the 'since' parameter on the next sync request.
         std::string next_batch_token_;
+        //! Records the requests, if set.
+        std::shared_ptr<TrafficRecorder> recorder_;
+        //! Traces the requests, if set.
+        std::shared_ptr<RequestTracer> tracer_;
+        //! Watches the requests for stalls, if set.
+        std::shared_ptr<StallDetector> stall_detector_;
+        //! The last detector started by `detect_stalls`, which watches the event loops of
+        //! the client. Unlike a shared one, it's stopped when the client is closed.
+        std::shared_ptr<StallDetector> own_stall_detector_;
+        //! Runs the callbacks of the requests, if set.
+        std::shared_ptr<CallbackExecutor> callback_executor_;
 };
 }
 }
 
-template<class Request, class Response>
+template<class Request, class Response, class Callback>
 void
-mtx::client::Client::post(
-  const std::string &endpoint,
-  const Request &req,
-  std::function<void(const Response &,
-                     std::experimental::optional<mtx::client::errors::ClientError>)> callback,
-  bool requires_auth)
+mtx::client::Client::post(const std::string &endpoint,
+                          const Request &req,
+                          Callback callback,
+                          bool requires_auth)
 {
-        // Serialize request.
-        nlohmann::json j = req;
+        // The request is serialized while it's being written.
+        post_body<Response>(endpoint,
+                            std::make_shared<JsonBody>(req),
+                            std::move(callback),
+                            client_api,
+                            requires_auth);
+}
 
-        using CallbackType = std::function<void(
-          const Response &, std::experimental::optional<mtx::client::errors::ClientError>)>;
+template<class Response, class Callback>
+void
+mtx::client::Client::post_body(const std::string &endpoint,
+                               std::shared_ptr<BodySource> body,
+                               Callback callback,
+                               const char *api,
+                               bool requires_auth)
+{
+        std::shared_ptr<Session> session = create_session<Response>(std::move(callback));
 
-        std::shared_ptr<Session> session = create_session<Response, CallbackType>(callback);
+        session->body_source = std::move(body);
 
-        session->request.method(boost::beast::http::verb::post);
-        session->request.target("/_matrix/client/r0" + endpoint);
-        session->request.set(boost::beast::http::field::user_agent, "mtxclient v0.1.0");
-        session->request.set(boost::beast::http::field::content_type, "application/json");
-        session->request.set(boost::beast::http::field::host, session->host);
-        if (requires_auth && !access_token_.empty())
-                session->request.set(boost::beast::http::field::authorization,
-                                     "Bearer " + access_token_);
-        session->request.body() = j.dump();
-        session->request.prepare_payload();
+        prepare_request(session, boost::beast::http::verb::post, endpoint, requires_auth, api);
 
         do_request(session);
 }
 
-template<class Response>
+template<class Response, class Callback>
 void
-mtx::client::Client::get(
-  const std::string &endpoint,
-  std::function<void(const Response &,
-                     std::experimental::optional<mtx::client::errors::ClientError>)> callback,
-  bool requires_auth)
+mtx::client::Client::get(const std::string &endpoint, Callback callback, bool requires_auth)
 {
-        using CallbackType = std::function<void(
-          const Response &, std::experimental::optional<mtx::client::errors::ClientError>)>;
-
-        std::shared_ptr<Session> session = create_session<Response, CallbackType>(callback);
+        std::shared_ptr<Session> session = create_session<Response>(std::move(callback));
 
-        session->request.method(boost::beast::http::verb::get);
-        session->request.target("/_matrix/client/r0" + endpoint);
-        session->request.set(boost::beast::http::field::user_agent, "mtxclient v0.1.0");
-        session->request.set(boost::beast::http::field::host, session->host);
-        if (requires_auth && !access_token_.empty())
-                session->request.set(boost::beast::http::field::authorization,
-                                     "Bearer " + access_token_);
-        session->request.prepare_payload();
+        prepare_request(session, boost::beast::http::verb::get, endpoint, requires_auth);
 
         do_request(session);
 }
 
-template<class Response, class Callback>
+template<class Response, class Callback, class Deserialize>
 std::shared_ptr<mtx::client::Session>
-mtx::client::Client::create_session(const Callback &callback)
+mtx::client::Client::create_session(Callback callback, Deserialize deserialize)
 {
-        boost::asio::ssl::context ssl_ctx{boost::asio::ssl::context::sslv23_client};
-
-        std::shared_ptr<Session> session = std::make_shared<Session>(
-          ios_,
-          ssl_ctx,
-          server_,
-          utils::random_token(),
-          [callback,
-           this](RequestID,
-                 const boost::beast::http::response<boost::beast::http::string_body> &response,
-                 const boost::system::error_code &err_code) {
-
-                  ios_.post([callback, response, err_code]() {
-                          Response response_data;
-                          mtx::client::errors::ClientError client_error;
-
-                          if (err_code) {
-                                  client_error.error_code = err_code;
-                                  return callback(response_data, client_error);
-                          }
+        SuccessCallback on_success =
+          [callback, deserialize](
+            RequestID, HttpResponse response, const boost::system::error_code &err_code) mutable {
+                  // Called on the strand of the finished request, so nothing
+                  // else is held up while the response is being deserialized.
+                  Response response_data;
+                  mtx::client::errors::ClientError client_error;
 
-                          // TODO: handle http error.
-                          if (response.result() != boost::beast::http::status::ok) {
-                                  // TODO: handle unknown error.
-                                  client_error.status_code = response.result();
+                  if (err_code) {
+                          client_error.error_code = err_code;
+                          return callback(std::move(response_data), client_error);
+                  }
 
-                                  try {
-                                          nlohmann::json json_error = json::parse(response.body());
-                                          mtx::errors::Error matrix_error = json_error;
+                  // TODO: handle http error.
+                  if (boost::beast::http::to_status_class(response.result()) !=
+                      boost::beast::http::status_class::successful) {
+                          // TODO: handle unknown error.
+                          client_error.status_code = response.result();
 
-                                          client_error.matrix_error = matrix_error;
-                                          return callback(response_data, client_error);
-                                  } catch (nlohmann::json::exception &e) {
-                                          std::cout << e.what() << ": Couldn't parse response\n"
-                                                    << response.body().data() << std::endl;
+                          try {
+                                  nlohmann::json json_error;
+                                  {
+                                          ParseTimer timer;
+                                          json_error = json::parse(response.body());
                                   }
-                          }
+                                  mtx::errors::Error matrix_error = json_error;
 
-                          try {
-                                  nlohmann::json json_data = json::parse(response.body().data());
-                                  response_data            = json_data;
+                                  client_error.matrix_error = matrix_error;
+                                  return callback(std::move(response_data), client_error);
                           } catch (nlohmann::json::exception &e) {
                                   std::cout << e.what() << ": Couldn't parse response\n"
                                             << response.body().data() << std::endl;
                           }
 
-                          callback(response_data, {});
-                  });
-          },
-          [callback](RequestID, const boost::system::error_code ec) {
-                  Response response_data;
+                          // Not a Matrix error (e.g a proxy's error page), only the status.
+                          return callback(std::move(response_data), client_error);
+                  }
+
+                  try {
+                          ParseTimer timer;
+                          response_data = deserialize(response.body());
+                  } catch (std::exception &e) {
+                          std::cout << e.what() << ": Couldn't parse response\n"
+                                    << response.body().data() << std::endl;
+                  }
+
+                  callback(std::move(response_data), RequestErr{});
+          };
+        FailureCallback on_failure = [callback](RequestID,
+                                                const boost::system::error_code ec) mutable {
+                Response response_data;
+
+                mtx::client::errors::ClientError client_error;
+                client_error.error_code = ec;
+
+                callback(std::move(response_data), client_error);
+        };
+
+        std::shared_ptr<Session> session;
+
+        // The session is allocated with the allocator associated to the callback, if
+        // it has one. Otherwise a recycled one is used.
+        auto alloc = boost::asio::get_associated_allocator(callback);
+        using SessionAllocator =
+          typename std::allocator_traits<decltype(alloc)>::template rebind_alloc<Session>;
+
+        if constexpr (std::is_same<decltype(alloc), std::allocator<void>>::value) {
+                // Spread the requests over the io_services.
+                const auto context = next_context_.fetch_add(1) % contexts_.size();
+
+                session = session_pool_->acquire(*contexts_[context],
+                                                 context,
+                                                 server_,
+                                                 next_request_id(),
+                                                 std::move(on_success),
+                                                 std::move(on_failure));
+        } else {
+                session = std::allocate_shared<Session>(SessionAllocator(alloc),
+                                                        server_,
+                                                        next_request_id(),
+                                                        std::move(on_success),
+                                                        std::move(on_failure));
+        }
 
-                  mtx::client::errors::ClientError client_error;
-                  client_error.error_code = ec;
+        session->timeouts = timeouts_;
+
+        return session;
+}
+
+template<class Callback>
+void
+mtx::client::Client::login_request(const std::string &user,
+                                   const std::string &password,
+                                   Callback callback)
+{
+        mtx::requests::Login req;
+        req.user     = user;
+        req.password = password;
+
+        // The session is allocated with the allocator of the callback.
+        auto on_login = bind_allocator_of(
+          callback, [this, callback](mtx::responses::Login &&resp, RequestErr err) mutable {
+                  if (!err && resp.access_token.size()) {
+                          set_access_token(resp.access_token);
+                  }
+                  callback(std::move(resp), err);
+          });
+
+        post<mtx::requests::Login, mtx::responses::Login>(
+          "/login", req, std::move(on_login), false);
+}
 
-                  callback(response_data, client_error);
+template<class Callback>
+void
+mtx::client::Client::logout_request(Callback callback)
+{
+        mtx::requests::Logout req;
+
+        auto on_logout = bind_allocator_of(
+          callback, [this, callback](mtx::responses::Logout &&res, RequestErr err) mutable {
+                  if (!err) {
+                          // Clear the now invalid access token when logout is successful
+                          set_access_token("");
+                  }
+                  // Pass up response and error to supplied callback
+                  callback(std::move(res), err);
           });
 
-        // Set SNI Hostname (many hosts need this to handshake successfully)
-        // TODO: handle the error
-        if (!SSL_set_tlsext_host_name(session->socket.native_handle(), server_.c_str())) {
-                boost::system::error_code ec{static_cast<int>(::ERR_get_error()),
-                                             boost::asio::error::get_ssl_category()};
-                std::cerr << ec.message() << "\n";
-                return session;
+        post<mtx::requests::Logout, mtx::responses::Logout>("/logout", req, std::move(on_logout));
+}
+
+template<class Callback>
+mtx::client::RequestID
+mtx::client::Client::sync_request(const std::string &filter,
+                                  const std::string &since,
+                                  bool full_state,
+                                  uint16_t timeout,
+                                  SyncRoomHandlers room_handlers,
+                                  Callback callback)
+{
+        std::map<std::string, std::string> params;
+
+        if (!filter.empty())
+                params.emplace("filter", filter);
+
+        if (!since.empty())
+                params.emplace("since", since);
+
+        if (full_state)
+                params.emplace("full_state", "true");
+
+        params.emplace("timeout", std::to_string(timeout));
+
+        auto parser = std::make_shared<SyncParser>(std::move(room_handlers));
+
+        auto session = create_session<mtx::responses::Sync>(
+          std::move(callback), [parser](const std::string &) { return parser->finish(); });
+
+        // The server holds the request for up to `timeout` before replying.
+        const std::chrono::milliseconds long_poll{timeout};
+
+        if (session->timeouts.read.count() > 0)
+                session->timeouts.read += long_poll;
+        if (session->timeouts.total.count() > 0)
+                session->timeouts.total += long_poll;
+
+        session->on_body = [parser](const char *data, std::size_t size) {
+                parser->feed(data, size);
+        };
+
+        prepare_request(
+          session, boost::beast::http::verb::get, "/sync?" + utils::query_params(params), true);
+
+        do_request(session);
+
+        return session->id;
+}
+
+template<class Response, class CompletionToken, class Start>
+auto
+mtx::client::Client::async_request(CompletionToken &&token, Start start)
+{
+        using Callback = std::decay_t<CompletionToken>;
+
+        if constexpr (is_response_callback<Callback, Response>) {
+                return start(Callback(std::forward<CompletionToken>(token)));
+        } else {
+                // The arguments are captured by value in `start`, as some tokens
+                // only start the request once it's awaited.
+                return initiate_request<Response>(
+                  [start](auto handler) mutable {
+                          using Handler = decltype(handler);
+                          start(CompletionCallback<Response, Handler>(std::move(handler)));
+                  },
+                  std::forward<CompletionToken>(token));
         }
+}
 
-        return session;
+template<class Response, class Callback>
+void
+mtx::client::Client::post_failure(Callback callback, boost::system::error_code ec)
+{
+        const auto context = next_context_.fetch_add(1) % contexts_.size();
+
+        boost::asio::post(*contexts_[context], [callback = std::move(callback), ec]() mutable {
+                mtx::client::errors::ClientError client_error;
+                client_error.error_code = ec;
+
+                callback(Response{}, client_error);
+        });
+}
+
+//
+// Client API endpoints
+//
+
+template<class CompletionToken>
+auto
+mtx::client::Client::login(const std::string &user,
+                           const std::string &password,
+                           CompletionToken &&token)
+{
+        return async_request<mtx::responses::Login>(
+          std::forward<CompletionToken>(token),
+          [self = shared_from_this(), user, password](auto callback) {
+                  self->login_request(user, password, std::move(callback));
+          });
+}
+
+template<class CompletionToken>
+auto
+mtx::client::Client::logout(CompletionToken &&token)
+{
+        return async_request<mtx::responses::Logout>(
+          std::forward<CompletionToken>(token), [self = shared_from_this()](auto callback) {
+                  self->logout_request(std::move(callback));
+          });
+}
+
+template<class CompletionToken>
+auto
+mtx::client::Client::create_room(const mtx::requests::CreateRoom &room_options,
+                                 CompletionToken &&token)
+{
+        return async_request<mtx::responses::CreateRoom>(
+          std::forward<CompletionToken>(token),
+          [self = shared_from_this(), room_options](auto callback) {
+                  self->post<mtx::requests::CreateRoom, mtx::responses::CreateRoom>(
+                    "/createRoom", room_options, std::move(callback));
+          });
+}
+
+template<class CompletionToken>
+auto
+mtx::client::Client::join_room(const mtx::identifiers::Room &room_id, CompletionToken &&token)
+{
+        auto api_path = "/rooms/" + room_id.toString() + "/join";
+
+        return async_request<nlohmann::json>(
+          std::forward<CompletionToken>(token),
+          [self = shared_from_this(), api_path](auto callback) {
+                  self->post<std::string, nlohmann::json>(api_path, "", std::move(callback));
+          });
+}
+
+template<class CompletionToken>
+auto
+mtx::client::Client::join_room(const std::string &room, CompletionToken &&token)
+{
+        auto api_path = "/join/" + room;
+
+        return async_request<nlohmann::json>(
+          std::forward<CompletionToken>(token),
+          [self = shared_from_this(), api_path](auto callback) {
+                  self->post<std::string, nlohmann::json>(api_path, "", std::move(callback));
+          });
+}
+
+template<class CompletionToken>
+auto
+mtx::client::Client::leave_room(const mtx::identifiers::Room &room_id, CompletionToken &&token)
+{
+        auto api_path = "/rooms/" + room_id.toString() + "/leave";
+
+        return async_request<nlohmann::json>(
+          std::forward<CompletionToken>(token),
+          [self = shared_from_this(), api_path](auto callback) {
+                  self->post<std::string, nlohmann::json>(api_path, "", std::move(callback));
+          });
+}
+
+template<class CompletionToken>
+auto
+mtx::client::Client::sync(const std::string &filter,
+                          const std::string &since,
+                          bool full_state,
+                          uint16_t timeout,
+                          CompletionToken &&token)
+{
+        return sync(filter,
+                    since,
+                    full_state,
+                    timeout,
+                    SyncRoomHandlers{},
+                    std::forward<CompletionToken>(token));
+}
+
+template<class CompletionToken>
+auto
+mtx::client::Client::sync(const std::string &filter,
+                          const std::string &since,
+                          bool full_state,
+                          uint16_t timeout,
+                          SyncRoomHandlers room_handlers,
+                          CompletionToken &&token)
+{
+        return async_request<mtx::responses::Sync>(
+          std::forward<CompletionToken>(token),
+          [self = shared_from_this(), filter, since, full_state, timeout, room_handlers](
+            auto callback) {
+                  return self->sync_request(
+                    filter, since, full_state, timeout, room_handlers, std::move(callback));
+          });
+}
+
+template<class CompletionToken>
+auto
+mtx::client::Client::download(const std::string &mxc_uri,
+                              std::shared_ptr<MediaSink> sink,
+                              const DownloadOptions &options,
+                              CompletionToken &&token)
+{
+        return async_request<Download>(
+          std::forward<CompletionToken>(token),
+          [self = shared_from_this(), mxc_uri, sink, options](auto callback) {
+                  std::string server, media_id;
+
+                  if (!parse_mxc_uri(mxc_uri, server, media_id))
+                          return self->template post_failure<Download>(
+                            std::move(callback),
+                            boost::system::errc::make_error_code(
+                              boost::system::errc::invalid_argument));
+
+                  std::make_shared<MediaDownload>(self,
+                                                  "/download/" + server + "/" + media_id,
+                                                  sink,
+                                                  options,
+                                                  std::move(callback))
+                    ->start();
+          });
+}
+
+template<class CompletionToken>
+auto
+mtx::client::Client::download_file(const std::string &mxc_uri,
+                                   const std::string &path,
+                                   const DownloadOptions &options,
+                                   CompletionToken &&token)
+{
+        return async_request<Download>(
+          std::forward<CompletionToken>(token),
+          [self = shared_from_this(), mxc_uri, path, options](auto callback) {
+                  boost::system::error_code ec;
+                  auto sink = FileSink::open(path, ec);
+
+                  if (!sink)
+                          return self->template post_failure<Download>(std::move(callback), ec);
+
+                  self->download(mxc_uri, std::move(sink), options, std::move(callback));
+          });
+}
+
+template<class CompletionToken>
+auto
+mtx::client::Client::upload(std::shared_ptr<BodySource> content,
+                            const std::string &filename,
+                            CompletionToken &&token)
+{
+        auto api_path = "/upload?filename=" + utils::url_encode(filename);
+
+        return async_request<ContentURI>(
+          std::forward<CompletionToken>(token),
+          [self = shared_from_this(), content, api_path](auto callback) {
+                  self->template post_body<ContentURI>(
+                    api_path, content, std::move(callback), media_api);
+          });
+}
+
+template<class CompletionToken>
+auto
+mtx::client::Client::upload_file(const std::string &path,
+                                 const std::string &content_type,
+                                 CompletionToken &&token)
+{
+        return async_request<ContentURI>(
+          std::forward<CompletionToken>(token),
+          [self = shared_from_this(), path, content_type](auto callback) {
+                  boost::system::error_code ec;
+                  std::shared_ptr<BodySource> content = FileBody::open(path, content_type, ec);
+
+                  if (!content)
+                          return self->template post_failure<ContentURI>(std::move(callback), ec);
+
+                  // Only the name of the file is sent.
+                  const auto slash = path.find_last_of('/');
+
+                  self->upload(std::move(content),
+                               slash == std::string::npos ? path : path.substr(slash + 1),
+                               std::move(callback));
+          });
 }
@@ -0,0 +1,45 @@
+#include "client_pool.hpp"
+
+using namespace mtx::client;
+
+ClientPool::ClientPool(const ThreadOptions &threads,
+                       std::shared_ptr<boost::asio::ssl::context> ssl_ctx)
+  : threads_{new IoServicePool(threads)}
+{
+        services_ = make_client_services(threads_->contexts(), ssl_ctx);
+}
+
+ClientPool::ClientPool(boost::asio::io_service &ios,
+                       std::shared_ptr<boost::asio::ssl::context> ssl_ctx)
+{
+        services_ = make_client_services({&ios}, ssl_ctx);
+}
+
+ClientPool::~ClientPool()
+{
+        // The idle sessions hold timers of the io_services.
+        services_.sessions->clear();
+
+        // The threads must not outlive the caches used by their handlers.
+        threads_.reset();
+}
+
+std::shared_ptr<Client>
+ClientPool::create_client(const std::string &server)
+{
+        return std::make_shared<Client>(server, services_);
+}
+
+void
+ClientPool::close()
+{
+        if (threads_)
+                threads_->stop();
+
+        // Idle connections don't have pending operations so
+        // they have to be closed explicitly.
+        for (auto &pool : services_.pools)
+                pool->clear();
+
+        services_.sessions->clear();
+}
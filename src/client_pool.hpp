@@ -0,0 +1,58 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+
+#include "client.hpp"
+#include "io_service_pool.hpp"
+
+namespace mtx {
+namespace client {
+
+//! Hosts many accounts in a single process. The clients created by the pool share
+//! its threads, DNS cache, TLS sessions and keep-alive connections, so an account
+//! costs little more than its tokens. Each client keeps its own access token and
+//! next batch token, which are sent with its requests only.
+class ClientPool
+{
+public:
+        //! Start the network threads as described by the options.
+        explicit ClientPool(const ThreadOptions &threads                     = ThreadOptions{},
+                            std::shared_ptr<boost::asio::ssl::context> ssl_ctx = nullptr);
+        //! Run the requests on an io_service owned by the caller, which has to run it.
+        explicit ClientPool(boost::asio::io_service &ios,
+                            std::shared_ptr<boost::asio::ssl::context> ssl_ctx = nullptr);
+        ~ClientPool();
+
+        //! Create a client for another account on the given homeserver.
+        std::shared_ptr<Client> create_client(const std::string &server);
+        //! Wait for the pending requests to complete & close the idle connections.
+        void close();
+
+        //! Retrieve the pools of keep-alive connections, one per io_service.
+        std::vector<std::shared_ptr<ConnectionPool>> connection_pools() const
+        {
+                return services_.pools;
+        }
+        //! Retrieve the cache of TLS sessions used to resume the handshakes.
+        std::shared_ptr<TlsSessionCache> tls_session_cache() const
+        {
+                return services_.tls_sessions;
+        }
+        //! Retrieve the cache of resolved DNS names.
+        std::shared_ptr<DnsCache> dns_cache() const { return services_.dns; }
+        //! Retrieve the pool recycling the sessions of the finished requests.
+        std::shared_ptr<SessionPool> session_pool() const { return services_.sessions; }
+
+private:
+        //! The io_services & threads started by the pool.
+        std::unique_ptr<IoServicePool> threads_;
+        //! The event loops & caches shared by the clients.
+        ClientServices services_;
+};
+}
+}
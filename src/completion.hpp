@@ -0,0 +1,162 @@
+#pragma once
+
+#include <exception>
+#include <experimental/optional>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+#include <boost/asio.hpp>
+#include <boost/version.hpp>
+
+#include "errors.hpp"
+
+namespace mtx {
+namespace client {
+
+//! The error of a request, if it failed.
+using RequestErr = std::experimental::optional<mtx::client::errors::ClientError>;
+
+//! The signature of the handlers created from completion tokens (e.g `use_future`).
+//! A failed request completes with an `errors::ClientException`.
+template<class Response>
+using CompletionSignature = void(std::exception_ptr, Response);
+
+//! Whether the endpoints can invoke the callback directly, with the response & the error.
+template<class Callback, class Response>
+constexpr bool is_response_callback =
+  std::is_invocable<Callback &, Response &&, RequestErr>::value;
+
+//! Adapts a completion handler to the callback of a session. The handler is invoked
+//! through its associated executor, and its allocator is used for the shared state.
+template<class Response, class Handler>
+class CompletionCallback
+{
+public:
+        using allocator_type = boost::asio::associated_allocator_t<Handler>;
+        using executor_type  = boost::asio::associated_executor_t<Handler>;
+
+        explicit CompletionCallback(Handler handler)
+        {
+                using StateAllocator =
+                  typename std::allocator_traits<allocator_type>::template rebind_alloc<State>;
+
+                auto alloc    = boost::asio::get_associated_allocator(handler);
+                auto executor = boost::asio::get_associated_executor(handler);
+
+                state_ = std::allocate_shared<State>(StateAllocator(alloc),
+                                                     std::move(handler),
+                                                     boost::asio::make_work_guard(executor));
+        }
+
+        allocator_type get_allocator() const noexcept
+        {
+                return boost::asio::get_associated_allocator(state_->handler);
+        }
+
+        void operator()(Response &&res, RequestErr err) const
+        {
+                auto executor = state_->work.get_executor();
+
+                // Runs inline when the request completes on a thread of the handler's
+                // executor, so there is no extra hop through a queue.
+                boost::asio::dispatch(executor, Completion{state_, std::move(res), err});
+        }
+
+private:
+        struct State
+        {
+                State(Handler handler, boost::asio::executor_work_guard<executor_type> work)
+                  : handler(std::move(handler))
+                  , work(std::move(work))
+                {}
+
+                Handler handler;
+                //! Keeps the handler's executor running until the request completes.
+                boost::asio::executor_work_guard<executor_type> work;
+        };
+
+        //! Invokes the handler on its executor.
+        struct Completion
+        {
+                using allocator_type = typename CompletionCallback::allocator_type;
+
+                allocator_type get_allocator() const noexcept
+                {
+                        return boost::asio::get_associated_allocator(state->handler);
+                }
+
+                void operator()()
+                {
+                        std::exception_ptr ex;
+                        if (err)
+                                ex = std::make_exception_ptr(errors::ClientException(*err));
+
+                        state->work.reset();
+                        state->handler(ex, std::move(res));
+                }
+
+                std::shared_ptr<State> state;
+                Response res;
+                RequestErr err;
+        };
+
+        std::shared_ptr<State> state_;
+};
+
+#if BOOST_VERSION < 107900
+//! A callback with the allocator of another one, for Boost versions without
+//! `boost::asio::bind_allocator`.
+template<class Callback, class Allocator>
+struct AllocatorBinder
+{
+        using allocator_type = Allocator;
+
+        allocator_type get_allocator() const noexcept { return allocator; }
+
+        template<class... Args>
+        void operator()(Args &&... args)
+        {
+                callback(std::forward<Args>(args)...);
+        }
+
+        Callback callback;
+        Allocator allocator;
+};
+#endif
+
+//! Give `callback` the allocator associated to `handler`, so that a callback wrapping
+//! a handler keeps using its allocator.
+template<class Handler, class Callback>
+auto
+bind_allocator_of(const Handler &handler, Callback callback)
+{
+        auto alloc = boost::asio::get_associated_allocator(handler);
+
+#if BOOST_VERSION >= 107900
+        return boost::asio::bind_allocator(std::move(alloc), std::move(callback));
+#else
+        return AllocatorBinder<Callback, decltype(alloc)>{std::move(callback), std::move(alloc)};
+#endif
+}
+
+//! Create the handler of the completion token, pass it to the initiation function &
+//! return the result of the token (e.g a future).
+template<class Response, class CompletionToken, class Initiation>
+auto
+initiate_request(Initiation initiation, CompletionToken &&token)
+{
+#if BOOST_VERSION >= 107000
+        // Lets the tokens that start the operation lazily (e.g `use_awaitable`) do so.
+        return boost::asio::async_initiate<CompletionToken, CompletionSignature<Response>>(
+          std::move(initiation), token);
+#else
+        boost::asio::async_completion<CompletionToken, CompletionSignature<Response>> init(token);
+
+        initiation(std::move(init.completion_handler));
+
+        return init.result.get();
+#endif
+}
+}
+}
@@ -0,0 +1,220 @@
+#include "connection_pool.hpp"
+#include "utils.hpp"
+
+#include <iostream>
+#include <vector>
+
+using namespace mtx::client;
+
+ConnectionPool::ConnectionPool(boost::asio::io_service &ios,
+                               std::shared_ptr<boost::asio::ssl::context> ssl_ctx,
+                               std::shared_ptr<TlsSessionCache> tls_sessions)
+  : ios_{ios}
+  , ssl_ctx_{ssl_ctx}
+  , tls_sessions_{tls_sessions}
+{}
+
+void
+ConnectionPool::acquire(const std::string &host, AcquireHandler handler)
+{
+        std::shared_ptr<Connection> conn;
+        // Unlike a deque, an empty vector doesn't allocate.
+        std::vector<std::shared_ptr<Connection>> expired;
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto &entry = hosts_[host];
+
+        // Idle connections that stayed unused for too long are likely to
+        // have been closed by the server.
+        const auto now = std::chrono::steady_clock::now();
+        while (!entry.idle.empty() && now - entry.idle.front()->last_used > idle_timeout_) {
+                expired.push_back(entry.idle.front());
+                entry.idle.pop_front();
+                entry.total -= 1;
+                dropped_ += 1;
+        }
+
+        if (!entry.idle.empty()) {
+                conn = entry.idle.back();
+                entry.idle.pop_back();
+                reused_ += 1;
+        } else if (entry.total < max_total_) {
+                conn = create_connection(host);
+                entry.total += 1;
+                created_ += 1;
+        } else {
+                entry.pending.push_back(handler);
+        }
+        lock.unlock();
+
+        for (auto &c : expired)
+                close_connection(c);
+
+        if (conn)
+                handler(conn);
+}
+
+void
+ConnectionPool::release(std::shared_ptr<Connection> conn)
+{
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto &entry = hosts_[conn->host];
+
+        conn->last_used = std::chrono::steady_clock::now();
+
+        // Hand the connection straight to a waiting request.
+        if (!entry.pending.empty()) {
+                auto handler = entry.pending.front();
+                entry.pending.pop_front();
+                reused_ += 1;
+                lock.unlock();
+
+                ios_.post(std::bind(handler, conn));
+                return;
+        }
+
+        if (entry.idle.size() < max_idle_) {
+                entry.idle.push_back(conn);
+                return;
+        }
+
+        entry.total -= 1;
+        dropped_ += 1;
+        lock.unlock();
+
+        close_connection(conn);
+}
+
+void
+ConnectionPool::drop(std::shared_ptr<Connection> conn)
+{
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto &entry = hosts_[conn->host];
+
+        entry.total -= 1;
+        dropped_ += 1;
+
+        // The freed slot can be used by a waiting request.
+        if (!entry.pending.empty() && entry.total < max_total_) {
+                auto handler = entry.pending.front();
+                entry.pending.pop_front();
+
+                auto new_conn = create_connection(conn->host);
+                entry.total += 1;
+                created_ += 1;
+                lock.unlock();
+
+                ios_.post(std::bind(handler, new_conn));
+        } else {
+                lock.unlock();
+        }
+
+        close_connection(conn);
+}
+
+void
+ConnectionPool::clear()
+{
+        std::deque<std::shared_ptr<Connection>> idle;
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (auto &host : hosts_) {
+                host.second.total -= host.second.idle.size();
+                dropped_ += host.second.idle.size();
+
+                idle.insert(idle.end(), host.second.idle.begin(), host.second.idle.end());
+                host.second.idle.clear();
+        }
+        lock.unlock();
+
+        for (auto &conn : idle) {
+                boost::system::error_code ignored_ec;
+                conn->socket.lowest_layer().close(ignored_ec);
+        }
+}
+
+void
+ConnectionPool::set_max_idle(std::size_t max_idle)
+{
+        std::unique_lock<std::mutex> lock(mutex_);
+        max_idle_ = max_idle;
+}
+
+void
+ConnectionPool::set_max_total(std::size_t max_total)
+{
+        std::unique_lock<std::mutex> lock(mutex_);
+        max_total_ = std::max<std::size_t>(1, max_total);
+}
+
+void
+ConnectionPool::set_idle_timeout(std::chrono::steady_clock::duration timeout)
+{
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_timeout_ = timeout;
+}
+
+ConnectionPool::Stats
+ConnectionPool::stats() const
+{
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        Stats stats;
+        stats.created = created_;
+        stats.reused  = reused_;
+        stats.dropped = dropped_;
+
+        for (const auto &host : hosts_) {
+                stats.idle += host.second.idle.size();
+                stats.active += host.second.total - host.second.idle.size();
+                stats.pending += host.second.pending.size();
+        }
+
+        return stats;
+}
+
+std::shared_ptr<Connection>
+ConnectionPool::create_connection(const std::string &host)
+{
+        auto conn = std::make_shared<Connection>(ios_, *ssl_ctx_, host);
+
+        // Set SNI Hostname (many hosts need this to handshake successfully)
+        // TODO: handle the error
+        const auto name = utils::split_host_port(host).first;
+        if (!SSL_set_tlsext_host_name(conn->socket.native_handle(), name.c_str())) {
+                boost::system::error_code ec{static_cast<int>(::ERR_get_error()),
+                                             boost::asio::error::get_ssl_category()};
+                std::cerr << ec.message() << "\n";
+        }
+
+        tls_sessions_->prepare(conn->socket.native_handle(), host);
+
+        return conn;
+}
+
+void
+ConnectionPool::close_connection(std::shared_ptr<Connection> conn)
+{
+        // Aborted requests have already closed the socket, there is nothing to shut down.
+        if (!conn->is_established || !conn->socket.lowest_layer().is_open()) {
+                boost::system::error_code ignored_ec;
+                conn->socket.lowest_layer().close(ignored_ec);
+                return;
+        }
+
+        // Shutting down the connection. This method may
+        // fail in case the socket is not connected. We don't
+        // care about the error code if this function fails.
+        conn->socket.async_shutdown([conn](boost::system::error_code ec) {
+                if (ec == boost::asio::error::eof ||
+                    ec == boost::asio::ssl::error::stream_truncated) {
+                        // Rationale:
+                        // http://stackoverflow.com/questions/25587403/boost-asio-ssl-async-shutdown-always-finishes-with-an-error
+                        ec.assign(0, ec.category());
+                }
+
+                if (ec)
+                        // TODO: propagate the error.
+                        std::cout << "shutdown: " << ec << std::endl;
+        });
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+
+#include "tls_session_cache.hpp"
+
+namespace mtx {
+namespace client {
+
+//! A TLS connection to a remote host which can be reused by multiple requests.
+struct Connection
+{
+        Connection(boost::asio::io_service &ios,
+                   boost::asio::ssl::context &ssl_ctx,
+                   const std::string &host)
+          : socket{ios, ssl_ctx}
+          , host{host}
+        {}
+
+        //! Socket used for communication.
+        boost::asio::ssl::stream<boost::asio::ip::tcp::socket> socket;
+        //! Remote host, with its port if it's not 443.
+        std::string host;
+        //! Whether the TCP connection & the TLS handshake have been completed.
+        bool is_established = false;
+        //! When the connection was returned to the pool for the last time.
+        std::chrono::steady_clock::time_point last_used;
+};
+
+//! Keeps per host HTTP/1.1 keep-alive connections that can be borrowed by sessions.
+class ConnectionPool : public std::enable_shared_from_this<ConnectionPool>
+{
+public:
+        //! Function to be called when a connection is available.
+        using AcquireHandler = std::function<void(std::shared_ptr<Connection>)>;
+
+        //! Counters describing the usage of the pool.
+        struct Stats
+        {
+                //! Number of connections that have been opened.
+                uint64_t created = 0;
+                //! Number of times an idle connection was handed to a request.
+                uint64_t reused = 0;
+                //! Number of connections that have been discarded.
+                uint64_t dropped = 0;
+                //! Number of connections currently waiting in the pool.
+                std::size_t idle = 0;
+                //! Number of connections currently borrowed by requests.
+                std::size_t active = 0;
+                //! Number of requests waiting for a connection.
+                std::size_t pending = 0;
+        };
+
+        ConnectionPool(boost::asio::io_service &ios,
+                       std::shared_ptr<boost::asio::ssl::context> ssl_ctx,
+                       std::shared_ptr<TlsSessionCache> tls_sessions);
+
+        //! Pass a connection to the given host to the handler. An idle connection will be
+        //! preferred. If there is none and the limit of open connections has been reached
+        //! the handler will be invoked after another request releases its connection.
+        void acquire(const std::string &host, AcquireHandler handler);
+        //! Give back a connection after its response has been fully read.
+        void release(std::shared_ptr<Connection> conn);
+        //! Discard a connection that can't be reused (e.g errors, `Connection: close`).
+        void drop(std::shared_ptr<Connection> conn);
+        //! Close all the idle connections.
+        void clear();
+
+        //! Maximum number of idle connections kept per host.
+        void set_max_idle(std::size_t max_idle);
+        //! Maximum number of open (idle + active) connections per host.
+        void set_max_total(std::size_t max_total);
+        //! Idle connections older than this will not be reused.
+        void set_idle_timeout(std::chrono::steady_clock::duration timeout);
+
+        //! Retrieve a snapshot of the pool counters.
+        Stats stats() const;
+
+private:
+        //! The connections to a single host.
+        struct HostEntry
+        {
+                //! Connections ready to be reused. The most recently used is at the back.
+                std::deque<std::shared_ptr<Connection>> idle;
+                //! Requests waiting for a connection to become available.
+                std::deque<AcquireHandler> pending;
+                //! Number of open connections (idle + active).
+                std::size_t total = 0;
+        };
+
+        std::shared_ptr<Connection> create_connection(const std::string &host);
+        void close_connection(std::shared_ptr<Connection> conn);
+
+        boost::asio::io_service &ios_;
+        //! SSL context used by all the connections.
+        std::shared_ptr<boost::asio::ssl::context> ssl_ctx_;
+        //! TLS sessions that new connections will try to resume.
+        std::shared_ptr<TlsSessionCache> tls_sessions_;
+
+        //! Connections grouped by host.
+        std::map<std::string, HostEntry> hosts_;
+        //! Used to synchronize access to the pool.
+        mutable std::mutex mutex_;
+
+        std::size_t max_idle_                             = 8;
+        std::size_t max_total_                            = std::numeric_limits<std::size_t>::max();
+        std::chrono::steady_clock::duration idle_timeout_ = std::chrono::seconds(30);
+
+        uint64_t created_ = 0;
+        uint64_t reused_  = 0;
+        uint64_t dropped_ = 0;
+};
+}
+}
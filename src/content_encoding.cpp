@@ -0,0 +1,276 @@
+#include "content_encoding.hpp"
+
+#include <boost/beast/core/string.hpp>
+
+#include <zlib.h>
+
+#if defined(MTXCLIENT_HAS_ZSTD)
+#include <zstd.h>
+#endif
+
+using namespace mtx::client;
+
+namespace {
+
+class DecodeCategory : public boost::system::error_category
+{
+public:
+        const char *name() const noexcept override { return "mtx.content_encoding"; }
+
+        std::string message(int ev) const override
+        {
+                switch (static_cast<DecodeError>(ev)) {
+                case DecodeError::UnsupportedEncoding:
+                        return "unsupported content encoding";
+                case DecodeError::Corrupted:
+                        return "corrupted compressed body";
+                case DecodeError::Truncated:
+                        return "truncated compressed body";
+                case DecodeError::TooLarge:
+                        return "decoded body too large";
+                }
+
+                return "unknown decoding error";
+        }
+};
+
+//! Decodes gzip & deflate with zlib.
+class ZlibDecoder : public ContentDecoder
+{
+public:
+        ZlibDecoder(bool is_gzip, uint64_t max_size)
+          : ContentDecoder(max_size)
+          , is_gzip_{is_gzip}
+          , out_{new char[chunk_size]}
+        {
+                if (inflateInit2(&stream_, window_bits_) != Z_OK)
+                        throw std::bad_alloc();
+        }
+
+        ~ZlibDecoder() override { inflateEnd(&stream_); }
+
+        void decode(const char *data,
+                    std::size_t size,
+                    const Sink &sink,
+                    boost::system::error_code &ec) override
+        {
+                const bool is_first_chunk = !has_input_;
+                has_input_                = has_input_ || size > 0;
+                set_input(data, size);
+
+                for (;;) {
+                        if (is_finished_) {
+                                // A gzip body can be made of several members.
+                                if (!is_gzip_ || stream_.avail_in == 0)
+                                        return;
+
+                                inflateReset(&stream_);
+                                is_finished_ = false;
+                        }
+
+                        stream_.next_out  = reinterpret_cast<Bytef *>(out_.get());
+                        stream_.avail_out = static_cast<uInt>(chunk_size);
+
+                        const auto ret = inflate(&stream_, Z_NO_FLUSH);
+
+                        // Some servers send raw deflate data for `deflate`, without
+                        // the zlib wrapper.
+                        if (ret == Z_DATA_ERROR && !is_gzip_ && is_first_chunk &&
+                            window_bits_ > 0 && stream_.total_out == 0) {
+                                window_bits_ = -MAX_WBITS;
+                                inflateReset2(&stream_, window_bits_);
+                                set_input(data, size);
+                                continue;
+                        }
+
+                        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                                ec = DecodeError::Corrupted;
+                                return;
+                        }
+
+                        const std::size_t produced = chunk_size - stream_.avail_out;
+                        if (produced > 0 && !emit(out_.get(), produced, sink, ec))
+                                return;
+
+                        if (ret == Z_STREAM_END) {
+                                is_finished_ = true;
+                                continue;
+                        }
+
+                        // Done once the input is consumed & the output wasn't cut short.
+                        if (stream_.avail_in == 0 && stream_.avail_out > 0)
+                                return;
+                        if (ret == Z_BUF_ERROR && produced == 0)
+                                return;
+                }
+        }
+
+        void finish(boost::system::error_code &ec) override
+        {
+                // An empty body (e.g. 204) is fine, whatever its encoding.
+                if (has_input_ && !is_finished_)
+                        ec = DecodeError::Truncated;
+        }
+
+        void reset() override
+        {
+                window_bits_ = MAX_WBITS + 32;
+                inflateReset2(&stream_, window_bits_);
+
+                is_finished_  = false;
+                has_input_    = false;
+                decoded_size_ = 0;
+        }
+
+        boost::beast::string_view encoding() const override
+        {
+                return is_gzip_ ? "gzip" : "deflate";
+        }
+
+private:
+        void set_input(const char *data, std::size_t size)
+        {
+                stream_.next_in  = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+                stream_.avail_in = static_cast<uInt>(size);
+        }
+
+        z_stream stream_{};
+        //! Accept both the gzip & the zlib wrapper, until the data turns out to be raw.
+        int window_bits_ = MAX_WBITS + 32;
+        bool is_gzip_;
+        bool is_finished_ = false;
+        bool has_input_   = false;
+        std::unique_ptr<char[]> out_;
+};
+
+#if defined(MTXCLIENT_HAS_ZSTD)
+//! Decodes zstd frames.
+class ZstdDecoder : public ContentDecoder
+{
+public:
+        explicit ZstdDecoder(uint64_t max_size)
+          : ContentDecoder(max_size)
+          , stream_{ZSTD_createDStream()}
+          , out_{new char[chunk_size]}
+        {
+                if (!stream_)
+                        throw std::bad_alloc();
+
+                ZSTD_initDStream(stream_);
+        }
+
+        ~ZstdDecoder() override { ZSTD_freeDStream(stream_); }
+
+        void decode(const char *data,
+                    std::size_t size,
+                    const Sink &sink,
+                    boost::system::error_code &ec) override
+        {
+                ZSTD_inBuffer in{data, size, 0};
+                has_input_ = has_input_ || size > 0;
+
+                for (;;) {
+                        ZSTD_outBuffer out{out_.get(), chunk_size, 0};
+
+                        const auto ret = ZSTD_decompressStream(stream_, &out, &in);
+                        if (ZSTD_isError(ret)) {
+                                ec = DecodeError::Corrupted;
+                                return;
+                        }
+
+                        // Zero means that a frame has been completely decoded & flushed.
+                        is_finished_ = ret == 0;
+
+                        if (out.pos > 0 && !emit(out_.get(), out.pos, sink, ec))
+                                return;
+
+                        // Done once the input is consumed & the output wasn't cut short.
+                        if (in.pos == in.size && out.pos < out.size)
+                                return;
+                }
+        }
+
+        void finish(boost::system::error_code &ec) override
+        {
+                // An empty body (e.g. 204) is fine, whatever its encoding.
+                if (has_input_ && !is_finished_)
+                        ec = DecodeError::Truncated;
+        }
+
+        void reset() override
+        {
+                ZSTD_initDStream(stream_);
+
+                is_finished_  = false;
+                has_input_    = false;
+                decoded_size_ = 0;
+        }
+
+        boost::beast::string_view encoding() const override { return "zstd"; }
+
+private:
+        ZSTD_DStream *stream_;
+        bool is_finished_ = false;
+        bool has_input_   = false;
+        std::unique_ptr<char[]> out_;
+};
+#endif
+}
+
+const boost::system::error_category &
+mtx::client::decode_category()
+{
+        static DecodeCategory category;
+        return category;
+}
+
+const std::string &
+mtx::client::supported_encodings()
+{
+#if defined(MTXCLIENT_HAS_ZSTD)
+        static const std::string encodings = "zstd, gzip, deflate";
+#else
+        static const std::string encodings = "gzip, deflate";
+#endif
+        return encodings;
+}
+
+bool
+ContentDecoder::emit(const char *data,
+                     std::size_t size,
+                     const Sink &sink,
+                     boost::system::error_code &ec)
+{
+        decoded_size_ += size;
+
+        if (decoded_size_ > max_size_) {
+                ec = DecodeError::TooLarge;
+                return false;
+        }
+
+        sink(data, size);
+        return true;
+}
+
+std::unique_ptr<ContentDecoder>
+mtx::client::make_content_decoder(boost::beast::string_view encoding, uint64_t max_size)
+{
+        using boost::beast::iequals;
+
+        if (iequals(encoding, "gzip") || iequals(encoding, "x-gzip"))
+                return std::make_unique<ZlibDecoder>(true, max_size);
+        if (iequals(encoding, "deflate"))
+                return std::make_unique<ZlibDecoder>(false, max_size);
+#if defined(MTXCLIENT_HAS_ZSTD)
+        if (iequals(encoding, "zstd"))
+                return std::make_unique<ZstdDecoder>(max_size);
+#endif
+
+        return nullptr;
+}
+
+bool
+mtx::client::is_identity_encoding(boost::beast::string_view encoding)
+{
+        return encoding.empty() || boost::beast::iequals(encoding, "identity");
+}
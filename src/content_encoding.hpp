@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <boost/beast/core/string.hpp>
+#include <boost/system/error_code.hpp>
+
+namespace mtx {
+namespace client {
+
+//! Why a compressed body couldn't be decoded.
+enum class DecodeError
+{
+        //! The server used an encoding that wasn't offered.
+        UnsupportedEncoding = 1,
+        //! The data isn't valid for its encoding.
+        Corrupted,
+        //! The body ended before the end of the compressed stream.
+        Truncated,
+        //! The decoded body exceeds the size limit of the responses.
+        TooLarge,
+};
+
+const boost::system::error_category &
+decode_category();
+
+inline boost::system::error_code
+make_error_code(DecodeError e)
+{
+        return boost::system::error_code(static_cast<int>(e), decode_category());
+}
+
+//! The value of the Accept-Encoding field offering the supported encodings,
+//! the preferred one first. zstd is only offered by builds with libzstd.
+const std::string &
+supported_encodings();
+
+//! Decompresses a body as it's received, so the compressed body never has to be
+//! stored in full. The decoder can be reset & used again for another body.
+class ContentDecoder
+{
+public:
+        //! Receives the decoded data. The pointer is only valid during the call.
+        using Sink = std::function<void(const char *data, std::size_t size)>;
+
+        explicit ContentDecoder(uint64_t max_size)
+          : max_size_{max_size}
+        {}
+        virtual ~ContentDecoder() = default;
+
+        //! Decode the next part of the body, passing the output to the sink.
+        virtual void decode(const char *data,
+                            std::size_t size,
+                            const Sink &sink,
+                            boost::system::error_code &ec) = 0;
+        //! Check that the end of the compressed stream has been reached.
+        virtual void finish(boost::system::error_code &ec) = 0;
+        //! Get ready for another body.
+        virtual void reset() = 0;
+        //! The Content-Encoding that is decoded.
+        virtual boost::beast::string_view encoding() const = 0;
+
+        //! Size of the data decoded since the last reset.
+        uint64_t decoded_size() const { return decoded_size_; }
+
+protected:
+        //! Account for & hand over decoded data.
+        bool emit(const char *data,
+                  std::size_t size,
+                  const Sink &sink,
+                  boost::system::error_code &ec);
+
+        //! Size of the chunks that the data is decoded into.
+        static constexpr std::size_t chunk_size = 16 * 1024;
+
+        uint64_t max_size_;
+        uint64_t decoded_size_ = 0;
+};
+
+//! Create a decoder for the value of a Content-Encoding field. Returns nullptr for an
+//! encoding that isn't supported. The decoder fails once more than `max_size` bytes
+//! have been decoded, so a small body can't inflate to an arbitrary size.
+std::unique_ptr<ContentDecoder>
+make_content_decoder(boost::beast::string_view encoding, uint64_t max_size);
+
+//! Whether the value of a Content-Encoding field means that the body isn't encoded.
+bool
+is_identity_encoding(boost::beast::string_view encoding);
+}
+}
+
+namespace boost {
+namespace system {
+template<>
+struct is_error_code_enum<mtx::client::DecodeError>
+{
+        static const bool value = true;
+};
+}
+}
@@ -0,0 +1,348 @@
+#include "dns_cache.hpp"
+
+#include <algorithm>
+
+#include <boost/core/ignore_unused.hpp>
+
+using namespace mtx::client;
+using boost::asio::ip::tcp;
+
+namespace {
+
+//! State shared by the concurrent connection attempts of a single connect.
+class HappyEyeballs : public std::enable_shared_from_this<HappyEyeballs>
+{
+public:
+        HappyEyeballs(boost::asio::io_service &ios,
+                      tcp::socket &socket,
+                      const DnsCache::Endpoints &endpoints,
+                      std::chrono::steady_clock::duration attempt_delay,
+                      std::function<void(boost::system::error_code)> handler)
+          : ios_{ios}
+          , socket_{socket}
+          , attempt_delay_{attempt_delay}
+          , timer_{ios}
+          , handler_{handler}
+        {
+                // Alternate between the address families, starting with IPv6.
+                DnsCache::Endpoints v6, v4;
+                for (const auto &endpoint : endpoints)
+                        (endpoint.address().is_v6() ? v6 : v4).push_back(endpoint);
+
+                for (std::size_t i = 0; i < std::max(v6.size(), v4.size()); ++i) {
+                        if (i < v6.size())
+                                endpoints_.push_back(v6[i]);
+                        if (i < v4.size())
+                                endpoints_.push_back(v4[i]);
+                }
+        }
+
+        void start()
+        {
+                std::unique_lock<std::mutex> lock(mutex_);
+
+                if (endpoints_.empty()) {
+                        is_done_ = true;
+
+                        // The handler is never called from within the initiating function.
+                        auto handler = handler_;
+                        ios_.post([handler]() { handler(boost::asio::error::host_not_found); });
+                        return;
+                }
+
+                start_attempt();
+        }
+
+        void cancel()
+        {
+                std::unique_lock<std::mutex> lock(mutex_);
+
+                if (is_done_)
+                        return;
+
+                is_done_ = true;
+                timer_.cancel();
+                close_attempts();
+
+                auto handler = handler_;
+                ios_.post([handler]() { handler(boost::asio::error::operation_aborted); });
+        }
+
+private:
+        //! Start connecting to the next endpoint. Called with the mutex held.
+        void start_attempt()
+        {
+                auto socket   = std::make_shared<tcp::socket>(ios_);
+                auto endpoint = endpoints_[next_];
+
+                next_ += 1;
+                attempts_.push_back(socket);
+
+                socket->async_connect(endpoint,
+                                      std::bind(&HappyEyeballs::on_connect,
+                                                shared_from_this(),
+                                                socket,
+                                                std::placeholders::_1));
+
+                if (next_ < endpoints_.size()) {
+                        timer_.expires_after(attempt_delay_);
+                        timer_.async_wait(std::bind(
+                          &HappyEyeballs::on_timeout, shared_from_this(), std::placeholders::_1));
+                }
+        }
+
+        void on_timeout(boost::system::error_code ec)
+        {
+                std::unique_lock<std::mutex> lock(mutex_);
+
+                // The timer was re-armed or the connect has finished.
+                if (ec || is_done_ || timer_.expiry() > std::chrono::steady_clock::now())
+                        return;
+
+                if (next_ < endpoints_.size())
+                        start_attempt();
+        }
+
+        void on_connect(std::shared_ptr<tcp::socket> socket, boost::system::error_code ec)
+        {
+                std::unique_lock<std::mutex> lock(mutex_);
+
+                // The attempt is no longer listed if it was closed by the winner.
+                attempts_.erase(std::remove(attempts_.begin(), attempts_.end(), socket),
+                                attempts_.end());
+
+                if (is_done_)
+                        return;
+
+                if (!ec) {
+                        is_done_ = true;
+                        timer_.cancel();
+
+                        // We have a winner. The remaining attempts are no longer needed.
+                        close_attempts();
+
+                        socket_ = std::move(*socket);
+                        lock.unlock();
+
+                        return handler_(ec);
+                }
+
+                last_error_ = ec;
+
+                // Don't wait for the timer if the attempt has already failed.
+                if (next_ < endpoints_.size()) {
+                        timer_.cancel();
+                        return start_attempt();
+                }
+
+                if (attempts_.empty()) {
+                        is_done_ = true;
+                        lock.unlock();
+
+                        handler_(last_error_);
+                }
+        }
+
+        //! Close the sockets of the attempts in progress. Called with the mutex held.
+        void close_attempts()
+        {
+                for (auto &attempt : attempts_) {
+                        boost::system::error_code ignored_ec;
+                        attempt->close(ignored_ec);
+                }
+                attempts_.clear();
+        }
+
+        boost::asio::io_service &ios_;
+        //! The socket that will own the established connection.
+        tcp::socket &socket_;
+        //! The endpoints in the order they'll be tried.
+        DnsCache::Endpoints endpoints_;
+        //! The index of the next endpoint to try.
+        std::size_t next_ = 0;
+        //! The sockets of the attempts in progress.
+        std::vector<std::shared_ptr<tcp::socket>> attempts_;
+        //! Delay between two attempts.
+        std::chrono::steady_clock::duration attempt_delay_;
+        //! Triggers the next attempt.
+        boost::asio::steady_timer timer_;
+        //! The error of the last failed attempt.
+        boost::system::error_code last_error_;
+        //! Whether the handler has been called.
+        bool is_done_ = false;
+        //! Used to synchronize the completion handlers of the attempts.
+        std::mutex mutex_;
+
+        std::function<void(boost::system::error_code)> handler_;
+};
+}
+
+DnsCache::DnsCache(boost::asio::io_service &ios)
+  : ios_{ios}
+{}
+
+void
+DnsCache::resolve(const std::string &host, const std::string &port, ResolveHandler handler)
+{
+        const auto key = host + ":" + port;
+        const auto now = std::chrono::steady_clock::now();
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto &entry = entries_[key];
+
+        if (entry.expires_at > now && !entry.is_resolving && entry.error) {
+                stats_.failures += 1;
+                lock.unlock();
+
+                return handler(entry.error, {});
+        }
+
+        if (entry.expires_at > now && !entry.endpoints.empty()) {
+                stats_.hits += 1;
+
+                // Refresh the addresses before they expire to keep
+                // the lookups off the request path.
+                if (!entry.is_resolving && entry.expires_at - now < refresh_ahead_) {
+                        entry.is_resolving = true;
+                        stats_.refreshes += 1;
+                        start_query(host, port);
+                }
+
+                auto endpoints = entry.endpoints;
+                lock.unlock();
+
+                return handler({}, std::move(endpoints));
+        }
+
+        stats_.misses += 1;
+        entry.pending.push_back(handler);
+
+        if (!entry.is_resolving) {
+                entry.is_resolving = true;
+                start_query(host, port);
+        }
+}
+
+void
+DnsCache::invalidate(const std::string &host, const std::string &port)
+{
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        auto it = entries_.find(host + ":" + port);
+        if (it != entries_.end() && !it->second.is_resolving)
+                entries_.erase(it);
+}
+
+void
+DnsCache::clear()
+{
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        for (auto it = entries_.begin(); it != entries_.end();) {
+                if (it->second.is_resolving)
+                        ++it;
+                else
+                        it = entries_.erase(it);
+        }
+}
+
+void
+DnsCache::set_ttl(std::chrono::steady_clock::duration ttl)
+{
+        std::unique_lock<std::mutex> lock(mutex_);
+        ttl_ = ttl;
+}
+
+void
+DnsCache::set_negative_ttl(std::chrono::steady_clock::duration ttl)
+{
+        std::unique_lock<std::mutex> lock(mutex_);
+        negative_ttl_ = ttl;
+}
+
+void
+DnsCache::set_refresh_ahead(std::chrono::steady_clock::duration interval)
+{
+        std::unique_lock<std::mutex> lock(mutex_);
+        refresh_ahead_ = interval;
+}
+
+DnsCache::Stats
+DnsCache::stats() const
+{
+        std::unique_lock<std::mutex> lock(mutex_);
+        return stats_;
+}
+
+void
+DnsCache::start_query(const std::string &host, const std::string &port)
+{
+        // Every query gets its own resolver, so that lookups initiated
+        // from different threads don't share any state.
+        auto resolver = std::make_shared<tcp::resolver>(ios_);
+
+        resolver->async_resolve(host,
+                                port,
+                                std::bind(&DnsCache::on_query,
+                                          shared_from_this(),
+                                          host + ":" + port,
+                                          resolver,
+                                          std::placeholders::_1,
+                                          std::placeholders::_2));
+}
+
+void
+DnsCache::on_query(const std::string &key,
+                   std::shared_ptr<tcp::resolver> resolver,
+                   boost::system::error_code ec,
+                   tcp::resolver::results_type results)
+{
+        boost::ignore_unused(resolver);
+
+        Endpoints endpoints;
+        for (const auto &result : results)
+                endpoints.push_back(result.endpoint());
+
+        if (!ec && endpoints.empty())
+                ec = boost::asio::error::host_not_found;
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto &entry = entries_[key];
+
+        entry.is_resolving = false;
+
+        if (!ec) {
+                entry.endpoints  = endpoints;
+                entry.error      = {};
+                entry.expires_at = std::chrono::steady_clock::now() + ttl_;
+        } else if (entry.pending.empty()) {
+                // A failed background refresh. Keep using the
+                // previous addresses until they expire.
+        } else {
+                entry.endpoints.clear();
+                entry.error      = ec;
+                entry.expires_at = std::chrono::steady_clock::now() + negative_ttl_;
+                stats_.failures += entry.pending.size();
+        }
+
+        auto pending = std::move(entry.pending);
+        entry.pending.clear();
+        lock.unlock();
+
+        for (auto &handler : pending)
+                handler(ec, endpoints);
+}
+
+std::function<void()>
+mtx::client::async_connect_happy_eyeballs(boost::asio::io_service &ios,
+                                          tcp::socket &socket,
+                                          const DnsCache::Endpoints &endpoints,
+                                          std::chrono::steady_clock::duration attempt_delay,
+                                          std::function<void(boost::system::error_code)> handler)
+{
+        auto connect =
+          std::make_shared<HappyEyeballs>(ios, socket, endpoints, attempt_delay, handler);
+        connect->start();
+
+        return std::bind(&HappyEyeballs::cancel, connect);
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+namespace mtx {
+namespace client {
+
+//! Caches the results of DNS lookups so that requests don't have to go
+//! through the system resolver every time.
+class DnsCache : public std::enable_shared_from_this<DnsCache>
+{
+public:
+        //! The addresses of a host.
+        using Endpoints = std::vector<boost::asio::ip::tcp::endpoint>;
+        //! Function to be called with the result of a lookup.
+        using ResolveHandler = std::function<void(boost::system::error_code, Endpoints)>;
+
+        //! Counters describing the usage of the cache.
+        struct Stats
+        {
+                //! Lookups served from the cache.
+                uint64_t hits = 0;
+                //! Lookups that had to wait for the resolver.
+                uint64_t misses = 0;
+                //! Entries refreshed in the background before they expired.
+                uint64_t refreshes = 0;
+                //! Lookups that failed (including cached failures).
+                uint64_t failures = 0;
+        };
+
+        explicit DnsCache(boost::asio::io_service &ios);
+
+        //! Resolve the host. Concurrent lookups of the same host & port
+        //! will share a single query.
+        void resolve(const std::string &host, const std::string &port, ResolveHandler handler);
+        //! Discard the cached addresses, e.g when none of them was reachable.
+        void invalidate(const std::string &host, const std::string &port);
+        //! Discard all the cached entries.
+        void clear();
+
+        //! How long the addresses of a successful lookup will be used.
+        void set_ttl(std::chrono::steady_clock::duration ttl);
+        //! How long a failed lookup will be remembered.
+        void set_negative_ttl(std::chrono::steady_clock::duration ttl);
+        //! Entries that are used within this interval before they expire
+        //! will be refreshed in the background.
+        void set_refresh_ahead(std::chrono::steady_clock::duration interval);
+
+        //! Retrieve a snapshot of the cache counters.
+        Stats stats() const;
+
+private:
+        struct Entry
+        {
+                //! The resolved addresses.
+                Endpoints endpoints;
+                //! The error of the last lookup, if it failed.
+                boost::system::error_code error;
+                //! When the entry should no longer be used.
+                std::chrono::steady_clock::time_point expires_at;
+                //! Whether a query for the entry is in progress.
+                bool is_resolving = false;
+                //! Lookups waiting for the query to complete.
+                std::deque<ResolveHandler> pending;
+        };
+
+        void start_query(const std::string &host, const std::string &port);
+        void on_query(const std::string &key,
+                      std::shared_ptr<boost::asio::ip::tcp::resolver> resolver,
+                      boost::system::error_code ec,
+                      boost::asio::ip::tcp::resolver::results_type results);
+
+        boost::asio::io_service &ios_;
+
+        //! Cached entries keyed by `host:port`.
+        std::map<std::string, Entry> entries_;
+        //! Used to synchronize access to the cache.
+        mutable std::mutex mutex_;
+
+        std::chrono::steady_clock::duration ttl_           = std::chrono::seconds(60);
+        std::chrono::steady_clock::duration negative_ttl_  = std::chrono::seconds(5);
+        std::chrono::steady_clock::duration refresh_ahead_ = std::chrono::seconds(10);
+
+        Stats stats_;
+};
+
+//! Connect to one of the given endpoints, racing the attempts as described in
+//! RFC 8305 (Happy Eyeballs). Addresses are interleaved by family, starting with
+//! IPv6, and a new attempt is started every `attempt_delay` (or as soon as the
+//! previous one fails) while the earlier ones are still in progress.
+//! The first socket to connect is moved into `socket`.
+//! Returns a function that aborts the attempts in progress, in which case the
+//! handler will be called with `operation_aborted`.
+std::function<void()>
+async_connect_happy_eyeballs(boost::asio::io_service &ios,
+                             boost::asio::ip::tcp::socket &socket,
+                             const DnsCache::Endpoints &endpoints,
+                             std::chrono::steady_clock::duration attempt_delay,
+                             std::function<void(boost::system::error_code)> handler);
+}
+}
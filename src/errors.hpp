@@ -3,6 +3,9 @@
 #include "mtx/errors.hpp"
 #include <boost/beast.hpp>
 
+#include <stdexcept>
+#include <string>
+
 namespace mtx {
 namespace client {
 namespace errors {
@@ -15,7 +18,32 @@ struct ClientError
         //! Error code if a network related error occured.
         boost::system::error_code error_code;
         //! Status code of the associated http response.
-        boost::beast::http::status status_code;
+        boost::beast::http::status status_code{};
+};
+
+//! Thrown by the awaitable endpoints when a request fails.
+class ClientException : public std::runtime_error
+{
+public:
+        explicit ClientException(const ClientError &error)
+          : std::runtime_error(describe(error))
+          , error_{error}
+        {}
+
+        //! The error of the failed request.
+        const ClientError &error() const { return error_; }
+
+private:
+        static std::string describe(const ClientError &error)
+        {
+                if (error.error_code)
+                        return error.error_code.message();
+
+                return "HTTP " + std::to_string(static_cast<int>(error.status_code)) + ": " +
+                       error.matrix_error.error;
+        }
+
+        ClientError error_;
 };
 }
 }
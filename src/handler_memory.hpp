@@ -0,0 +1,139 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include <boost/asio.hpp>
+
+namespace mtx {
+namespace client {
+
+//! Storage for the asynchronous operations of a request. A request has few operations
+//! in flight at once (a socket operation nested in a composed one, and its timers), so
+//! a handful of slots lets asio reuse the same memory for all of them instead of going
+//! to the heap. Larger or extra operations fall back to `operator new`.
+//!
+//! A slot is released by the thread completing the operation, which isn't necessarily
+//! the strand of the request, hence the atomic flags.
+class HandlerMemory
+{
+public:
+        HandlerMemory() = default;
+        HandlerMemory(const HandlerMemory &) = delete;
+        HandlerMemory &operator=(const HandlerMemory &) = delete;
+
+        void *allocate(std::size_t size)
+        {
+                if (size <= slot_size) {
+                        for (auto &slot : slots_) {
+                                if (!slot.in_use.exchange(true, std::memory_order_acquire))
+                                        return &slot.storage;
+                        }
+                }
+
+                return ::operator new(size);
+        }
+
+        void deallocate(void *pointer)
+        {
+                for (auto &slot : slots_) {
+                        if (pointer == &slot.storage) {
+                                slot.in_use.store(false, std::memory_order_release);
+                                return;
+                        }
+                }
+
+                ::operator delete(pointer);
+        }
+
+        static constexpr std::size_t slot_size  = 1024;
+        static constexpr std::size_t slot_count = 4;
+
+private:
+        struct Slot
+        {
+                typename std::aligned_storage<slot_size>::type storage;
+                std::atomic<bool> in_use{false};
+        };
+
+        Slot slots_[slot_count];
+};
+
+//! Allocator associated to the handlers of a request, drawing from its `HandlerMemory`.
+template<class T>
+class HandlerAllocator
+{
+public:
+        using value_type = T;
+
+        explicit HandlerAllocator(HandlerMemory &memory) noexcept
+          : memory_{&memory}
+        {}
+
+        template<class U>
+        HandlerAllocator(const HandlerAllocator<U> &other) noexcept
+          : memory_{other.memory_}
+        {}
+
+        T *allocate(std::size_t n)
+        {
+                return static_cast<T *>(memory_->allocate(n * sizeof(T)));
+        }
+        void deallocate(T *pointer, std::size_t) noexcept { memory_->deallocate(pointer); }
+
+        template<class U>
+        bool operator==(const HandlerAllocator<U> &other) const noexcept
+        {
+                return memory_ == other.memory_;
+        }
+        template<class U>
+        bool operator!=(const HandlerAllocator<U> &other) const noexcept
+        {
+                return memory_ != other.memory_;
+        }
+
+private:
+        template<class U>
+        friend class HandlerAllocator;
+
+        HandlerMemory *memory_;
+};
+
+//! A handler whose operations are allocated from the given memory, which has
+//! to outlive them.
+template<class Handler>
+class AllocHandler
+{
+public:
+        using allocator_type = HandlerAllocator<Handler>;
+
+        AllocHandler(HandlerMemory &memory, Handler handler)
+          : memory_{memory}
+          , handler_{std::move(handler)}
+        {}
+
+        allocator_type get_allocator() const noexcept { return allocator_type(memory_); }
+
+        template<class... Args>
+        void operator()(Args &&... args)
+        {
+                handler_(std::forward<Args>(args)...);
+        }
+
+private:
+        HandlerMemory &memory_;
+        Handler handler_;
+};
+
+template<class Handler>
+AllocHandler<typename std::decay<Handler>::type>
+make_alloc_handler(HandlerMemory &memory, Handler &&handler)
+{
+        return AllocHandler<typename std::decay<Handler>::type>(memory,
+                                                               std::forward<Handler>(handler));
+}
+}
+}
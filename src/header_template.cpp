@@ -0,0 +1,22 @@
+#include "header_template.hpp"
+
+using namespace mtx::client;
+
+const char *const HeaderTemplate::user_agent = "mtxclient v0.1.0";
+
+HeaderTemplate::HeaderTemplate(const std::string &host,
+                               const std::string &access_token,
+                               const std::string &accept_encoding)
+  : accepts_encoding_{!accept_encoding.empty()}
+{
+        anonymous_.append("Host: ").append(host).append("\r\n");
+        anonymous_.append("User-Agent: ").append(user_agent).append("\r\n");
+
+        identity_ = anonymous_;
+        if (accepts_encoding_)
+                anonymous_.append("Accept-Encoding: ").append(accept_encoding).append("\r\n");
+
+        authenticated_ = anonymous_;
+        if (!access_token.empty())
+                authenticated_.append("Authorization: Bearer ").append(access_token).append("\r\n");
+}
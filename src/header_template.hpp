@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+
+namespace mtx {
+namespace client {
+
+//! The header fields that every request of a client carries, rendered once in
+//! their wire format. A template is immutable; the client replaces it when the
+//! access token changes, and the requests in progress keep the one they started with.
+class HeaderTemplate
+{
+public:
+        //! The responses may be compressed with the given encodings, if any
+        //! (see `supported_encodings`).
+        HeaderTemplate(const std::string &host,
+                       const std::string &access_token,
+                       const std::string &accept_encoding = "");
+
+        //! The rendered fields, each one terminated by CRLF. The authorization
+        //! is only included if it's required & there is an access token.
+        const std::string &fields(bool requires_auth) const
+        {
+                return requires_auth ? authenticated_ : anonymous_;
+        }
+
+        //! The fields without authorization nor Accept-Encoding, for the requests of
+        //! byte ranges: a range would apply to the compressed content.
+        const std::string &identity_fields() const { return identity_; }
+
+        //! Whether the server may compress the responses.
+        bool accepts_encoding() const { return accepts_encoding_; }
+
+        //! The value of the User-Agent field.
+        static const char *const user_agent;
+
+private:
+        std::string identity_;
+        std::string anonymous_;
+        std::string authenticated_;
+        bool accepts_encoding_;
+};
+}
+}
@@ -0,0 +1,120 @@
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <thread>
+
+#include <boost/core/ignore_unused.hpp>
+
+#include "io_service_pool.hpp"
+
+using namespace mtx::client;
+
+namespace {
+
+//! Restrict the thread to the CPUs of the mask.
+void
+set_affinity(boost::thread &thread, uint64_t mask)
+{
+#if defined(__linux__)
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+
+        for (int cpu = 0; cpu < 64; ++cpu) {
+                if (mask & (uint64_t(1) << cpu))
+                        CPU_SET(cpu, &cpus);
+        }
+
+        pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus);
+#else
+        boost::ignore_unused(thread, mask);
+#endif
+}
+
+//! Select the n-th CPU of the mask, wrapping around.
+uint64_t
+nth_cpu(uint64_t mask, unsigned int n)
+{
+        std::vector<uint64_t> cpus;
+        for (int cpu = 0; cpu < 64; ++cpu) {
+                if (mask & (uint64_t(1) << cpu))
+                        cpus.push_back(uint64_t(1) << cpu);
+        }
+
+        return cpus[n % cpus.size()];
+}
+}
+
+IoServicePool::IoServicePool(const ThreadOptions &options)
+{
+        const auto threads_num =
+          options.threads > 0 ? options.threads : std::max(1U, std::thread::hardware_concurrency());
+        const auto contexts_num = options.model == ThreadingModel::PerThread ? threads_num : 1;
+
+        // The number of threads that will run each io_service.
+        const int concurrency_hint = threads_num / contexts_num;
+
+        for (unsigned int i = 0; i < contexts_num; ++i) {
+                contexts_.push_back(std::make_shared<boost::asio::io_service>(concurrency_hint));
+                work_.emplace_back(new boost::asio::io_service::work(*contexts_.back()));
+        }
+
+        for (unsigned int i = 0; i < threads_num; ++i) {
+                auto ios = contexts_[i % contexts_num];
+                threads_.emplace_back([ios]() { ios->run(); });
+
+                if (options.affinity_mask != 0)
+                        set_affinity(threads_.back(),
+                                     options.model == ThreadingModel::PerThread
+                                       ? nth_cpu(options.affinity_mask, i)
+                                       : options.affinity_mask);
+        }
+}
+
+IoServicePool::~IoServicePool()
+{
+        work_.clear();
+
+        // The pending operations are abandoned, as the io_services are about to be destroyed.
+        for (auto &ios : contexts_)
+                ios->stop();
+
+        for (auto &thread : threads_) {
+                if (!thread.joinable())
+                        continue;
+
+                // The last reference to the owner might be released by a handler. The thread
+                // keeps its io_service until it returns from it.
+                if (thread.get_id() == boost::this_thread::get_id())
+                        thread.detach();
+                else
+                        thread.join();
+        }
+}
+
+std::vector<boost::asio::io_service *>
+IoServicePool::contexts() const
+{
+        std::vector<boost::asio::io_service *> contexts;
+        for (const auto &ios : contexts_)
+                contexts.push_back(ios.get());
+
+        return contexts;
+}
+
+void
+IoServicePool::stop()
+{
+        // Destroy work object. This allows the I/O thread to
+        // exit the event loop when there are no more pending
+        // asynchronous operations.
+        work_.clear();
+
+        // Wait for the worker threads to exit. A handler can't wait for its own thread.
+        for (auto &thread : threads_) {
+                if (thread.joinable() && thread.get_id() != boost::this_thread::get_id())
+                        thread.join();
+        }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace mtx {
+namespace client {
+
+//! How the network threads are organized.
+enum class ThreadingModel
+{
+        //! All the threads run a single io_service. The handlers of each
+        //! request are serialized by a strand.
+        Shared,
+        //! Every thread runs its own io_service with its own connection pool.
+        //! A request & its connection stay on the same thread, which avoids
+        //! synchronization and lets each thread be pinned to a core.
+        PerThread,
+};
+
+//! Network threads started by the client.
+struct ThreadOptions
+{
+        //! Number of threads. Zero starts one per hardware thread.
+        unsigned int threads = 0;
+        //! How the threads are organized.
+        ThreadingModel model = ThreadingModel::Shared;
+        //! The CPUs the threads may run on, one bit per CPU (Linux only). Zero keeps
+        //! the default affinity. With `ThreadingModel::PerThread` each thread is pinned
+        //! to a single CPU of the mask, in turn.
+        uint64_t affinity_mask = 0;
+};
+
+//! The io_services and the threads that run them.
+class IoServicePool
+{
+public:
+        //! Start the threads described by the options.
+        explicit IoServicePool(const ThreadOptions &options);
+        ~IoServicePool();
+
+        //! The io_services. There is a single one unless each thread has its own.
+        std::vector<boost::asio::io_service *> contexts() const;
+        //! Let the threads exit once they run out of work, and wait for them.
+        void stop();
+
+private:
+        //! Shared with the threads running them, as the last reference to the owner of
+        //! the pool might be released by a handler.
+        std::vector<std::shared_ptr<boost::asio::io_service>> contexts_;
+        //! Used to prevent the event loops from shutting down.
+        std::vector<std::unique_ptr<boost::asio::io_service::work>> work_;
+        //! Worker threads for the requests.
+        std::vector<boost::thread> threads_;
+};
+}
+}
@@ -0,0 +1,486 @@
+#include "media.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <limits>
+
+#include <unistd.h>
+
+#include "client.hpp"
+
+using namespace mtx::client;
+namespace http = boost::beast::http;
+
+namespace {
+
+RequestErr
+make_error(boost::system::error_code ec)
+{
+        mtx::client::errors::ClientError client_error;
+        client_error.error_code = ec;
+
+        return client_error;
+}
+
+//! The response doesn't match the request.
+boost::system::error_code
+protocol_error()
+{
+        return boost::system::errc::make_error_code(boost::system::errc::protocol_error);
+}
+
+//! Parse an unsigned decimal number that spans the whole value.
+bool
+parse_number(boost::beast::string_view value, uint64_t &number)
+{
+        // Anything longer may overflow.
+        if (value.empty() || value.size() > 19)
+                return false;
+
+        number = 0;
+        for (const char c : value) {
+                if (c < '0' || c > '9')
+                        return false;
+
+                number = number * 10 + (c - '0');
+        }
+
+        return true;
+}
+
+//! Check a server name against the grammar of the spec: a DNS name, an IPv4 address or a
+//! bracketed IPv6 address, optionally followed by a port.
+bool
+is_valid_server_name(const std::string &server)
+{
+        std::string host = server;
+
+        const auto bracket = host.rfind(']');
+        const auto colon   = host.rfind(':');
+        if (colon != std::string::npos && (bracket == std::string::npos || colon > bracket)) {
+                const auto port = host.substr(colon + 1);
+
+                if (port.empty() || port.size() > 5 ||
+                    !std::all_of(port.begin(), port.end(), [](char c) {
+                            return c >= '0' && c <= '9';
+                    }))
+                        return false;
+
+                host.erase(colon);
+        }
+
+        if (host.empty())
+                return false;
+
+        if (host.front() == '[') {
+                if (host.size() < 4 || host.back() != ']')
+                        return false;
+
+                return host.size() - 2 <= 45 &&
+                       std::all_of(host.begin() + 1, host.end() - 1, [](char c) {
+                               return std::isxdigit(static_cast<unsigned char>(c)) ||
+                                      c == ':' || c == '.';
+                       });
+        }
+
+        // Covers the IPv4 addresses as well.
+        return host.size() <= 255 && std::all_of(host.begin(), host.end(), [](char c) {
+                       return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+                              (c >= 'A' && c <= 'Z') || c == '-' || c == '.';
+               });
+}
+}
+
+void
+mtx::client::from_json(const nlohmann::json &obj, ContentURI &response)
+{
+        response.content_uri = obj.at("content_uri").get<std::string>();
+}
+
+bool
+mtx::client::parse_mxc_uri(const std::string &uri, std::string &server, std::string &media_id)
+{
+        static const std::string scheme = "mxc://";
+
+        if (uri.compare(0, scheme.size(), scheme) != 0)
+                return false;
+
+        const auto slash = uri.find('/', scheme.size());
+        if (slash == std::string::npos || slash == scheme.size() || slash + 1 == uri.size())
+                return false;
+
+        // Both end up in the request line, and the URI comes from untrusted events.
+        const auto is_media_char = [](char c) {
+                return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '-';
+        };
+
+        auto name = uri.substr(scheme.size(), slash - scheme.size());
+        if (!is_valid_server_name(name) ||
+            !std::all_of(uri.begin() + slash + 1, uri.end(), is_media_char))
+                return false;
+
+        server   = std::move(name);
+        media_id = uri.substr(slash + 1);
+
+        return true;
+}
+
+bool
+mtx::client::parse_content_range(boost::beast::string_view value,
+                                 uint64_t &first,
+                                 uint64_t &last,
+                                 std::experimental::optional<uint64_t> &total)
+{
+        const boost::beast::string_view unit = "bytes ";
+
+        if (value.substr(0, unit.size()) != unit)
+                return false;
+        value.remove_prefix(unit.size());
+
+        const auto dash  = value.find('-');
+        const auto slash = value.find('/');
+        if (dash == boost::beast::string_view::npos || slash == boost::beast::string_view::npos ||
+            dash > slash)
+                return false;
+
+        if (!parse_number(value.substr(0, dash), first) ||
+            !parse_number(value.substr(dash + 1, slash - dash - 1), last) || last < first)
+                return false;
+
+        const auto size = value.substr(slash + 1);
+        if (size == "*") {
+                total = std::experimental::nullopt;
+                return true;
+        }
+
+        uint64_t length = 0;
+        if (!parse_number(size, length) || last >= length)
+                return false;
+
+        total = length;
+        return true;
+}
+
+std::shared_ptr<FileSink>
+FileSink::open(const std::string &path, boost::system::error_code &ec)
+{
+        boost::beast::file file;
+
+        // The content of an existing file is kept, so it can be resumed.
+        file.open(path.c_str(), boost::beast::file_mode::write_existing, ec);
+        if (ec == boost::system::errc::no_such_file_or_directory)
+                file.open(path.c_str(), boost::beast::file_mode::write, ec);
+
+        if (ec)
+                return nullptr;
+
+        return std::shared_ptr<FileSink>(new FileSink(std::move(file)));
+}
+
+FileSink::FileSink(boost::beast::file file)
+  : file_{std::move(file)}
+{}
+
+uint64_t
+FileSink::size() const
+{
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        boost::system::error_code ec;
+        const auto size = file_.size(ec);
+
+        return ec ? 0 : size;
+}
+
+void
+FileSink::truncate(uint64_t size, boost::system::error_code &ec)
+{
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (::ftruncate(file_.native_handle(), static_cast<off_t>(size)) != 0)
+                ec.assign(errno, boost::system::generic_category());
+}
+
+void
+FileSink::write(uint64_t offset, const char *data, std::size_t size, boost::system::error_code &ec)
+{
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        file_.seek(offset, ec);
+
+        while (size > 0 && !ec) {
+                const auto n = file_.write(data, size, ec);
+
+                data += n;
+                size -= n;
+        }
+}
+
+MediaDownload::MediaDownload(std::shared_ptr<Client> client,
+                             std::string endpoint,
+                             std::shared_ptr<MediaSink> sink,
+                             DownloadOptions options,
+                             Handler handler)
+  : client_{std::move(client)}
+  , endpoint_{std::move(endpoint)}
+  , sink_{std::move(sink)}
+  , options_{std::move(options)}
+  , handler_{std::move(handler)}
+{
+        options_.segment_size      = std::max<uint64_t>(options_.segment_size, 1);
+        options_.parallel_segments = std::max(options_.parallel_segments, 1u);
+}
+
+void
+MediaDownload::start()
+{
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        boost::system::error_code ec;
+        const auto first = options_.resume ? sink_->size() : 0;
+
+        sink_->truncate(first, ec);
+        if (ec)
+                return finish(make_error(ec), lock);
+
+        result_.resumed_from = first;
+        received_            = first;
+
+        // A parallel download starts with a single segment, which tells the size of the
+        // content. Otherwise the whole content is requested at once.
+        auto segment = std::make_shared<Segment>(Segment{first, first, {}});
+        if (options_.parallel_segments > 1)
+                segment->last = first + options_.segment_size - 1;
+
+        next_offset_ = segment->last ? *segment->last + 1 : std::numeric_limits<uint64_t>::max();
+        in_progress_.emplace(first, segment);
+        active_ = 1;
+
+        lock.unlock();
+        request(segment, true);
+}
+
+void
+MediaDownload::request(std::shared_ptr<Segment> segment, bool is_first)
+{
+        auto self = shared_from_this();
+
+        RangeRequest range;
+        range.first     = segment->first;
+        range.last      = segment->last;
+        range.on_header = [self, segment, is_first](const HttpResponse &response,
+                                                    boost::system::error_code &ec) {
+                self->on_header(segment, is_first, response, ec);
+        };
+        range.on_body = [self, segment](const char *data, std::size_t size) {
+                self->on_body(segment, data, size);
+        };
+        range.on_complete = [self, segment](RequestErr err) { self->on_complete(segment, err); };
+
+        const auto id = client_->get_range(endpoint_, std::move(range));
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        segment->id = id;
+
+        // Another segment failed while this one was being sent.
+        if (error_) {
+                lock.unlock();
+                client_->cancel_request(id);
+        }
+}
+
+void
+MediaDownload::on_header(std::shared_ptr<Segment> segment,
+                         bool is_first,
+                         const HttpResponse &response,
+                         boost::system::error_code &ec)
+{
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (is_first)
+                result_.content_type = response[http::field::content_type].to_string();
+
+        switch (response.result()) {
+        case http::status::partial_content: {
+                uint64_t first = 0, last = 0;
+                std::experimental::optional<uint64_t> total;
+
+                if (!parse_content_range(
+                      response[http::field::content_range], first, last, total) ||
+                    first != segment->first) {
+                        ec = protocol_error();
+                        return;
+                }
+
+                if (!is_first) {
+                        // The segments were cut at the size given by the first response.
+                        if (!segment->last || last != *segment->last)
+                                ec = protocol_error();
+
+                        return;
+                }
+
+                // The size is needed to split the rest of the content.
+                if (segment->last && (last > *segment->last || !total)) {
+                        ec = protocol_error();
+                        return;
+                }
+
+                total_ = total;
+                // The server may send less than what was asked for.
+                next_offset_ = std::min(next_offset_, last + 1);
+                return;
+        }
+        case http::status::ok: {
+                // The server doesn't support ranges, so the whole content comes in
+                // this response.
+                if (!is_first) {
+                        ec = protocol_error();
+                        return;
+                }
+
+                is_ranged_           = false;
+                segment->offset      = 0;
+                received_            = 0;
+                result_.resumed_from = 0;
+
+                uint64_t length = 0;
+                if (parse_number(response[http::field::content_length], length))
+                        total_ = length;
+
+                sink_->truncate(0, ec);
+                return;
+        }
+        case http::status::range_not_satisfiable: {
+                // When resuming, the content may have been complete already.
+                const auto range = response[http::field::content_range];
+                uint64_t total   = 0;
+
+                if (is_first && segment->first > 0 && range.substr(0, 8) == "bytes */" &&
+                    parse_number(range.substr(8), total) && total == segment->first) {
+                        is_complete_ = true;
+                        total_       = total;
+                }
+
+                return;
+        }
+        default:
+                // The request fails with the error of the server.
+                return;
+        }
+}
+
+void
+MediaDownload::on_body(std::shared_ptr<Segment> segment, const char *data, std::size_t size)
+{
+        // Only this segment writes at its offset.
+        boost::system::error_code ec;
+        sink_->write(segment->offset, data, size, ec);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        if (ec)
+                return fail(make_error(ec), lock);
+
+        segment->offset += size;
+        received_ += size;
+
+        if (options_.on_progress)
+                options_.on_progress(received_, total_ ? *total_ : 0);
+}
+
+void
+MediaDownload::on_complete(std::shared_ptr<Segment> segment, RequestErr err)
+{
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        --active_;
+
+        if (err && !is_complete_) {
+                fail(err, lock);
+                lock.lock();
+        } else if (!error_) {
+                in_progress_.erase(segment->first);
+        }
+
+        if (error_) {
+                // The requests that were cancelled may still be writing.
+                if (active_ > 0)
+                        return;
+
+                // Only the contiguous content is kept, so the download can be resumed.
+                boost::system::error_code ec;
+                sink_->truncate(
+                  in_progress_.empty() ? received_ : in_progress_.begin()->second->offset, ec);
+
+                return finish(error_, lock);
+        }
+
+        const auto segments = schedule();
+
+        if (active_ == 0)
+                return finish({}, lock);
+
+        lock.unlock();
+
+        for (const auto &next : segments)
+                request(next, false);
+}
+
+std::vector<std::shared_ptr<MediaDownload::Segment>>
+MediaDownload::schedule()
+{
+        std::vector<std::shared_ptr<Segment>> segments;
+
+        if (!is_ranged_ || !total_)
+                return segments;
+
+        while (active_ < options_.parallel_segments && next_offset_ < *total_) {
+                const auto last = std::min(next_offset_ + options_.segment_size, *total_) - 1;
+                auto segment =
+                  std::make_shared<Segment>(Segment{next_offset_, next_offset_, last});
+
+                in_progress_.emplace(next_offset_, segment);
+                segments.push_back(std::move(segment));
+
+                next_offset_ = last + 1;
+                ++active_;
+        }
+
+        return segments;
+}
+
+void
+MediaDownload::fail(RequestErr err, std::unique_lock<std::mutex> &lock)
+{
+        if (!error_)
+                error_ = err;
+
+        std::vector<RequestID> ids;
+        for (const auto &segment : in_progress_)
+                if (segment.second->id != 0)
+                        ids.push_back(segment.second->id);
+
+        // Cancelling may complete a request right away.
+        lock.unlock();
+
+        for (const auto id : ids)
+                client_->cancel_request(id);
+}
+
+void
+MediaDownload::finish(RequestErr err, std::unique_lock<std::mutex> &lock)
+{
+        if (is_finished_)
+                return;
+
+        is_finished_ = true;
+        result_.size = total_ ? *total_ : received_;
+
+        auto handler = std::move(handler_);
+        auto result  = std::move(result_);
+
+        lock.unlock();
+        handler(std::move(result), err);
+}
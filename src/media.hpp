@@ -0,0 +1,231 @@
+#pragma once
+
+#include <cstdint>
+#include <experimental/optional>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/beast/core/file.hpp>
+#include <boost/system/error_code.hpp>
+#include <json.hpp>
+
+#include "completion.hpp"
+#include "request_body.hpp"
+#include "session.hpp"
+
+namespace mtx {
+namespace client {
+
+class Client;
+
+//! The response of an upload.
+struct ContentURI
+{
+        //! The mxc:// URI of the uploaded content.
+        std::string content_uri;
+};
+
+void
+from_json(const nlohmann::json &obj, ContentURI &response);
+
+//! The outcome of a download.
+struct Download
+{
+        //! Size of the content.
+        uint64_t size = 0;
+        //! The offset the download started from, when it was resumed.
+        uint64_t resumed_from = 0;
+        //! Media type of the content.
+        std::string content_type;
+};
+
+//! Options of a download.
+struct DownloadOptions
+{
+        //! Continue after the content already in the sink (e.g a partially downloaded
+        //! file), if the server supports range requests. Otherwise the content is
+        //! downloaded again from the start.
+        bool resume = false;
+        //! Number of segments of the content downloaded at the same time, if the server
+        //! supports range requests.
+        unsigned int parallel_segments = 1;
+        //! Size of the segments of a parallel download.
+        uint64_t segment_size = 4 * 1024 * 1024;
+        //! Called on a network thread as the content is received. The calls are serialized.
+        ProgressCallback on_progress;
+};
+
+//! The handlers of a request for a range of some content (see `Client::get_range`).
+struct RangeRequest
+{
+        //! The first byte requested.
+        uint64_t first = 0;
+        //! The last byte requested, if it's not the end of the content.
+        std::experimental::optional<uint64_t> last;
+        //! Receives the header of the response.
+        HeaderCallback on_header;
+        //! Receives the body of a successful response as it's received.
+        BodyCallback on_body;
+        //! Called once the request is over.
+        std::function<void(RequestErr err)> on_complete;
+};
+
+//! Where the content of a download is written. The segments of a parallel download
+//! are written concurrently, each one in order.
+class MediaSink
+{
+public:
+        virtual ~MediaSink() = default;
+
+        //! Size of the content already in the sink, that a download can resume from.
+        virtual uint64_t size() const = 0;
+        //! Drop the content after the given size, before it's written again.
+        virtual void truncate(uint64_t size, boost::system::error_code &ec) = 0;
+        //! Write a part of the content at its offset.
+        virtual void write(uint64_t offset,
+                           const char *data,
+                           std::size_t size,
+                           boost::system::error_code &ec) = 0;
+};
+
+//! Writes the content to a file.
+class FileSink : public MediaSink
+{
+public:
+        //! Open or create the file, keeping its content. Returns nullptr on failure.
+        static std::shared_ptr<FileSink> open(const std::string &path,
+                                              boost::system::error_code &ec);
+
+        uint64_t size() const override;
+        void truncate(uint64_t size, boost::system::error_code &ec) override;
+        void write(uint64_t offset,
+                   const char *data,
+                   std::size_t size,
+                   boost::system::error_code &ec) override;
+
+private:
+        explicit FileSink(boost::beast::file file);
+
+        //! The writes of the segments are serialized, as they share the file position.
+        mutable std::mutex mutex_;
+        boost::beast::file file_;
+};
+
+//! Passes the content to a function.
+class CallbackSink : public MediaSink
+{
+public:
+        using Callback = std::function<void(uint64_t offset, const char *data, std::size_t size)>;
+
+        explicit CallbackSink(Callback callback)
+          : callback_{std::move(callback)}
+        {}
+
+        uint64_t size() const override { return 0; }
+        void truncate(uint64_t, boost::system::error_code &) override {}
+        void write(uint64_t offset,
+                   const char *data,
+                   std::size_t size,
+                   boost::system::error_code &) override
+        {
+                callback_(offset, data, size);
+        }
+
+private:
+        Callback callback_;
+};
+
+//! Downloads some content into a sink, in a single request or in segments requested
+//! in parallel, and resumes from the content already in the sink if asked to.
+//!
+//! The first request asks for the first segment (or the whole content) with a Range
+//! field. If the server doesn't support ranges, it sends the whole content back, and
+//! that's the only request. Otherwise the total size is known from its Content-Range,
+//! and the remaining segments are requested, `parallel_segments` at a time.
+class MediaDownload : public std::enable_shared_from_this<MediaDownload>
+{
+public:
+        using Handler = std::function<void(Download download, RequestErr err)>;
+
+        MediaDownload(std::shared_ptr<Client> client,
+                      std::string endpoint,
+                      std::shared_ptr<MediaSink> sink,
+                      DownloadOptions options,
+                      Handler handler);
+
+        //! Send the first request.
+        void start();
+
+private:
+        //! A request for a part of the content.
+        struct Segment
+        {
+                //! Where the body is written next.
+                uint64_t offset;
+                //! The first & last byte requested.
+                uint64_t first;
+                std::experimental::optional<uint64_t> last;
+                //! The request, once it has been sent.
+                RequestID id = 0;
+        };
+
+        void request(std::shared_ptr<Segment> segment, bool is_first);
+        void on_header(std::shared_ptr<Segment> segment,
+                       bool is_first,
+                       const HttpResponse &response,
+                       boost::system::error_code &ec);
+        void on_body(std::shared_ptr<Segment> segment, const char *data, std::size_t size);
+        void on_complete(std::shared_ptr<Segment> segment, RequestErr err);
+        //! Pick the next segments to request, up to the number of parallel ones. Locked.
+        std::vector<std::shared_ptr<Segment>> schedule();
+        //! Keep the first error & cancel the requests in progress. Unlocks.
+        void fail(RequestErr err, std::unique_lock<std::mutex> &lock);
+        //! Call the handler once. Unlocks.
+        void finish(RequestErr err, std::unique_lock<std::mutex> &lock);
+
+        std::shared_ptr<Client> client_;
+        std::string endpoint_;
+        std::shared_ptr<MediaSink> sink_;
+        DownloadOptions options_;
+        Handler handler_;
+
+        Download result_;
+        //! Size of the content, once known.
+        std::experimental::optional<uint64_t> total_;
+        //! Start of the next segment to request.
+        uint64_t next_offset_ = 0;
+        //! Bytes received, including the resumed ones.
+        uint64_t received_ = 0;
+        //! The segments that haven't been received in full, by their first byte. The
+        //! content is contiguous up to the first one.
+        std::map<uint64_t, std::shared_ptr<Segment>> in_progress_;
+        //! Number of requests that haven't completed yet.
+        unsigned int active_ = 0;
+        //! Whether the server honours the ranges. Otherwise the content comes in one piece.
+        bool is_ranged_ = true;
+        //! Whether the content was already complete in the sink (when resuming).
+        bool is_complete_ = false;
+        //! The first error, which fails the download.
+        RequestErr error_;
+        bool is_finished_ = false;
+
+        std::mutex mutex_;
+};
+
+//! Split an mxc:// URI into the server name & the media id. Returns false if it's invalid.
+bool
+parse_mxc_uri(const std::string &uri, std::string &server, std::string &media_id);
+
+//! Parse the value of a Content-Range field ("bytes first-last/total"). The total
+//! is left empty if it's unknown ("*").
+bool
+parse_content_range(boost::beast::string_view value,
+                    uint64_t &first,
+                    uint64_t &last,
+                    std::experimental::optional<uint64_t> &total);
+}
+}
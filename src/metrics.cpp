@@ -0,0 +1,511 @@
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+
+using namespace mtx::client;
+
+namespace {
+
+//! Upper bounds of the buckets exported to Prometheus, in microseconds.
+constexpr uint64_t prometheus_buckets[] = {
+  100,    250,    500,    1000,    2500,    5000,    10000,    25000,    50000,
+  100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000, 30000000, 60000000};
+
+bool
+starts_with(boost::beast::string_view value, boost::beast::string_view prefix)
+{
+        return value.substr(0, prefix.size()) == prefix;
+}
+
+//! Whether a segment of a path is an identifier (e.g a room id, an alias, an event id).
+bool
+is_identifier(boost::beast::string_view segment)
+{
+        if (segment.empty())
+                return false;
+
+        switch (segment.front()) {
+        case '!':
+        case '@':
+        case '#':
+        case '$':
+        case '+':
+                return true;
+        default:
+                break;
+        }
+
+        // A server name, an escaped identifier, or a transaction id.
+        return segment.find(':') != boost::beast::string_view::npos ||
+               segment.find('%') != boost::beast::string_view::npos ||
+               std::all_of(segment.begin(), segment.end(), [](char c) {
+                       return c >= '0' && c <= '9';
+               });
+}
+
+void
+append_escaped(std::string &out, const std::string &label)
+{
+        for (const char c : label) {
+                if (c == '"' || c == '\\')
+                        out.push_back('\\');
+
+                if (c == '\n')
+                        out.append("\\n");
+                else
+                        out.push_back(c);
+        }
+}
+
+void
+append_seconds(std::string &out, uint64_t microseconds)
+{
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "%.9g", microseconds / 1e6);
+        out.append(buffer);
+}
+}
+
+const char *
+mtx::client::to_string(RequestTiming timing)
+{
+        static const char *const names[request_timing_count] = {"queued",
+                                                                "resolve",
+                                                                "connect",
+                                                                "handshake",
+                                                                "write",
+                                                                "read",
+                                                                "first_byte",
+                                                                "parse",
+                                                                "callback",
+                                                                "total"};
+
+        return names[static_cast<std::size_t>(timing)];
+}
+
+std::size_t
+Histogram::bucket_index(uint64_t value)
+{
+        if (value < sub_bucket_count)
+                return static_cast<std::size_t>(value);
+
+        unsigned int exponent = 63;
+        while ((value >> exponent) == 0)
+                --exponent;
+
+        if (exponent >= max_exponent)
+                return bucket_count - 1;
+
+        // The bits following the highest one select the bucket within the power of two.
+        const auto shift = exponent - sub_bucket_bits;
+        const auto sub   = static_cast<std::size_t>(value >> shift) - sub_bucket_count;
+
+        return sub_bucket_count * (exponent - sub_bucket_bits + 1) + sub;
+}
+
+uint64_t
+Histogram::bucket_upper_bound(std::size_t index)
+{
+        if (index < sub_bucket_count)
+                return index;
+
+        if (index >= bucket_count - 1)
+                return std::numeric_limits<uint64_t>::max();
+
+        const auto exponent = static_cast<unsigned int>(index / sub_bucket_count) +
+                              sub_bucket_bits - 1;
+        const auto sub      = index % sub_bucket_count;
+        const auto shift    = exponent - sub_bucket_bits;
+
+        return ((uint64_t(sub_bucket_count + sub) + 1) << shift) - 1;
+}
+
+void
+Histogram::record(uint64_t value, uint64_t count)
+{
+        buckets_[bucket_index(value)] += count;
+        count_ += count;
+        sum_ += value * count;
+        max_ = std::max(max_, value);
+}
+
+void
+Histogram::merge(const Histogram &other)
+{
+        for (std::size_t i = 0; i < bucket_count; ++i)
+                buckets_[i] += other.buckets_[i];
+
+        count_ += other.count_;
+        sum_ += other.sum_;
+        max_ = std::max(max_, other.max_);
+}
+
+uint64_t
+Histogram::percentile(double q) const
+{
+        if (count_ == 0)
+                return 0;
+
+        const auto rank = std::max<uint64_t>(
+          1, std::min<uint64_t>(count_, static_cast<uint64_t>(std::ceil(q * count_))));
+
+        uint64_t seen = 0;
+        for (std::size_t i = 0; i < bucket_count; ++i) {
+                seen += buckets_[i];
+                if (seen >= rank)
+                        return std::min(bucket_upper_bound(i), max_);
+        }
+
+        return max_;
+}
+
+void
+mtx::client::endpoint_label(boost::beast::string_view target, std::string &label)
+{
+        label.clear();
+
+        auto path = target.substr(0, target.find('?'));
+
+        // Without the API & its version (e.g "/_matrix/client/r0").
+        if (starts_with(path, "/_matrix/")) {
+                std::size_t pos = 0;
+                for (int i = 0; i < 3 && pos != boost::beast::string_view::npos; ++i)
+                        pos = path.find('/', pos + 1);
+
+                path = pos == boost::beast::string_view::npos ? boost::beast::string_view{}
+                                                               : path.substr(pos);
+        }
+
+        boost::beast::string_view previous;
+        int media_segments = 0;
+
+        while (!path.empty()) {
+                // Past the slash.
+                path.remove_prefix(1);
+
+                const auto end     = std::min(path.find('/'), path.size());
+                const auto segment = path.substr(0, end);
+                path.remove_prefix(end);
+
+                label.push_back('/');
+
+                if (media_segments > 0) {
+                        label.append(media_segments == 2 ? "{serverName}" : "{mediaId}");
+                        --media_segments;
+                } else if (previous == "rooms") {
+                        label.append("{roomId}");
+                } else if (previous == "join") {
+                        label.append("{roomIdOrAlias}");
+                } else if (previous == "profile" || previous == "user") {
+                        label.append("{userId}");
+                } else if (is_identifier(segment)) {
+                        label.append("{id}");
+                } else {
+                        label.append(segment.data(), segment.size());
+                }
+
+                if (segment == "download" || segment == "thumbnail")
+                        media_segments = 2;
+
+                previous = segment;
+        }
+
+        if (label.empty())
+                label = "/";
+}
+
+//! A histogram written by a single thread, and read by any.
+struct ClientMetrics::AtomicHistogram
+{
+        std::array<std::atomic<uint64_t>, Histogram::bucket_count> buckets{};
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> sum{0};
+        std::atomic<uint64_t> max{0};
+
+        //! Only called by the thread owning the histogram, so there is no need
+        //! for an atomic read-modify-write.
+        void record(uint64_t value)
+        {
+                auto &bucket = buckets[Histogram::bucket_index(value)];
+                bucket.store(bucket.load(std::memory_order_relaxed) + 1,
+                             std::memory_order_relaxed);
+
+                count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                sum.store(sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+                if (value > max.load(std::memory_order_relaxed))
+                        max.store(value, std::memory_order_relaxed);
+        }
+
+        void record(std::chrono::steady_clock::duration duration)
+        {
+                const auto us =
+                  std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+                record(static_cast<uint64_t>(std::max<decltype(us)>(us, 0)));
+        }
+
+        void add_to(Histogram &histogram) const
+        {
+                for (std::size_t i = 0; i < Histogram::bucket_count; ++i)
+                        histogram.buckets_[i] += buckets[i].load(std::memory_order_relaxed);
+
+                histogram.count_ += count.load(std::memory_order_relaxed);
+                histogram.sum_ += sum.load(std::memory_order_relaxed);
+                histogram.max_ = std::max(histogram.max_, max.load(std::memory_order_relaxed));
+        }
+};
+
+struct ClientMetrics::EndpointStats
+{
+        std::array<AtomicHistogram, request_timing_count> timings;
+        std::atomic<uint64_t> requests{0};
+        std::atomic<uint64_t> failures{0};
+        std::atomic<uint64_t> error_responses{0};
+        std::atomic<uint64_t> bytes_sent{0};
+        std::atomic<uint64_t> bytes_received{0};
+
+        AtomicHistogram &timing(RequestTiming t) { return timings[static_cast<std::size_t>(t)]; }
+
+        static void add(std::atomic<uint64_t> &counter, uint64_t value)
+        {
+                counter.store(counter.load(std::memory_order_relaxed) + value,
+                              std::memory_order_relaxed);
+        }
+};
+
+//! The measures of a thread. The stats of an endpoint are only allocated once the
+//! thread has recorded a request to it.
+struct ClientMetrics::Shard
+{
+        ~Shard()
+        {
+                for (auto &stats : endpoints)
+                        delete stats.load();
+        }
+
+        //! By endpoint index, the last one being "other".
+        std::array<std::atomic<EndpointStats *>, max_endpoints + 1> endpoints{};
+
+        //! The indexes of the labels seen by the thread, sorted by label.
+        std::vector<std::pair<std::string, std::size_t>> indexes;
+        //! Storage of the label of the request being recorded.
+        std::string label;
+};
+
+ClientMetrics::ClientMetrics() = default;
+
+ClientMetrics::~ClientMetrics() = default;
+
+ClientMetrics::Shard &
+ClientMetrics::local_shard()
+{
+        return shards_.local([](std::size_t) { return std::make_unique<Shard>(); });
+}
+
+std::size_t
+ClientMetrics::endpoint_index(const std::string &label)
+{
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        const auto it = std::find(endpoints_.begin(), endpoints_.end(), label);
+        if (it != endpoints_.end())
+                return it - endpoints_.begin();
+
+        if (endpoints_.size() == max_endpoints)
+                return max_endpoints;
+
+        endpoints_.push_back(label);
+        return endpoints_.size() - 1;
+}
+
+ClientMetrics::EndpointStats &
+ClientMetrics::local_stats(std::size_t endpoint)
+{
+        auto &slot  = local_shard().endpoints[endpoint];
+        auto *stats = slot.load(std::memory_order_relaxed);
+
+        if (!stats) {
+                stats = new EndpointStats();
+                slot.store(stats, std::memory_order_release);
+        }
+
+        return *stats;
+}
+
+std::size_t
+ClientMetrics::record(boost::beast::string_view target,
+                      const RequestTimings &timings,
+                      unsigned int status)
+{
+        auto &shard = local_shard();
+
+        endpoint_label(target, shard.label);
+
+        auto it = std::lower_bound(
+          shard.indexes.begin(),
+          shard.indexes.end(),
+          shard.label,
+          [](const std::pair<std::string, std::size_t> &entry, const std::string &label) {
+                  return entry.first < label;
+          });
+
+        if (it == shard.indexes.end() || it->first != shard.label)
+                it = shard.indexes.emplace(it, shard.label, endpoint_index(shard.label));
+
+        auto &stats = local_stats(it->second);
+
+        for (std::size_t i = 0; i < timings.phases.size(); ++i) {
+                if (timings.phases_entered & (1u << i))
+                        stats.timings[i].record(timings.phases[i]);
+        }
+
+        if (timings.has_first_byte)
+                stats.timing(RequestTiming::FirstByte).record(timings.first_byte);
+
+        stats.timing(RequestTiming::Total).record(timings.total);
+
+        EndpointStats::add(stats.requests, 1);
+        EndpointStats::add(stats.bytes_sent, timings.bytes_sent);
+        EndpointStats::add(stats.bytes_received, timings.bytes_received);
+
+        if (status == 0)
+                EndpointStats::add(stats.failures, 1);
+        else if (status < 200 || status >= 300)
+                EndpointStats::add(stats.error_responses, 1);
+
+        return it->second;
+}
+
+void
+ClientMetrics::record_callback(std::size_t endpoint,
+                               bool has_response,
+                               std::chrono::steady_clock::duration parse,
+                               std::chrono::steady_clock::duration callback)
+{
+        auto &stats = local_stats(endpoint);
+
+        if (has_response)
+                stats.timing(RequestTiming::Parse).record(parse);
+
+        stats.timing(RequestTiming::Callback).record(callback);
+}
+
+MetricsSnapshot
+ClientMetrics::snapshot() const
+{
+        MetricsSnapshot snapshot;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        shards_.for_each([&](const Shard &shard) {
+                for (std::size_t i = 0; i < shard.endpoints.size(); ++i) {
+                        const auto stats = shard.endpoints[i].load(std::memory_order_acquire);
+                        if (!stats)
+                                continue;
+
+                        auto &endpoint =
+                          snapshot.endpoints[i < endpoints_.size() ? endpoints_[i] : "other"];
+
+                        for (std::size_t t = 0; t < request_timing_count; ++t)
+                                stats->timings[t].add_to(endpoint.timings[t]);
+
+                        endpoint.requests += stats->requests.load(std::memory_order_relaxed);
+                        endpoint.failures += stats->failures.load(std::memory_order_relaxed);
+                        endpoint.error_responses +=
+                          stats->error_responses.load(std::memory_order_relaxed);
+                        endpoint.bytes_sent += stats->bytes_sent.load(std::memory_order_relaxed);
+                        endpoint.bytes_received +=
+                          stats->bytes_received.load(std::memory_order_relaxed);
+                }
+        });
+
+        return snapshot;
+}
+
+std::string
+mtx::client::to_prometheus(const MetricsSnapshot &snapshot, const std::string &prefix)
+{
+        std::string out;
+
+        const auto counter = [&](const char *name,
+                                 const char *help,
+                                 uint64_t EndpointMetrics::*value) {
+                out.append("# HELP ").append(prefix).append("_").append(name).append(" ");
+                out.append(help).append("\n");
+                out.append("# TYPE ").append(prefix).append("_").append(name).append(" counter\n");
+
+                for (const auto &endpoint : snapshot.endpoints) {
+                        out.append(prefix).append("_").append(name).append("{endpoint=\"");
+                        append_escaped(out, endpoint.first);
+                        out.append("\"} ").append(std::to_string(endpoint.second.*value));
+                        out.append("\n");
+                }
+        };
+
+        counter("requests_total", "Requests completed.", &EndpointMetrics::requests);
+        counter("request_failures_total",
+                "Requests that failed before a response was received.",
+                &EndpointMetrics::failures);
+        counter("error_responses_total",
+                "Responses that aren't successful.",
+                &EndpointMetrics::error_responses);
+        counter("sent_bytes_total", "Bytes sent, headers included.", &EndpointMetrics::bytes_sent);
+        counter("received_bytes_total",
+                "Bytes received, headers included.",
+                &EndpointMetrics::bytes_received);
+
+        const auto name = prefix + "_request_duration_seconds";
+        out.append("# HELP ").append(name).append(" Duration of the phases of the requests.\n");
+        out.append("# TYPE ").append(name).append(" histogram\n");
+
+        for (const auto &endpoint : snapshot.endpoints) {
+                for (std::size_t t = 0; t < request_timing_count; ++t) {
+                        const auto &histogram = endpoint.second.timings[t];
+                        if (histogram.count() == 0)
+                                continue;
+
+                        std::string labels = "endpoint=\"";
+                        append_escaped(labels, endpoint.first);
+                        labels.append("\",timing=\"")
+                          .append(to_string(static_cast<RequestTiming>(t)))
+                          .append("\"");
+
+                        std::size_t bucket  = 0;
+                        uint64_t cumulative = 0;
+
+                        for (const auto bound : prometheus_buckets) {
+                                while (bucket < Histogram::bucket_count &&
+                                       Histogram::bucket_upper_bound(bucket) <= bound)
+                                        cumulative += histogram.bucket(bucket++);
+
+                                out.append(name).append("_bucket{").append(labels);
+                                out.append(",le=\"");
+                                append_seconds(out, bound);
+                                out.append("\"} ").append(std::to_string(cumulative));
+                                out.append("\n");
+                        }
+
+                        out.append(name).append("_bucket{").append(labels);
+                        out.append(",le=\"+Inf\"} ").append(std::to_string(histogram.count()));
+                        out.append("\n");
+
+                        out.append(name).append("_sum{").append(labels).append("} ");
+                        append_seconds(out, histogram.sum());
+                        out.append("\n");
+
+                        out.append(name).append("_count{").append(labels).append("} ");
+                        out.append(std::to_string(histogram.count())).append("\n");
+                }
+        }
+
+        return out;
+}
+
+std::chrono::steady_clock::duration *&
+ParseTimer::current()
+{
+        thread_local std::chrono::steady_clock::duration *total = nullptr;
+        return total;
+}
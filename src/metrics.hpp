@@ -0,0 +1,251 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/beast/core/string.hpp>
+
+#include "per_thread.hpp"
+
+namespace mtx {
+namespace client {
+
+//! The durations measured for each request.
+enum class RequestTiming
+{
+        //! Waiting for a connection from the pool.
+        Queued,
+        //! Resolving the address of the server.
+        Resolve,
+        //! Establishing the TCP connection.
+        Connect,
+        //! Performing the TLS handshake.
+        Handshake,
+        //! Sending the request.
+        Write,
+        //! Receiving the response, from the moment the request has been sent.
+        Read,
+        //! From the moment the request has been sent until the first part of the response.
+        FirstByte,
+        //! Deserializing the response, including its body handler if it's streamed.
+        Parse,
+        //! Running the callback of the request, without the parsing.
+        Callback,
+        //! The whole request, from the moment it was made.
+        Total,
+};
+
+constexpr std::size_t request_timing_count = static_cast<std::size_t>(RequestTiming::Total) + 1;
+
+//! Lowercase name of a timing (e.g "first_byte").
+const char *
+to_string(RequestTiming timing);
+
+//! Distribution of durations in microseconds, in log-linear buckets like an HDR histogram:
+//! each power of two is split into 16 buckets, so a value is known within 1/16th of
+//! itself. The values above 2^36 µs (about 19 hours) are counted in the last bucket.
+class Histogram
+{
+public:
+        static constexpr unsigned int sub_bucket_bits = 4;
+        static constexpr std::size_t sub_bucket_count = std::size_t(1) << sub_bucket_bits;
+        static constexpr unsigned int max_exponent    = 36;
+        static constexpr std::size_t bucket_count =
+          sub_bucket_count * (max_exponent - sub_bucket_bits + 1);
+
+        //! Index of the bucket of a value.
+        static std::size_t bucket_index(uint64_t value);
+        //! Highest value counted in a bucket.
+        static uint64_t bucket_upper_bound(std::size_t index);
+
+        void record(uint64_t value, uint64_t count = 1);
+        //! Add the values of another histogram.
+        void merge(const Histogram &other);
+
+        uint64_t count() const { return count_; }
+        uint64_t sum() const { return sum_; }
+        uint64_t max() const { return max_; }
+        double mean() const { return count_ ? double(sum_) / count_ : 0; }
+        //! The value below which the fraction `q` (0 to 1) of the values are,
+        //! as the upper bound of its bucket.
+        uint64_t percentile(double q) const;
+        //! Number of values in a bucket.
+        uint64_t bucket(std::size_t index) const { return buckets_[index]; }
+
+private:
+        friend class ClientMetrics;
+
+        std::array<uint64_t, bucket_count> buckets_{};
+        uint64_t count_ = 0;
+        uint64_t sum_   = 0;
+        uint64_t max_   = 0;
+};
+
+//! What is measured during a request, before it's recorded by `ClientMetrics`.
+struct RequestTimings
+{
+        using Clock = std::chrono::steady_clock;
+
+        //! When the request was made.
+        Clock::time_point started_at;
+        //! When the current phase started.
+        Clock::time_point phase_started_at;
+        //! Time spent in each phase (`Queued` to `Read`).
+        std::array<Clock::duration, static_cast<std::size_t>(RequestTiming::Read) + 1> phases{};
+        //! The phases the request went through, one bit each.
+        unsigned int phases_entered = 0;
+        Clock::duration first_byte{0};
+        bool has_first_byte = false;
+        Clock::duration parse{0};
+        //! From the moment the request was made until its callback is called.
+        Clock::duration total{0};
+        uint64_t bytes_sent     = 0;
+        uint64_t bytes_received = 0;
+
+        void reset() { *this = RequestTimings{}; }
+};
+
+//! The measures of the requests to an endpoint.
+struct EndpointMetrics
+{
+        std::array<Histogram, request_timing_count> timings;
+        //! Number of requests completed.
+        uint64_t requests = 0;
+        //! Requests that failed before a response was received (e.g timeouts).
+        uint64_t failures = 0;
+        //! Responses that aren't successful (2xx).
+        uint64_t error_responses = 0;
+        uint64_t bytes_sent      = 0;
+        uint64_t bytes_received  = 0;
+
+        const Histogram &timing(RequestTiming t) const
+        {
+                return timings[static_cast<std::size_t>(t)];
+        }
+};
+
+//! The measures of the requests, aggregated over the threads.
+struct MetricsSnapshot
+{
+        //! By endpoint, with the identifiers replaced by placeholders
+        //! (e.g "/rooms/{roomId}/join").
+        std::map<std::string, EndpointMetrics> endpoints;
+};
+
+//! Write the metrics in the text format of Prometheus, as a histogram of the durations
+//! of the requests by endpoint & timing, and the counters of each endpoint. The
+//! buckets are coarser than the ones of the histograms, and a value is counted in
+//! the first bucket above the upper bound of its own.
+std::string
+to_prometheus(const MetricsSnapshot &snapshot, const std::string &prefix = "mtxclient");
+
+//! The endpoint of a request target, without its query & with its identifiers replaced
+//! by placeholders, as it's labelled in the metrics (e.g "/rooms/{roomId}/join").
+void
+endpoint_label(boost::beast::string_view target, std::string &label);
+
+//! Aggregates the measures of the requests of the clients sharing it (see
+//! `ClientServices`).
+//!
+//! Each thread records into its own shard (see `PerThread`), with plain loads & stores
+//! on atomic counters. The shards are only summed up when a snapshot is taken.
+class ClientMetrics
+{
+public:
+        //! At most this many endpoints are told apart. The requests to the others
+        //! are counted as "other".
+        static constexpr std::size_t max_endpoints = 64;
+
+        ClientMetrics();
+        ~ClientMetrics();
+
+        ClientMetrics(const ClientMetrics &) = delete;
+        ClientMetrics &operator=(const ClientMetrics &) = delete;
+
+        //! Record a finished request, from the thread it completed on, before its callback
+        //! is called. The status of a request that failed without a response is 0.
+        //! Returns the index of its endpoint, for `record_callback`.
+        std::size_t record(boost::beast::string_view target,
+                           const RequestTimings &timings,
+                           unsigned int status);
+        //! Record the time spent parsing the response of a request (if it has one) & the
+        //! rest of the time spent in its callback, from the same thread, once it returned.
+        void record_callback(std::size_t endpoint,
+                             bool has_response,
+                             std::chrono::steady_clock::duration parse,
+                             std::chrono::steady_clock::duration callback);
+
+        MetricsSnapshot snapshot() const;
+
+private:
+        struct AtomicHistogram;
+        struct EndpointStats;
+        struct Shard;
+
+        //! The shard of the calling thread.
+        Shard &local_shard();
+        //! The stats of an endpoint in the shard of the calling thread.
+        EndpointStats &local_stats(std::size_t endpoint);
+        //! The index of an endpoint, shared by the shards.
+        std::size_t endpoint_index(const std::string &label);
+
+        //! Used to synchronize access to the labels of the endpoints.
+        mutable std::mutex mutex_;
+        std::vector<std::string> endpoints_;
+        PerThread<Shard> shards_;
+};
+
+//! Measures the time spent parsing a response in its success callback. It's added to
+//! the parse time of the request completing on the thread, if its metrics are recorded.
+class ParseTimer
+{
+public:
+        ParseTimer()
+          : total_{current()}
+        {
+                if (total_)
+                        start_ = std::chrono::steady_clock::now();
+        }
+        ~ParseTimer()
+        {
+                if (total_)
+                        *total_ += std::chrono::steady_clock::now() - start_;
+        }
+
+        ParseTimer(const ParseTimer &) = delete;
+        ParseTimer &operator=(const ParseTimer &) = delete;
+
+        //! Attributes the parse times measured on the thread to `total` while it's alive.
+        class Scope
+        {
+        public:
+                explicit Scope(std::chrono::steady_clock::duration *total)
+                  : previous_{current()}
+                {
+                        current() = total;
+                }
+                ~Scope() { current() = previous_; }
+
+                Scope(const Scope &) = delete;
+                Scope &operator=(const Scope &) = delete;
+
+        private:
+                std::chrono::steady_clock::duration *previous_;
+        };
+
+private:
+        static std::chrono::steady_clock::duration *&current();
+
+        std::chrono::steady_clock::duration *total_;
+        std::chrono::steady_clock::time_point start_;
+};
+}
+}
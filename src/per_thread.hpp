@@ -0,0 +1,110 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace mtx {
+namespace client {
+
+//! An instance of `T` for each thread that uses it, e.g the shard of some counters.
+//!
+//! Each thread writes into its own instance, so the writes take no lock & don't contend
+//! with the other threads. The instances are only read together, under a lock.
+//!
+//! A thread finds its instance in a cache of its own, by the id of the owner, as their
+//! addresses can be reused. The entries of the owners that have been destroyed are
+//! dropped as the thread looks its instances up, so the cache doesn't grow with every
+//! owner the thread has ever used.
+template<class T>
+class PerThread
+{
+public:
+        PerThread()
+          : id_{next_id()++}
+          , alive_{std::make_shared<char>()}
+        {}
+
+        PerThread(const PerThread &) = delete;
+        PerThread &operator=(const PerThread &) = delete;
+
+        //! The instance of the calling thread. The first time, it's created by calling
+        //! `make` with the number of instances created before it, under the lock.
+        template<class Make>
+        T &local(Make make)
+        {
+                auto &entries = cache();
+
+                for (std::size_t i = 0; i < entries.size();) {
+                        if (entries[i].id == id_)
+                                return *entries[i].instance;
+
+                        if (entries[i].alive.expired()) {
+                                entries[i] = std::move(entries.back());
+                                entries.pop_back();
+                        } else {
+                                ++i;
+                        }
+                }
+
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                instances_.push_back(make(instances_.size()));
+                entries.push_back(Entry{id_, instances_.back().get(), alive_});
+
+                return *instances_.back();
+        }
+
+        //! Call `f` with each instance, under the lock.
+        template<class F>
+        void for_each(F f)
+        {
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                for (const auto &instance : instances_)
+                        f(*instance);
+        }
+
+        template<class F>
+        void for_each(F f) const
+        {
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                for (const auto &instance : instances_)
+                        f(static_cast<const T &>(*instance));
+        }
+
+private:
+        struct Entry
+        {
+                uint64_t id;
+                T *instance;
+                //! Expires when the owner is destroyed.
+                std::weak_ptr<const void> alive;
+        };
+
+        static std::atomic<uint64_t> &next_id()
+        {
+                static std::atomic<uint64_t> id{1};
+                return id;
+        }
+
+        static std::vector<Entry> &cache()
+        {
+                thread_local std::vector<Entry> entries;
+                return entries;
+        }
+
+        const uint64_t id_;
+        const std::shared_ptr<const void> alive_;
+
+        mutable std::mutex mutex_;
+        std::vector<std::unique_ptr<T>> instances_;
+};
+}
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace mtx {
+namespace client {
+
+//! Monotonic storage for the short lived allocations of a request (e.g the header
+//! fields). Freeing is a no-op, the whole arena is reset at once when the request
+//! is over. The blocks are kept across resets, so once an arena has grown to the
+//! size of the requests it serves, it stops allocating.
+class RequestArena
+{
+public:
+        RequestArena() = default;
+        RequestArena(const RequestArena &) = delete;
+        RequestArena &operator=(const RequestArena &) = delete;
+
+        void *allocate(std::size_t size, std::size_t alignment)
+        {
+                for (;;) {
+                        if (current_ < blocks_.size()) {
+                                auto &block = blocks_[current_];
+
+                                const std::size_t offset =
+                                  (used_ + alignment - 1) & ~(alignment - 1);
+                                if (offset + size <= block.size) {
+                                        used_ = offset + size;
+                                        return block.data.get() + offset;
+                                }
+
+                                current_ += 1;
+                                used_ = 0;
+                                continue;
+                        }
+
+                        // Grow geometrically, so that a large header costs a few blocks.
+                        const std::size_t first_size = initial_block_size;
+                        std::size_t block_size =
+                          blocks_.empty() ? first_size : 2 * blocks_.back().size;
+                        while (block_size < size + alignment)
+                                block_size *= 2;
+
+                        blocks_.push_back(Block{std::unique_ptr<char[]>(new char[block_size]),
+                                                block_size});
+                }
+        }
+
+        //! Make the whole storage available again. Everything allocated from the
+        //! arena must have been destroyed.
+        void reset()
+        {
+                current_ = 0;
+                used_    = 0;
+        }
+
+        //! Total size of the blocks owned by the arena.
+        std::size_t capacity() const
+        {
+                std::size_t total = 0;
+                for (const auto &block : blocks_)
+                        total += block.size;
+                return total;
+        }
+
+        static constexpr std::size_t initial_block_size = 2048;
+
+private:
+        struct Block
+        {
+                std::unique_ptr<char[]> data;
+                std::size_t size;
+        };
+
+        std::vector<Block> blocks_;
+        //! The block allocations are served from.
+        std::size_t current_ = 0;
+        //! Bytes used in the current block.
+        std::size_t used_ = 0;
+};
+
+//! Allocator drawing from a `RequestArena`. The memory is only given back by `reset`.
+template<class T>
+class ArenaAllocator
+{
+public:
+        using value_type = T;
+
+        using propagate_on_container_copy_assignment = std::true_type;
+        using propagate_on_container_move_assignment = std::true_type;
+        using propagate_on_container_swap            = std::true_type;
+
+        explicit ArenaAllocator(RequestArena &arena) noexcept
+          : arena_{&arena}
+        {}
+
+        template<class U>
+        ArenaAllocator(const ArenaAllocator<U> &other) noexcept
+          : arena_{other.arena_}
+        {}
+
+        T *allocate(std::size_t n)
+        {
+                return static_cast<T *>(arena_->allocate(n * sizeof(T), alignof(T)));
+        }
+        void deallocate(T *, std::size_t) noexcept {}
+
+        template<class U>
+        bool operator==(const ArenaAllocator<U> &other) const noexcept
+        {
+                return arena_ == other.arena_;
+        }
+        template<class U>
+        bool operator!=(const ArenaAllocator<U> &other) const noexcept
+        {
+                return arena_ != other.arena_;
+        }
+
+private:
+        template<class U>
+        friend class ArenaAllocator;
+
+        RequestArena *arena_;
+};
+}
+}
@@ -0,0 +1,278 @@
+#include "request_body.hpp"
+
+#include <cstring>
+
+using namespace mtx::client;
+
+namespace {
+
+//! Whether the character has to be escaped in a JSON string.
+bool
+needs_escape(char c)
+{
+        return static_cast<unsigned char>(c) < 0x20 || c == '"' || c == '\\';
+}
+}
+
+JsonBody::JsonBody(nlohmann::json document)
+  : BodySource("application/json")
+  // Not braces, which would make an array out of the document.
+  , document_(std::move(document))
+{
+        boost::system::error_code ec;
+        rewind(ec);
+
+        // Counting pass, through a small buffer.
+        char buffer[1024];
+        while (const auto n = read(buffer, sizeof(buffer), ec))
+                size_ += n;
+
+        rewind(ec);
+}
+
+std::size_t
+JsonBody::read(char *buffer, std::size_t capacity, boost::system::error_code &)
+{
+        out_       = buffer;
+        out_size_  = 0;
+        out_space_ = capacity;
+
+        while (out_space_ > 0) {
+                if (pending_pos_ < pending_.size()) {
+                        const auto n = std::min(pending_.size() - pending_pos_, out_space_);
+                        std::memcpy(out_ + out_size_, pending_.data() + pending_pos_, n);
+
+                        out_size_ += n;
+                        out_space_ -= n;
+                        pending_pos_ += n;
+                        continue;
+                }
+
+                pending_.clear();
+                pending_pos_ = 0;
+
+                if (string_)
+                        write_string();
+                else if (!is_done_)
+                        step();
+                else
+                        break;
+        }
+
+        return out_size_;
+}
+
+void
+JsonBody::rewind(boost::system::error_code &)
+{
+        pending_.clear();
+        pending_pos_ = 0;
+        string_      = nullptr;
+        next_value_  = &document_;
+        is_done_     = false;
+        stack_.clear();
+}
+
+void
+JsonBody::put(const char *data, std::size_t size)
+{
+        // Once something has been kept back, the rest has to follow it.
+        if (!pending_.empty()) {
+                pending_.append(data, size);
+                return;
+        }
+
+        const auto n = std::min(size, out_space_);
+        std::memcpy(out_ + out_size_, data, n);
+
+        out_size_ += n;
+        out_space_ -= n;
+
+        if (n < size)
+                pending_.append(data + n, size - n);
+}
+
+void
+JsonBody::step()
+{
+        if (next_value_) {
+                const auto &value = *next_value_;
+                next_value_       = nullptr;
+
+                switch (value.type()) {
+                case nlohmann::json::value_t::object:
+                        put('{');
+                        stack_.push_back(Frame{&value, value.cbegin(), true});
+                        break;
+                case nlohmann::json::value_t::array:
+                        put('[');
+                        stack_.push_back(Frame{&value, value.cbegin(), true});
+                        break;
+                case nlohmann::json::value_t::string:
+                        start_string(value.get_ref<const std::string &>(), "\"");
+                        break;
+                default: {
+                        // Numbers, booleans & null are short.
+                        const auto scalar = value.dump();
+                        put(scalar.data(), scalar.size());
+                        break;
+                }
+                }
+
+                return;
+        }
+
+        if (stack_.empty()) {
+                is_done_ = true;
+                return;
+        }
+
+        auto &frame          = stack_.back();
+        const bool is_object = frame.value->is_object();
+
+        if (frame.next == frame.value->cend()) {
+                put(is_object ? '}' : ']');
+                stack_.pop_back();
+                return;
+        }
+
+        if (!frame.is_first)
+                put(',');
+        frame.is_first = false;
+
+        const auto it = frame.next++;
+
+        if (is_object) {
+                next_value_ = &it.value();
+                start_string(it.key(), "\":");
+        } else {
+                next_value_ = &*it;
+        }
+}
+
+void
+JsonBody::start_string(const std::string &value, const char *closing)
+{
+        put('"');
+
+        string_         = &value;
+        string_pos_     = 0;
+        string_closing_ = closing;
+}
+
+void
+JsonBody::write_string()
+{
+        const auto &value = *string_;
+
+        while (string_pos_ < value.size() && out_space_ > 0 && pending_.empty()) {
+                // Copy the characters that don't need escaping as a whole.
+                auto end = string_pos_;
+                while (end < value.size() && end - string_pos_ < out_space_ &&
+                       !needs_escape(value[end]))
+                        ++end;
+
+                if (end > string_pos_) {
+                        put(value.data() + string_pos_, end - string_pos_);
+                        string_pos_ = end;
+                        continue;
+                }
+
+                const char c = value[string_pos_++];
+
+                switch (c) {
+                case '"':
+                        put("\\\"", 2);
+                        break;
+                case '\\':
+                        put("\\\\", 2);
+                        break;
+                case '\b':
+                        put("\\b", 2);
+                        break;
+                case '\f':
+                        put("\\f", 2);
+                        break;
+                case '\n':
+                        put("\\n", 2);
+                        break;
+                case '\r':
+                        put("\\r", 2);
+                        break;
+                case '\t':
+                        put("\\t", 2);
+                        break;
+                default: {
+                        // The other control characters, like nlohmann::json does.
+                        static const char digits[] = "0123456789abcdef";
+                        const char escaped[]       = {
+                          '\\', 'u', '0', '0', digits[(c >> 4) & 0xf], digits[c & 0xf]};
+                        put(escaped, sizeof(escaped));
+                        break;
+                }
+                }
+        }
+
+        if (string_pos_ == value.size()) {
+                put(string_closing_, std::strlen(string_closing_));
+                string_ = nullptr;
+        }
+}
+
+std::unique_ptr<FileBody>
+FileBody::open(const std::string &path,
+               const std::string &content_type,
+               boost::system::error_code &ec)
+{
+        boost::beast::file file;
+
+        file.open(path.c_str(), boost::beast::file_mode::scan, ec);
+        if (ec)
+                return nullptr;
+
+        const auto size = file.size(ec);
+        if (ec)
+                return nullptr;
+
+        return std::unique_ptr<FileBody>(new FileBody(std::move(file), size, content_type));
+}
+
+std::unique_ptr<FileBody>
+FileBody::adopt(boost::beast::file::native_handle_type fd,
+                const std::string &content_type,
+                boost::system::error_code &ec)
+{
+        boost::beast::file file;
+        file.native_handle(fd);
+
+        // The data is sent from the current position of the descriptor.
+        const auto size   = file.size(ec);
+        const auto offset = ec ? 0 : file.pos(ec);
+        if (ec)
+                return nullptr;
+
+        return std::unique_ptr<FileBody>(
+          new FileBody(std::move(file), size - offset, content_type, offset));
+}
+
+FileBody::FileBody(boost::beast::file file,
+                   uint64_t size,
+                   const std::string &content_type,
+                   uint64_t start)
+  : BodySource(content_type)
+  , file_{std::move(file)}
+  , size_{size}
+  , start_{start}
+{}
+
+std::size_t
+FileBody::read(char *buffer, std::size_t capacity, boost::system::error_code &ec)
+{
+        return file_.read(buffer, capacity, ec);
+}
+
+void
+FileBody::rewind(boost::system::error_code &ec)
+{
+        file_.seek(start_, ec);
+}
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <boost/beast/core/file.hpp>
+#include <boost/container/small_vector.hpp>
+#include <boost/system/error_code.hpp>
+#include <json.hpp>
+
+namespace mtx {
+namespace client {
+
+//! Receives the number of bytes transferred so far & the total size (0 if unknown).
+using ProgressCallback = std::function<void(uint64_t transferred, uint64_t total)>;
+
+//! Produces the body of a request while it's being written, one chunk at a time,
+//! so the body never has to be stored in full. Its size has to be known upfront,
+//! to be sent as the Content-Length.
+class BodySource
+{
+public:
+        explicit BodySource(std::string content_type)
+          : content_type_{std::move(content_type)}
+        {}
+        virtual ~BodySource() = default;
+
+        BodySource(const BodySource &) = delete;
+        BodySource &operator=(const BodySource &) = delete;
+
+        //! Size of the whole body.
+        virtual uint64_t size() const = 0;
+        //! Copy the next part of the body into the buffer, up to `capacity` bytes.
+        //! Returns the number of bytes copied, zero once the body is over.
+        virtual std::size_t read(char *buffer,
+                                 std::size_t capacity,
+                                 boost::system::error_code &ec) = 0;
+        //! Go back to the start of the body, so it can be sent again on another connection.
+        virtual void rewind(boost::system::error_code &ec) = 0;
+
+        //! The value of the Content-Type field.
+        const std::string &content_type() const { return content_type_; }
+
+private:
+        std::string content_type_;
+};
+
+//! A JSON document, serialized while it's being sent instead of being dumped into a
+//! string first. The output is the same as `nlohmann::json::dump()`. The document is
+//! serialized twice: once to count its size, and once to send it.
+class JsonBody : public BodySource
+{
+public:
+        explicit JsonBody(nlohmann::json document);
+
+        uint64_t size() const override { return size_; }
+        std::size_t read(char *buffer,
+                         std::size_t capacity,
+                         boost::system::error_code &ec) override;
+        void rewind(boost::system::error_code &ec) override;
+
+private:
+        //! An object or an array being serialized.
+        struct Frame
+        {
+                const nlohmann::json *value;
+                nlohmann::json::const_iterator next;
+                bool is_first;
+        };
+
+        //! Write to the output, keeping what doesn't fit for the next read.
+        void put(const char *data, std::size_t size);
+        void put(char c) { put(&c, 1); }
+        //! Produce the next token of the document.
+        void step();
+        //! Write as much of the current string as fits, escaped.
+        void write_string();
+        void start_string(const std::string &value, const char *closing);
+
+        nlohmann::json document_;
+        uint64_t size_ = 0;
+
+        //! Where the current read writes to.
+        char *out_             = nullptr;
+        std::size_t out_size_  = 0;
+        std::size_t out_space_ = 0;
+
+        //! The start of a token that didn't fit in the previous read.
+        std::string pending_;
+        std::size_t pending_pos_ = 0;
+
+        //! The string being written (a key or a value), from `string_pos_`.
+        const std::string *string_ = nullptr;
+        std::size_t string_pos_    = 0;
+        //! What follows the string (the closing quote, and a colon after a key).
+        const char *string_closing_ = nullptr;
+
+        //! The value to write next, if any.
+        const nlohmann::json *next_value_ = nullptr;
+        boost::container::small_vector<Frame, 8> stack_;
+        bool is_done_ = false;
+};
+
+//! Reports the progress of another source as it's read, which is just before the
+//! chunks are written.
+class ProgressBody : public BodySource
+{
+public:
+        ProgressBody(std::shared_ptr<BodySource> source, ProgressCallback on_progress)
+          : BodySource(source->content_type())
+          , source_{std::move(source)}
+          , on_progress_{std::move(on_progress)}
+        {}
+
+        uint64_t size() const override { return source_->size(); }
+        std::size_t read(char *buffer,
+                         std::size_t capacity,
+                         boost::system::error_code &ec) override
+        {
+                const auto n = source_->read(buffer, capacity, ec);
+
+                transferred_ += n;
+                if (n > 0)
+                        on_progress_(transferred_, size());
+
+                return n;
+        }
+        void rewind(boost::system::error_code &ec) override
+        {
+                transferred_ = 0;
+                source_->rewind(ec);
+        }
+
+private:
+        std::shared_ptr<BodySource> source_;
+        ProgressCallback on_progress_;
+        uint64_t transferred_ = 0;
+};
+
+//! The content of a file, read while it's being sent.
+class FileBody : public BodySource
+{
+public:
+        //! Returns nullptr if the file can't be opened.
+        static std::unique_ptr<FileBody> open(const std::string &path,
+                                              const std::string &content_type,
+                                              boost::system::error_code &ec);
+        //! Take ownership of an open file descriptor (or handle) of a regular file.
+        //! Returns nullptr if its size can't be found.
+        static std::unique_ptr<FileBody> adopt(boost::beast::file::native_handle_type fd,
+                                               const std::string &content_type,
+                                               boost::system::error_code &ec);
+
+        uint64_t size() const override { return size_; }
+        std::size_t read(char *buffer,
+                         std::size_t capacity,
+                         boost::system::error_code &ec) override;
+        void rewind(boost::system::error_code &ec) override;
+
+private:
+        FileBody(boost::beast::file file,
+                 uint64_t size,
+                 const std::string &content_type,
+                 uint64_t start = 0);
+
+        boost::beast::file file_;
+        uint64_t size_;
+        //! Where the body starts in the file.
+        uint64_t start_;
+};
+}
+}
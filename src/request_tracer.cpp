@@ -0,0 +1,258 @@
+#include "request_tracer.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <set>
+
+using namespace mtx::client;
+
+namespace {
+
+std::size_t
+round_up_to_power_of_two(std::size_t value)
+{
+        std::size_t result = 2;
+        while (result < value)
+                result <<= 1;
+
+        return result;
+}
+
+//! Append a time point or a duration, in microseconds.
+void
+append_microseconds(std::string &out, std::chrono::steady_clock::duration value)
+{
+        char buf[32];
+        std::snprintf(buf,
+                      sizeof(buf),
+                      "%.3f",
+                      std::chrono::duration<double, std::micro>(value).count());
+        out.append(buf);
+}
+
+void
+append_common(std::string &out,
+              const char *name,
+              const char *category,
+              const char *type,
+              uint32_t thread,
+              std::chrono::steady_clock::duration timestamp)
+{
+        out.append("{\"name\":\"").append(name);
+        out.append("\",\"cat\":\"").append(category);
+        out.append("\",\"ph\":\"").append(type);
+        out.append("\",\"pid\":1,\"tid\":").append(std::to_string(thread));
+        out.append(",\"ts\":");
+        append_microseconds(out, timestamp);
+}
+}
+
+//! The spans of a thread. Only the thread writes to it, so a slot is only overwritten once
+//! `head` has gone around. The fields are atomic to be read while they're written.
+struct RequestTracer::Ring
+{
+        struct Slot
+        {
+                std::atomic<TraceEvent::Kind> kind{TraceEvent::Kind::Handler};
+                std::atomic<const char *> name{nullptr};
+                std::atomic<const char *> phase{nullptr};
+                std::atomic<uint64_t> request{0};
+                std::atomic<std::chrono::steady_clock::rep> start{0};
+                std::atomic<std::chrono::steady_clock::rep> duration{0};
+        };
+
+        Ring(std::size_t capacity, uint32_t thread)
+          : slots(capacity)
+          , thread{thread}
+        {}
+
+        std::vector<Slot> slots;
+        //! Number of spans written so far.
+        std::atomic<uint64_t> head{0};
+        const uint32_t thread;
+};
+
+std::string
+mtx::client::to_chrome_trace(const std::vector<TraceEvent> &events)
+{
+        std::string out;
+        out.reserve(events.size() * 160 + 64);
+        out.append("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+        // The timestamps are relative to the first span.
+        const auto epoch = events.empty() ? std::chrono::steady_clock::time_point{}
+                                          : events.front().start;
+
+        std::set<uint32_t> threads;
+        bool first = true;
+
+        const auto separate = [&out, &first]() {
+                if (!first)
+                        out.append(",\n");
+                first = false;
+        };
+
+        for (const auto &event : events) {
+                threads.insert(event.thread);
+
+                const auto start   = event.start - epoch;
+                const auto request = std::to_string(event.request);
+
+                separate();
+
+                if (event.kind == TraceEvent::Kind::Handler) {
+                        append_common(out, event.name, "handler", "X", event.thread, start);
+                        out.append(",\"dur\":");
+                        append_microseconds(out, event.duration);
+                        out.append(",\"args\":{\"request\":").append(request);
+                        if (event.phase)
+                                out.append(",\"phase\":\"").append(event.phase).append("\"");
+                        out.append("}}");
+                        continue;
+                }
+
+                // The begin & the end of an async slice, matched by their id.
+                append_common(out, event.name, "request", "b", event.thread, start);
+                out.append(",\"id\":").append(request);
+                out.append(",\"args\":{\"request\":").append(request).append("}}");
+
+                separate();
+                append_common(
+                  out, event.name, "request", "e", event.thread, start + event.duration);
+                out.append(",\"id\":").append(request).append("}");
+        }
+
+        for (const auto thread : threads) {
+                separate();
+                out.append("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":");
+                out.append(std::to_string(thread));
+                out.append(",\"args\":{\"name\":\"network thread ");
+                out.append(std::to_string(thread)).append("\"}}");
+        }
+
+        out.append("]}\n");
+        return out;
+}
+
+RequestTracer::RequestTracer(std::size_t capacity)
+  : capacity_{round_up_to_power_of_two(capacity)}
+{}
+
+RequestTracer::~RequestTracer() = default;
+
+void
+RequestTracer::handler(const char *name,
+                       uint64_t request,
+                       const char *phase,
+                       std::chrono::steady_clock::time_point start,
+                       std::chrono::steady_clock::time_point end)
+{
+        write(TraceEvent::Kind::Handler, name, phase, request, start, end);
+}
+
+void
+RequestTracer::phase(const char *name,
+                     uint64_t request,
+                     std::chrono::steady_clock::time_point start,
+                     std::chrono::steady_clock::time_point end)
+{
+        write(TraceEvent::Kind::Phase, name, nullptr, request, start, end);
+}
+
+void
+RequestTracer::write(TraceEvent::Kind kind,
+                     const char *name,
+                     const char *phase,
+                     uint64_t request,
+                     std::chrono::steady_clock::time_point start,
+                     std::chrono::steady_clock::time_point end)
+{
+        auto &ring      = local_ring();
+        const auto head = ring.head.load(std::memory_order_relaxed);
+        auto &slot      = ring.slots[head & (capacity_ - 1)];
+
+        // A reader that sees any of the stores below also sees the previous heads, which
+        // tells it that the slot is being overwritten.
+        std::atomic_thread_fence(std::memory_order_release);
+
+        slot.kind.store(kind, std::memory_order_relaxed);
+        slot.name.store(name, std::memory_order_relaxed);
+        slot.phase.store(phase, std::memory_order_relaxed);
+        slot.request.store(request, std::memory_order_relaxed);
+        slot.start.store(start.time_since_epoch().count(), std::memory_order_relaxed);
+        slot.duration.store((end - start).count(), std::memory_order_relaxed);
+
+        ring.head.store(head + 1, std::memory_order_release);
+}
+
+RequestTracer::Ring &
+RequestTracer::local_ring()
+{
+        // The threads are numbered from 1, in the order they started tracing.
+        return rings_.local([this](std::size_t index) {
+                return std::make_unique<Ring>(capacity_, static_cast<uint32_t>(index + 1));
+        });
+}
+
+std::vector<TraceEvent>
+RequestTracer::events() const
+{
+        using Clock = std::chrono::steady_clock;
+
+        std::vector<TraceEvent> events;
+
+        rings_.for_each([&](const Ring &ring) {
+                const auto head  = ring.head.load(std::memory_order_acquire);
+                const auto first = head > capacity_ - 1 ? head - (capacity_ - 1) : 0;
+                const auto start = events.size();
+
+                for (auto i = first; i < head; ++i) {
+                        const auto &slot = ring.slots[i & (capacity_ - 1)];
+
+                        TraceEvent event;
+                        event.kind     = slot.kind.load(std::memory_order_relaxed);
+                        event.name     = slot.name.load(std::memory_order_relaxed);
+                        event.phase    = slot.phase.load(std::memory_order_relaxed);
+                        event.request  = slot.request.load(std::memory_order_relaxed);
+                        event.thread   = ring.thread;
+                        event.start    = Clock::time_point(
+                          Clock::duration(slot.start.load(std::memory_order_relaxed)));
+                        event.duration =
+                          Clock::duration(slot.duration.load(std::memory_order_relaxed));
+
+                        events.push_back(event);
+                }
+
+                // Drop the slots that were overwritten while they were copied. The one
+                // after the last head may be in the middle of it.
+                std::atomic_thread_fence(std::memory_order_acquire);
+                const auto last_head = ring.head.load(std::memory_order_relaxed);
+
+                if (last_head > first + (capacity_ - 1)) {
+                        const auto overwritten =
+                          std::min<uint64_t>(last_head - (capacity_ - 1) - first, head - first);
+                        events.erase(events.begin() + start,
+                                     events.begin() + start + overwritten);
+                }
+        });
+
+        std::stable_sort(events.begin(), events.end(), [](const auto &a, const auto &b) {
+                return a.start < b.start;
+        });
+
+        return events;
+}
+
+uint64_t
+RequestTracer::dropped() const
+{
+        uint64_t dropped = 0;
+
+        rings_.for_each([&](const Ring &ring) {
+                const auto head = ring.head.load(std::memory_order_relaxed);
+                if (head > capacity_)
+                        dropped += head - capacity_;
+        });
+
+        return dropped;
+}
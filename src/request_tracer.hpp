@@ -0,0 +1,132 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "per_thread.hpp"
+
+namespace mtx {
+namespace client {
+
+//! A span of a request, as it was traced.
+struct TraceEvent
+{
+        enum class Kind : uint8_t
+        {
+                //! A handler of the request (or its callback) ran on a thread.
+                Handler,
+                //! The request went through one of its phases (e.g "connect").
+                Phase,
+        };
+
+        Kind kind = Kind::Handler;
+        //! The handler (e.g "on_read_some", "callback") or the phase.
+        const char *name = nullptr;
+        //! The phase the request was in when the handler ran.
+        const char *phase = nullptr;
+        //! The id of the request.
+        uint64_t request = 0;
+        //! The thread that recorded the span, numbered from 1 in the order they started tracing.
+        uint32_t thread = 0;
+        std::chrono::steady_clock::time_point start;
+        std::chrono::steady_clock::duration duration{0};
+};
+
+//! Write the events in the JSON format of the Chrome trace viewer, which Perfetto opens
+//! as well. The handlers are slices on the track of their thread & the phases are
+//! async slices on the track of their request, both labelled with the request id.
+std::string
+to_chrome_trace(const std::vector<TraceEvent> &events);
+
+//! Keeps the latest spans of the requests of the clients tracing into it (see
+//! `Client::set_tracer`).
+//!
+//! Each thread writes into its own ring buffer (see `PerThread`), with relaxed stores
+//! only. The oldest spans of a thread are overwritten once its buffer is full. The
+//! buffers can be read at any time.
+class RequestTracer
+{
+public:
+        //! Default number of spans kept by each thread.
+        static constexpr std::size_t default_capacity = 8192;
+
+        //! Keep up to `capacity` spans for each thread, rounded up to a power of two.
+        explicit RequestTracer(std::size_t capacity = default_capacity);
+        ~RequestTracer();
+
+        RequestTracer(const RequestTracer &) = delete;
+        RequestTracer &operator=(const RequestTracer &) = delete;
+
+        //! Record the run of a handler of a request on the calling thread. The names
+        //! must be string literals, as they are only referenced.
+        void handler(const char *name,
+                     uint64_t request,
+                     const char *phase,
+                     std::chrono::steady_clock::time_point start,
+                     std::chrono::steady_clock::time_point end);
+        //! Record a phase of a request, from the thread it ended on.
+        void phase(const char *name,
+                   uint64_t request,
+                   std::chrono::steady_clock::time_point start,
+                   std::chrono::steady_clock::time_point end);
+
+        //! The spans in the buffers, ordered by their start. The span being written
+        //! by a thread is left out, as is the oldest one of a full buffer.
+        std::vector<TraceEvent> events() const;
+        //! Number of spans that have been overwritten.
+        uint64_t dropped() const;
+
+private:
+        struct Ring;
+
+        void write(TraceEvent::Kind kind,
+                   const char *name,
+                   const char *phase,
+                   uint64_t request,
+                   std::chrono::steady_clock::time_point start,
+                   std::chrono::steady_clock::time_point end);
+        //! The ring buffer of the calling thread.
+        Ring &local_ring();
+
+        const std::size_t capacity_;
+
+        PerThread<Ring> rings_;
+};
+
+//! Traces the run of a handler while it's alive, if there is a tracer.
+class TraceSpan
+{
+public:
+        TraceSpan(RequestTracer *tracer, const char *name, uint64_t request, const char *phase)
+          : tracer_{tracer}
+          , name_{name}
+          , phase_{phase}
+          , request_{request}
+        {
+                if (tracer_)
+                        start_ = std::chrono::steady_clock::now();
+        }
+        ~TraceSpan()
+        {
+                if (tracer_)
+                        tracer_->handler(
+                          name_, request_, phase_, start_, std::chrono::steady_clock::now());
+        }
+
+        TraceSpan(const TraceSpan &) = delete;
+        TraceSpan &operator=(const TraceSpan &) = delete;
+
+private:
+        RequestTracer *tracer_;
+        const char *name_;
+        const char *phase_;
+        uint64_t request_;
+        std::chrono::steady_clock::time_point start_;
+};
+}
+}
@@ -3,55 +3,282 @@
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
 #include <boost/beast.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <experimental/optional>
 #include <memory>
-#include <mutex>
+#include <string>
+#include <tuple>
+
+#include "callback_executor.hpp"
+#include "connection_pool.hpp"
+#include "content_encoding.hpp"
+#include "handler_memory.hpp"
+#include "metrics.hpp"
+#include "request_arena.hpp"
+#include "request_body.hpp"
+#include "request_tracer.hpp"
+#include "stall_detector.hpp"
+#include "traffic_recorder.hpp"
 
 namespace mtx {
 namespace client {
 
-//! Type of the unique request id.
-using RequestID = std::string;
+//! Type of the unique request id. The ids are handed out by each client
+//! from a counter, so they are cheap to create, copy & compare.
+using RequestID = uint64_t;
+
+//! Human readable form of a request id, for logging & debugging.
+inline std::string
+request_id_string(RequestID id)
+{
+        return "request-" + std::to_string(id);
+}
+
+//! Largest part of the announced size of a response body reserved upfront.
+constexpr std::size_t max_reserved_body_size = 64 * 1024;
+
+//! Like `string_body`, except that the storage of the whole body isn't reserved as soon
+//! as its size is announced: a body that is streamed (e.g a download) only ever holds
+//! the last read.
+struct ResponseBody
+{
+        using value_type = std::string;
+
+        static uint64_t size(const value_type &body) { return body.size(); }
+
+        class reader
+        {
+        public:
+#if BOOST_VERSION >= 106700
+                template<bool isRequest, class Fields>
+                reader(boost::beast::http::header<isRequest, Fields> &, value_type &body)
+                  : body_{body}
+                {}
+#else
+                template<bool isRequest, class Fields>
+                explicit reader(boost::beast::http::message<isRequest, ResponseBody, Fields> &m)
+                  : body_{m.body()}
+                {}
+#endif
+
+                void init(const boost::optional<uint64_t> &length, boost::system::error_code &ec)
+                {
+                        if (length)
+                                body_.reserve(static_cast<std::size_t>(
+                                  std::min<uint64_t>(*length, max_reserved_body_size)));
+
+                        ec = {};
+                }
+
+                template<class ConstBufferSequence>
+                std::size_t put(const ConstBufferSequence &buffers, boost::system::error_code &ec)
+                {
+                        const auto size  = body_.size();
+                        const auto extra = boost::asio::buffer_size(buffers);
+
+                        body_.resize(size + extra);
+                        boost::asio::buffer_copy(boost::asio::buffer(&body_[size], extra),
+                                                 buffers);
+
+                        ec = {};
+                        return extra;
+                }
+
+                void finish(boost::system::error_code &ec) { ec = {}; }
+
+        private:
+                value_type &body_;
+        };
+};
+
+//! Header fields stored in the arena of the session.
+using ArenaFields = boost::beast::http::basic_fields<ArenaAllocator<char>>;
+//! The request sent by a session.
+using HttpRequest = boost::beast::http::request<boost::beast::http::string_body, ArenaFields>;
+//! The response received by a session.
+using HttpResponse   = boost::beast::http::response<ResponseBody, ArenaFields>;
+using ResponseParser = boost::beast::http::response_parser<ResponseBody, ArenaAllocator<char>>;
+
+//! Largest response body accepted, once decoded.
+constexpr uint64_t max_body_size = 1 * 1024 * 1024 * 1024; // 1 GiB
+
+//! Largest chunk of a streamed request body written at once.
+constexpr std::size_t max_body_chunk_size = 64 * 1024;
 
-//! Type of the callback function on success.
-using SuccessCallback =
-  std::function<void(RequestID request_id,
-                     const boost::beast::http::response<boost::beast::http::string_body> &response,
-                     const boost::system::error_code &err)>;
+//! Type of the callback function on success. The response is moved out of the
+//! session, so the body can be handed to the parser without being copied. Its
+//! header fields are stored in the session, and they must not be used once the
+//! callback has returned.
+using SuccessCallback = std::function<
+  void(RequestID request_id, HttpResponse response, const boost::system::error_code &err)>;
 
 //! Type of the callback function on failure.
 using FailureCallback =
   std::function<void(RequestID request_id, const boost::system::error_code ec)>;
 
-//! Represents a context of a single request.
+//! Type of the function that consumes the body while it's being received.
+using BodyCallback = std::function<void(const char *data, std::size_t size)>;
+
+//! Type of the function that receives the header of a response before its body.
+//! Setting `ec` fails the request.
+using HeaderCallback =
+  std::function<void(const HttpResponse &response, boost::system::error_code &ec)>;
+
+//! The stages a request goes through.
+enum class RequestPhase
+{
+        //! Waiting for a connection from the pool.
+        Queued,
+        //! Resolving the address of the server.
+        Resolve,
+        //! Establishing the TCP connection.
+        Connect,
+        //! Performing the TLS handshake.
+        Handshake,
+        //! Sending the request.
+        Write,
+        //! Receiving the response.
+        Read,
+};
+
+//! Time limits of a request. A zero duration disables the limit.
+//! The request fails with `boost::asio::error::timed_out` when one of them expires.
+struct RequestTimeouts
+{
+        //! The whole request, including the time spent waiting for a connection.
+        std::chrono::milliseconds total{0};
+        std::chrono::milliseconds resolve{10000};
+        std::chrono::milliseconds connect{10000};
+        std::chrono::milliseconds handshake{10000};
+        //! Sending the request. A streamed body gets this long for each of its chunks.
+        std::chrono::milliseconds write{30000};
+        //! From the moment the request has been sent until the whole response is received.
+        std::chrono::milliseconds read{30000};
+};
+
+//! Serializes the handlers of a request.
+using Strand = boost::asio::strand<boost::asio::io_service::executor_type>;
+
+//! Represents a context of a single request. Once the request has been started,
+//! its state is only accessed from handlers running on its strand.
+//!
+//! Sessions are recycled by the client once their request is over (see `SessionPool`),
+//! so the strand, the timers and the storage of the buffers serve many requests.
 struct Session
 {
-        Session(boost::asio::io_service &ios,
-                boost::asio::ssl::context &ssl_ctx,
-                const std::string &host,
+        Session(const std::string &host,
                 RequestID id,
                 SuccessCallback on_success,
                 FailureCallback on_failure)
-          : socket{ios, ssl_ctx}
-          , host{host}
-          , id{id}
-          , on_success{on_success}
-          , on_failure{on_failure}
-          , is_cancelled{false}
+          : request{std::piecewise_construct,
+                    std::make_tuple(),
+                    std::make_tuple(ArenaAllocator<char>(arena))}
         {
-                parser.header_limit(8192);
-                parser.body_limit(1 * 1024 * 1024 * 1024); // 1 GiB
+                reuse(host, id, std::move(on_success), std::move(on_failure));
+        }
+
+        //! Prepare the session for a new request.
+        void reuse(const std::string &host,
+                   RequestID id,
+                   SuccessCallback on_success,
+                   FailureCallback on_failure)
+        {
+                this->host       = host;
+                this->id         = id;
+                this->on_success = std::move(on_success);
+                this->on_failure = std::move(on_failure);
+
+                is_reused_connection = false;
+                has_body_failed      = false;
+                is_cancelled         = false;
+                is_completed         = false;
+                accepts_encoding     = false;
+                is_header_inspected  = false;
+                error_response       = false;
+                is_decoding          = false;
+                phase                = RequestPhase::Queued;
+                timeouts             = RequestTimeouts{};
+                error_code           = {};
+                abort_reason         = {};
+                timings.reset();
+
+                parser.emplace(std::piecewise_construct,
+                               std::make_tuple(),
+                               std::make_tuple(ArenaAllocator<char>(arena)));
+                parser->header_limit(8192);
+                parser->body_limit(max_body_size);
+        }
+
+        //! Release what the finished request holds on to, while keeping the
+        //! storage of the buffers for the next one.
+        void clear()
+        {
+                connection.reset();
+                on_success     = nullptr;
+                on_failure     = nullptr;
+                on_body        = nullptr;
+                on_header      = nullptr;
+                cancel_connect = nullptr;
+
+                // Everything allocated from the arena goes away before it's reset.
+                parser   = std::experimental::nullopt;
+                request.clear();
+                request.body().clear();
+                body_source.reset();
+                body_remaining = 0;
+                arena.reset();
+
+                header_fields.reset();
+                request_head.clear();
+                request_line_size = 0;
+
+                output_buf.consume(output_buf.size());
+                decoded_body.clear();
+
+                metrics = nullptr;
+                tracer.reset();
+                stall_detector.reset();
+                callback_executor.reset();
+                recorder.reset();
+                recorded_request.clear();
+                recorded_response.clear();
         }
 
-        //! Socket used for communication.
-        boost::asio::ssl::stream<boost::asio::ip::tcp::socket> socket;
+        //! Storage of the header fields of the request & the response.
+        RequestArena arena;
+        //! Storage of the asio operations of the request.
+        HandlerMemory handler_memory;
+        //! Connection borrowed from the pool for the duration of the request.
+        std::shared_ptr<Connection> connection;
+        //! Whether the connection was reused from a previous request.
+        bool is_reused_connection = false;
         //! Remote host.
         std::string host;
         //! Buffer where the response will be stored.
         boost::beast::flat_buffer output_buf;
         //! Parser that will the response data.
-        boost::beast::http::response_parser<boost::beast::http::string_body> parser;
+        std::experimental::optional<ResponseParser> parser;
         //! Request string.
-        boost::beast::http::request<boost::beast::http::string_body> request;
+        HttpRequest request;
+        //! The fields shared by the requests of the client (see `HeaderTemplate`). If set,
+        //! the request is written from `request_head` around them & the body of `request`,
+        //! instead of serializing `request`.
+        std::shared_ptr<const std::string> header_fields;
+        //! The request line, followed by the fields specific to the request & the empty
+        //! line ending the header.
+        std::string request_head;
+        //! Length of the request line at the start of `request_head`.
+        std::size_t request_line_size = 0;
+        //! If set, the body is read from it in chunks while it's written,
+        //! instead of being taken from `request`.
+        std::shared_ptr<BodySource> body_source;
+        //! The chunk of the body being written. It keeps its storage when the
+        //! session is recycled.
+        std::string body_chunk;
+        //! Size of the body that hasn't been read from `body_source` yet.
+        uint64_t body_remaining = 0;
         //! Contains the description of an error if one occurs
         //! during the request life cycle.
         boost::system::error_code error_code;
@@ -61,10 +288,65 @@ struct Session
         SuccessCallback on_success;
         //! Function to be called when the request fails.
         FailureCallback on_failure;
+        //! If set, the body of a successful response will be passed to this function
+        //! in chunks as it arrives, instead of being accumulated into the response.
+        BodyCallback on_body;
+        //! If set, called with the header of the response before `on_body`.
+        HeaderCallback on_header;
+        //! Whether `on_body` has thrown. The rest of the body will be discarded.
+        bool has_body_failed = false;
+        //! Whether the server was told that it may compress the response.
+        bool accepts_encoding = false;
+        //! Whether the header of the response has been looked at for its encoding.
+        bool is_header_inspected = false;
+        //! Whether the response isn't successful (2xx), in which case its body isn't streamed.
+        bool error_response = false;
+        //! Whether the body is compressed & decoded by `decoder` while it's received.
+        bool is_decoding = false;
+        //! Decoder of the last compressed response, kept when the session is recycled.
+        std::unique_ptr<ContentDecoder> decoder;
+        //! The decoded body, unless it's passed to `on_body`.
+        std::string decoded_body;
         //! Whether or not the request has been cancelled.
-        bool is_cancelled;
-        //! Retricting access to the cancelled bool.
-        std::mutex cancel_guard;
+        bool is_cancelled = false;
+        //! Index of the io_service the request runs on.
+        std::size_t context = 0;
+        //! Serializes the handlers of the request.
+        std::unique_ptr<Strand> strand;
+        //! Time limits of the request.
+        RequestTimeouts timeouts;
+        //! The stage the request is in.
+        RequestPhase phase = RequestPhase::Queued;
+        //! Enforces the deadline of the whole request.
+        std::unique_ptr<boost::asio::steady_timer> request_timer;
+        //! Enforces the deadline of the current phase.
+        std::unique_ptr<boost::asio::steady_timer> phase_timer;
+        //! Aborts the connection attempts in progress.
+        std::function<void()> cancel_connect;
+        //! Why the request was aborted (cancelled or timed out).
+        boost::system::error_code abort_reason;
+        //! Whether the success or the failure callback has been called.
+        bool is_completed = false;
+        //! If set, the timings of the request are recorded into it once it's complete.
+        ClientMetrics *metrics = nullptr;
+        //! What is measured of the request, if its metrics are recorded.
+        RequestTimings timings;
+        //! If set, the handlers & the phases of the request are traced into it.
+        std::shared_ptr<RequestTracer> tracer;
+        //! When the current phase started, if the request is traced.
+        std::chrono::steady_clock::time_point traced_phase_started_at;
+        //! If set, the handlers & the callback of the request are watched for stalls.
+        std::shared_ptr<StallDetector> stall_detector;
+        //! If set, the callback of the request is run on it instead of the network thread.
+        std::shared_ptr<CallbackExecutor> callback_executor;
+        //! If set, the request & its response are written to it once it's complete.
+        std::shared_ptr<TrafficRecorder> recorder;
+        //! When the request was started, for the recorder.
+        std::chrono::steady_clock::time_point started_at;
+        //! The streamed body of the request, as it was sent, for the recorder.
+        std::string recorded_request;
+        //! The body passed to `on_body`, for the recorder.
+        std::string recorded_response;
 };
 }
 }
@@ -0,0 +1,171 @@
+#include "session_pool.hpp"
+
+#include <algorithm>
+
+using namespace mtx::client;
+
+template<class T>
+class SessionPool::BlockAllocator
+{
+public:
+        using value_type = T;
+
+        explicit BlockAllocator(std::shared_ptr<SessionPool> pool)
+          : pool_{std::move(pool)}
+        {}
+
+        template<class U>
+        BlockAllocator(const BlockAllocator<U> &other)
+          : pool_{other.pool_}
+        {}
+
+        T *allocate(std::size_t n)
+        {
+                return static_cast<T *>(pool_->allocate_block(n * sizeof(T)));
+        }
+        void deallocate(T *block, std::size_t n) { pool_->deallocate_block(block, n * sizeof(T)); }
+
+        template<class U>
+        bool operator==(const BlockAllocator<U> &other) const
+        {
+                return pool_ == other.pool_;
+        }
+        template<class U>
+        bool operator!=(const BlockAllocator<U> &other) const
+        {
+                return pool_ != other.pool_;
+        }
+
+private:
+        template<class U>
+        friend class BlockAllocator;
+
+        std::shared_ptr<SessionPool> pool_;
+};
+
+SessionPool::SessionPool(std::size_t max_idle)
+  : max_idle_{max_idle}
+{}
+
+SessionPool::~SessionPool()
+{
+        for (auto block : blocks_)
+                ::operator delete(block);
+}
+
+std::shared_ptr<Session>
+SessionPool::acquire(boost::asio::io_service &ios,
+                     std::size_t context,
+                     const std::string &host,
+                     RequestID id,
+                     SuccessCallback on_success,
+                     FailureCallback on_failure)
+{
+        std::unique_ptr<Session> s;
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (context >= idle_.size())
+                idle_.resize(context + 1);
+
+        auto &idle = idle_[context];
+        if (!idle.empty()) {
+                s = std::move(idle.back());
+                idle.pop_back();
+                reused_ += 1;
+        } else {
+                created_ += 1;
+        }
+        lock.unlock();
+
+        if (s) {
+                s->reuse(host, id, std::move(on_success), std::move(on_failure));
+        } else {
+                s = std::make_unique<Session>(
+                  host, id, std::move(on_success), std::move(on_failure));
+
+                s->context       = context;
+                s->strand        = std::make_unique<Strand>(ios.get_executor());
+                s->request_timer = std::make_unique<boost::asio::steady_timer>(ios);
+                s->phase_timer   = std::make_unique<boost::asio::steady_timer>(ios);
+        }
+
+        // The recycler takes care of the session from now on, even if this throws.
+        return std::shared_ptr<Session>(
+          s.release(), Recycler{this}, BlockAllocator<Session>(shared_from_this()));
+}
+
+void
+SessionPool::recycle(Session *s)
+{
+        std::unique_ptr<Session> session(s);
+
+        // The pending handlers of an io_service that is being torn down are destroyed
+        // with it, and the sessions they held must not outlive it.
+        if (session->strand && session->strand->get_inner_executor().context().stopped())
+                return;
+
+        // Let go of the callbacks & the connection right away.
+        session->clear();
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (session->context < idle_.size() && idle_[session->context].size() < max_idle_)
+                idle_[session->context].push_back(std::move(session));
+        lock.unlock();
+}
+
+void
+SessionPool::clear()
+{
+        std::vector<std::vector<std::unique_ptr<Session>>> idle;
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle.swap(idle_);
+        lock.unlock();
+}
+
+SessionPool::Stats
+SessionPool::stats() const
+{
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        std::size_t idle = 0;
+        for (const auto &sessions : idle_)
+                idle += sessions.size();
+
+        return Stats{created_, reused_, idle};
+}
+
+void *
+SessionPool::allocate_block(std::size_t size)
+{
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        // All the control blocks have the same size.
+        if (size == block_size_ && !blocks_.empty()) {
+                auto block = blocks_.back();
+                blocks_.pop_back();
+                return block;
+        }
+
+        if (block_size_ == 0)
+                block_size_ = size;
+        lock.unlock();
+
+        return ::operator new(size);
+}
+
+void
+SessionPool::deallocate_block(void *block, std::size_t size)
+{
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        // As many are kept as there can be idle sessions.
+        if (size == block_size_ &&
+            blocks_.size() < max_idle_ * std::max<std::size_t>(idle_.size(), 1)) {
+                blocks_.push_back(block);
+                return;
+        }
+        lock.unlock();
+
+        ::operator delete(block);
+}
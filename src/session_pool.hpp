@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "session.hpp"
+
+namespace mtx {
+namespace client {
+
+//! Recycles the sessions of finished requests. A session is returned to the pool when
+//! the last reference to it goes away, and handed out again with its strand, timers,
+//! handler memory and buffers, so a steady flow of requests doesn't allocate them.
+//!
+//! The idle sessions are kept per io_service, since their strand & timers are bound
+//! to it. The pool can be shared by the clients running on the same io_services.
+class SessionPool : public std::enable_shared_from_this<SessionPool>
+{
+public:
+        //! At most `max_idle` sessions are kept per io_service.
+        explicit SessionPool(std::size_t max_idle = 64);
+        ~SessionPool();
+
+        //! Retrieve an idle session of the io_service with the given index, or create one.
+        std::shared_ptr<Session> acquire(boost::asio::io_service &ios,
+                                         std::size_t context,
+                                         const std::string &host,
+                                         RequestID id,
+                                         SuccessCallback on_success,
+                                         FailureCallback on_failure);
+        //! Destroy the idle sessions. It has to be done before the io_services go away.
+        void clear();
+
+        struct Stats
+        {
+                //! Number of sessions allocated.
+                uint64_t created;
+                //! Number of requests that got a recycled session.
+                uint64_t reused;
+                //! Number of sessions currently idle.
+                std::size_t idle;
+        };
+
+        Stats stats() const;
+
+private:
+        //! Gives the session back to the pool, instead of deleting it.
+        struct Recycler
+        {
+                void operator()(Session *s) const { pool->recycle(s); }
+
+                SessionPool *pool;
+        };
+
+        //! Allocates the control blocks of the shared pointers from the pool.
+        //! It keeps the pool alive until the last control block is freed.
+        template<class T>
+        class BlockAllocator;
+
+        void recycle(Session *s);
+        void *allocate_block(std::size_t size);
+        void deallocate_block(void *block, std::size_t size);
+
+        std::size_t max_idle_;
+
+        mutable std::mutex mutex_;
+        //! The idle sessions of each io_service.
+        std::vector<std::vector<std::unique_ptr<Session>>> idle_;
+        //! Unused control blocks.
+        std::vector<void *> blocks_;
+        std::size_t block_size_ = 0;
+
+        uint64_t created_ = 0;
+        uint64_t reused_  = 0;
+};
+}
+}
@@ -0,0 +1,89 @@
+#include "session_registry.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <thread>
+
+using namespace mtx::client;
+
+SessionRegistry::SessionRegistry(std::size_t shards)
+{
+        if (shards == 0)
+                shards = 4 * std::max(1U, std::thread::hardware_concurrency());
+
+        std::size_t count = 1;
+        while (count < shards)
+                count <<= 1;
+
+        shards_.reset(new Shard[count]);
+        mask_ = count - 1;
+}
+
+SessionRegistry::Shard &
+SessionRegistry::shard_for(RequestID id) const
+{
+        // Spread the high bits of the hash over the low ones used by the mask.
+        auto hash = std::hash<RequestID>{}(id);
+        hash ^= hash >> 17;
+
+        return shards_[hash & mask_];
+}
+
+void
+SessionRegistry::insert(std::shared_ptr<Session> s)
+{
+        auto &shard = shard_for(s->id);
+
+        std::unique_lock<std::mutex> lock(shard.mutex);
+
+        if (shard.spare_nodes.empty()) {
+                if (shard.sessions.emplace(s->id, s).second)
+                        size_.fetch_add(1, std::memory_order_relaxed);
+                return;
+        }
+
+        auto node = std::move(shard.spare_nodes.back());
+        shard.spare_nodes.pop_back();
+
+        node.key()    = s->id;
+        node.mapped() = s;
+
+        if (shard.sessions.insert(std::move(node)).inserted)
+                size_.fetch_add(1, std::memory_order_relaxed);
+}
+
+std::shared_ptr<Session>
+SessionRegistry::erase(RequestID id)
+{
+        auto &shard = shard_for(id);
+
+        std::unique_lock<std::mutex> lock(shard.mutex);
+
+        auto it = shard.sessions.find(id);
+        if (it == shard.sessions.end())
+                return nullptr;
+
+        auto node = shard.sessions.extract(it);
+        auto s    = std::move(node.mapped());
+        size_.fetch_sub(1, std::memory_order_relaxed);
+
+        // Keep the node for the next request, rather than freeing it.
+        if (shard.spare_nodes.size() < max_spare_nodes)
+                shard.spare_nodes.push_back(std::move(node));
+
+        return s;
+}
+
+std::shared_ptr<Session>
+SessionRegistry::find(RequestID id) const
+{
+        auto &shard = shard_for(id);
+
+        std::unique_lock<std::mutex> lock(shard.mutex);
+
+        auto it = shard.sessions.find(id);
+        if (it == shard.sessions.end())
+                return nullptr;
+
+        return it->second;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "session.hpp"
+
+namespace mtx {
+namespace client {
+
+//! Keeps track of the requests in progress, so they can be cancelled. The sessions
+//! are spread over independently locked shards, which lets the worker threads
+//! register & remove different requests without contending on a single mutex.
+class SessionRegistry
+{
+public:
+        //! The number of shards is rounded up to a power of two. By default
+        //! there are a few shards per hardware thread.
+        explicit SessionRegistry(std::size_t shards = 0);
+
+        //! Register a session under its id.
+        void insert(std::shared_ptr<Session> s);
+        //! Remove the session with the given id, which is returned if it was registered.
+        std::shared_ptr<Session> erase(RequestID id);
+        //! Find the session with the given id.
+        std::shared_ptr<Session> find(RequestID id) const;
+        //! Number of registered sessions.
+        std::size_t size() const { return size_.load(std::memory_order_relaxed); }
+
+private:
+        //! Each shard gets its own cache line, so that threads locking
+        //! neighbouring shards don't invalidate each other's caches.
+        struct alignas(64) Shard
+        {
+                using Map = std::unordered_map<RequestID, std::shared_ptr<Session>>;
+
+                mutable std::mutex mutex;
+                Map sessions;
+                //! Nodes of the removed sessions, reused by the next insertions.
+                std::vector<Map::node_type> spare_nodes;
+        };
+
+        Shard &shard_for(RequestID id) const;
+
+        std::unique_ptr<Shard[]> shards_;
+        //! Number of shards minus one.
+        std::size_t mask_;
+        std::atomic<std::size_t> size_{0};
+
+        //! Number of spare nodes kept by each shard.
+        static constexpr std::size_t max_spare_nodes = 16;
+};
+}
+}
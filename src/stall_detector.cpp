@@ -0,0 +1,338 @@
+#include "stall_detector.hpp"
+
+using namespace mtx::client;
+
+namespace {
+
+//! The innermost handler running on the thread.
+thread_local StallDetector::Frame *current_frame = nullptr;
+}
+
+//! The handler running on a thread, as seen by the watchdog. Only the thread writes to
+//! it, under a sequence number that is odd while the handler is being changed.
+struct StallDetector::ThreadState
+{
+        std::atomic<uint64_t> version{0};
+        std::atomic<Stall::Kind> kind{Stall::Kind::Handler};
+        std::atomic<const char *> name{nullptr};
+        std::atomic<uint64_t> request{0};
+        std::atomic<std::size_t> context{0};
+        //! Zero while no handler is running.
+        std::atomic<std::chrono::steady_clock::rep> started_at{0};
+        //! The version of the last handler reported by the watchdog, so it's reported once.
+        uint64_t reported_version = 0;
+};
+
+//! Tells the watchdog thread to exit.
+struct StallDetector::Watchdog
+{
+        bool is_stopped = false;
+
+        std::mutex mutex;
+        //! Wakes up the watchdog when it's stopped.
+        std::condition_variable cv;
+};
+
+//! The probe of an event loop, while it waits to be run.
+struct StallDetector::Probe
+{
+        std::chrono::steady_clock::time_point posted_at;
+        bool is_pending = false;
+};
+
+StallDetector::StallDetector(const std::vector<boost::asio::io_service *> &contexts,
+                             Options options)
+  : contexts_{contexts}
+  , options_{options}
+{
+        for (std::size_t i = 0; i < contexts_.size(); ++i)
+                probes_.push_back(std::make_unique<Probe>());
+}
+
+StallDetector::~StallDetector()
+{
+        stop();
+}
+
+void
+StallDetector::start()
+{
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        if (watchdog_.joinable())
+                return;
+
+        watchdog_state_ = std::make_shared<Watchdog>();
+        watchdog_       = std::thread(
+          &StallDetector::run, weak_from_this(), watchdog_state_, options_.interval);
+}
+
+void
+StallDetector::stop()
+{
+        // A shared detector can be stopped by several clients at once, and only one of
+        // them joins the thread.
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto watchdog = watchdog_state_;
+        auto thread   = std::move(watchdog_);
+        lock.unlock();
+
+        if (!watchdog)
+                return;
+
+        std::unique_lock<std::mutex> watchdog_lock(watchdog->mutex);
+        watchdog->is_stopped = true;
+        watchdog_lock.unlock();
+
+        watchdog->cv.notify_all();
+
+        if (!thread.joinable())
+                return;
+
+        // The last reference might be released by `on_stall`, on the watchdog. Once it
+        // returns, the thread only uses the state it shares with the detector.
+        if (thread.get_id() == std::this_thread::get_id())
+                thread.detach();
+        else
+                thread.join();
+}
+
+void
+StallDetector::enter(Frame &frame,
+                     Stall::Kind kind,
+                     const char *name,
+                     uint64_t request,
+                     std::size_t context,
+                     std::chrono::steady_clock::time_point now)
+{
+        frame.detector   = this;
+        frame.kind       = kind;
+        frame.name       = name;
+        frame.request    = request;
+        frame.context    = context;
+        frame.started_at = now;
+        frame.nested     = {};
+        frame.parent     = current_frame;
+
+        current_frame = &frame;
+
+        publish(local_state(), &frame);
+}
+
+bool
+StallDetector::leave(Frame &frame,
+                     std::chrono::steady_clock::time_point now,
+                     std::chrono::steady_clock::duration &duration)
+{
+        current_frame = frame.parent;
+
+        const auto total = now - frame.started_at;
+        if (frame.parent)
+                frame.parent->nested += total;
+
+        // Back to the handler this one was nested in, if it's watched by this detector.
+        const bool is_parent_watched = frame.parent && frame.parent->detector == this;
+        publish(local_state(), is_parent_watched ? frame.parent : nullptr);
+
+        duration = total - frame.nested;
+
+        auto &longest =
+          frame.kind == Stall::Kind::Callback ? longest_callback_ : longest_handler_;
+        auto previous = longest.load(std::memory_order_relaxed);
+
+        while (duration.count() > previous &&
+               !longest.compare_exchange_weak(
+                 previous, duration.count(), std::memory_order_relaxed)) {
+        }
+
+        return duration > options_.threshold;
+}
+
+void
+StallDetector::report(const Stall &stall)
+{
+        stalls_.fetch_add(1, std::memory_order_relaxed);
+
+        if (options_.on_stall)
+                options_.on_stall(stall);
+}
+
+StallDetector::Stats
+StallDetector::stats() const
+{
+        Stats stats;
+        stats.stalls = stalls_.load(std::memory_order_relaxed);
+        stats.longest_handler =
+          std::chrono::steady_clock::duration(longest_handler_.load(std::memory_order_relaxed));
+        stats.longest_callback =
+          std::chrono::steady_clock::duration(longest_callback_.load(std::memory_order_relaxed));
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats.queue_delay = queue_delay_;
+
+        return stats;
+}
+
+void
+StallDetector::publish(ThreadState &state, const Frame *frame)
+{
+        const auto version = state.version.load(std::memory_order_relaxed);
+        state.version.store(version + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        if (frame) {
+                state.kind.store(frame->kind, std::memory_order_relaxed);
+                state.name.store(frame->name, std::memory_order_relaxed);
+                state.request.store(frame->request, std::memory_order_relaxed);
+                state.context.store(frame->context, std::memory_order_relaxed);
+                state.started_at.store(frame->started_at.time_since_epoch().count(),
+                                       std::memory_order_relaxed);
+        } else {
+                state.started_at.store(0, std::memory_order_relaxed);
+        }
+
+        state.version.store(version + 2, std::memory_order_release);
+}
+
+StallDetector::ThreadState &
+StallDetector::local_state()
+{
+        return threads_.local([](std::size_t) { return std::make_unique<ThreadState>(); });
+}
+
+void
+StallDetector::run(std::weak_ptr<StallDetector> detector,
+                   std::shared_ptr<Watchdog> watchdog,
+                   std::chrono::milliseconds interval)
+{
+        std::unique_lock<std::mutex> lock(watchdog->mutex);
+
+        while (!watchdog->is_stopped) {
+                lock.unlock();
+
+                if (auto self = detector.lock())
+                        self->check();
+                else
+                        return;
+
+                lock.lock();
+                watchdog->cv.wait_for(
+                  lock, interval, [&watchdog]() { return watchdog->is_stopped; });
+        }
+}
+
+void
+StallDetector::check()
+{
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        const auto now = std::chrono::steady_clock::now();
+        std::vector<std::size_t> late;
+
+        for (std::size_t i = 0; i < probes_.size(); ++i) {
+                auto &probe = *probes_[i];
+
+                if (!probe.is_pending) {
+                        send_probe(i);
+                        continue;
+                }
+
+                // Looked at again at every interval, as the handler holding it up
+                // might have started after it was late.
+                if (now - probe.posted_at > options_.threshold)
+                        late.push_back(i);
+        }
+
+        lock.unlock();
+
+        for (const auto context : late)
+                report_running(context, now);
+}
+
+void
+StallDetector::send_probe(std::size_t context)
+{
+        auto &ios = *contexts_[context];
+
+        // It would never run.
+        if (ios.stopped())
+                return;
+
+        auto &probe      = *probes_[context];
+        probe.posted_at  = std::chrono::steady_clock::now();
+        probe.is_pending = true;
+
+        // The probe can outlive the detector, if the event loop is held up for long enough.
+        boost::asio::post(ios, [detector = weak_from_this(), context]() {
+                if (auto self = detector.lock())
+                        self->on_probe(context);
+        });
+}
+
+void
+StallDetector::on_probe(std::size_t context)
+{
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        auto &probe      = *probes_[context];
+        probe.is_pending = false;
+
+        const auto delay = std::chrono::steady_clock::now() - probe.posted_at;
+        queue_delay_.record(
+          std::chrono::duration_cast<std::chrono::microseconds>(delay).count());
+        lock.unlock();
+
+        if (delay <= options_.threshold)
+                return;
+
+        Stall stall;
+        stall.kind     = Stall::Kind::QueueDelay;
+        stall.context  = context;
+        stall.duration = delay;
+
+        report(stall);
+}
+
+void
+StallDetector::report_running(std::size_t context, std::chrono::steady_clock::time_point now)
+{
+        std::vector<Stall> stalls;
+
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        threads_.for_each([&](ThreadState &state) {
+                const auto version = state.version.load(std::memory_order_acquire);
+                if (version & 1 || version == state.reported_version)
+                        return;
+
+                Stall stall;
+                stall.kind        = state.kind.load(std::memory_order_relaxed);
+                stall.name        = state.name.load(std::memory_order_relaxed);
+                stall.request     = state.request.load(std::memory_order_relaxed);
+                stall.context     = state.context.load(std::memory_order_relaxed);
+                stall.in_progress = true;
+
+                const auto started_at = state.started_at.load(std::memory_order_relaxed);
+
+                // The handler changed while it was read.
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (state.version.load(std::memory_order_relaxed) != version)
+                        return;
+
+                if (started_at == 0 || stall.context != context)
+                        return;
+
+                stall.duration = now - std::chrono::steady_clock::time_point(
+                                         std::chrono::steady_clock::duration(started_at));
+                if (stall.duration <= options_.threshold)
+                        return;
+
+                state.reported_version = version;
+                stalls.push_back(stall);
+        });
+
+        lock.unlock();
+
+        for (const auto &stall : stalls)
+                report(stall);
+}
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "metrics.hpp"
+#include "per_thread.hpp"
+
+namespace mtx {
+namespace client {
+
+//! Watches the event loops of a client for the work that holds up the network threads
+//! (see `Client::detect_stalls`).
+//!
+//! The handlers & the callbacks of the requests are timed when they return, without
+//! the handlers nested in them, and the ones that ran longer than the threshold are
+//! reported with their request & their endpoint. A watchdog thread also posts a probe
+//! to each event loop at every interval, to measure how long work waits in its queue.
+//! When a probe is late, the handlers that have been running for longer than the
+//! threshold on the threads of its loop are reported right away, in case they never
+//! return.
+class StallDetector : public std::enable_shared_from_this<StallDetector>
+{
+public:
+        //! Something that held up an event loop.
+        struct Stall
+        {
+                enum class Kind
+                {
+                        //! A handler of a request ran for too long.
+                        Handler,
+                        //! The callback of a request ran for too long.
+                        Callback,
+                        //! Work waited for too long in the queue of the event loop.
+                        QueueDelay,
+                };
+
+                Kind kind = Kind::Handler;
+                //! The handler (e.g "on_read_some") or "callback". Null for a queue delay.
+                const char *name = nullptr;
+                //! The id of the request, if there is one.
+                uint64_t request = 0;
+                //! The endpoint of the request, as labelled in the metrics (e.g "/sync").
+                //! Empty for a handler that is still running.
+                std::string endpoint;
+                //! Index of the event loop.
+                std::size_t context = 0;
+                //! How long it ran, or it waited.
+                std::chrono::steady_clock::duration duration{0};
+                //! Whether it was still running when it was reported by the watchdog.
+                bool in_progress = false;
+        };
+
+        struct Options
+        {
+                //! What runs or waits longer than this is reported.
+                std::chrono::milliseconds threshold{100};
+                //! How often the watchdog probes the event loops.
+                std::chrono::milliseconds interval{50};
+                //! Called with each stall, from the thread that returned from the slow
+                //! handler, the thread of the event loop or the watchdog. It can be called
+                //! from several threads at once, and it has to return quickly.
+                std::function<void(const Stall &)> on_stall;
+        };
+
+        struct Stats
+        {
+                //! Number of stalls reported.
+                uint64_t stalls = 0;
+                //! The longest run of a handler, without the handlers nested in it.
+                std::chrono::steady_clock::duration longest_handler{0};
+                //! The longest run of a callback.
+                std::chrono::steady_clock::duration longest_callback{0};
+                //! How long the probes of the watchdog waited in the queues.
+                Histogram queue_delay;
+        };
+
+        //! The run of a handler on a thread, from its start.
+        struct Frame
+        {
+                StallDetector *detector = nullptr;
+                Stall::Kind kind        = Stall::Kind::Handler;
+                const char *name        = nullptr;
+                uint64_t request        = 0;
+                std::size_t context     = 0;
+                std::chrono::steady_clock::time_point started_at;
+                //! Time spent in the handlers nested in this one.
+                std::chrono::steady_clock::duration nested{0};
+                //! The handler this one is nested in.
+                Frame *parent = nullptr;
+        };
+
+        StallDetector(const std::vector<boost::asio::io_service *> &contexts, Options options);
+        ~StallDetector();
+
+        //! Start the watchdog.
+        void start();
+        //! Stop the watchdog & wait for it. The handlers are still timed.
+        void stop();
+
+        //! Mark the start of a handler on the calling thread.
+        void enter(Frame &frame,
+                   Stall::Kind kind,
+                   const char *name,
+                   uint64_t request,
+                   std::size_t context,
+                   std::chrono::steady_clock::time_point now);
+        //! Mark the end of the handler on the calling thread, and return how long it ran
+        //! without the nested handlers, if it's a stall to report.
+        bool leave(Frame &frame,
+                   std::chrono::steady_clock::time_point now,
+                   std::chrono::steady_clock::duration &duration);
+        //! Report a stall to the callback of the options.
+        void report(const Stall &stall);
+
+        Stats stats() const;
+
+private:
+        struct ThreadState;
+        struct Probe;
+        struct Watchdog;
+
+        //! Publish the handler running on the calling thread (or none) to the watchdog.
+        void publish(ThreadState &state, const Frame *frame);
+        //! The state of the calling thread.
+        ThreadState &local_state();
+        //! Probe the event loops until the watchdog is stopped. `on_stall` can release the
+        //! last reference to the detector, so the thread only holds it while it checks.
+        static void run(std::weak_ptr<StallDetector> detector,
+                        std::shared_ptr<Watchdog> watchdog,
+                        std::chrono::milliseconds interval);
+        //! Probe the event loops that are idle, & look for the handlers holding up the others.
+        void check();
+        void send_probe(std::size_t context);
+        void on_probe(std::size_t context);
+        //! Report the handlers that have been running for too long on the event loop.
+        void report_running(std::size_t context, std::chrono::steady_clock::time_point now);
+
+        const std::vector<boost::asio::io_service *> contexts_;
+        const Options options_;
+        std::atomic<uint64_t> stalls_{0};
+        std::atomic<std::chrono::steady_clock::rep> longest_handler_{0};
+        std::atomic<std::chrono::steady_clock::rep> longest_callback_{0};
+
+        std::vector<std::unique_ptr<Probe>> probes_;
+        //! The handlers running on the threads. Destroyed detectors (e.g of closed
+        //! clients) don't stay in the caches of the network threads.
+        PerThread<ThreadState> threads_;
+        Histogram queue_delay_;
+
+        //! Used to synchronize access to the probes, the queue delays & the versions
+        //! reported by the watchdog.
+        mutable std::mutex mutex_;
+        //! Shared with the watchdog, which can outlive the detector.
+        std::shared_ptr<Watchdog> watchdog_state_;
+        std::thread watchdog_;
+};
+}
+}
@@ -0,0 +1,285 @@
+#include "sync_loop.hpp"
+
+#include <algorithm>
+
+using namespace mtx::client;
+
+SyncLoop::SyncLoop(std::shared_ptr<Client> client, Handler handler, Options options)
+  : client_{client}
+  , options_{options}
+  , state_{std::make_shared<State>(handler)}
+{
+        options_.max_queued = std::max<std::size_t>(1, options_.max_queued);
+}
+
+SyncLoop::~SyncLoop()
+{
+        stop();
+}
+
+void
+SyncLoop::start()
+{
+        std::unique_lock<std::mutex> lock(state_->mutex);
+
+        if (!state_->is_stopped || worker_.joinable())
+                return;
+
+        // What's left from a previous run is dropped, including the responses of its
+        // requests that complete from now on.
+        const auto generation = ++state_->generation;
+
+        state_->queue.clear();
+        state_->is_retry_pending = false;
+        state_->is_poll_blocked  = false;
+        state_->is_stopped       = false;
+        failures_                = 0;
+
+        worker_ = std::thread(
+          &SyncLoop::run, state_, std::weak_ptr<SyncLoop>(shared_from_this()), generation);
+        lock.unlock();
+
+        // A worker detached by a previous run exits.
+        state_->cv.notify_all();
+
+        poll(generation);
+}
+
+void
+SyncLoop::stop()
+{
+        std::unique_lock<std::mutex> lock(state_->mutex);
+        state_->is_stopped = true;
+
+        const auto request = state_->in_flight;
+        state_->in_flight  = 0;
+
+        // Only one caller joins the worker.
+        auto worker = std::move(worker_);
+        lock.unlock();
+
+        state_->cv.notify_all();
+
+        // The long poll would hold on to the loop until the server answers.
+        if (request != 0)
+                client_->cancel_request(request);
+
+        if (!worker.joinable())
+                return;
+
+        // The last reference might be released by the worker itself. It only uses
+        // the state afterwards, which it keeps alive.
+        if (worker.get_id() == std::this_thread::get_id())
+                worker.detach();
+        else
+                worker.join();
+}
+
+SyncLoop::Stats
+SyncLoop::stats() const
+{
+        std::unique_lock<std::mutex> lock(state_->mutex);
+
+        auto stats        = state_->stats;
+        stats.queue_depth = state_->queue.size();
+
+        return stats;
+}
+
+void
+SyncLoop::poll(uint64_t generation)
+{
+        std::unique_lock<std::mutex> lock(state_->mutex);
+
+        if (state_->is_stopped || generation != state_->generation)
+                return;
+
+        const auto sequence = ++state_->sent;
+        lock.unlock();
+
+        const auto since = client_->next_batch_token();
+
+        // The rooms are moved into the batch as soon as they have been parsed,
+        // so the response doesn't have to be copied into the queue.
+        auto batch = std::make_shared<mtx::responses::Sync>();
+
+        SyncRoomHandlers rooms;
+        rooms.join = [batch](const std::string &id, mtx::responses::JoinedRoom room) {
+                batch->rooms.join.emplace(id, std::move(room));
+        };
+        rooms.leave = [batch](const std::string &id, mtx::responses::LeftRoom room) {
+                batch->rooms.leave.emplace(id, std::move(room));
+        };
+        rooms.invite = [batch](const std::string &id, mtx::responses::InvitedRoom room) {
+                batch->rooms.invite.emplace(id, std::move(room));
+        };
+
+        const auto id = client_->sync(options_.filter,
+                                      since,
+                                      false,
+                                      since.empty() ? 0 : options_.timeout,
+                                      rooms,
+                                      std::bind(&SyncLoop::on_sync,
+                                                shared_from_this(),
+                                                generation,
+                                                batch,
+                                                std::chrono::steady_clock::now(),
+                                                std::placeholders::_1,
+                                                std::placeholders::_2));
+
+        lock.lock();
+
+        // The loop was stopped while the request was being sent, too early to cancel it.
+        if (state_->is_stopped || generation != state_->generation) {
+                lock.unlock();
+                return client_->cancel_request(id);
+        }
+
+        // The request may have completed already, and the next one been sent.
+        if (sequence == state_->sent)
+                state_->in_flight = id;
+}
+
+void
+SyncLoop::on_sync(uint64_t generation,
+                  std::shared_ptr<mtx::responses::Sync> batch,
+                  std::chrono::steady_clock::time_point started_at,
+                  const mtx::responses::Sync &res,
+                  Client::RequestErr err)
+{
+        const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - started_at);
+
+        std::unique_lock<std::mutex> lock(state_->mutex);
+
+        // The loop was stopped, or restarted since the request was sent.
+        if (state_->is_stopped || generation != state_->generation)
+                return;
+
+        state_->in_flight = 0;
+
+        if (err) {
+                state_->stats.failed_polls += 1;
+                failures_ += 1;
+
+                state_->retry_at         = std::chrono::steady_clock::now() + next_backoff();
+                state_->is_retry_pending = true;
+                lock.unlock();
+
+                state_->cv.notify_all();
+
+                if (options_.on_error)
+                        options_.on_error(*err);
+
+                return;
+        }
+
+        failures_ = 0;
+
+        state_->stats.polls += 1;
+        state_->stats.last_poll_latency = latency;
+        state_->stats.total_poll_latency += latency;
+
+        // Only the rooms were received through the handlers.
+        auto rooms   = std::move(batch->rooms);
+        *batch       = res;
+        batch->rooms = std::move(rooms);
+
+        client_->set_next_batch_token(batch->next_batch);
+
+        state_->queue.push_back(batch);
+        state_->stats.max_queue_depth =
+          std::max(state_->stats.max_queue_depth, state_->queue.size());
+
+        // Apply back-pressure until the worker catches up.
+        const bool is_blocked   = state_->queue.size() >= options_.max_queued;
+        state_->is_poll_blocked = is_blocked;
+        lock.unlock();
+
+        state_->cv.notify_all();
+
+        if (!is_blocked)
+                poll(generation);
+}
+
+void
+SyncLoop::run(std::shared_ptr<State> state, std::weak_ptr<SyncLoop> loop, uint64_t generation)
+{
+        // Send a request, if the loop is still alive.
+        const auto poll = [&loop, generation]() {
+                if (auto self = loop.lock())
+                        self->poll(generation);
+        };
+
+        // The worker of a previous run exits once the loop is restarted.
+        const auto is_replaced = [&state, generation]() {
+                return state->generation != generation;
+        };
+
+        std::unique_lock<std::mutex> lock(state->mutex);
+
+        while (true) {
+                if (state->is_retry_pending)
+                        state->cv.wait_until(lock, state->retry_at, [&]() {
+                                return is_replaced() || state->is_stopped ||
+                                       !state->queue.empty() ||
+                                       std::chrono::steady_clock::now() >= state->retry_at;
+                        });
+                else
+                        state->cv.wait(lock, [&]() {
+                                return is_replaced() || state->is_stopped ||
+                                       !state->queue.empty() || state->is_retry_pending;
+                        });
+
+                if (is_replaced() || (state->is_stopped && state->queue.empty()))
+                        break;
+
+                if (!state->is_stopped && state->is_retry_pending &&
+                    std::chrono::steady_clock::now() >= state->retry_at) {
+                        state->is_retry_pending = false;
+                        lock.unlock();
+
+                        poll();
+
+                        lock.lock();
+                        continue;
+                }
+
+                if (state->queue.empty())
+                        continue;
+
+                auto batch = state->queue.front();
+                state->queue.pop_front();
+
+                const bool resume      = state->is_poll_blocked && !state->is_stopped;
+                state->is_poll_blocked = false;
+                lock.unlock();
+
+                if (resume)
+                        poll();
+
+                const auto started_at = std::chrono::steady_clock::now();
+                state->handler(*batch);
+                const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+                  std::chrono::steady_clock::now() - started_at);
+
+                lock.lock();
+                state->stats.processed += 1;
+                state->stats.last_processing_latency = latency;
+                state->stats.total_processing_latency += latency;
+        }
+}
+
+std::chrono::milliseconds
+SyncLoop::next_backoff()
+{
+        // Exponential backoff with jitter, so that many clients
+        // don't retry against the server at the same time.
+        const auto exponent = std::min(failures_ - 1, 16U);
+        const auto ceiling =
+          std::min(options_.max_backoff.count(), options_.min_backoff.count() << exponent);
+
+        std::uniform_int_distribution<std::chrono::milliseconds::rep> dist(ceiling / 2, ceiling);
+
+        return std::chrono::milliseconds(dist(rng_));
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+
+#include "client.hpp"
+
+namespace mtx {
+namespace client {
+
+//! Continuously polls /sync and keeps track of the next batch token. The next
+//! long-poll is sent as soon as a response has been received, while the previous
+//! responses are processed by a worker thread.
+class SyncLoop : public std::enable_shared_from_this<SyncLoop>
+{
+public:
+        //! Function that processes a /sync response.
+        using Handler = std::function<void(const mtx::responses::Sync &)>;
+        //! Function to be called when a request fails, before it is retried.
+        using ErrorHandler = std::function<void(const mtx::client::errors::ClientError &)>;
+
+        struct Options
+        {
+                //! The filter that will be passed to /sync.
+                std::string filter;
+                //! The long-poll timeout in milliseconds. The initial sync is always
+                //! performed with a timeout of 0.
+                uint16_t timeout = 30000;
+                //! Maximum number of responses waiting to be processed. No new
+                //! request will be sent while the queue is full.
+                std::size_t max_queued = 4;
+                //! The delay before the first retry of a failed request.
+                std::chrono::milliseconds min_backoff{500};
+                //! The maximum delay between two retries.
+                std::chrono::milliseconds max_backoff{60000};
+                //! Called when a request fails.
+                ErrorHandler on_error;
+        };
+
+        //! Counters describing the progress of the loop.
+        struct Stats
+        {
+                //! Number of successful /sync requests.
+                uint64_t polls = 0;
+                //! Number of failed /sync requests.
+                uint64_t failed_polls = 0;
+                //! Number of processed responses.
+                uint64_t processed = 0;
+                //! Number of responses waiting to be processed.
+                std::size_t queue_depth = 0;
+                //! Highest number of responses that were waiting at the same time.
+                std::size_t max_queue_depth = 0;
+                //! Duration of the last successful request.
+                std::chrono::microseconds last_poll_latency{0};
+                //! Total duration of the successful requests.
+                std::chrono::microseconds total_poll_latency{0};
+                //! Duration of the last call to the handler.
+                std::chrono::microseconds last_processing_latency{0};
+                //! Total duration of the calls to the handler.
+                std::chrono::microseconds total_processing_latency{0};
+        };
+
+        SyncLoop(std::shared_ptr<Client> client, Handler handler, Options options);
+        SyncLoop(std::shared_ptr<Client> client, Handler handler)
+          : SyncLoop(client, handler, Options{})
+        {}
+        ~SyncLoop();
+
+        //! Start polling from the next batch token of the client.
+        void start();
+        //! Stop polling & cancel the request in flight. The responses already received
+        //! will be processed before the worker thread exits, unless the loop is started
+        //! again first.
+        void stop();
+
+        //! Retrieve a snapshot of the loop counters.
+        Stats stats() const;
+
+private:
+        //! The responses & the flags, shared with the worker thread. The handler can
+        //! release the last reference to the loop, so the worker outlives it.
+        struct State
+        {
+                explicit State(Handler handler)
+                  : handler{std::move(handler)}
+                {}
+
+                const Handler handler;
+
+                //! Responses waiting to be processed.
+                std::deque<std::shared_ptr<mtx::responses::Sync>> queue;
+                //! When a failed request should be sent again.
+                std::chrono::steady_clock::time_point retry_at;
+                //! Whether a failed request is waiting to be sent again.
+                bool is_retry_pending = false;
+                //! Whether polling is paused until the queue has room.
+                bool is_poll_blocked = false;
+                //! Whether the loop has been stopped.
+                bool is_stopped = true;
+                //! Incremented by each start, to drop what's left of the previous runs.
+                uint64_t generation = 0;
+                //! Number of requests sent, which tells the last one apart.
+                uint64_t sent = 0;
+                //! The request in flight, cancelled when the loop is stopped.
+                RequestID in_flight = 0;
+
+                Stats stats;
+
+                //! Used to synchronize access to the state of the loop.
+                std::mutex mutex;
+                //! Wakes up the worker thread.
+                std::condition_variable cv;
+        };
+
+        //! Send a request, unless the run it belongs to is over.
+        void poll(uint64_t generation);
+        void on_sync(uint64_t generation,
+                     std::shared_ptr<mtx::responses::Sync> batch,
+                     std::chrono::steady_clock::time_point started_at,
+                     const mtx::responses::Sync &res,
+                     Client::RequestErr err);
+        //! Holds the loop only while it sends a request.
+        static void run(std::shared_ptr<State> state,
+                        std::weak_ptr<SyncLoop> loop,
+                        uint64_t generation);
+        std::chrono::milliseconds next_backoff();
+
+        std::shared_ptr<Client> client_;
+        Options options_;
+
+        const std::shared_ptr<State> state_;
+
+        //! Number of consecutive failed requests. Guarded by the mutex of the state.
+        unsigned int failures_ = 0;
+        //! Processes the responses & sends the delayed requests.
+        std::thread worker_;
+        //! Used to add jitter to the retry delays.
+        std::mt19937 rng_{std::random_device{}()};
+};
+}
+}
@@ -0,0 +1,228 @@
+#include "sync_parser.hpp"
+
+#include <stdexcept>
+
+#include <json.hpp>
+
+using namespace mtx::client;
+
+namespace {
+
+bool
+is_whitespace(char c)
+{
+        return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+//! Decode a key which might contain escape sequences.
+std::string
+unescape(const std::string &raw)
+{
+        if (raw.find('\\') == std::string::npos)
+                return raw;
+
+        return json::parse("\"" + raw + "\"").get<std::string>();
+}
+}
+
+void
+SyncParser::feed(const char *data, std::size_t size)
+{
+        if (has_failed_)
+                return;
+
+        try {
+                scan(data, size);
+        } catch (...) {
+                has_failed_ = true;
+                throw;
+        }
+}
+
+void
+SyncParser::scan(const char *data, std::size_t size)
+{
+        for (const char *it = data, *end = data + size; it != end; ++it) {
+                const char c = *it;
+
+                if (in_string_) {
+                        if (is_capturing_)
+                                capture_.push_back(c);
+                        else if (is_key_ && (is_escaped_ || c != '"'))
+                                key_.push_back(c);
+
+                        if (is_escaped_) {
+                                is_escaped_ = false;
+                        } else if (c == '\\') {
+                                is_escaped_ = true;
+                        } else if (c == '"') {
+                                in_string_ = false;
+
+                                if (is_key_) {
+                                        is_key_ = false;
+                                        on_key(std::move(key_));
+                                        key_.clear();
+                                }
+                        }
+
+                        continue;
+                }
+
+                if (is_whitespace(c)) {
+                        if (is_capturing_)
+                                capture_.push_back(c);
+                        continue;
+                }
+
+                if (is_capturing_) {
+                        // The end of the member that is being captured.
+                        if (capture_nesting_ == 0 && (c == ',' || c == '}')) {
+                                is_capturing_ = false;
+                                on_captured();
+                        } else {
+                                capture_.push_back(c);
+
+                                if (c == '"')
+                                        in_string_ = true;
+                                else if (c == '{' || c == '[')
+                                        capture_nesting_ += 1;
+                                else if (c == '}' || c == ']')
+                                        capture_nesting_ -= 1;
+
+                                continue;
+                        }
+                }
+
+                if (expects_value_) {
+                        expects_value_ = false;
+                        on_value_start(c);
+
+                        if (is_capturing_)
+                                continue;
+                }
+
+                switch (c) {
+                case '{':
+                        containers_.push_back(c);
+                        depth_ += 1;
+                        expects_key_ = true;
+                        break;
+                case '[':
+                        containers_.push_back(c);
+                        depth_ += 1;
+                        break;
+                case '}':
+                case ']':
+                        if (containers_.empty())
+                                throw std::runtime_error("unbalanced /sync response");
+
+                        containers_.pop_back();
+                        depth_ -= 1;
+                        is_done_ = depth_ == 0;
+                        break;
+                case ',':
+                        expects_key_ = !containers_.empty() && containers_.back() == '{';
+                        break;
+                case ':':
+                        expects_key_   = false;
+                        expects_value_ = true;
+                        break;
+                case '"':
+                        in_string_ = true;
+                        is_key_    = expects_key_;
+                        break;
+                default:
+                        break;
+                }
+        }
+}
+
+void
+SyncParser::on_key(std::string key)
+{
+        if (depth_ < 4)
+                keys_[depth_] = std::move(key);
+}
+
+void
+SyncParser::on_value_start(char c)
+{
+        if (depth_ == 1 && keys_[1] != "rooms") {
+                capture_section_ = Section::Top;
+        } else if (depth_ == 3 && keys_[1] == "rooms" && keys_[2] == "join") {
+                capture_section_ = Section::Join;
+        } else if (depth_ == 3 && keys_[1] == "rooms" && keys_[2] == "leave") {
+                capture_section_ = Section::Leave;
+        } else if (depth_ == 3 && keys_[1] == "rooms" && keys_[2] == "invite") {
+                capture_section_ = Section::Invite;
+        } else {
+                // Either a level that we have to walk into or a value we don't need.
+                return;
+        }
+
+        is_capturing_    = true;
+        capture_nesting_ = 0;
+        capture_.clear();
+
+        capture_.push_back(c);
+
+        if (c == '"')
+                in_string_ = true;
+        else if (c == '{' || c == '[')
+                capture_nesting_ += 1;
+}
+
+void
+SyncParser::on_captured()
+{
+        using namespace mtx::responses;
+
+        switch (capture_section_) {
+        case Section::Top:
+                if (!top_.empty())
+                        top_.push_back(',');
+                top_ += "\"" + keys_[1] + "\":" + capture_;
+                break;
+        case Section::Join:
+                if (handlers_.join)
+                        handlers_.join(unescape(keys_[3]), json::parse(capture_));
+                else
+                        join_.emplace(unescape(keys_[3]), json::parse(capture_).get<JoinedRoom>());
+                break;
+        case Section::Leave:
+                if (handlers_.leave)
+                        handlers_.leave(unescape(keys_[3]), json::parse(capture_));
+                else
+                        leave_.emplace(unescape(keys_[3]), json::parse(capture_).get<LeftRoom>());
+                break;
+        case Section::Invite:
+                if (handlers_.invite)
+                        handlers_.invite(unescape(keys_[3]), json::parse(capture_));
+                else
+                        invite_.emplace(unescape(keys_[3]),
+                                        json::parse(capture_).get<InvitedRoom>());
+                break;
+        }
+
+        // The buffer is kept to be reused by the next room.
+        capture_.clear();
+}
+
+mtx::responses::Sync
+SyncParser::finish()
+{
+        if (has_failed_ || !is_done_)
+                throw std::runtime_error("incomplete /sync response");
+
+        json top = json::parse("{" + top_ + "}");
+        top["rooms"] = {
+          {"join", json::object()}, {"leave", json::object()}, {"invite", json::object()}};
+
+        mtx::responses::Sync sync = top;
+
+        sync.rooms.join   = std::move(join_);
+        sync.rooms.leave  = std::move(leave_);
+        sync.rooms.invite = std::move(invite_);
+
+        return sync;
+}
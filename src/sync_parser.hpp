@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "mtx/responses.hpp"
+
+namespace mtx {
+namespace client {
+
+//! Functions to be called as soon as a room of a /sync response has been parsed.
+struct SyncRoomHandlers
+{
+        //! Called for every room under `rooms.join`.
+        std::function<void(const std::string &room_id, mtx::responses::JoinedRoom room)> join;
+        //! Called for every room under `rooms.leave`.
+        std::function<void(const std::string &room_id, mtx::responses::LeftRoom room)> leave;
+        //! Called for every room under `rooms.invite`.
+        std::function<void(const std::string &room_id, mtx::responses::InvitedRoom room)> invite;
+};
+
+//! Builds a mtx::responses::Sync from the raw /sync body without creating the
+//! JSON document of the whole response. The body is scanned as it is fed and
+//! only the object of a single room is parsed into a DOM at any given time,
+//! which keeps the peak memory low for accounts with a lot of rooms.
+class SyncParser
+{
+public:
+        //! Rooms with a handler will be passed to it instead of being
+        //! stored in the final response.
+        explicit SyncParser(SyncRoomHandlers handlers = {})
+          : handlers_{std::move(handlers)}
+        {}
+
+        //! Process the next chunk of the body. Once an exception has been
+        //! thrown any subsequent chunk will be ignored.
+        void feed(const char *data, std::size_t size);
+        void feed(const std::string &data) { feed(data.data(), data.size()); }
+
+        //! Whether the whole top-level object has been received.
+        bool is_done() const { return is_done_; }
+
+        //! Retrieve the response after the whole body has been fed.
+        //! Throws std::runtime_error if the body is incomplete.
+        mtx::responses::Sync finish();
+
+private:
+        //! Where the value being captured belongs to.
+        enum class Section
+        {
+                //! A top-level member other than `rooms`.
+                Top,
+                //! A room under `rooms.join`.
+                Join,
+                //! A room under `rooms.leave`.
+                Leave,
+                //! A room under `rooms.invite`.
+                Invite,
+        };
+
+        void scan(const char *data, std::size_t size);
+        void on_value_start(char c);
+        void on_key(std::string key);
+        void on_captured();
+
+        SyncRoomHandlers handlers_;
+
+        //! Number of open objects & arrays outside of the captured value.
+        std::size_t depth_ = 0;
+        //! The type of each open container.
+        std::vector<char> containers_;
+        //! The raw key of each of the first levels.
+        std::string keys_[4];
+
+        bool in_string_     = false;
+        bool is_escaped_    = false;
+        bool is_key_        = false;
+        bool expects_key_   = false;
+        bool expects_value_ = false;
+        bool is_done_       = false;
+        bool has_failed_    = false;
+
+        //! The key being read.
+        std::string key_;
+
+        //! Whether a value is being captured.
+        bool is_capturing_ = false;
+        //! Nesting level inside the captured value.
+        std::size_t capture_nesting_ = 0;
+        //! The section of the captured value.
+        Section capture_section_ = Section::Top;
+        //! The raw text of the captured value.
+        std::string capture_;
+
+        //! The raw top-level members, except for `rooms`.
+        std::string top_;
+
+        std::map<std::string, mtx::responses::JoinedRoom> join_;
+        std::map<std::string, mtx::responses::LeftRoom> leave_;
+        std::map<std::string, mtx::responses::InvitedRoom> invite_;
+};
+}
+}
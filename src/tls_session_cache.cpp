@@ -0,0 +1,122 @@
+#include "tls_session_cache.hpp"
+
+using namespace mtx::client;
+
+TlsSessionCache::TlsSessionCache(boost::asio::ssl::context &ssl_ctx)
+{
+        // OpenSSL will hand us every new session through the callback.
+        // TLS 1.3 sends the tickets after the handshake, so looking up
+        // the session right after the handshake isn't enough.
+        SSL_CTX_set_session_cache_mode(ssl_ctx.native_handle(),
+                                       SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ssl_ctx.native_handle(), &TlsSessionCache::on_new_session);
+}
+
+TlsSessionCache::~TlsSessionCache()
+{
+        for (auto &session : sessions_)
+                SSL_SESSION_free(session.second);
+}
+
+void
+TlsSessionCache::prepare(SSL *ssl, const std::string &host)
+{
+        // The context might be shared by multiple caches, so every
+        // connection keeps track of the cache it belongs to. The new sessions
+        // are stored under the host they were looked up with, as the server
+        // name sent with SNI doesn't have the port.
+        SSL_set_ex_data(ssl, ex_data_index(), this);
+        SSL_set_ex_data(ssl, host_ex_data_index(), new std::string(host));
+
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        auto it = sessions_.find(host);
+        if (it != sessions_.end())
+                SSL_set_session(ssl, it->second);
+}
+
+void
+TlsSessionCache::on_handshake(SSL *ssl)
+{
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        if (SSL_session_reused(ssl))
+                resumed_ += 1;
+        else
+                full_ += 1;
+}
+
+void
+TlsSessionCache::remove(const std::string &host)
+{
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        auto it = sessions_.find(host);
+        if (it != sessions_.end()) {
+                SSL_SESSION_free(it->second);
+                sessions_.erase(it);
+        }
+}
+
+TlsSessionCache::Stats
+TlsSessionCache::stats() const
+{
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        Stats stats;
+        stats.resumed = resumed_;
+        stats.full    = full_;
+        stats.cached  = sessions_.size();
+
+        return stats;
+}
+
+int
+TlsSessionCache::ex_data_index()
+{
+        static const int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return index;
+}
+
+int
+TlsSessionCache::host_ex_data_index()
+{
+        static const int index =
+          SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, &TlsSessionCache::free_host);
+        return index;
+}
+
+void
+TlsSessionCache::free_host(void *, void *host, CRYPTO_EX_DATA *, int, long, void *)
+{
+        delete static_cast<std::string *>(host);
+}
+
+int
+TlsSessionCache::on_new_session(SSL *ssl, SSL_SESSION *session)
+{
+        auto cache = static_cast<TlsSessionCache *>(SSL_get_ex_data(ssl, ex_data_index()));
+        auto host  = static_cast<std::string *>(SSL_get_ex_data(ssl, host_ex_data_index()));
+
+        if (cache == nullptr || host == nullptr)
+                return 0;
+
+        cache->store(*host, session);
+
+        // We keep the reference to the session.
+        return 1;
+}
+
+void
+TlsSessionCache::store(const std::string &host, SSL_SESSION *session)
+{
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        auto it = sessions_.find(host);
+        if (it != sessions_.end()) {
+                SSL_SESSION_free(it->second);
+                it->second = session;
+        } else {
+                sessions_.emplace(host, session);
+        }
+}
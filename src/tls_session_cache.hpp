@@ -0,0 +1,64 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <boost/asio/ssl.hpp>
+
+namespace mtx {
+namespace client {
+
+//! Client side cache of TLS sessions, used to resume the sessions
+//! (with tickets or session IDs) when a new connection to a host is opened.
+class TlsSessionCache
+{
+public:
+        //! Counters describing the outcome of the TLS handshakes.
+        struct Stats
+        {
+                //! Number of handshakes that resumed a cached session.
+                uint64_t resumed = 0;
+                //! Number of handshakes that negotiated a new session.
+                uint64_t full = 0;
+                //! Number of hosts with a cached session.
+                std::size_t cached = 0;
+        };
+
+        //! Enable the client side session cache on the given context.
+        explicit TlsSessionCache(boost::asio::ssl::context &ssl_ctx);
+        ~TlsSessionCache();
+
+        TlsSessionCache(const TlsSessionCache &) = delete;
+        TlsSessionCache &operator=(const TlsSessionCache &) = delete;
+
+        //! Offer the cached session for the host (if any) on the next handshake.
+        void prepare(SSL *ssl, const std::string &host);
+        //! Update the counters after a successful handshake.
+        void on_handshake(SSL *ssl);
+        //! Forget the session of the host, e.g after a failed handshake.
+        void remove(const std::string &host);
+
+        //! Retrieve a snapshot of the handshake counters.
+        Stats stats() const;
+
+private:
+        static int ex_data_index();
+        //! Index of the host of the connection, as given to `prepare`.
+        static int host_ex_data_index();
+        static void free_host(void *, void *host, CRYPTO_EX_DATA *, int, long, void *);
+        static int on_new_session(SSL *ssl, SSL_SESSION *session);
+
+        void store(const std::string &host, SSL_SESSION *session);
+
+        //! The most recent session of each host.
+        std::map<std::string, SSL_SESSION *> sessions_;
+        //! Used to synchronize access to the cache.
+        mutable std::mutex mutex_;
+
+        uint64_t resumed_ = 0;
+        uint64_t full_    = 0;
+};
+}
+}
@@ -0,0 +1,302 @@
+#include "traffic_recorder.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+
+using namespace mtx::client;
+
+namespace {
+
+//! The start of a recording: a magic string & the version of the format.
+constexpr char file_header[] = {'M', 'T', 'X', 'R', 1};
+
+//! Larger sizes can only come from a corrupted file.
+constexpr uint64_t max_field_size = uint64_t{1} << 32;
+
+constexpr char redacted[] = "REDACTED";
+
+//! The JSON keys & the query parameters whose values are redacted.
+const char *const secret_names[] = {"access_token", "refresh_token", "password"};
+
+boost::system::error_code
+corrupted_error()
+{
+        return boost::system::errc::make_error_code(boost::system::errc::illegal_byte_sequence);
+}
+
+//! The error of the last operation on the file.
+boost::system::error_code
+file_error(gzFile file)
+{
+        int error = Z_OK;
+        gzerror(file, &error);
+
+        if (error == Z_ERRNO && errno != 0)
+                return boost::system::error_code(errno, boost::system::system_category());
+
+        return boost::system::errc::make_error_code(boost::system::errc::io_error);
+}
+
+void
+put_varint(std::string &out, uint64_t value)
+{
+        while (value >= 0x80) {
+                out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+                value >>= 7;
+        }
+
+        out.push_back(static_cast<char>(value));
+}
+
+void
+put_string(std::string &out, const std::string &value)
+{
+        put_varint(out, value.size());
+        out.append(value);
+}
+
+//! Returns false at the end of the file.
+bool
+get_varint(gzFile file, uint64_t &value)
+{
+        value = 0;
+
+        for (unsigned int shift = 0; shift < 64; shift += 7) {
+                const int c = gzgetc(file);
+                if (c < 0)
+                        return false;
+
+                value |= uint64_t(c & 0x7f) << shift;
+                if ((c & 0x80) == 0)
+                        return true;
+        }
+
+        return false;
+}
+
+bool
+get_string(gzFile file, std::string &value)
+{
+        uint64_t size = 0;
+        if (!get_varint(file, size) || size > max_field_size)
+                return false;
+
+        value.resize(size);
+
+        std::size_t done = 0;
+        while (done < size) {
+                // gzread takes an unsigned int.
+                const auto chunk = static_cast<unsigned int>(
+                  std::min<uint64_t>(size - done, std::numeric_limits<int>::max()));
+                const int n = gzread(file, &value[done], chunk);
+                if (n <= 0)
+                        return false;
+
+                done += n;
+        }
+
+        return true;
+}
+
+//! Redact the value following `name` at `pos`, if it's a JSON string. Returns
+//! the position to continue the search from.
+std::size_t
+redact_json_value(std::string &text, std::size_t pos)
+{
+        while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos])))
+                ++pos;
+        if (pos == text.size() || text[pos] != ':')
+                return pos;
+
+        ++pos;
+        while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos])))
+                ++pos;
+        if (pos == text.size() || text[pos] != '"')
+                return pos;
+
+        const auto start = ++pos;
+        while (pos < text.size() && text[pos] != '"')
+                pos += text[pos] == '\\' ? 2 : 1;
+
+        const auto end = std::min(pos, text.size());
+        text.replace(start, end - start, redacted);
+
+        return start + sizeof(redacted);
+}
+
+//! Redact the value of a query parameter, up to the next parameter.
+std::size_t
+redact_query_value(std::string &text, std::size_t pos)
+{
+        const auto end = std::min(text.find('&', pos), text.size());
+        text.replace(pos, end - pos, redacted);
+
+        return pos + sizeof(redacted) - 1;
+}
+}
+
+void
+mtx::client::redact_secrets(std::string &text)
+{
+        for (const auto name : secret_names) {
+                const auto size = std::strlen(name);
+
+                std::size_t pos = 0;
+                while ((pos = text.find(name, pos)) != std::string::npos) {
+                        const auto end = pos + size;
+
+                        if (pos > 0 && text[pos - 1] == '"' && end < text.size() &&
+                            text[end] == '"')
+                                pos = redact_json_value(text, end + 1);
+                        else if (pos > 0 && (text[pos - 1] == '?' || text[pos - 1] == '&') &&
+                                 end < text.size() && text[end] == '=')
+                                pos = redact_query_value(text, end + 1);
+                        else
+                                pos = end;
+                }
+        }
+}
+
+std::shared_ptr<TrafficRecorder>
+TrafficRecorder::open(const std::string &path, boost::system::error_code &ec)
+{
+        errno           = 0;
+        const auto file = gzopen(path.c_str(), "wb6");
+        if (!file) {
+                ec = boost::system::error_code(errno ? errno : ENOMEM,
+                                               boost::system::system_category());
+                return nullptr;
+        }
+
+        // Larger writes into zlib, as the records are written one by one.
+        gzbuffer(file, 1 << 16);
+
+        if (gzwrite(file, file_header, sizeof(file_header)) != sizeof(file_header)) {
+                ec = file_error(file);
+                gzclose(file);
+                return nullptr;
+        }
+
+        return std::shared_ptr<TrafficRecorder>(new TrafficRecorder(file));
+}
+
+TrafficRecorder::TrafficRecorder(gzFile file)
+  : file_{file}
+  , started_at_{std::chrono::steady_clock::now()}
+{}
+
+TrafficRecorder::~TrafficRecorder() { close(); }
+
+void
+TrafficRecorder::write(TrafficRecord record)
+{
+        // Outside of the lock, as it's what takes the longest.
+        redact_secrets(record.target);
+        redact_secrets(record.request_body);
+        redact_secrets(record.response_body);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!file_)
+                return;
+
+        buffer_.clear();
+        put_varint(buffer_, record.start.count());
+        put_varint(buffer_, record.duration.count());
+        put_varint(buffer_, static_cast<uint64_t>(record.method));
+        put_varint(buffer_, record.status);
+        put_string(buffer_, record.target);
+        put_string(buffer_, record.request_body);
+        put_string(buffer_, record.response_fields);
+        put_string(buffer_, record.response_body);
+
+        // gzwrite takes the whole record, or fails.
+        if (gzwrite(file_, buffer_.data(), static_cast<unsigned int>(buffer_.size())) > 0)
+                ++records_;
+}
+
+void
+TrafficRecorder::flush()
+{
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (file_)
+                gzflush(file_, Z_SYNC_FLUSH);
+}
+
+void
+TrafficRecorder::close()
+{
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (file_)
+                gzclose(file_);
+
+        file_ = nullptr;
+}
+
+uint64_t
+TrafficRecorder::records() const
+{
+        std::lock_guard<std::mutex> lock(mutex_);
+        return records_;
+}
+
+std::unique_ptr<TrafficReader>
+TrafficReader::open(const std::string &path, boost::system::error_code &ec)
+{
+        errno           = 0;
+        const auto file = gzopen(path.c_str(), "rb");
+        if (!file) {
+                ec = boost::system::error_code(errno ? errno : ENOMEM,
+                                               boost::system::system_category());
+                return nullptr;
+        }
+
+        gzbuffer(file, 1 << 16);
+
+        char header[sizeof(file_header)];
+        if (gzread(file, header, sizeof(header)) != sizeof(header) ||
+            std::memcmp(header, file_header, sizeof(header)) != 0) {
+                ec = corrupted_error();
+                gzclose(file);
+                return nullptr;
+        }
+
+        return std::unique_ptr<TrafficReader>(new TrafficReader(file));
+}
+
+TrafficReader::TrafficReader(gzFile file)
+  : file_{file}
+{}
+
+TrafficReader::~TrafficReader() { gzclose(file_); }
+
+bool
+TrafficReader::next(TrafficRecord &record, boost::system::error_code &ec)
+{
+        uint64_t start = 0;
+        if (!get_varint(file_, start)) {
+                // The end of the file, unless it's cut in the middle of the varint.
+                if (!gzeof(file_))
+                        ec = file_error(file_);
+                return false;
+        }
+
+        uint64_t duration = 0, method = 0, status = 0;
+        if (!get_varint(file_, duration) || !get_varint(file_, method) ||
+            !get_varint(file_, status) || !get_string(file_, record.target) ||
+            !get_string(file_, record.request_body) ||
+            !get_string(file_, record.response_fields) ||
+            !get_string(file_, record.response_body)) {
+                ec = corrupted_error();
+                return false;
+        }
+
+        record.start    = std::chrono::microseconds(start);
+        record.duration = std::chrono::microseconds(duration);
+        record.method   = static_cast<boost::beast::http::verb>(method);
+        record.status   = static_cast<unsigned int>(status);
+
+        return true;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <boost/beast/http/verb.hpp>
+#include <boost/system/error_code.hpp>
+#include <zlib.h>
+
+namespace mtx {
+namespace client {
+
+//! A request & its response, as captured by a `TrafficRecorder`.
+struct TrafficRecord
+{
+        //! When the request was sent, since the recording started.
+        std::chrono::microseconds start{0};
+        //! How long it took until the response was received in full.
+        std::chrono::microseconds duration{0};
+        boost::beast::http::verb method = boost::beast::http::verb::get;
+        //! The target of the request (e.g "/_matrix/client/r0/sync?since=s1").
+        std::string target;
+        //! The body of the request.
+        std::string request_body;
+        unsigned int status = 0;
+        //! The fields of the response that describe its body (e.g Content-Type),
+        //! each one terminated by CRLF.
+        std::string response_fields;
+        //! The body of the response, decoded if it was compressed.
+        std::string response_body;
+};
+
+//! Writes the requests of a client & their responses to a file (see
+//! `Client::set_recorder`), to be replayed later. The access tokens & passwords
+//! are redacted, in the targets & in the bodies.
+//!
+//! The file is gzip compressed. It starts with a magic string, followed by the
+//! records: the start, the duration, the method & the status as varints, then
+//! the target, the request body, the response fields & the response body, each
+//! one prefixed by its size as a varint.
+class TrafficRecorder
+{
+public:
+        //! Create the file, replacing any existing one. Returns nullptr on failure.
+        static std::shared_ptr<TrafficRecorder> open(const std::string &path,
+                                                     boost::system::error_code &ec);
+        ~TrafficRecorder();
+
+        TrafficRecorder(const TrafficRecorder &) = delete;
+        TrafficRecorder &operator=(const TrafficRecorder &) = delete;
+
+        //! Append a record, after redacting it. Called from the network threads.
+        void write(TrafficRecord record);
+        //! Write out what's buffered.
+        void flush();
+        //! Finish the file, which is otherwise finished once the recorder is destroyed.
+        //! The records written after this are dropped.
+        void close();
+
+        //! When the recording started, which the records' starts are relative to.
+        std::chrono::steady_clock::time_point started_at() const { return started_at_; }
+        //! Number of records written.
+        uint64_t records() const;
+
+private:
+        explicit TrafficRecorder(gzFile file);
+
+        mutable std::mutex mutex_;
+        gzFile file_;
+        std::chrono::steady_clock::time_point started_at_;
+        uint64_t records_ = 0;
+        //! The encoded record, kept between the writes for its storage.
+        std::string buffer_;
+};
+
+//! Reads the records of a file written by a `TrafficRecorder`, one at a time.
+class TrafficReader
+{
+public:
+        //! Returns nullptr if the file can't be opened or isn't a recording.
+        static std::unique_ptr<TrafficReader> open(const std::string &path,
+                                                   boost::system::error_code &ec);
+        ~TrafficReader();
+
+        TrafficReader(const TrafficReader &) = delete;
+        TrafficReader &operator=(const TrafficReader &) = delete;
+
+        //! Read the next record. Returns false at the end of the file, or on an error.
+        bool next(TrafficRecord &record, boost::system::error_code &ec);
+
+private:
+        explicit TrafficReader(gzFile file);
+
+        gzFile file_;
+};
+
+//! Replace the values of the secrets (access tokens, passwords) of a JSON text
+//! or a query string with "REDACTED".
+void
+redact_secrets(std::string &text);
+}
+}
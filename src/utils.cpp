@@ -1,4 +1,8 @@
 #include "utils.hpp"
+#include "sync_parser.hpp"
+
+#include <algorithm>
+#include <cctype>
 
 #include <boost/random/random_device.hpp>
 #include <boost/random/uniform_int_distribution.hpp>
@@ -25,6 +29,50 @@ mtx::client::utils::random_token(uint8_t len, bool with_symbols)
         return token;
 }
 
+std::pair<std::string, std::string>
+mtx::client::utils::split_host_port(const std::string &server)
+{
+        const auto colon = server.rfind(':');
+
+        std::string host = server, port = "443";
+
+        // A colon inside the brackets of an IPv6 address isn't followed by a port.
+        if (colon != std::string::npos && server.find(']', colon) == std::string::npos &&
+            colon + 1 < server.size() &&
+            std::all_of(server.begin() + colon + 1, server.end(), [](char c) {
+                    return c >= '0' && c <= '9';
+            })) {
+                host = server.substr(0, colon);
+                port = server.substr(colon + 1);
+        }
+
+        if (host.size() > 1 && host.front() == '[' && host.back() == ']')
+                host = host.substr(1, host.size() - 2);
+
+        return {host, port};
+}
+
+std::string
+mtx::client::utils::url_encode(const std::string &value)
+{
+        static const char digits[] = "0123456789ABCDEF";
+
+        std::string encoded;
+        encoded.reserve(value.size());
+
+        for (const unsigned char c : value) {
+                if (std::isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+                        encoded.push_back(c);
+                } else {
+                        encoded.push_back('%');
+                        encoded.push_back(digits[c >> 4]);
+                        encoded.push_back(digits[c & 0xf]);
+                }
+        }
+
+        return encoded;
+}
+
 std::string
 mtx::client::utils::query_params(const std::map<std::string, std::string> &params)
 {
@@ -45,3 +93,13 @@ mtx::client::utils::query_params(const std::map<std::string, std::string> &param
 
         return data;
 }
+
+template<>
+mtx::responses::Sync
+mtx::client::utils::deserialize<mtx::responses::Sync>(const std::string &data)
+{
+        SyncParser parser;
+        parser.feed(data);
+
+        return parser.finish();
+}
@@ -2,17 +2,44 @@
 
 #include <map>
 #include <string>
+#include <utility>
+
+#include <json.hpp>
+
+#include "mtx/responses.hpp"
 
 namespace mtx {
 namespace client {
 namespace utils {
 
-//! Generates a random string of the given size.
+//! Generates a random string of the given size. It reads from the system's
+//! random device, so it should only be used where the value has to be
+//! unpredictable (e.g transaction ids or room aliases).
 std::string
 random_token(uint8_t len = 12, bool with_symbols = true);
+//! Split the address of a server into its host & its port, which is 443 if it's
+//! not given (e.g "example.com:8448" or "[::1]:8448").
+std::pair<std::string, std::string>
+split_host_port(const std::string &server);
+//! Percent-encode everything but the unreserved characters (RFC 3986).
+std::string
+url_encode(const std::string &value);
 //! Construct query string from the given parameter pairs.
 std::string
 query_params(const std::map<std::string, std::string> &params);
+
+//! Convert the body of a response to the given type.
+template<class Response>
+Response
+deserialize(const std::string &data)
+{
+        return json::parse(data);
+}
+
+//! The /sync response is parsed one room at a time, without the DOM of the whole body.
+template<>
+mtx::responses::Sync
+deserialize<mtx::responses::Sync>(const std::string &data);
 }
 }
 }
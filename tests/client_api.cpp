@@ -1,11 +1,15 @@
+#include <atomic>
 #include <chrono>
+#include <future>
 #include <thread>
 
 #include <gtest/gtest.h>
 
 #include "client.hpp"
+#include "client_pool.hpp"
 #include "mtx/requests.hpp"
 #include "mtx/responses.hpp"
+#include "sync_loop.hpp"
 
 using namespace mtx::client;
 using namespace mtx::identifiers;
@@ -14,6 +18,44 @@ using namespace std;
 
 using ErrType = std::experimental::optional<errors::ClientError>;
 
+//! Counts the allocations made through it.
+template<class T>
+struct CountingAllocator
+{
+        using value_type = T;
+
+        explicit CountingAllocator(std::atomic<int> *count)
+          : count(count)
+        {}
+
+        template<class U>
+        CountingAllocator(const CountingAllocator<U> &other)
+          : count(other.count)
+        {}
+
+        T *allocate(std::size_t n)
+        {
+                *count += 1;
+                return std::allocator<T>().allocate(n);
+        }
+
+        void deallocate(T *p, std::size_t n) { std::allocator<T>().deallocate(p, n); }
+
+        template<class U>
+        bool operator==(const CountingAllocator<U> &other) const
+        {
+                return count == other.count;
+        }
+
+        template<class U>
+        bool operator!=(const CountingAllocator<U> &other) const
+        {
+                return count != other.count;
+        }
+
+        std::atomic<int> *count;
+};
+
 void
 validate_login(const std::string &user, const mtx::responses::Login &res)
 {
@@ -379,3 +421,651 @@ TEST(ClientAPI, Sync)
 
         mtx_client->close();
 }
+
+TEST(ClientAPI, ConnectionReuse)
+{
+        std::shared_ptr<Client> mtx_client = std::make_shared<Client>("localhost");
+
+        std::atomic<int> completed(0);
+
+        mtx_client->login(
+          "alice", "secret", [&completed](const mtx::responses::Login &res, ErrType err) {
+                  ASSERT_FALSE(err);
+                  validate_login("@alice:localhost", res);
+                  completed += 1;
+          });
+
+        while (completed != 1)
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        mtx::requests::CreateRoom req;
+        req.name  = "Name";
+        req.topic = "Topic";
+        mtx_client->create_room(req, [&completed](const mtx::responses::CreateRoom &, ErrType err) {
+                ASSERT_FALSE(err);
+                completed += 1;
+        });
+
+        while (completed != 2)
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        // The second request should have been sent over the connection of the first.
+        const auto stats = mtx_client->connection_pool()->stats();
+        EXPECT_EQ(stats.created, 1);
+        EXPECT_EQ(stats.reused, 1);
+        EXPECT_EQ(stats.active, 0);
+
+        mtx_client->close();
+}
+
+TEST(ClientAPI, TlsSessionResumption)
+{
+        // The sessions are cached under the server as given, with or without its port,
+        // while SNI only names the host.
+        for (const auto &server : {"localhost", "localhost:443"}) {
+                std::shared_ptr<Client> mtx_client = std::make_shared<Client>(server);
+
+                // Every request will have to open a new connection.
+                mtx_client->connection_pool()->set_max_idle(0);
+
+                std::atomic<int> completed(0);
+
+                for (int i = 1; i <= 3; ++i) {
+                        mtx_client->login(
+                          "alice",
+                          "secret",
+                          [&completed](const mtx::responses::Login &res, ErrType err) {
+                                  ASSERT_FALSE(err);
+                                  validate_login("@alice:localhost", res);
+                                  completed += 1;
+                          });
+
+                        while (completed != i)
+                                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                }
+
+                const auto stats = mtx_client->tls_session_cache()->stats();
+                EXPECT_EQ(stats.full, 1) << server;
+                EXPECT_EQ(stats.resumed, 2) << server;
+
+                mtx_client->close();
+        }
+}
+
+TEST(ClientAPI, StreamingSync)
+{
+        std::shared_ptr<Client> mtx_client = std::make_shared<Client>("localhost");
+
+        mtx_client->login(
+          "alice", "secret", [mtx_client](const mtx::responses::Login &res, ErrType err) {
+                  boost::ignore_unused(res);
+                  ASSERT_FALSE(err);
+          });
+
+        // Waiting for the previous request to complete.
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+
+        mtx::requests::CreateRoom req;
+        req.name  = "Name";
+        req.topic = "Topic";
+        mtx_client->create_room(
+          req, [](const mtx::responses::CreateRoom &, ErrType err) { ASSERT_FALSE(err); });
+
+        // Waiting for the previous request to complete.
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+
+        std::atomic<int> joined_rooms(0);
+
+        SyncRoomHandlers handlers;
+        handlers.join = [&joined_rooms](const std::string &room_id,
+                                        mtx::responses::JoinedRoom) {
+                ASSERT_FALSE(room_id.empty());
+                joined_rooms += 1;
+        };
+
+        mtx_client->sync("",
+                         "",
+                         false,
+                         0,
+                         handlers,
+                         [&joined_rooms](const mtx::responses::Sync &res, ErrType err) {
+                                 ASSERT_FALSE(err);
+                                 ASSERT_TRUE(joined_rooms > 0);
+                                 ASSERT_TRUE(res.rooms.join.empty());
+                                 ASSERT_TRUE(res.next_batch.size() > 0);
+                         });
+
+        mtx_client->close();
+}
+
+TEST(ClientAPI, CompressedSync)
+{
+        std::shared_ptr<Client> mtx_client = std::make_shared<Client>("localhost");
+        mtx_client->set_compression(true);
+
+        mtx_client->login(
+          "alice", "secret", [mtx_client](const mtx::responses::Login &res, ErrType err) {
+                  boost::ignore_unused(res);
+                  ASSERT_FALSE(err);
+          });
+
+        // Waiting for the previous request to complete.
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+
+        mtx::requests::CreateRoom req;
+        req.name  = "Name";
+        req.topic = "Topic";
+        mtx_client->create_room(
+          req, [](const mtx::responses::CreateRoom &, ErrType err) { ASSERT_FALSE(err); });
+
+        // Waiting for the previous request to complete.
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+
+        std::atomic<int> completed(0);
+        std::atomic<int> joined_rooms(0);
+
+        mtx_client->sync(
+          "", "", false, 0, [&completed](const mtx::responses::Sync &res, ErrType err) {
+                  completed += 1;
+                  ASSERT_FALSE(err);
+                  ASSERT_TRUE(res.rooms.join.size() > 0);
+                  ASSERT_TRUE(res.next_batch.size() > 0);
+          });
+
+        // The decoded body is parsed while it's received.
+        SyncRoomHandlers handlers;
+        handlers.join = [&joined_rooms](const std::string &, mtx::responses::JoinedRoom) {
+                joined_rooms += 1;
+        };
+
+        mtx_client->sync("",
+                         "",
+                         false,
+                         0,
+                         handlers,
+                         [&completed](const mtx::responses::Sync &res, ErrType err) {
+                                 completed += 1;
+                                 ASSERT_FALSE(err);
+                                 ASSERT_TRUE(res.next_batch.size() > 0);
+                         });
+
+        while (completed < 2)
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        EXPECT_TRUE(joined_rooms > 0);
+
+        mtx_client->close();
+}
+
+TEST(ClientAPI, SyncLoop)
+{
+        std::shared_ptr<Client> mtx_client = std::make_shared<Client>("localhost");
+
+        mtx_client->login(
+          "alice", "secret", [mtx_client](const mtx::responses::Login &res, ErrType err) {
+                  ASSERT_FALSE(err);
+                  mtx_client->set_access_token(res.access_token);
+          });
+
+        // Waiting for the previous request to complete.
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+
+        std::atomic<int> batches(0);
+
+        SyncLoop::Options options;
+        options.timeout    = 1000;
+        options.max_queued = 1;
+
+        auto sync_loop = std::make_shared<SyncLoop>(
+          mtx_client,
+          [&batches, mtx_client](const mtx::responses::Sync &res) {
+                  ASSERT_TRUE(res.next_batch.size() > 0);
+                  ASSERT_EQ(mtx_client->next_batch_token().empty(), false);
+                  batches += 1;
+          },
+          options);
+
+        sync_loop->start();
+
+        // Waiting for a few long-polls to complete.
+        std::this_thread::sleep_for(std::chrono::seconds(5));
+
+        sync_loop->stop();
+
+        const auto stats = sync_loop->stats();
+        EXPECT_GE(batches, 2);
+        EXPECT_EQ(stats.processed, static_cast<uint64_t>(batches));
+        EXPECT_LE(stats.max_queue_depth, options.max_queued);
+        EXPECT_EQ(stats.failed_polls, 0U);
+
+        mtx_client->close();
+}
+
+//! Prepare a /sync request that will be held by the server for 30 seconds.
+std::shared_ptr<Session>
+long_poll_session(RequestID id,
+                  const std::string &access_token,
+                  const std::string &since,
+                  std::function<void(const boost::system::error_code &)> on_failure)
+{
+        auto session = std::make_shared<Session>(
+          "localhost",
+          id,
+          [](RequestID, HttpResponse, const boost::system::error_code &) {
+                  FAIL() << "the request wasn't aborted";
+          },
+          [on_failure](RequestID, const boost::system::error_code ec) { on_failure(ec); });
+
+        session->request.method(boost::beast::http::verb::get);
+        session->request.target("/_matrix/client/r0/sync?timeout=30000&since=" + since);
+        session->request.set(boost::beast::http::field::host, "localhost");
+        session->request.set(boost::beast::http::field::authorization, "Bearer " + access_token);
+        session->request.prepare_payload();
+
+        return session;
+}
+
+TEST(ClientAPI, CancelLongPoll)
+{
+        std::shared_ptr<Client> mtx_client = std::make_shared<Client>("localhost");
+
+        std::string access_token, since;
+
+        mtx_client->login(
+          "alice", "secret", [&access_token](const mtx::responses::Login &res, ErrType err) {
+                  ASSERT_FALSE(err);
+                  access_token = res.access_token;
+          });
+
+        // Waiting for the previous request to complete.
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+
+        mtx_client->sync("", "", false, 0, [&since](const mtx::responses::Sync &res, ErrType err) {
+                ASSERT_FALSE(err);
+                since = res.next_batch;
+        });
+
+        // Waiting for the previous request to complete.
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+
+        std::atomic<bool> has_failed(false);
+        boost::system::error_code result;
+
+        const auto request_id = mtx_client->next_request_id();
+
+        mtx_client->do_request(
+          long_poll_session(request_id, access_token, since, [&](const auto &ec) {
+                  result     = ec;
+                  has_failed = true;
+          }));
+
+        // Waiting for the request to be sent.
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+
+        const auto cancelled_at = std::chrono::steady_clock::now();
+        mtx_client->cancel_request(request_id);
+
+        while (!has_failed &&
+               std::chrono::steady_clock::now() - cancelled_at < std::chrono::seconds(5))
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        ASSERT_TRUE(has_failed);
+        EXPECT_EQ(result, boost::asio::error::operation_aborted);
+        EXPECT_LT(std::chrono::steady_clock::now() - cancelled_at, std::chrono::seconds(1));
+        EXPECT_EQ(mtx_client->active_sessions(), 0);
+
+        mtx_client->close();
+}
+
+TEST(ClientAPI, ReadTimeout)
+{
+        std::shared_ptr<Client> mtx_client = std::make_shared<Client>("localhost");
+
+        std::string access_token, since;
+
+        mtx_client->login(
+          "alice", "secret", [&access_token](const mtx::responses::Login &res, ErrType err) {
+                  ASSERT_FALSE(err);
+                  access_token = res.access_token;
+          });
+
+        // Waiting for the previous request to complete.
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+
+        mtx_client->sync("", "", false, 0, [&since](const mtx::responses::Sync &res, ErrType err) {
+                ASSERT_FALSE(err);
+                since = res.next_batch;
+        });
+
+        // Waiting for the previous request to complete.
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+
+        std::atomic<bool> has_failed(false);
+        boost::system::error_code result;
+
+        const auto request_id = mtx_client->next_request_id();
+
+        auto session = long_poll_session(request_id, access_token, since, [&](const auto &ec) {
+                result     = ec;
+                has_failed = true;
+        });
+        session->timeouts.read = std::chrono::milliseconds(500);
+
+        const auto sent_at = std::chrono::steady_clock::now();
+        mtx_client->do_request(session);
+
+        while (!has_failed && std::chrono::steady_clock::now() - sent_at < std::chrono::seconds(5))
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        ASSERT_TRUE(has_failed);
+        EXPECT_EQ(result, boost::asio::error::timed_out);
+        EXPECT_LT(std::chrono::steady_clock::now() - sent_at, std::chrono::seconds(2));
+
+        mtx_client->close();
+}
+
+TEST(ClientAPI, PerThreadModel)
+{
+        std::shared_ptr<Client> mtx_client =
+          std::make_shared<Client>("localhost", nullptr, ThreadingModel::PerThread);
+
+        mtx_client->login(
+          "alice", "secret", [mtx_client](const mtx::responses::Login &res, ErrType err) {
+                  boost::ignore_unused(res);
+                  ASSERT_FALSE(err);
+          });
+
+        // Waiting for the previous request to complete.
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+
+        std::atomic<int> completed(0);
+
+        for (int i = 0; i < 8; ++i) {
+                mtx_client->sync(
+                  "", "", false, 0, [&completed](const mtx::responses::Sync &res, ErrType err) {
+                          ASSERT_FALSE(err);
+                          ASSERT_TRUE(res.next_batch.size() > 0);
+                          completed += 1;
+                  });
+        }
+
+        // Waiting for the requests to complete.
+        for (int i = 0; i < 300 && completed != 8; ++i)
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        EXPECT_EQ(completed, 8);
+        EXPECT_EQ(mtx_client->active_sessions(), 0);
+        EXPECT_EQ(mtx_client->connection_pools().size(),
+                  std::max(1U, std::thread::hardware_concurrency()));
+
+        mtx_client->close();
+}
+
+TEST(ClientAPI, SharedIoService)
+{
+        boost::asio::io_service ios;
+        std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(ios));
+
+        std::thread worker([&ios]() { ios.run(); });
+
+        // Both clients run on the single thread of the caller.
+        auto alice = std::make_shared<Client>(ios, "localhost");
+        auto bob   = std::make_shared<Client>(ios, "localhost");
+
+        std::atomic<int> completed(0);
+
+        mtx::requests::CreateRoom req;
+        req.name = "Name";
+
+        for (auto &client : {alice, bob}) {
+                client->create_room(
+                  req, [&completed, &worker](const mtx::responses::CreateRoom &res, ErrType err) {
+                          ASSERT_FALSE(err);
+                          ASSERT_TRUE(res.room_id.toString().size() > 0);
+                          EXPECT_EQ(std::this_thread::get_id(), worker.get_id());
+                          completed += 1;
+                  });
+        }
+
+        // Waiting for the requests to complete.
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+
+        EXPECT_EQ(completed, 2);
+
+        alice->close();
+        bob->close();
+
+        work.reset();
+        worker.join();
+}
+
+TEST(ClientAPI, ClientPool)
+{
+        ClientPool accounts(ThreadOptions{2, ThreadingModel::Shared, 0});
+
+        auto alice = accounts.create_client("localhost");
+        auto bob   = accounts.create_client("localhost");
+
+        alice->set_access_token("alice_token");
+        bob->set_access_token("bob_token");
+
+        std::atomic<int> completed(0);
+
+        mtx::requests::CreateRoom req;
+        req.name = "Name";
+
+        // Bob's request is sent after Alice's has completed, on the same connection.
+        alice->create_room(
+          req, [bob, req, &completed](const mtx::responses::CreateRoom &, ErrType err) {
+                  ASSERT_FALSE(err);
+                  completed += 1;
+
+                  bob->create_room(req,
+                                   [&completed](const mtx::responses::CreateRoom &, ErrType err) {
+                                           ASSERT_FALSE(err);
+                                           completed += 1;
+                                   });
+          });
+
+        while (completed < 2)
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+        const auto stats = accounts.connection_pools().front()->stats();
+        EXPECT_EQ(stats.created, 1);
+        EXPECT_EQ(stats.reused, 1);
+
+        // Closing a client leaves the shared connections open for the others.
+        alice->close();
+        EXPECT_EQ(accounts.connection_pools().front()->stats().idle, 1);
+
+        accounts.close();
+        EXPECT_EQ(accounts.connection_pools().front()->stats().idle, 0);
+}
+
+TEST(ClientAPI, UseFuture)
+{
+        auto client = std::make_shared<Client>("localhost");
+
+        mtx::requests::CreateRoom req;
+        req.name = "Name";
+
+        std::future<mtx::responses::CreateRoom> room =
+          client->create_room(req, boost::asio::use_future);
+        EXPECT_TRUE(room.get().room_id.toString().size() > 0);
+
+        auto sync = client->sync("", "", false, 0, boost::asio::use_future);
+        EXPECT_FALSE(sync.get().next_batch.empty());
+
+        // The failures are thrown by the future.
+        auto unreachable = std::make_shared<Client>("nonexistent.invalid");
+        auto failed      = unreachable->sync("", "", false, 0, boost::asio::use_future);
+        EXPECT_THROW(failed.get(), errors::ClientException);
+
+        client->close();
+        unreachable->close();
+}
+
+TEST(ClientAPI, AssociatedAllocator)
+{
+        auto client = std::make_shared<Client>("localhost");
+
+        std::atomic<int> allocations(0);
+        std::atomic<bool> done(false);
+
+        // A completion handler with its own allocator.
+        struct Handler
+        {
+                using allocator_type = CountingAllocator<void>;
+                allocator_type get_allocator() const { return allocator; }
+
+                void operator()(std::exception_ptr ex, mtx::responses::CreateRoom res)
+                {
+                        EXPECT_FALSE(ex);
+                        EXPECT_TRUE(res.room_id.toString().size() > 0);
+                        *done = true;
+                }
+
+                allocator_type allocator;
+                std::atomic<bool> *done;
+        };
+
+        mtx::requests::CreateRoom req;
+        req.name = "Name";
+
+        client->create_room(req, Handler{CountingAllocator<void>(&allocations), &done});
+
+        while (!done)
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        // The shared state of the handler & the session.
+        EXPECT_GE(allocations, 2);
+
+        client->close();
+}
+
+TEST(ClientAPI, AssociatedAllocatorLogin)
+{
+        auto client = std::make_shared<Client>("localhost");
+
+        std::atomic<int> allocations(0);
+        std::atomic<bool> done(false);
+
+        // The endpoint wraps the handler to keep the access token.
+        struct Handler
+        {
+                using allocator_type = CountingAllocator<void>;
+                allocator_type get_allocator() const { return allocator; }
+
+                void operator()(std::exception_ptr ex, mtx::responses::Login res)
+                {
+                        EXPECT_FALSE(ex);
+                        validate_login("@alice:localhost", res);
+                        *done = true;
+                }
+
+                allocator_type allocator;
+                std::atomic<bool> *done;
+        };
+
+        client->login("alice", "secret", Handler{CountingAllocator<void>(&allocations), &done});
+
+        while (!done)
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        // The shared state of the handler & the session.
+        EXPECT_GE(allocations, 2);
+
+        client->close();
+}
+
+TEST(ClientAPI, RecycledSessions)
+{
+        auto client   = std::make_shared<Client>("localhost");
+        auto sessions = client->session_pool();
+
+        mtx::requests::CreateRoom req;
+        req.name = "Name";
+
+        for (int i = 0; i < 3; ++i) {
+                std::atomic<bool> done(false);
+
+                client->create_room(req,
+                                    [&done](const mtx::responses::CreateRoom &res, ErrType err) {
+                                            ASSERT_FALSE(err);
+                                            EXPECT_TRUE(res.room_id.toString().size() > 0);
+                                            done = true;
+                                    });
+
+                // The session goes back to the pool once the io_service has let go of it.
+                while (!done || sessions->stats().idle == 0)
+                        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        const auto stats = sessions->stats();
+        EXPECT_EQ(stats.created, 1);
+        EXPECT_EQ(stats.reused, 2);
+
+        client->close();
+        EXPECT_EQ(sessions->stats().idle, 0);
+}
+
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+TEST(ClientAPI, Coroutines)
+{
+        boost::asio::io_service ios;
+        auto client = std::make_shared<Client>(ios, "localhost");
+
+        bool completed = false;
+
+        boost::asio::co_spawn(
+          ios,
+          [&]() -> boost::asio::awaitable<void> {
+                  using boost::asio::use_awaitable;
+
+                  mtx::requests::CreateRoom req;
+                  req.name = "Name";
+
+                  auto room = co_await client->create_room(req, use_awaitable);
+                  EXPECT_TRUE(room.room_id.toString().size() > 0);
+
+                  auto res = co_await client->sync("", "", false, 0, use_awaitable);
+                  EXPECT_FALSE(res.next_batch.empty());
+
+                  completed = true;
+          },
+          boost::asio::detached);
+
+        // Returns once the coroutine is done.
+        ios.run();
+
+        EXPECT_TRUE(completed);
+
+        client->close();
+}
+
+TEST(ClientAPI, CoroutineFailure)
+{
+        boost::asio::io_service ios;
+        auto client = std::make_shared<Client>(ios, "nonexistent.invalid");
+
+        bool thrown = false;
+
+        boost::asio::co_spawn(
+          ios,
+          [&]() -> boost::asio::awaitable<void> {
+                  try {
+                          co_await client->sync("", "", false, 0, boost::asio::use_awaitable);
+                  } catch (const mtx::client::errors::ClientException &e) {
+                          EXPECT_TRUE(e.error().error_code);
+                          thrown = true;
+                  }
+          },
+          boost::asio::detached);
+
+        ios.run();
+
+        EXPECT_TRUE(thrown);
+
+        client->close();
+}
+#endif
@@ -1,11 +1,141 @@
 #include <gtest/gtest.h>
 #include <iostream>
+#include <thread>
 
 #include "client.hpp"
+#include "dns_cache.hpp"
+#include "header_template.hpp"
 #include "mtx/responses.hpp"
+#include "session_registry.hpp"
+#include "utils.hpp"
 
 using namespace mtx::client;
+using boost::asio::ip::tcp;
 
 TEST(Basic, Connection) {}
 
 TEST(Basic, Failure) {}
+
+TEST(Basic, DnsCache)
+{
+        boost::asio::io_service ios;
+
+        auto cache = std::make_shared<DnsCache>(ios);
+
+        int completed = 0;
+        auto handler  = [&completed](boost::system::error_code ec, DnsCache::Endpoints endpoints) {
+                ASSERT_FALSE(ec);
+                ASSERT_FALSE(endpoints.empty());
+                EXPECT_EQ(endpoints[0].port(), 443);
+                completed += 1;
+        };
+
+        // Concurrent lookups share the same query.
+        cache->resolve("127.0.0.1", "443", handler);
+        cache->resolve("127.0.0.1", "443", handler);
+        ios.run();
+
+        cache->resolve("127.0.0.1", "443", handler);
+
+        EXPECT_EQ(completed, 3);
+        EXPECT_EQ(cache->stats().misses, 2);
+        EXPECT_EQ(cache->stats().hits, 1);
+}
+
+TEST(Basic, HappyEyeballs)
+{
+        boost::asio::io_service ios;
+
+        tcp::acceptor acceptor(ios, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+        tcp::socket peer(ios);
+        acceptor.async_accept(peer, [](boost::system::error_code ec) { ASSERT_FALSE(ec); });
+
+        // The first address never answers (or isn't routable).
+        DnsCache::Endpoints endpoints = {
+          tcp::endpoint(boost::asio::ip::address::from_string("10.255.255.1"), 443),
+          acceptor.local_endpoint()};
+
+        tcp::socket socket(ios);
+        boost::system::error_code result = boost::asio::error::would_block;
+
+        async_connect_happy_eyeballs(
+          ios,
+          socket,
+          endpoints,
+          std::chrono::milliseconds(50),
+          [&result](boost::system::error_code ec) { result = ec; });
+
+        ios.run_for(std::chrono::seconds(5));
+
+        ASSERT_FALSE(result);
+        EXPECT_EQ(socket.remote_endpoint().port(), acceptor.local_endpoint().port());
+}
+
+TEST(Basic, HeaderTemplate)
+{
+        HeaderTemplate headers("matrix.org", "abc");
+
+        EXPECT_EQ(headers.fields(false), "Host: matrix.org\r\nUser-Agent: mtxclient v0.1.0\r\n");
+        EXPECT_EQ(headers.fields(true),
+                  "Host: matrix.org\r\nUser-Agent: mtxclient v0.1.0\r\n"
+                  "Authorization: Bearer abc\r\n");
+
+        // Without a token, there is nothing to authenticate with.
+        HeaderTemplate anonymous("matrix.org", "");
+        EXPECT_EQ(anonymous.fields(true), anonymous.fields(false));
+        EXPECT_FALSE(anonymous.accepts_encoding());
+
+        HeaderTemplate compressed("matrix.org", "abc", "gzip, deflate");
+        EXPECT_TRUE(compressed.accepts_encoding());
+        EXPECT_EQ(compressed.fields(false),
+                  "Host: matrix.org\r\nUser-Agent: mtxclient v0.1.0\r\n"
+                  "Accept-Encoding: gzip, deflate\r\n");
+
+        // The requests of byte ranges can't be compressed.
+        EXPECT_EQ(compressed.identity_fields(),
+                  "Host: matrix.org\r\nUser-Agent: mtxclient v0.1.0\r\n");
+}
+
+TEST(Basic, HostPort)
+{
+        using HostPort = std::pair<std::string, std::string>;
+
+        EXPECT_EQ(utils::split_host_port("matrix.org"), HostPort("matrix.org", "443"));
+        EXPECT_EQ(utils::split_host_port("localhost:8448"), HostPort("localhost", "8448"));
+        EXPECT_EQ(utils::split_host_port("[::1]:8448"), HostPort("::1", "8448"));
+        EXPECT_EQ(utils::split_host_port("[::1]"), HostPort("::1", "443"));
+        EXPECT_EQ(utils::split_host_port("localhost:"), HostPort("localhost:", "443"));
+}
+
+TEST(Basic, SessionRegistry)
+{
+        SessionRegistry registry(4);
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+                threads.emplace_back([&registry, t]() {
+                        for (int i = 0; i < 1000; ++i) {
+                                const RequestID id = t * 1000 + i;
+
+                                registry.insert(
+                                  std::make_shared<Session>("localhost", id, nullptr, nullptr));
+                                EXPECT_EQ(registry.find(id)->id, id);
+
+                                // Keep every other session registered.
+                                if (i % 2 == 0) {
+                                        EXPECT_TRUE(registry.erase(id) != nullptr);
+                                }
+                        }
+                });
+        }
+
+        for (auto &thread : threads)
+                thread.join();
+
+        EXPECT_EQ(registry.size(), 2000U);
+        EXPECT_TRUE(registry.find(0) == nullptr);
+        EXPECT_TRUE(registry.find(3999) != nullptr);
+        EXPECT_TRUE(registry.erase(3999) != nullptr);
+        EXPECT_TRUE(registry.erase(3999) == nullptr);
+        EXPECT_EQ(registry.size(), 1999U);
+}
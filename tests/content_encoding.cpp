@@ -0,0 +1,190 @@
+#include <gtest/gtest.h>
+
+#include <zlib.h>
+
+#include "content_encoding.hpp"
+
+using namespace mtx::client;
+
+const uint64_t max_size = 1024 * 1024;
+
+//! Compress the data with zlib. The window bits select the wrapper
+//! (gzip: 15 + 16, zlib: 15, raw deflate: -15).
+std::string
+compress(const std::string &data, int window_bits)
+{
+        z_stream stream{};
+        deflateInit2(
+          &stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY);
+
+        std::string out(deflateBound(&stream, data.size()), '\0');
+
+        stream.next_in   = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+        stream.avail_in  = data.size();
+        stream.next_out  = reinterpret_cast<Bytef *>(&out[0]);
+        stream.avail_out = out.size();
+
+        deflate(&stream, Z_FINISH);
+        out.resize(stream.total_out);
+        deflateEnd(&stream);
+
+        return out;
+}
+
+std::string
+sample_body()
+{
+        std::string body = "{\"next_batch\": \"s72595_4483_1934\", \"events\": [";
+        for (int i = 0; i < 5000; ++i)
+                body += "{\"type\": \"m.room.message\", \"content\": {\"body\": \"" +
+                        std::to_string(i) + "\"}},";
+        body += "{}]}";
+
+        return body;
+}
+
+//! Decode the data, fed in pieces of the given size.
+std::string
+decode(ContentDecoder &decoder,
+       const std::string &data,
+       std::size_t piece_size,
+       boost::system::error_code &ec)
+{
+        std::string out;
+        const auto sink = [&out](const char *data, std::size_t size) { out.append(data, size); };
+
+        for (std::size_t pos = 0; pos < data.size() && !ec; pos += piece_size)
+                decoder.decode(
+                  data.data() + pos, std::min(piece_size, data.size() - pos), sink, ec);
+
+        if (!ec)
+                decoder.finish(ec);
+
+        return out;
+}
+
+TEST(ContentEncoding, Gzip)
+{
+        const auto body = sample_body();
+        auto decoder    = make_content_decoder("gzip", max_size);
+
+        ASSERT_TRUE(decoder);
+        EXPECT_EQ(decoder->encoding(), "gzip");
+
+        boost::system::error_code ec;
+        EXPECT_EQ(decode(*decoder, compress(body, 15 + 16), 64 * 1024, ec), body);
+        EXPECT_FALSE(ec);
+        EXPECT_EQ(decoder->decoded_size(), body.size());
+}
+
+TEST(ContentEncoding, ByteByByte)
+{
+        const auto body = sample_body();
+        auto decoder    = make_content_decoder("GZIP", max_size);
+
+        boost::system::error_code ec;
+        EXPECT_EQ(decode(*decoder, compress(body, 15 + 16), 1, ec), body);
+        EXPECT_FALSE(ec);
+}
+
+TEST(ContentEncoding, Deflate)
+{
+        const auto body = sample_body();
+
+        boost::system::error_code ec;
+        auto decoder = make_content_decoder("deflate", max_size);
+        EXPECT_EQ(decode(*decoder, compress(body, 15), 4096, ec), body);
+        EXPECT_FALSE(ec);
+
+        // Without the zlib wrapper.
+        decoder = make_content_decoder("deflate", max_size);
+        EXPECT_EQ(decode(*decoder, compress(body, -15), 4096, ec), body);
+        EXPECT_FALSE(ec);
+}
+
+TEST(ContentEncoding, Reset)
+{
+        const auto body = sample_body();
+        auto decoder    = make_content_decoder("deflate", max_size);
+
+        boost::system::error_code ec;
+        EXPECT_EQ(decode(*decoder, compress(body, -15), 4096, ec), body);
+
+        decoder->reset();
+        EXPECT_EQ(decoder->decoded_size(), 0);
+        EXPECT_EQ(decode(*decoder, compress("again", 15), 4096, ec), "again");
+        EXPECT_FALSE(ec);
+}
+
+TEST(ContentEncoding, MultipleGzipMembers)
+{
+        boost::system::error_code ec;
+        auto decoder = make_content_decoder("gzip", max_size);
+
+        const auto members = compress("first ", 15 + 16) + compress("second", 15 + 16);
+
+        EXPECT_EQ(decode(*decoder, members, 3, ec), "first second");
+        EXPECT_FALSE(ec);
+}
+
+TEST(ContentEncoding, Truncated)
+{
+        const auto compressed = compress(sample_body(), 15 + 16);
+        auto decoder          = make_content_decoder("gzip", max_size);
+
+        boost::system::error_code ec;
+        decode(*decoder, compressed.substr(0, compressed.size() / 2), 4096, ec);
+        EXPECT_EQ(ec, DecodeError::Truncated);
+}
+
+TEST(ContentEncoding, Corrupted)
+{
+        auto compressed = compress(sample_body(), 15 + 16);
+        compressed[compressed.size() / 2] ^= 0x55;
+        compressed[compressed.size() / 2 + 1] ^= 0x55;
+
+        auto decoder = make_content_decoder("gzip", max_size);
+
+        boost::system::error_code ec;
+        decode(*decoder, compressed, 4096, ec);
+        EXPECT_EQ(ec, DecodeError::Corrupted);
+
+        decoder = make_content_decoder("gzip", max_size);
+        decode(*decoder, "not compressed at all", 4096, ec);
+        EXPECT_EQ(ec, DecodeError::Corrupted);
+}
+
+TEST(ContentEncoding, TooLarge)
+{
+        // A few KiB inflating to 4 MiB.
+        const auto compressed = compress(std::string(4 * max_size, 'a'), 15 + 16);
+        auto decoder          = make_content_decoder("gzip", max_size);
+
+        boost::system::error_code ec;
+        const auto out = decode(*decoder, compressed, compressed.size(), ec);
+
+        EXPECT_EQ(ec, DecodeError::TooLarge);
+        EXPECT_LE(out.size(), max_size);
+}
+
+TEST(ContentEncoding, EmptyBody)
+{
+        auto decoder = make_content_decoder("gzip", max_size);
+
+        boost::system::error_code ec;
+        decoder->finish(ec);
+        EXPECT_FALSE(ec);
+}
+
+TEST(ContentEncoding, Unsupported)
+{
+        EXPECT_FALSE(make_content_decoder("br", max_size));
+        EXPECT_FALSE(make_content_decoder("", max_size));
+
+        EXPECT_TRUE(is_identity_encoding(""));
+        EXPECT_TRUE(is_identity_encoding("Identity"));
+        EXPECT_FALSE(is_identity_encoding("gzip"));
+
+        EXPECT_NE(supported_encodings().find("gzip"), std::string::npos);
+        EXPECT_EQ(make_error_code(DecodeError::TooLarge).message(), "decoded body too large");
+}
@@ -0,0 +1,336 @@
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <sstream>
+#include <thread>
+
+#include <fcntl.h>
+#include <gtest/gtest.h>
+
+#include "client.hpp"
+#include "media.hpp"
+#include "mock_homeserver.hpp"
+#include "mtx/responses.hpp"
+#include "utils.hpp"
+
+using namespace mtx::client;
+using namespace mtx::client::testing;
+
+std::string
+read_file(const std::string &path)
+{
+        std::ifstream file(path, std::ios::binary);
+        std::ostringstream content;
+        content << file.rdbuf();
+
+        return content.str();
+}
+
+TEST(MediaAPI, ParseMxcUri)
+{
+        std::string server, media_id;
+
+        EXPECT_TRUE(parse_mxc_uri("mxc://example.com:8448/AbC_12-x", server, media_id));
+        EXPECT_EQ(server, "example.com:8448");
+        EXPECT_EQ(media_id, "AbC_12-x");
+
+        EXPECT_TRUE(parse_mxc_uri("mxc://127.0.0.1/id", server, media_id));
+        EXPECT_EQ(server, "127.0.0.1");
+
+        EXPECT_TRUE(parse_mxc_uri("mxc://[::1]:8448/id", server, media_id));
+        EXPECT_EQ(server, "[::1]:8448");
+
+        for (const auto &uri : {"",
+                                "mxc://",
+                                "mxc://example.com",
+                                "mxc://example.com/",
+                                "mxc:///id",
+                                "https://example.com/id",
+                                "mxc://example.com/a/b",
+                                "mxc://example.com/id?x=1",
+                                "mxc://example.com?/id",
+                                "mxc://evil\r\nX-Injected: 1/abc",
+                                "mxc://evil\n/abc",
+                                "mxc://evil com/abc",
+                                "mxc://evil\tcom/abc",
+                                "mxc://example.com:/id",
+                                "mxc://example.com:84a8/id",
+                                "mxc://:8448/id",
+                                "mxc://[::1/id",
+                                "mxc://[evil]/id"})
+                EXPECT_FALSE(parse_mxc_uri(uri, server, media_id)) << uri;
+}
+
+TEST(MediaAPI, ParseContentRange)
+{
+        uint64_t first = 0, last = 0;
+        std::experimental::optional<uint64_t> total;
+
+        EXPECT_TRUE(parse_content_range("bytes 0-99/1000", first, last, total));
+        EXPECT_EQ(first, 0);
+        EXPECT_EQ(last, 99);
+        ASSERT_TRUE(total);
+        EXPECT_EQ(*total, 1000);
+
+        EXPECT_TRUE(parse_content_range("bytes 500-999/*", first, last, total));
+        EXPECT_EQ(first, 500);
+        EXPECT_EQ(last, 999);
+        EXPECT_FALSE(total);
+
+        for (const auto &value : {"",
+                                  "bytes */1000",
+                                  "bytes 0-99",
+                                  "bytes 99-0/1000",
+                                  "bytes 0-1000/1000",
+                                  "bytes -1-99/1000",
+                                  "items 0-99/1000",
+                                  "bytes 0-99/99999999999999999999"})
+                EXPECT_FALSE(parse_content_range(value, first, last, total)) << value;
+}
+
+TEST(MediaAPI, FileSink)
+{
+        const std::string path = "media_test.bin";
+        std::remove(path.c_str());
+
+        boost::system::error_code ec;
+        auto sink = FileSink::open(path, ec);
+
+        ASSERT_FALSE(ec);
+        ASSERT_TRUE(sink);
+        EXPECT_EQ(sink->size(), 0);
+
+        // The segments are written at their offsets, in any order.
+        sink->write(5, "56789", 5, ec);
+        sink->write(0, "01234", 5, ec);
+        EXPECT_FALSE(ec);
+        EXPECT_EQ(sink->size(), 10);
+
+        sink.reset();
+        EXPECT_EQ(read_file(path), "0123456789");
+
+        // The content is kept when it's opened again, to be resumed.
+        sink = FileSink::open(path, ec);
+        ASSERT_TRUE(sink);
+        EXPECT_EQ(sink->size(), 10);
+
+        sink->truncate(4, ec);
+        EXPECT_FALSE(ec);
+        EXPECT_EQ(sink->size(), 4);
+
+        sink.reset();
+        EXPECT_EQ(read_file(path), "0123");
+
+        std::remove(path.c_str());
+
+        EXPECT_FALSE(FileSink::open("does/not/exist.bin", ec));
+        EXPECT_TRUE(ec);
+}
+
+TEST(MediaAPI, AdoptedFile)
+{
+        const std::string path = "media_adopt_test.bin";
+        std::ofstream(path, std::ios::binary) << "headerpayload";
+
+        // The body starts at the current position of the descriptor.
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ(::lseek(fd, 6, SEEK_SET), 6);
+
+        boost::system::error_code ec;
+        std::shared_ptr<BodySource> body = FileBody::adopt(fd, "text/plain", ec);
+
+        ASSERT_FALSE(ec);
+        ASSERT_TRUE(body);
+        EXPECT_EQ(body->size(), 7);
+
+        std::vector<std::pair<uint64_t, uint64_t>> progress;
+        ProgressBody tracked(body, [&progress](uint64_t transferred, uint64_t total) {
+                progress.emplace_back(transferred, total);
+        });
+
+        char buffer[4];
+        std::string content;
+
+        for (int pass = 0; pass < 2; ++pass) {
+                content.clear();
+                progress.clear();
+                tracked.rewind(ec);
+
+                while (const auto n = tracked.read(buffer, sizeof(buffer), ec))
+                        content.append(buffer, n);
+
+                EXPECT_FALSE(ec);
+                EXPECT_EQ(content, "payload");
+                EXPECT_EQ(progress,
+                          (std::vector<std::pair<uint64_t, uint64_t>>{{4, 7}, {7, 7}}));
+        }
+
+        std::remove(path.c_str());
+}
+
+TEST(MediaAPI, UrlEncode)
+{
+        EXPECT_EQ(utils::url_encode("a-Z_0.~"), "a-Z_0.~");
+        EXPECT_EQ(utils::url_encode("my file/é?.png"), "my%20file%2F%C3%A9%3F.png");
+}
+
+//! Upload some content from a file, and return its URI.
+std::string
+upload_content(std::shared_ptr<Client> client, const std::string &name, const std::string &content)
+{
+        std::ofstream(name, std::ios::binary) << content;
+
+        auto uri = client->upload_file(name, "application/octet-stream", boost::asio::use_future);
+        std::remove(name.c_str());
+
+        return uri.get().content_uri;
+}
+
+//! Some content that isn't the same at every offset.
+std::string
+sample_content(std::size_t size)
+{
+        std::string content(size, '\0');
+        for (std::size_t i = 0; i < size; ++i)
+                content[i] = static_cast<char>(i * 7 + i / 251);
+
+        return content;
+}
+
+TEST(MediaAPI, UploadAndDownload)
+{
+        auto client        = std::make_shared<Client>("localhost");
+        const auto content = sample_content(3 * 1024 * 1024 + 17);
+
+        // The uploads need an access token.
+        client->login("alice", "secret", boost::asio::use_future).get();
+
+        std::atomic<uint64_t> uploaded(0);
+        auto body = std::make_shared<ProgressBody>(
+          std::make_shared<JsonBody>(nlohmann::json{{"content", "json"}}),
+          [&uploaded](uint64_t transferred, uint64_t) { uploaded = transferred; });
+
+        EXPECT_EQ(client->upload(body, "data.json", boost::asio::use_future)
+                    .get()
+                    .content_uri.substr(0, 6),
+                  "mxc://");
+        EXPECT_EQ(uploaded, body->size());
+
+        const auto uri = upload_content(client, "media_upload_test.bin", content);
+        ASSERT_EQ(uri.substr(0, 6), "mxc://");
+
+        // In a single request, then in segments requested in parallel.
+        for (unsigned int parallel : {1, 4}) {
+                const std::string path = "media_download_test.bin";
+                std::remove(path.c_str());
+
+                DownloadOptions options;
+                options.parallel_segments = parallel;
+                options.segment_size      = 256 * 1024;
+
+                std::atomic<uint64_t> progress(0);
+                options.on_progress = [&progress](uint64_t transferred, uint64_t total) {
+                        EXPECT_GE(transferred, progress.load());
+                        EXPECT_LE(transferred, total);
+                        progress = transferred;
+                };
+
+                const auto download =
+                  client->download_file(uri, path, options, boost::asio::use_future).get();
+
+                EXPECT_EQ(download.size, content.size());
+                EXPECT_EQ(download.resumed_from, 0);
+                EXPECT_EQ(download.content_type, "application/octet-stream");
+                EXPECT_EQ(progress, content.size());
+                EXPECT_TRUE(read_file(path) == content) << "parallel " << parallel;
+
+                std::remove(path.c_str());
+        }
+
+        client->close();
+}
+
+TEST(MediaAPI, ResumeDownload)
+{
+        // The mock homeserver is known to honor the ranges.
+        MockHomeserver server;
+        auto client = std::make_shared<Client>(server.address());
+
+        client->login("alice", "secret", boost::asio::use_future).get();
+
+        const auto content = sample_content(512 * 1024);
+        const auto uri     = upload_content(client, "media_upload_test.bin", content);
+
+        const std::string path = "media_resume_test.bin";
+        std::ofstream(path, std::ios::binary) << content.substr(0, 300000);
+
+        DownloadOptions options;
+        options.resume = true;
+
+        auto download = client->download_file(uri, path, options, boost::asio::use_future).get();
+        EXPECT_EQ(download.resumed_from, 300000);
+        EXPECT_EQ(download.size, content.size());
+        EXPECT_TRUE(read_file(path) == content);
+
+        // Nothing is left to download.
+        download = client->download_file(uri, path, options, boost::asio::use_future).get();
+        EXPECT_EQ(download.resumed_from, content.size());
+        EXPECT_TRUE(read_file(path) == content);
+
+        // The rest of the content, in segments requested in parallel.
+        std::ofstream(path, std::ios::binary | std::ios::trunc) << content.substr(0, 100000);
+
+        options.parallel_segments = 4;
+        options.segment_size      = 64 * 1024;
+
+        download = client->download_file(uri, path, options, boost::asio::use_future).get();
+        EXPECT_EQ(download.resumed_from, 100000);
+        EXPECT_EQ(download.size, content.size());
+        EXPECT_TRUE(read_file(path) == content);
+
+        std::remove(path.c_str());
+        client->close();
+}
+
+TEST(MediaAPI, DownloadFailures)
+{
+        auto client = std::make_shared<Client>("localhost");
+
+        std::string received;
+        auto sink = std::make_shared<CallbackSink>(
+          [&received](uint64_t, const char *data, std::size_t size) {
+                  received.append(data, size);
+          });
+
+        auto invalid = client->download("https://example.com/a", sink, {}, boost::asio::use_future);
+        EXPECT_THROW(invalid.get(), errors::ClientException);
+
+        auto missing =
+          client->download("mxc://localhost/missing", sink, {}, boost::asio::use_future);
+        EXPECT_THROW(missing.get(), errors::ClientException);
+        EXPECT_TRUE(received.empty());
+
+        // The requests that can't be started still fail from an event loop, not from the
+        // call that starts them, as the callbacks can take the locks held by the caller.
+        const auto caller = std::this_thread::get_id();
+        std::promise<void> downloaded, uploaded;
+
+        client->download("mxc://", sink, {}, [&](const Download &, RequestErr err) {
+                EXPECT_NE(std::this_thread::get_id(), caller);
+                EXPECT_TRUE(err);
+                downloaded.set_value();
+        });
+        client->upload_file(
+          "/nonexistent/file", "text/plain", [&](const ContentURI &, RequestErr err) {
+                  EXPECT_NE(std::this_thread::get_id(), caller);
+                  EXPECT_TRUE(err);
+                  uploaded.set_value();
+          });
+
+        downloaded.get_future().wait();
+        uploaded.get_future().wait();
+
+        client->close();
+}
@@ -0,0 +1,290 @@
+#include <chrono>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "client.hpp"
+#include "metrics.hpp"
+#include "mock_homeserver.hpp"
+#include "mtx/requests.hpp"
+#include "mtx/responses.hpp"
+
+//
+// The histograms of the request timings, and the metrics recorded by the client.
+//
+
+using namespace mtx::client;
+using namespace mtx::client::testing;
+
+namespace {
+
+std::string
+label(const std::string &target)
+{
+        std::string out;
+        endpoint_label(target, out);
+        return out;
+}
+
+//! Number of lines of the text that start with the prefix.
+std::size_t
+count_lines(const std::string &text, const std::string &prefix)
+{
+        std::size_t count = 0;
+
+        for (std::size_t pos = 0; pos < text.size();) {
+                auto end = text.find('\n', pos);
+                if (end == std::string::npos)
+                        end = text.size();
+
+                if (text.compare(pos, prefix.size(), prefix) == 0)
+                        ++count;
+
+                pos = end + 1;
+        }
+
+        return count;
+}
+
+//! The metrics of the client, once the callbacks of `requests` requests to the endpoint
+//! have returned: their parse & callback times are recorded right after.
+MetricsSnapshot
+settled_metrics(Client &client, const std::string &endpoint, uint64_t requests)
+{
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+
+        for (;;) {
+                auto snapshot = client.metrics();
+
+                const auto it = snapshot.endpoints.find(endpoint);
+                if ((it != snapshot.endpoints.end() &&
+                     it->second.timing(RequestTiming::Callback).count() >= requests) ||
+                    std::chrono::steady_clock::now() > deadline)
+                        return snapshot;
+
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+}
+}
+
+TEST(Metrics, HistogramBuckets)
+{
+        // Every value is in a bucket whose bounds are within 1/16th of it.
+        const uint64_t values[] = {0, 1, 15, 16, 17, 100, 1023, 1024, 123456789};
+
+        for (const auto value : values) {
+                const auto index = Histogram::bucket_index(value);
+                const auto upper = Histogram::bucket_upper_bound(index);
+
+                EXPECT_GE(upper, value);
+                EXPECT_LE(upper - value, value / Histogram::sub_bucket_count);
+                if (index > 0) {
+                        EXPECT_LT(Histogram::bucket_upper_bound(index - 1), value);
+                }
+        }
+
+        // The buckets are contiguous.
+        for (std::size_t i = 1; i < Histogram::bucket_count - 1; ++i)
+                EXPECT_EQ(Histogram::bucket_index(Histogram::bucket_upper_bound(i)), i);
+
+        EXPECT_EQ(Histogram::bucket_index(uint64_t(1) << 40), Histogram::bucket_count - 1);
+}
+
+TEST(Metrics, HistogramPercentiles)
+{
+        Histogram histogram;
+        EXPECT_EQ(histogram.percentile(0.5), 0);
+
+        for (uint64_t value = 1; value <= 1000; ++value)
+                histogram.record(value);
+
+        EXPECT_EQ(histogram.count(), 1000);
+        EXPECT_EQ(histogram.sum(), 500500);
+        EXPECT_EQ(histogram.max(), 1000);
+        EXPECT_DOUBLE_EQ(histogram.mean(), 500.5);
+
+        EXPECT_NEAR(histogram.percentile(0.5), 500, 500 / 16);
+        EXPECT_NEAR(histogram.percentile(0.99), 990, 990 / 16);
+        EXPECT_EQ(histogram.percentile(1), 1000);
+
+        Histogram other;
+        other.record(5000, 1000);
+        histogram.merge(other);
+
+        EXPECT_EQ(histogram.count(), 2000);
+        EXPECT_EQ(histogram.max(), 5000);
+        EXPECT_NEAR(histogram.percentile(0.75), 5000, 5000 / 16);
+}
+
+TEST(Metrics, EndpointLabels)
+{
+        EXPECT_EQ(label("/_matrix/client/r0/sync?since=s1&timeout=30000"), "/sync");
+        EXPECT_EQ(label("/_matrix/client/r0/login"), "/login");
+        EXPECT_EQ(label("/_matrix/client/r0/rooms/!abc:localhost/join"), "/rooms/{roomId}/join");
+        EXPECT_EQ(label("/_matrix/client/r0/join/#alias:localhost"), "/join/{roomIdOrAlias}");
+        EXPECT_EQ(label("/_matrix/client/r0/rooms/!abc:localhost/send/m.room.message/42"),
+                  "/rooms/{roomId}/send/m.room.message/{id}");
+        EXPECT_EQ(label("/_matrix/client/r0/profile/@alice:localhost/displayname"),
+                  "/profile/{userId}/displayname");
+        EXPECT_EQ(label("/_matrix/media/r0/download/localhost/AbCdEf"),
+                  "/download/{serverName}/{mediaId}");
+        EXPECT_EQ(label("/_matrix/media/r0/upload?filename=a.png"), "/upload");
+}
+
+TEST(Metrics, ConcurrentRecording)
+{
+        ClientMetrics metrics;
+
+        RequestTimings timings;
+        timings.phases_entered = 1;
+        timings.phases[0]      = std::chrono::microseconds(100);
+        timings.total          = std::chrono::milliseconds(2);
+        timings.bytes_sent     = 10;
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+                threads.emplace_back([&metrics, &timings]() {
+                        for (int i = 0; i < 1000; ++i)
+                                metrics.record("/_matrix/client/r0/sync", timings, 200);
+                });
+        }
+
+        // Snapshots can be taken while the threads are recording.
+        metrics.snapshot();
+
+        for (auto &thread : threads)
+                thread.join();
+
+        const auto snapshot = metrics.snapshot();
+        ASSERT_EQ(snapshot.endpoints.count("/sync"), 1);
+
+        const auto &sync = snapshot.endpoints.at("/sync");
+        EXPECT_EQ(sync.requests, 4000);
+        EXPECT_EQ(sync.bytes_sent, 40000);
+        EXPECT_EQ(sync.timing(RequestTiming::Queued).count(), 4000);
+        EXPECT_EQ(sync.timing(RequestTiming::Connect).count(), 0);
+        EXPECT_NEAR(sync.timing(RequestTiming::Total).percentile(0.5), 2000, 2000 / 16);
+}
+
+TEST(Metrics, Client)
+{
+        MockOptions options;
+        options.latency = std::chrono::milliseconds(20);
+
+        MockHomeserver server(options);
+        auto client = std::make_shared<Client>(server.address());
+
+        client->login("alice", "secret", boost::asio::use_future).get();
+
+        for (int i = 0; i < 3; ++i)
+                client->sync("", "", false, 0, boost::asio::use_future).get();
+
+        client->join_room("!room0:localhost", boost::asio::use_future).get();
+
+        try {
+                client->login("alice", "wrong", boost::asio::use_future).get();
+        } catch (const errors::ClientException &) {
+        }
+
+        const auto snapshot = settled_metrics(*client, "/login", 2);
+
+        ASSERT_EQ(snapshot.endpoints.count("/login"), 1);
+        ASSERT_EQ(snapshot.endpoints.count("/sync"), 1);
+        ASSERT_EQ(snapshot.endpoints.count("/join/{roomIdOrAlias}"), 1);
+
+        const auto &login = snapshot.endpoints.at("/login");
+        EXPECT_EQ(login.requests, 2);
+        EXPECT_EQ(login.error_responses, 1);
+        EXPECT_EQ(login.failures, 0);
+
+        // Only the first request had to connect.
+        EXPECT_EQ(login.timing(RequestTiming::Connect).count(), 1);
+        EXPECT_EQ(login.timing(RequestTiming::Handshake).count(), 1);
+
+        const auto &sync = snapshot.endpoints.at("/sync");
+        EXPECT_EQ(sync.requests, 3);
+        EXPECT_EQ(sync.timing(RequestTiming::Connect).count(), 0);
+        EXPECT_EQ(sync.timing(RequestTiming::Parse).count(), 3);
+        EXPECT_EQ(sync.timing(RequestTiming::FirstByte).count(), 3);
+        EXPECT_GT(sync.timing(RequestTiming::Parse).sum(), 0);
+        EXPECT_GT(sync.bytes_received, 3 * server.sync_body().size());
+        EXPECT_GT(sync.bytes_sent, 0);
+
+        // The latency of the server is seen from the first byte on.
+        const auto &first_byte = sync.timing(RequestTiming::FirstByte);
+        EXPECT_GE(first_byte.percentile(0), 20000);
+        EXPECT_GE(sync.timing(RequestTiming::Total).sum(),
+                  sync.timing(RequestTiming::Read).sum());
+
+        // Disabled.
+        client->set_metrics_enabled(false);
+        client->sync("", "", false, 0, boost::asio::use_future).get();
+        EXPECT_EQ(client->metrics().endpoints.at("/sync").requests, 3);
+
+        client->close();
+}
+
+TEST(Metrics, Failures)
+{
+        MockOptions options;
+        options.latency = std::chrono::milliseconds(500);
+
+        MockHomeserver server(options);
+        auto client = std::make_shared<Client>(server.address());
+
+        RequestTimeouts timeouts;
+        timeouts.read = std::chrono::milliseconds(50);
+        client->set_timeouts(timeouts);
+
+        EXPECT_THROW(client->sync("", "", false, 0, boost::asio::use_future).get(),
+                     errors::ClientException);
+
+        // Counted before the callback is called.
+        const auto sync = client->metrics().endpoints.at("/sync");
+        EXPECT_EQ(sync.requests, 1);
+        EXPECT_EQ(sync.failures, 1);
+        EXPECT_EQ(sync.timing(RequestTiming::Parse).count(), 0);
+        EXPECT_GE(sync.timing(RequestTiming::Read).max(), 50000);
+
+        client->close();
+}
+
+TEST(Metrics, Prometheus)
+{
+        MetricsSnapshot snapshot;
+
+        auto &sync          = snapshot.endpoints["/sync"];
+        sync.requests       = 3;
+        sync.bytes_received = 1000;
+        sync.timings[static_cast<std::size_t>(RequestTiming::Total)].record(200);
+        sync.timings[static_cast<std::size_t>(RequestTiming::Total)].record(3000);
+        sync.timings[static_cast<std::size_t>(RequestTiming::Total)].record(90000000);
+
+        snapshot.endpoints["/say \"hi\""].requests = 1;
+
+        const auto text = to_prometheus(snapshot, "test");
+
+        EXPECT_NE(text.find("# TYPE test_requests_total counter\n"), std::string::npos);
+        EXPECT_NE(text.find("test_requests_total{endpoint=\"/sync\"} 3\n"), std::string::npos);
+        EXPECT_NE(text.find("test_requests_total{endpoint=\"/say \\\"hi\\\"\"} 1\n"),
+                  std::string::npos);
+        EXPECT_NE(text.find("test_received_bytes_total{endpoint=\"/sync\"} 1000\n"),
+                  std::string::npos);
+
+        const std::string bucket =
+          "test_request_duration_seconds_bucket{endpoint=\"/sync\",timing=\"total\",";
+        EXPECT_NE(text.find(bucket + "le=\"0.0001\"} 0\n"), std::string::npos);
+        EXPECT_NE(text.find(bucket + "le=\"0.00025\"} 1\n"), std::string::npos);
+        EXPECT_NE(text.find(bucket + "le=\"0.005\"} 2\n"), std::string::npos);
+        EXPECT_NE(text.find(bucket + "le=\"60\"} 2\n"), std::string::npos);
+        EXPECT_NE(text.find(bucket + "le=\"+Inf\"} 3\n"), std::string::npos);
+        EXPECT_NE(
+          text.find("test_request_duration_seconds_count{endpoint=\"/sync\",timing=\"total\"} 3\n"),
+          std::string::npos);
+
+        // Only the timings that have been measured are exported.
+        EXPECT_EQ(count_lines(text, "test_request_duration_seconds_count"), 1);
+}
@@ -0,0 +1,268 @@
+#include <atomic>
+#include <future>
+
+#include <gtest/gtest.h>
+
+#include "client.hpp"
+#include "mock_homeserver.hpp"
+#include "mtx/requests.hpp"
+#include "mtx/responses.hpp"
+#include "sync_loop.hpp"
+
+//
+// The endpoints against the mock homeserver, so they run without a live Synapse.
+//
+
+using namespace mtx::client;
+using namespace mtx::client::testing;
+
+TEST(MockClientAPI, Login)
+{
+        MockHomeserver server;
+        auto client = std::make_shared<Client>(server.address());
+
+        auto login = client->login("alice", "secret", boost::asio::use_future);
+        EXPECT_EQ(login.get().user_id.toString(), "@alice:localhost");
+
+        auto wrong = client->login("alice", "wrong", boost::asio::use_future);
+
+        try {
+                wrong.get();
+                ADD_FAILURE() << "the wrong password was accepted";
+        } catch (const errors::ClientException &e) {
+                EXPECT_EQ(e.error().status_code, boost::beast::http::status::forbidden);
+                EXPECT_EQ(mtx::errors::to_string(e.error().matrix_error.errcode), "M_FORBIDDEN");
+        }
+
+        client->close();
+}
+
+TEST(MockClientAPI, Endpoints)
+{
+        MockHomeserver server;
+        auto client = std::make_shared<Client>(server.address());
+
+        mtx::requests::CreateRoom req;
+        req.name = "Name";
+
+        const auto room = client->create_room(req, boost::asio::use_future).get().room_id;
+        EXPECT_EQ(room.toString(), "!created0:localhost");
+
+        EXPECT_EQ(client->join_room(room, boost::asio::use_future).get()["room_id"],
+                  room.toString());
+        EXPECT_EQ(client->join_room("#alias:localhost", boost::asio::use_future)
+                    .get()["room_id"],
+                  "#alias:localhost");
+        client->leave_room(room, boost::asio::use_future).get();
+
+        const auto sync = client->sync("", "", false, 0, boost::asio::use_future).get();
+        EXPECT_EQ(sync.next_batch, "s1");
+        EXPECT_EQ(sync.rooms.join.size(), 10);
+
+        // All the requests went over the same connection.
+        EXPECT_EQ(server.requests(), 5);
+        EXPECT_EQ(server.connections(), 1);
+
+        client->close();
+}
+
+TEST(MockClientAPI, InjectedErrors)
+{
+        MockOptions options;
+        options.error_rate = 1;
+
+        MockHomeserver server(options);
+        auto client = std::make_shared<Client>(server.address());
+
+        auto sync = client->sync("", "", false, 0, boost::asio::use_future);
+
+        try {
+                sync.get();
+                ADD_FAILURE() << "the request didn't fail";
+        } catch (const errors::ClientException &e) {
+                EXPECT_EQ(e.error().status_code,
+                          boost::beast::http::status::internal_server_error);
+        }
+
+        client->close();
+}
+
+TEST(MockClientAPI, Latency)
+{
+        MockOptions options;
+        options.latency = std::chrono::milliseconds(300);
+
+        MockHomeserver server(options);
+        auto client = std::make_shared<Client>(server.address());
+
+        const auto start = std::chrono::steady_clock::now();
+        client->sync("", "", false, 0, boost::asio::use_future).get();
+        EXPECT_GE(std::chrono::steady_clock::now() - start, options.latency);
+
+        // The server is slower than the read limit.
+        RequestTimeouts timeouts;
+        timeouts.read = std::chrono::milliseconds(100);
+        client->set_timeouts(timeouts);
+
+        auto timed_out = client->sync("", "", false, 0, boost::asio::use_future);
+
+        try {
+                timed_out.get();
+                ADD_FAILURE() << "the request didn't time out";
+        } catch (const errors::ClientException &e) {
+                EXPECT_EQ(e.error().error_code, boost::asio::error::timed_out);
+        }
+
+        // Without a read limit, the long poll doesn't add one.
+        timeouts.read = std::chrono::milliseconds(0);
+        client->set_timeouts(timeouts);
+        client->sync("", "", false, 100, boost::asio::use_future).get();
+
+        client->close();
+}
+
+TEST(MockClientAPI, StaleConnection)
+{
+        std::atomic<int> dropped_syncs(0), dropped_rooms(0);
+
+        // The first /sync & /createRoom find their connection closed by the server.
+        MockOptions options;
+        options.drop = [&dropped_syncs, &dropped_rooms](const MockRequest &request) {
+                const auto target = request.target();
+
+                if (target.find("/sync") != boost::beast::string_view::npos)
+                        return dropped_syncs++ == 0;
+                if (target.find("/createRoom") != boost::beast::string_view::npos)
+                        return dropped_rooms++ == 0;
+
+                return false;
+        };
+
+        MockHomeserver server(options);
+        auto client = std::make_shared<Client>(server.address());
+
+        client->login("alice", "secret", boost::asio::use_future).get();
+
+        // A GET is sent again on a new connection.
+        const auto sync = client->sync("", "", false, 0, boost::asio::use_future).get();
+        EXPECT_EQ(sync.next_batch, "s1");
+        EXPECT_EQ(dropped_syncs, 2);
+        EXPECT_EQ(server.connections(), 2);
+
+        // The server may have created the room already, so a POST isn't.
+        auto room = client->create_room(mtx::requests::CreateRoom{}, boost::asio::use_future);
+        EXPECT_THROW(room.get(), errors::ClientException);
+        EXPECT_EQ(dropped_rooms, 1);
+
+        client->close();
+}
+
+TEST(MockClientAPI, SyncLoopReleasedByHandler)
+{
+        MockHomeserver server;
+        auto client = std::make_shared<Client>(server.address());
+
+        std::shared_ptr<SyncLoop> sync_loop;
+        std::weak_ptr<SyncLoop> weak_loop;
+        std::promise<void> done;
+
+        // The loop is released on its worker thread, which then goes on without it.
+        sync_loop = std::make_shared<SyncLoop>(
+          client, [&sync_loop, &done](const mtx::responses::Sync &) {
+                  if (!sync_loop)
+                          return;
+
+                  sync_loop->stop();
+
+                  // The request sent in the meantime lets go of the loop once it completes.
+                  const auto deadline =
+                    std::chrono::steady_clock::now() + std::chrono::seconds(5);
+                  while (sync_loop.use_count() > 1 && std::chrono::steady_clock::now() < deadline)
+                          std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+                  EXPECT_EQ(sync_loop.use_count(), 1);
+                  sync_loop.reset();
+                  done.set_value();
+          });
+        weak_loop = sync_loop;
+
+        sync_loop->start();
+        done.get_future().wait();
+
+        EXPECT_TRUE(weak_loop.expired());
+
+        client->close();
+}
+
+TEST(MockClientAPI, SyncLoopRestart)
+{
+        std::atomic<int> syncs(0);
+
+        // The first /sync is answered after the loop is restarted, the next ones later.
+        MockOptions options;
+        options.responder = [&syncs](const MockRequest &request,
+                                     MockResponse &,
+                                     std::chrono::microseconds &delay) {
+                if (request.target().find("/sync") != boost::beast::string_view::npos)
+                        delay = syncs++ == 0 ? std::chrono::milliseconds(300)
+                                             : std::chrono::milliseconds(1000);
+
+                return false;
+        };
+
+        MockHomeserver server(options);
+        auto client = std::make_shared<Client>(server.address());
+
+        std::atomic<int> batches(0);
+        auto sync_loop = std::make_shared<SyncLoop>(
+          client, [&batches](const mtx::responses::Sync &) { batches += 1; });
+
+        sync_loop->start();
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+        sync_loop->stop();
+        sync_loop->start();
+
+        // The request of the first run was cancelled, and its response isn't processed.
+        std::this_thread::sleep_for(std::chrono::milliseconds(600));
+
+        auto stats = sync_loop->stats();
+        EXPECT_EQ(batches, 0);
+        EXPECT_EQ(stats.polls, 0);
+        EXPECT_EQ(stats.failed_polls, 0);
+
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (batches == 0 && std::chrono::steady_clock::now() < deadline)
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+        sync_loop->stop();
+
+        // A single chain of requests was polling.
+        stats = sync_loop->stats();
+        EXPECT_EQ(batches, 1);
+        EXPECT_EQ(stats.polls, 1);
+        EXPECT_LE(syncs, 3);
+
+        client->close();
+}
+
+TEST(MockClientAPI, TlsSessionResumption)
+{
+        MockHomeserver server;
+        auto client = std::make_shared<Client>(server.address());
+
+        // Every request will have to open a new connection.
+        client->connection_pool()->set_max_idle(0);
+
+        for (int i = 0; i < 3; ++i)
+                client->login("alice", "secret", boost::asio::use_future).get();
+
+        // The sessions are cached under the host & its port, like the connections.
+        const auto stats = client->tls_session_cache()->stats();
+        EXPECT_EQ(stats.full, 1);
+        EXPECT_EQ(stats.resumed, 2);
+        EXPECT_EQ(stats.cached, 1);
+        EXPECT_EQ(server.connections(), 3);
+
+        client->close();
+}
@@ -0,0 +1,452 @@
+#include "mock_homeserver.hpp"
+
+#include <limits>
+#include <stdexcept>
+
+#include <boost/beast.hpp>
+#include <json.hpp>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+using namespace mtx::client::testing;
+namespace http = boost::beast::http;
+using tcp      = boost::asio::ip::tcp;
+
+namespace {
+
+using Request  = MockRequest;
+using Response = MockResponse;
+
+//! Generate a key & a certificate for localhost, valid for a day.
+void
+use_self_signed_certificate(boost::asio::ssl::context &ctx)
+{
+        std::unique_ptr<EVP_PKEY_CTX, decltype(&EVP_PKEY_CTX_free)> key_ctx(
+          EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr), &EVP_PKEY_CTX_free);
+        EVP_PKEY *raw_key = nullptr;
+
+        if (!key_ctx || EVP_PKEY_keygen_init(key_ctx.get()) <= 0 ||
+            EVP_PKEY_CTX_set_ec_paramgen_curve_nid(key_ctx.get(), NID_X9_62_prime256v1) <= 0 ||
+            EVP_PKEY_keygen(key_ctx.get(), &raw_key) <= 0)
+                throw std::runtime_error("mock homeserver: can't generate a key");
+
+        std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> key(raw_key, &EVP_PKEY_free);
+        std::unique_ptr<X509, decltype(&X509_free)> cert(X509_new(), &X509_free);
+
+        X509_set_version(cert.get(), 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(cert.get()), 1);
+        X509_gmtime_adj(X509_get_notBefore(cert.get()), -3600);
+        X509_gmtime_adj(X509_get_notAfter(cert.get()), 24 * 3600);
+        X509_set_pubkey(cert.get(), key.get());
+
+        auto name       = X509_get_subject_name(cert.get());
+        const auto host = reinterpret_cast<const unsigned char *>("localhost");
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, host, -1, -1, 0);
+        X509_set_issuer_name(cert.get(), name);
+
+        if (X509_sign(cert.get(), key.get(), EVP_sha256()) <= 0 ||
+            SSL_CTX_use_certificate(ctx.native_handle(), cert.get()) <= 0 ||
+            SSL_CTX_use_PrivateKey(ctx.native_handle(), key.get()) <= 0)
+                throw std::runtime_error("mock homeserver: can't set up the certificate");
+}
+
+//! The /sync response: the given number of joined rooms with a timeline each.
+std::string
+make_sync_body(std::size_t rooms, std::size_t events)
+{
+        nlohmann::json join = nlohmann::json::object();
+
+        for (std::size_t r = 0; r < rooms; ++r) {
+                nlohmann::json timeline = nlohmann::json::array();
+
+                for (std::size_t e = 0; e < events; ++e) {
+                        const auto body = "Message " + std::to_string(e);
+
+                        timeline.push_back(
+                          {{"type", "m.room.message"},
+                           {"event_id", "$" + std::to_string(r) + "_" + std::to_string(e)},
+                           {"sender", "@alice:localhost"},
+                           {"origin_server_ts", 1500000000000 + e},
+                           {"content", {{"msgtype", "m.text"}, {"body", body}}}});
+                }
+
+                join["!room" + std::to_string(r) + ":localhost"] = {
+                  {"state", {{"events", nlohmann::json::array()}}},
+                  {"timeline", {{"events", timeline}, {"limited", false}, {"prev_batch", "p1"}}},
+                  {"ephemeral", {{"events", nlohmann::json::array()}}},
+                  {"account_data", {{"events", nlohmann::json::array()}}},
+                  {"unread_notifications", {{"highlight_count", 0}, {"notification_count", 0}}}};
+        }
+
+        return nlohmann::json{{"next_batch", "s1"}, {"rooms", {{"join", join}}}}.dump();
+}
+
+void
+reply(Response &response, http::status status, std::string body)
+{
+        response.result(status);
+        response.set(http::field::content_type, "application/json");
+        response.body() = std::move(body);
+        response.prepare_payload();
+}
+
+void
+reply_error(Response &response, http::status status, const char *errcode, const char *error)
+{
+        reply(response, status, nlohmann::json{{"errcode", errcode}, {"error", error}}.dump());
+}
+
+bool
+starts_with(boost::beast::string_view value, boost::beast::string_view prefix)
+{
+        return value.substr(0, prefix.size()) == prefix;
+}
+
+bool
+ends_with(boost::beast::string_view value, boost::beast::string_view suffix)
+{
+        return value.size() >= suffix.size() &&
+               value.substr(value.size() - suffix.size()) == suffix;
+}
+
+//! Parse a single range of a `Range` field ("bytes=first-" or "bytes=first-last").
+bool
+parse_range(boost::beast::string_view value, uint64_t &first, uint64_t &last)
+{
+        if (!starts_with(value, "bytes="))
+                return false;
+        value.remove_prefix(6);
+
+        const auto dash = value.find('-');
+        if (dash == 0 || dash == boost::beast::string_view::npos)
+                return false;
+
+        try {
+                first = std::stoull(value.substr(0, dash).to_string());
+                last  = dash + 1 < value.size()
+                         ? std::stoull(value.substr(dash + 1).to_string())
+                         : std::numeric_limits<uint64_t>::max();
+        } catch (const std::exception &) {
+                return false;
+        }
+
+        return first <= last;
+}
+}
+
+class MockHomeserver::Connection : public std::enable_shared_from_this<Connection>
+{
+public:
+        Connection(MockHomeserver &server, tcp::socket socket)
+          : server_{server}
+          , stream_{std::move(socket), server.ssl_ctx_}
+          , timer_{server.ios_}
+        {}
+
+        void start()
+        {
+                stream_.async_handshake(
+                  boost::asio::ssl::stream_base::server,
+                  [self = shared_from_this()](boost::system::error_code ec) {
+                          if (!ec)
+                                  self->read();
+                  });
+        }
+
+private:
+        void read()
+        {
+                request_ = {};
+
+                http::async_read(
+                  stream_,
+                  buffer_,
+                  request_,
+                  [self = shared_from_this()](boost::system::error_code ec, std::size_t) {
+                          if (ec)
+                                  return self->close();
+
+                          const auto &drop = self->server_.options_.drop;
+                          if (drop && drop(self->request_))
+                                  return self->drop();
+
+                          self->respond();
+                  });
+        }
+
+        void respond()
+        {
+                response_ = {};
+                response_.version(request_.version());
+                response_.keep_alive(request_.keep_alive());
+
+                delay_ = std::chrono::microseconds(0);
+
+                handle();
+                ++server_.requests_;
+
+                const auto delay = server_.options_.latency + delay_;
+                if (delay.count() <= 0)
+                        return write();
+
+                timer_.expires_from_now(delay);
+                timer_.async_wait(
+                  [self = shared_from_this()](boost::system::error_code) { self->write(); });
+        }
+
+        void write()
+        {
+                http::async_write(
+                  stream_,
+                  response_,
+                  [self = shared_from_this()](boost::system::error_code ec, std::size_t) {
+                          if (ec)
+                                  return;
+
+                          if (!self->response_.keep_alive())
+                                  return self->close();
+
+                          self->read();
+                  });
+        }
+
+        void close()
+        {
+                stream_.async_shutdown(
+                  [self = shared_from_this()](boost::system::error_code) {});
+        }
+
+        //! Close the connection right away, without a TLS shutdown.
+        void drop()
+        {
+                boost::system::error_code ignored_ec;
+                stream_.next_layer().shutdown(tcp::socket::shutdown_both, ignored_ec);
+                stream_.next_layer().close(ignored_ec);
+        }
+
+        //! Fill the response to the request.
+        void handle()
+        {
+                if (server_.inject_error())
+                        return reply_error(
+                          response_, http::status::internal_server_error, "M_UNKNOWN", "Injected");
+
+                const auto &responder = server_.options_.responder;
+                if (responder && responder(request_, response_, delay_))
+                        return;
+
+                const boost::beast::string_view prefix       = "/_matrix/client/r0";
+                const boost::beast::string_view media_prefix = "/_matrix/media/r0";
+
+                auto target = request_.target();
+                target      = target.substr(0, target.find('?'));
+
+                if (starts_with(target, media_prefix))
+                        return media(target.substr(media_prefix.size()));
+
+                if (!starts_with(target, prefix))
+                        return reply_error(
+                          response_, http::status::not_found, "M_UNRECOGNIZED", "Unknown path");
+
+                const auto path = target.substr(prefix.size());
+
+                if (request_.method() == http::verb::get && path == "/sync")
+                        return reply(response_, http::status::ok, server_.sync_body_);
+
+                if (request_.method() != http::verb::post)
+                        return reply_error(
+                          response_, http::status::not_found, "M_UNRECOGNIZED", "Unknown path");
+
+                if (path == "/login")
+                        return login();
+
+                if (path == "/logout")
+                        return reply(response_, http::status::ok, "{}");
+
+                if (path == "/createRoom") {
+                        const auto room = "!created" + std::to_string(server_.next_room_++) +
+                                          ":localhost";
+
+                        return reply(
+                          response_, http::status::ok, nlohmann::json{{"room_id", room}}.dump());
+                }
+
+                if (starts_with(path, "/join/")) {
+                        const auto room = path.substr(6);
+
+                        return reply(response_,
+                                     http::status::ok,
+                                     nlohmann::json{{"room_id", room.to_string()}}.dump());
+                }
+
+                if (starts_with(path, "/rooms/") && ends_with(path, "/join")) {
+                        const auto room = path.substr(7, path.size() - 7 - 5);
+
+                        return reply(response_,
+                                     http::status::ok,
+                                     nlohmann::json{{"room_id", room.to_string()}}.dump());
+                }
+
+                if (starts_with(path, "/rooms/") && ends_with(path, "/leave"))
+                        return reply(response_, http::status::ok, "{}");
+
+                reply_error(response_, http::status::not_found, "M_UNRECOGNIZED", "Unknown path");
+        }
+
+        void login()
+        {
+                nlohmann::json body;
+
+                try {
+                        body = nlohmann::json::parse(request_.body());
+                } catch (const nlohmann::json::exception &) {
+                        return reply_error(
+                          response_, http::status::bad_request, "M_NOT_JSON", "Invalid JSON");
+                }
+
+                if (body.value("password", "") != server_.options_.password)
+                        return reply_error(
+                          response_, http::status::forbidden, "M_FORBIDDEN", "Invalid password");
+
+                const auto user = body.value("user", "alice");
+
+                reply(response_,
+                      http::status::ok,
+                      nlohmann::json{{"user_id", "@" + user + ":localhost"},
+                                     {"access_token", "token" + std::to_string(server_.requests_)},
+                                     {"home_server", "localhost"},
+                                     {"device_id", "MOCKDEVICE"}}
+                        .dump());
+        }
+
+        void media(boost::beast::string_view path)
+        {
+                if (request_.method() == http::verb::post && path == "/upload") {
+                        if (!starts_with(request_[http::field::authorization], "Bearer "))
+                                return reply_error(response_,
+                                                   http::status::unauthorized,
+                                                   "M_MISSING_TOKEN",
+                                                   "Missing access token");
+
+                        std::unique_lock<std::mutex> lock(server_.media_mutex_);
+
+                        const auto id = "media" + std::to_string(server_.media_.size());
+                        server_.media_[id] = {request_[http::field::content_type].to_string(),
+                                              request_.body()};
+                        lock.unlock();
+
+                        return reply(response_,
+                                     http::status::ok,
+                                     nlohmann::json{{"content_uri", "mxc://localhost/" + id}}
+                                       .dump());
+                }
+
+                const boost::beast::string_view download = "/download/localhost/";
+
+                if (request_.method() != http::verb::get || !starts_with(path, download))
+                        return reply_error(
+                          response_, http::status::not_found, "M_UNRECOGNIZED", "Unknown path");
+
+                std::unique_lock<std::mutex> lock(server_.media_mutex_);
+
+                const auto it = server_.media_.find(path.substr(download.size()).to_string());
+                if (it == server_.media_.end())
+                        return reply_error(
+                          response_, http::status::not_found, "M_NOT_FOUND", "Unknown media");
+
+                const auto media = it->second;
+                lock.unlock();
+
+                const auto size  = media.content.size();
+                const auto range = request_[http::field::range];
+                uint64_t first = 0, last = 0;
+
+                if (range.empty() || !parse_range(range, first, last)) {
+                        response_.result(http::status::ok);
+                        response_.body() = media.content;
+                } else if (first >= size) {
+                        response_.result(http::status::range_not_satisfiable);
+                        response_.set(http::field::content_range,
+                                      "bytes */" + std::to_string(size));
+                } else {
+                        last = std::min<uint64_t>(last, size - 1);
+
+                        response_.result(http::status::partial_content);
+                        response_.set(http::field::content_range,
+                                      "bytes " + std::to_string(first) + "-" +
+                                        std::to_string(last) + "/" + std::to_string(size));
+                        response_.body() = media.content.substr(first, last - first + 1);
+                }
+
+                response_.set(http::field::content_type, media.content_type);
+                response_.prepare_payload();
+        }
+
+        MockHomeserver &server_;
+        boost::asio::ssl::stream<tcp::socket> stream_;
+        boost::asio::steady_timer timer_;
+        boost::beast::flat_buffer buffer_;
+        Request request_;
+        Response response_;
+        //! Delay of the response, asked by the responder.
+        std::chrono::microseconds delay_{0};
+};
+
+MockHomeserver::MockHomeserver(MockOptions options)
+  : options_{std::move(options)}
+  , sync_body_{make_sync_body(options_.sync_rooms, options_.sync_events)}
+  , ssl_ctx_{boost::asio::ssl::context::sslv23_server}
+  , acceptor_{ios_}
+  , random_{options_.seed}
+{
+        use_self_signed_certificate(ssl_ctx_);
+
+        const tcp::endpoint endpoint{boost::asio::ip::address_v4::loopback(), 0};
+
+        acceptor_.open(endpoint.protocol());
+        acceptor_.set_option(tcp::acceptor::reuse_address(true));
+        acceptor_.bind(endpoint);
+        acceptor_.listen();
+
+        port_ = acceptor_.local_endpoint().port();
+
+        accept();
+
+        for (unsigned int i = 0; i < std::max(options_.threads, 1u); ++i)
+                threads_.emplace_back([this]() { ios_.run(); });
+}
+
+MockHomeserver::~MockHomeserver()
+{
+        ios_.stop();
+
+        for (auto &thread : threads_)
+                thread.join();
+}
+
+void
+MockHomeserver::accept()
+{
+        acceptor_.async_accept([this](boost::system::error_code ec, tcp::socket socket) {
+                if (ec)
+                        return;
+
+                ++connections_;
+
+                boost::system::error_code ignored_ec;
+                socket.set_option(tcp::no_delay(true), ignored_ec);
+
+                std::make_shared<Connection>(*this, std::move(socket))->start();
+                accept();
+        });
+}
+
+bool
+MockHomeserver::inject_error()
+{
+        if (options_.error_rate <= 0)
+                return false;
+
+        std::lock_guard<std::mutex> lock(random_mutex_);
+        return std::uniform_real_distribution<double>(0, 1)(random_) < options_.error_rate;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/beast/http.hpp>
+
+namespace mtx {
+namespace client {
+namespace testing {
+
+using MockRequest  = boost::beast::http::request<boost::beast::http::string_body>;
+using MockResponse = boost::beast::http::response<boost::beast::http::string_body>;
+
+//! Fills the response to a request & returns true, or returns false to leave the request
+//! to the canned responses. The response is sent after `delay`, on top of the latency.
+using MockResponder = std::function<
+  bool(const MockRequest &request, MockResponse &response, std::chrono::microseconds &delay)>;
+
+//! How the mock homeserver behaves.
+struct MockOptions
+{
+        //! Delay before every response is sent.
+        std::chrono::milliseconds latency{0};
+        //! Fraction of the requests (0 to 1) answered with a 500 error.
+        double error_rate = 0;
+        //! Size of the /sync response: the number of joined rooms & the messages of each.
+        std::size_t sync_rooms  = 10;
+        std::size_t sync_events = 10;
+        //! The password /login accepts. Any other one is rejected with M_FORBIDDEN.
+        std::string password = "secret";
+        //! Number of threads serving the requests.
+        unsigned int threads = 1;
+        //! Seed of the errors, so that a run can be reproduced.
+        uint32_t seed = 1;
+        //! If set, asked for a response before the canned ones (e.g by a `TrafficReplay`).
+        //! It's called from the threads serving the requests.
+        MockResponder responder;
+        //! If set and it returns true, the connection is closed without answering the
+        //! request, as when a server closes an idle connection while a request is sent.
+        std::function<bool(const MockRequest &request)> drop;
+};
+
+//! A homeserver stand-in that serves canned responses over TLS on a local port,
+//! with a self-signed certificate. It answers:
+//!
+//!  - POST /login, /logout & /createRoom
+//!  - POST /join/{room} & /rooms/{id}/join, /rooms/{id}/leave
+//!  - GET /sync
+//!  - POST /upload (with an access token) & GET /download/localhost/{id}, which honors
+//!    a single `Range`
+//!
+//! Anything else gets a 404 M_UNRECOGNIZED, unless the responder of the options
+//! answers it. The connections are kept alive.
+class MockHomeserver
+{
+public:
+        explicit MockHomeserver(MockOptions options = {});
+        //! Stop serving & wait for the threads.
+        ~MockHomeserver();
+
+        MockHomeserver(const MockHomeserver &) = delete;
+        MockHomeserver &operator=(const MockHomeserver &) = delete;
+
+        //! The port it listens to, on the loopback interface.
+        unsigned short port() const { return port_; }
+        //! The address to give to a client ("localhost:port").
+        std::string address() const { return "localhost:" + std::to_string(port_); }
+
+        //! Number of requests answered so far.
+        uint64_t requests() const { return requests_; }
+        //! Number of connections accepted so far.
+        uint64_t connections() const { return connections_; }
+
+        //! The body of every /sync response.
+        const std::string &sync_body() const { return sync_body_; }
+
+private:
+        class Connection;
+
+        void accept();
+        //! Whether the next request should fail.
+        bool inject_error();
+
+        MockOptions options_;
+        std::string sync_body_;
+
+        boost::asio::io_service ios_;
+        boost::asio::ssl::context ssl_ctx_;
+        boost::asio::ip::tcp::acceptor acceptor_;
+        unsigned short port_ = 0;
+
+        std::atomic<uint64_t> requests_{0};
+        std::atomic<uint64_t> connections_{0};
+        std::atomic<uint64_t> next_room_{0};
+
+        //! The uploaded content & its media type, by media id.
+        struct Media
+        {
+                std::string content_type;
+                std::string content;
+        };
+
+        std::mutex media_mutex_;
+        std::map<std::string, Media> media_;
+
+        std::mutex random_mutex_;
+        std::mt19937 random_;
+
+        std::vector<std::thread> threads_;
+};
+}
+}
+}
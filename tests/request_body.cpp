@@ -0,0 +1,110 @@
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <fstream>
+
+#include "request_body.hpp"
+
+using namespace mtx::client;
+
+//! Read the whole body, in reads of the given size.
+std::string
+read_all(BodySource &body, std::size_t read_size)
+{
+        std::string out;
+        std::string buffer(read_size, '\0');
+
+        boost::system::error_code ec;
+        while (const auto n = body.read(&buffer[0], buffer.size(), ec))
+                out.append(buffer.data(), n);
+
+        EXPECT_FALSE(ec);
+        return out;
+}
+
+nlohmann::json
+sample_document()
+{
+        nlohmann::json events = nlohmann::json::array();
+        for (int i = 0; i < 100; ++i)
+                events.push_back({{"type", "m.room.member"},
+                                  {"state_key", "@user" + std::to_string(i) + ":example.com"},
+                                  {"content", {{"membership", "join"}, {"power", i * 1.5}}}});
+
+        return {{"name", "Name"},
+                {"topic", "a \"quoted\" \\ topic\n\twith\x01 control characters & ünicode"},
+                {"invite", nlohmann::json::array()},
+                {"options", nlohmann::json::object()},
+                {"is_direct", false},
+                {"preset", nullptr},
+                {"counts", {-1, 0, 42, 1e100}},
+                {"initial_state", events}};
+}
+
+TEST(RequestBody, JsonMatchesDump)
+{
+        const auto document = sample_document();
+        const auto expected = document.dump();
+
+        JsonBody body(document);
+        EXPECT_EQ(body.size(), expected.size());
+        EXPECT_EQ(body.content_type(), "application/json");
+
+        // Every token has to survive being split across reads.
+        for (std::size_t read_size : {1, 2, 3, 5, 7, 13, 64, 1000, 65536}) {
+                boost::system::error_code ec;
+                body.rewind(ec);
+
+                EXPECT_EQ(read_all(body, read_size), expected) << "read size " << read_size;
+        }
+}
+
+TEST(RequestBody, JsonScalars)
+{
+        for (const nlohmann::json &document : {nlohmann::json("\x1f\""),
+                                               nlohmann::json(""),
+                                               nlohmann::json(12),
+                                               nlohmann::json(true),
+                                               nlohmann::json(nullptr),
+                                               nlohmann::json::array(),
+                                               nlohmann::json::object()}) {
+                JsonBody body(document);
+
+                EXPECT_EQ(body.size(), document.dump().size());
+                EXPECT_EQ(read_all(body, 3), document.dump());
+        }
+}
+
+TEST(RequestBody, LongString)
+{
+        const nlohmann::json document = {{"body", std::string(100000, 'a') + "\n"}};
+
+        JsonBody body(document);
+        EXPECT_EQ(read_all(body, 4096), document.dump());
+}
+
+TEST(RequestBody, File)
+{
+        const std::string path = "request_body_test.bin";
+        const std::string data(200000, 'x');
+
+        std::ofstream(path, std::ios::binary) << data;
+
+        boost::system::error_code ec;
+        auto body = FileBody::open(path, "application/octet-stream", ec);
+
+        ASSERT_FALSE(ec);
+        ASSERT_TRUE(body);
+        EXPECT_EQ(body->size(), data.size());
+        EXPECT_EQ(body->content_type(), "application/octet-stream");
+        EXPECT_EQ(read_all(*body, 65536), data);
+
+        body->rewind(ec);
+        EXPECT_FALSE(ec);
+        EXPECT_EQ(read_all(*body, 1000), data);
+
+        std::remove(path.c_str());
+
+        EXPECT_FALSE(FileBody::open("does_not_exist.bin", "text/plain", ec));
+        EXPECT_TRUE(ec);
+}
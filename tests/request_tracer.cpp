@@ -0,0 +1,219 @@
+#include <chrono>
+#include <future>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <json.hpp>
+
+#include "client.hpp"
+#include "mock_homeserver.hpp"
+#include "mtx/requests.hpp"
+#include "mtx/responses.hpp"
+#include "request_tracer.hpp"
+
+//
+// Tracing the handlers & the phases of the requests, and exporting the traces.
+//
+
+using namespace mtx::client;
+using namespace mtx::client::testing;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+std::vector<TraceEvent>
+events_of(const std::vector<TraceEvent> &events, uint64_t request, TraceEvent::Kind kind)
+{
+        std::vector<TraceEvent> result;
+        for (const auto &event : events) {
+                if (event.request == request && event.kind == kind)
+                        result.push_back(event);
+        }
+
+        return result;
+}
+
+bool
+has_event(const std::vector<TraceEvent> &events, const std::string &name)
+{
+        for (const auto &event : events) {
+                if (event.name == name)
+                        return true;
+        }
+
+        return false;
+}
+}
+
+TEST(RequestTracer, RingBuffer)
+{
+        RequestTracer tracer(8);
+
+        const auto start = Clock::now();
+        for (uint64_t i = 0; i < 20; ++i)
+                tracer.handler("handler",
+                               i,
+                               "read",
+                               start + std::chrono::microseconds(i),
+                               start + std::chrono::microseconds(i + 1));
+
+        // The oldest span of a full buffer is left out, as it could be overwritten.
+        const auto events = tracer.events();
+        ASSERT_EQ(events.size(), 7);
+        EXPECT_EQ(tracer.dropped(), 12);
+
+        for (std::size_t i = 0; i < events.size(); ++i) {
+                EXPECT_EQ(events[i].request, 13 + i);
+                EXPECT_EQ(events[i].start, start + std::chrono::microseconds(13 + i));
+                EXPECT_EQ(events[i].duration, std::chrono::microseconds(1));
+                EXPECT_EQ(std::string(events[i].phase), "read");
+                EXPECT_EQ(events[i].thread, 1);
+        }
+}
+
+TEST(RequestTracer, ConcurrentThreads)
+{
+        RequestTracer tracer(1024);
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+                threads.emplace_back([&tracer, t]() {
+                        for (int i = 0; i < 5000; ++i) {
+                                TraceSpan span(&tracer, "handler", t, "read");
+                        }
+                });
+        }
+
+        // The buffers can be read while they're written.
+        for (int i = 0; i < 10; ++i) {
+                for (const auto &event : tracer.events())
+                        EXPECT_EQ(event.request, event.thread - 1);
+        }
+
+        for (auto &thread : threads)
+                thread.join();
+
+        const auto events = tracer.events();
+        EXPECT_EQ(events.size(), 4 * 1023);
+        EXPECT_EQ(tracer.dropped(), 4 * (5000 - 1024));
+
+        std::set<uint32_t> thread_ids;
+        for (std::size_t i = 0; i < events.size(); ++i) {
+                thread_ids.insert(events[i].thread);
+                if (i > 0) {
+                        EXPECT_LE(events[i - 1].start, events[i].start);
+                }
+        }
+
+        EXPECT_EQ(thread_ids.size(), 4);
+}
+
+TEST(RequestTracer, Client)
+{
+        MockOptions options;
+        options.latency = std::chrono::milliseconds(10);
+
+        MockHomeserver server(options);
+        auto client = std::make_shared<Client>(server.address());
+
+        auto tracer = std::make_shared<RequestTracer>();
+        client->set_tracer(tracer);
+
+        client->login("alice", "secret", boost::asio::use_future).get();
+        client->sync("", "", false, 0, boost::asio::use_future).get();
+
+        // Not traced.
+        client->set_tracer(nullptr);
+        client->sync("", "", false, 0, boost::asio::use_future).get();
+
+        client->close();
+
+        const auto events = tracer->events();
+        std::set<uint64_t> requests;
+        for (const auto &event : events)
+                requests.insert(event.request);
+
+        ASSERT_EQ(requests.size(), 2);
+
+        // The first request went through all the phases.
+        const auto login = *requests.begin();
+
+        const auto phases = events_of(events, login, TraceEvent::Kind::Phase);
+        std::vector<std::string> names;
+        for (const auto &phase : phases)
+                names.push_back(phase.name);
+
+        EXPECT_EQ(names,
+                  (std::vector<std::string>{
+                    "queued", "resolve", "connect", "handshake", "write", "read"}));
+
+        for (std::size_t i = 1; i < phases.size(); ++i)
+                EXPECT_EQ(phases[i].start, phases[i - 1].start + phases[i - 1].duration);
+
+        const auto handlers = events_of(events, login, TraceEvent::Kind::Handler);
+        for (const auto *name : {"start_request",
+                                 "on_connection",
+                                 "on_resolve",
+                                 "on_connect",
+                                 "on_handshake",
+                                 "on_write",
+                                 "on_read_some",
+                                 "callback"}) {
+                EXPECT_TRUE(has_event(handlers, name)) << name;
+        }
+
+        // The second one reused the connection, and waited for the server while reading.
+        const auto sync          = *requests.rbegin();
+        const auto read          = events_of(events, sync, TraceEvent::Kind::Phase).back();
+        const auto sync_handlers = events_of(events, sync, TraceEvent::Kind::Handler);
+
+        EXPECT_EQ(std::string(read.name), "read");
+        EXPECT_GE(read.duration, std::chrono::milliseconds(10));
+        EXPECT_FALSE(has_event(sync_handlers, "on_connect"));
+        EXPECT_EQ(std::string(sync_handlers.back().name), "callback");
+        EXPECT_EQ(std::string(sync_handlers.back().phase), "read");
+}
+
+TEST(RequestTracer, ChromeTrace)
+{
+        RequestTracer tracer;
+
+        const auto start = Clock::now();
+        tracer.phase("connect", 7, start, start + std::chrono::microseconds(1500));
+        tracer.handler("on_connect",
+                       7,
+                       "connect",
+                       start + std::chrono::microseconds(1500),
+                       start + std::chrono::microseconds(1520));
+
+        const auto trace   = nlohmann::json::parse(to_chrome_trace(tracer.events()));
+        const auto &events = trace.at("traceEvents");
+
+        ASSERT_EQ(events.size(), 4);
+
+        EXPECT_EQ(events[0].at("ph"), "b");
+        EXPECT_EQ(events[0].at("name"), "connect");
+        EXPECT_EQ(events[0].at("id"), 7);
+        EXPECT_DOUBLE_EQ(events[0].at("ts").get<double>(), 0);
+
+        EXPECT_EQ(events[1].at("ph"), "e");
+        EXPECT_EQ(events[1].at("id"), 7);
+        EXPECT_DOUBLE_EQ(events[1].at("ts").get<double>(), 1500);
+
+        EXPECT_EQ(events[2].at("ph"), "X");
+        EXPECT_EQ(events[2].at("name"), "on_connect");
+        EXPECT_DOUBLE_EQ(events[2].at("ts").get<double>(), 1500);
+        EXPECT_DOUBLE_EQ(events[2].at("dur").get<double>(), 20);
+        EXPECT_EQ(events[2].at("args").at("request"), 7);
+        EXPECT_EQ(events[2].at("args").at("phase"), "connect");
+        EXPECT_EQ(events[2].at("tid"), 1);
+
+        // The threads are named.
+        EXPECT_EQ(events[3].at("ph"), "M");
+        EXPECT_EQ(events[3].at("args").at("name"), "network thread 1");
+
+        EXPECT_EQ(to_chrome_trace({}), "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[]}\n");
+}
@@ -0,0 +1,360 @@
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "callback_executor.hpp"
+#include "client.hpp"
+#include "mock_homeserver.hpp"
+#include "mtx/requests.hpp"
+#include "mtx/responses.hpp"
+#include "stall_detector.hpp"
+
+//
+// Detecting the handlers & the callbacks that hold up the network threads, and moving
+// the callbacks off them.
+//
+
+using namespace mtx::client;
+using namespace mtx::client::testing;
+using Clock = std::chrono::steady_clock;
+using Stall = StallDetector::Stall;
+
+namespace {
+
+//! Collects the stalls reported by a detector.
+class StallLog
+{
+public:
+        StallDetector::Options options(std::chrono::milliseconds threshold)
+        {
+                StallDetector::Options options;
+                options.threshold = threshold;
+                options.interval  = std::chrono::milliseconds(10);
+                options.on_stall  = [this](const Stall &stall) {
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        stalls_.push_back(stall);
+                };
+
+                return options;
+        }
+
+        std::vector<Stall> stalls() const
+        {
+                std::lock_guard<std::mutex> lock(mutex_);
+                return stalls_;
+        }
+
+        std::vector<Stall> stalls(Stall::Kind kind, bool in_progress) const
+        {
+                std::vector<Stall> result;
+                for (const auto &stall : stalls()) {
+                        if (stall.kind == kind && stall.in_progress == in_progress)
+                                result.push_back(stall);
+                }
+
+                return result;
+        }
+
+private:
+        mutable std::mutex mutex_;
+        std::vector<Stall> stalls_;
+};
+
+//! Wait until the stalls of the kind have been reported.
+std::vector<Stall>
+wait_for_stalls(const StallLog &log, Stall::Kind kind, bool in_progress)
+{
+        const auto deadline = Clock::now() + std::chrono::seconds(5);
+
+        auto stalls = log.stalls(kind, in_progress);
+        while (stalls.empty() && Clock::now() < deadline) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                stalls = log.stalls(kind, in_progress);
+        }
+
+        return stalls;
+}
+}
+
+TEST(StallDetector, NestedHandlers)
+{
+        StallLog log;
+        StallDetector detector({}, log.options(std::chrono::milliseconds(50)));
+
+        const auto start = Clock::now();
+
+        StallDetector::Frame outer, inner;
+        detector.enter(outer, Stall::Kind::Handler, "on_read_some", 1, 0, start);
+        detector.enter(inner,
+                       Stall::Kind::Callback,
+                       "callback",
+                       1,
+                       0,
+                       start + std::chrono::milliseconds(10));
+
+        // The time spent in the callback isn't counted in the handler it's nested in.
+        std::chrono::steady_clock::duration duration;
+        EXPECT_TRUE(detector.leave(inner, start + std::chrono::milliseconds(110), duration));
+        EXPECT_EQ(duration, std::chrono::milliseconds(100));
+
+        EXPECT_FALSE(detector.leave(outer, start + std::chrono::milliseconds(130), duration));
+        EXPECT_EQ(duration, std::chrono::milliseconds(30));
+
+        const auto stats = detector.stats();
+        EXPECT_EQ(stats.longest_callback, std::chrono::milliseconds(100));
+        EXPECT_EQ(stats.longest_handler, std::chrono::milliseconds(30));
+        EXPECT_EQ(stats.stalls, 0);
+}
+
+TEST(StallDetector, SlowCallback)
+{
+        MockHomeserver server;
+
+        ThreadOptions threads;
+        threads.threads = 1;
+        auto client     = std::make_shared<Client>(server.address(), threads);
+
+        StallLog log;
+        auto detector = client->detect_stalls(log.options(std::chrono::milliseconds(50)));
+
+        // Quick requests don't stall anything.
+        client->login("alice", "secret", boost::asio::use_future).get();
+        client->sync("", "", false, 0, boost::asio::use_future).get();
+        EXPECT_TRUE(log.stalls().empty());
+
+        std::promise<void> done;
+        client->sync("", "", false, 0, [&done](const mtx::responses::Sync &, Client::RequestErr) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(300));
+                done.set_value();
+        });
+        done.get_future().wait();
+
+        // Seen by the watchdog while it was running, as its probe couldn't run.
+        const auto running = wait_for_stalls(log, Stall::Kind::Callback, true);
+        ASSERT_FALSE(running.empty());
+        EXPECT_STREQ(running.front().name, "callback");
+        EXPECT_GT(running.front().request, 0);
+        EXPECT_GE(running.front().duration, std::chrono::milliseconds(50));
+
+        // Then reported with its endpoint once it returned.
+        const auto callbacks = wait_for_stalls(log, Stall::Kind::Callback, false);
+        ASSERT_EQ(callbacks.size(), 1);
+        EXPECT_EQ(callbacks.front().endpoint, "/sync");
+        EXPECT_EQ(callbacks.front().request, running.front().request);
+        EXPECT_GE(callbacks.front().duration, std::chrono::milliseconds(300));
+
+        const auto delays = wait_for_stalls(log, Stall::Kind::QueueDelay, false);
+        ASSERT_FALSE(delays.empty());
+        EXPECT_GE(delays.front().duration, std::chrono::milliseconds(50));
+
+        // The handlers themselves were quick.
+        EXPECT_TRUE(log.stalls(Stall::Kind::Handler, false).empty());
+
+        const auto stats = detector->stats();
+        EXPECT_GE(stats.longest_callback, std::chrono::milliseconds(300));
+        EXPECT_GT(stats.queue_delay.count(), 0);
+        EXPECT_EQ(stats.stalls, log.stalls().size());
+
+        client->close();
+}
+
+TEST(StallDetector, CallbackExecutor)
+{
+        MockHomeserver server;
+
+        ThreadOptions threads;
+        threads.threads = 1;
+        auto client     = std::make_shared<Client>(server.address(), threads);
+
+        StallLog log;
+        client->detect_stalls(log.options(std::chrono::milliseconds(50)));
+
+        auto executor = std::make_shared<CallbackExecutor>(2);
+        client->set_callback_executor(executor);
+
+        client->login("alice", "secret", boost::asio::use_future).get();
+
+        // A slow callback doesn't hold up the next request.
+        std::promise<void> done;
+        client->sync("", "", false, 0, [&done](const mtx::responses::Sync &, Client::RequestErr) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(300));
+                done.set_value();
+        });
+
+        const auto start = Clock::now();
+        client->sync("", "", false, 0, boost::asio::use_future).get();
+        EXPECT_LT(Clock::now() - start, std::chrono::milliseconds(250));
+
+        done.get_future().wait();
+
+        const auto stats = executor->stats();
+        EXPECT_EQ(stats.overflows, 0);
+        EXPECT_GE(stats.max_queue_depth, 1);
+
+        // It didn't run on a network thread.
+        EXPECT_TRUE(log.stalls(Stall::Kind::Callback, false).empty());
+        EXPECT_TRUE(log.stalls(Stall::Kind::QueueDelay, false).empty());
+
+        client->close();
+        executor->stop();
+        EXPECT_EQ(executor->stats().executed, 3);
+}
+
+TEST(StallDetector, ReleasedByWatchdog)
+{
+        // Never run, so the probes are late.
+        boost::asio::io_service ios;
+
+        StallDetector::Options options;
+        options.threshold = std::chrono::milliseconds(50);
+        options.interval  = std::chrono::milliseconds(10);
+
+        std::shared_ptr<StallDetector> detector;
+        std::promise<void> reported;
+
+        // The watchdog releases the last reference while it reports the stall.
+        options.on_stall = [&detector, &reported](const Stall &) {
+                if (detector) {
+                        detector.reset();
+                        reported.set_value();
+                }
+        };
+
+        detector = std::make_shared<StallDetector>(std::vector<boost::asio::io_service *>{&ios},
+                                                   options);
+        std::weak_ptr<StallDetector> watched = detector;
+        auto raw                             = detector.get();
+        detector->start();
+
+        std::promise<void> released;
+        std::thread handler([raw, &released]() {
+                StallDetector::Frame frame;
+                raw->enter(frame,
+                           Stall::Kind::Handler,
+                           "on_read_some",
+                           1,
+                           0,
+                           Clock::now() - std::chrono::seconds(1));
+
+                released.get_future().wait();
+        });
+
+        reported.get_future().wait();
+
+        const auto deadline = Clock::now() + std::chrono::seconds(5);
+        while (!watched.expired() && Clock::now() < deadline)
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+        EXPECT_TRUE(watched.expired());
+
+        released.set_value();
+        handler.join();
+}
+
+TEST(StallDetector, ReleasedByCallback)
+{
+        MockHomeserver server;
+
+        auto client = std::make_shared<Client>(server.address());
+        client->set_callback_executor(std::make_shared<CallbackExecutor>());
+
+        std::weak_ptr<Client> weak_client             = client;
+        std::weak_ptr<CallbackExecutor> weak_executor = client->callback_executor();
+
+        // The client & its executor are released on the thread of the executor.
+        std::promise<void> done;
+        client->sync(
+          "", "", false, 0, [&client, &done](const mtx::responses::Sync &, Client::RequestErr) {
+                  client.reset();
+                  done.set_value();
+          });
+        done.get_future().wait();
+
+        const auto deadline = Clock::now() + std::chrono::seconds(5);
+        while (!weak_executor.expired() && Clock::now() < deadline)
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+        EXPECT_TRUE(weak_client.expired());
+        EXPECT_TRUE(weak_executor.expired());
+}
+
+TEST(StallDetector, SharedDetector)
+{
+        MockHomeserver server;
+        StallLog log;
+
+        auto owner    = std::make_shared<Client>(server.address());
+        auto detector = owner->detect_stalls(log.options(std::chrono::milliseconds(100)));
+
+        auto other = std::make_shared<Client>(server.address());
+        other->set_stall_detector(detector);
+        other->sync("", "", false, 0, boost::asio::use_future).get();
+
+        // Only the client that started the detector stops it.
+        other->close();
+        other.reset();
+
+        const auto probes   = detector->stats().queue_delay.count();
+        const auto deadline = Clock::now() + std::chrono::seconds(5);
+        while (detector->stats().queue_delay.count() <= probes && Clock::now() < deadline)
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+        EXPECT_GT(detector->stats().queue_delay.count(), probes);
+
+        owner->close();
+}
+
+TEST(StallDetector, ConcurrentStop)
+{
+        boost::asio::io_service ios;
+        StallLog log;
+
+        auto detector = std::make_shared<StallDetector>(
+          std::vector<boost::asio::io_service *>{&ios},
+          log.options(std::chrono::milliseconds(100)));
+        detector->start();
+
+        // As when the clients sharing the detector are closed at the same time.
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 4; ++i)
+                threads.emplace_back([detector]() { detector->stop(); });
+
+        for (auto &thread : threads)
+                thread.join();
+
+        detector->stop();
+}
+
+TEST(StallDetector, ExecutorOverflow)
+{
+        CallbackExecutor executor(1, 1);
+
+        std::promise<void> release;
+        auto released = release.get_future().share();
+        std::promise<void> started;
+
+        EXPECT_TRUE(executor.try_post([&started, released]() {
+                started.set_value();
+                released.wait();
+        }));
+        started.get_future().wait();
+
+        // One function can wait while the first one runs.
+        EXPECT_TRUE(executor.try_post([]() {}));
+        EXPECT_FALSE(executor.try_post([]() {}));
+
+        release.set_value();
+        executor.stop();
+
+        const auto stats = executor.stats();
+        EXPECT_EQ(stats.executed, 2);
+        EXPECT_EQ(stats.overflows, 1);
+        EXPECT_EQ(stats.queue_depth, 0);
+
+        // Nothing runs once it's stopped.
+        EXPECT_FALSE(executor.try_post([]() {}));
+}
@@ -0,0 +1,117 @@
+#include <gtest/gtest.h>
+
+#include "sync_parser.hpp"
+#include "utils.hpp"
+
+using namespace mtx::client;
+
+const std::string sync_data = R"({
+  "next_batch": "s72595_4483_1934",
+  "presence": {"events": [{"type": "m.presence", "content": {"presence": "online"}}]},
+  "account_data": {"events": []},
+  "rooms": {
+    "join": {
+      "!726s6s6q:example.com": {
+        "state": {"events": [{"type": "m.room.name", "state_key": "", "content": {"name": "{[\"}"}}]},
+        "timeline": {
+          "events": [
+            {"type": "m.room.message", "content": {"body": "a \"quoted\" } brace", "msgtype": "m.text"}},
+            {"type": "m.room.message", "content": {"body": "\\", "msgtype": "m.text"}}
+          ],
+          "limited": true,
+          "prev_batch": "t34-23535_0_0"
+        },
+        "ephemeral": {"events": []}
+      },
+      "!esc\"aped:example.com": {"timeline": {"events": []}}
+    },
+    "invite": {
+      "!696r7674:example.com": {"invite_state": {"events": []}}
+    },
+    "leave": {
+      "!left:example.com": {"timeline": {"events": [{"type": "m.room.message", "content": {}}]}}
+    },
+    "unknown": {"!room:example.com": {"timeline": {"events": []}}}
+  }
+})";
+
+void
+expect_same(const mtx::responses::Sync &expected, const mtx::responses::Sync &actual)
+{
+        EXPECT_EQ(expected.next_batch, actual.next_batch);
+        EXPECT_EQ(expected.rooms.join.size(), actual.rooms.join.size());
+        EXPECT_EQ(expected.rooms.leave.size(), actual.rooms.leave.size());
+        EXPECT_EQ(expected.rooms.invite.size(), actual.rooms.invite.size());
+
+        for (const auto &room : expected.rooms.join) {
+                ASSERT_EQ(actual.rooms.join.count(room.first), 1);
+
+                const auto &other = actual.rooms.join.at(room.first);
+                EXPECT_EQ(room.second.timeline.events.size(), other.timeline.events.size());
+                EXPECT_EQ(room.second.timeline.prev_batch, other.timeline.prev_batch);
+                EXPECT_EQ(room.second.state.events.size(), other.state.events.size());
+        }
+}
+
+TEST(SyncParser, SameAsDom)
+{
+        const mtx::responses::Sync expected = json::parse(sync_data);
+
+        expect_same(expected, utils::deserialize<mtx::responses::Sync>(sync_data));
+        EXPECT_EQ(expected.rooms.join.count("!esc\"aped:example.com"), 1);
+}
+
+TEST(SyncParser, ByteByByte)
+{
+        const mtx::responses::Sync expected = json::parse(sync_data);
+
+        SyncParser parser;
+        for (const auto &c : sync_data) {
+                EXPECT_FALSE(parser.is_done());
+                parser.feed(&c, 1);
+        }
+
+        EXPECT_TRUE(parser.is_done());
+        expect_same(expected, parser.finish());
+}
+
+TEST(SyncParser, IncompleteBody)
+{
+        SyncParser parser;
+        parser.feed(sync_data.substr(0, sync_data.size() / 2));
+
+        EXPECT_FALSE(parser.is_done());
+        EXPECT_THROW(parser.finish(), std::runtime_error);
+}
+
+TEST(SyncParser, MalformedRoom)
+{
+        SyncParser parser;
+        EXPECT_THROW(parser.feed(R"({"rooms": {"join": {"!r:example.com": {"timeline": [}}}})"),
+                     std::exception);
+}
+
+TEST(SyncParser, RoomHandlers)
+{
+        std::vector<std::string> joined;
+
+        SyncRoomHandlers handlers;
+        handlers.join = [&joined](const std::string &room_id, mtx::responses::JoinedRoom room) {
+                joined.push_back(room_id);
+
+                if (room_id == "!726s6s6q:example.com") {
+                        EXPECT_EQ(room.timeline.events.size(), 2);
+                }
+        };
+
+        SyncParser parser(handlers);
+        parser.feed(sync_data);
+
+        const auto sync = parser.finish();
+
+        EXPECT_EQ(joined.size(), 2);
+        EXPECT_TRUE(sync.rooms.join.empty());
+        EXPECT_EQ(sync.rooms.leave.size(), 1);
+        EXPECT_EQ(sync.rooms.invite.size(), 1);
+        EXPECT_EQ(sync.next_batch, "s72595_4483_1934");
+}
@@ -0,0 +1,252 @@
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include "client.hpp"
+#include "mock_homeserver.hpp"
+#include "mtx/requests.hpp"
+#include "mtx/responses.hpp"
+#include "traffic_recorder.hpp"
+#include "traffic_replay.hpp"
+
+//
+// Recording the traffic of a client, and replaying it from the mock homeserver.
+//
+
+using namespace mtx::client;
+using namespace mtx::client::testing;
+namespace http = boost::beast::http;
+
+namespace {
+
+//! A path for a recording, removed at the end of the test.
+class TempFile
+{
+public:
+        TempFile()
+          : path_{"/tmp/mtxclient_traffic_" + std::to_string(::getpid()) + ".mtxr"}
+        {}
+        ~TempFile() { std::remove(path_.c_str()); }
+
+        const std::string &path() const { return path_; }
+
+private:
+        std::string path_;
+};
+
+std::vector<TrafficRecord>
+read_records(const std::string &path)
+{
+        boost::system::error_code ec;
+        auto reader = TrafficReader::open(path, ec);
+        EXPECT_TRUE(reader) << ec.message();
+
+        std::vector<TrafficRecord> records;
+        if (!reader)
+                return records;
+
+        TrafficRecord record;
+        while (reader->next(record, ec))
+                records.push_back(record);
+
+        EXPECT_FALSE(ec) << ec.message();
+        return records;
+}
+}
+
+TEST(TrafficRecorder, Redaction)
+{
+        std::string json = R"({"user":"alice", "password" : "se\"cret","x":1})";
+        redact_secrets(json);
+        EXPECT_EQ(json, R"({"user":"alice", "password" : "REDACTED","x":1})");
+
+        json = R"({"access_token":"abc","refresh_token":"def","device_id":"D"})";
+        redact_secrets(json);
+        EXPECT_EQ(json,
+                  R"({"access_token":"REDACTED","refresh_token":"REDACTED","device_id":"D"})");
+
+        std::string target = "/sync?access_token=abc&since=s1";
+        redact_secrets(target);
+        EXPECT_EQ(target, "/sync?access_token=REDACTED&since=s1");
+
+        target = "/sync?since=s1&access_token=abc";
+        redact_secrets(target);
+        EXPECT_EQ(target, "/sync?since=s1&access_token=REDACTED");
+
+        // Only the keys & the parameters are redacted.
+        std::string text = R"({"body":"my password is hunter2"})";
+        redact_secrets(text);
+        EXPECT_EQ(text, R"({"body":"my password is hunter2"})");
+}
+
+TEST(TrafficRecorder, NotARecording)
+{
+        TempFile file;
+
+        auto out = std::fopen(file.path().c_str(), "w");
+        ASSERT_TRUE(out);
+        std::fputs("not a recording", out);
+        std::fclose(out);
+
+        boost::system::error_code ec;
+        EXPECT_FALSE(TrafficReader::open(file.path(), ec));
+        EXPECT_TRUE(ec);
+}
+
+TEST(TrafficRecorder, Record)
+{
+        TempFile file;
+        MockHomeserver server;
+
+        boost::system::error_code ec;
+        auto recorder = TrafficRecorder::open(file.path(), ec);
+        ASSERT_TRUE(recorder) << ec.message();
+
+        auto client = std::make_shared<Client>(server.address());
+        client->set_recorder(recorder);
+
+        client->login("alice", "secret", boost::asio::use_future).get();
+
+        mtx::requests::CreateRoom req;
+        req.name        = "Name";
+        const auto room = client->create_room(req, boost::asio::use_future).get().room_id;
+
+        client->join_room(room, boost::asio::use_future).get();
+        client->sync("", "", false, 0, boost::asio::use_future).get();
+
+        // Not recorded.
+        client->set_recorder(nullptr);
+        client->leave_room(room, boost::asio::use_future).get();
+
+        client->close();
+        EXPECT_EQ(recorder->records(), 4);
+        recorder->close();
+
+        const auto records = read_records(file.path());
+        ASSERT_EQ(records.size(), 4);
+
+        EXPECT_EQ(records[0].method, http::verb::post);
+        EXPECT_EQ(records[0].target, "/_matrix/client/r0/login");
+        EXPECT_EQ(records[0].status, 200);
+        EXPECT_EQ(records[1].target, "/_matrix/client/r0/createRoom");
+        EXPECT_EQ(records[2].target, "/_matrix/client/r0/rooms/!created0:localhost/join");
+        EXPECT_EQ(records[3].method, http::verb::get);
+        EXPECT_EQ(records[3].response_body, server.sync_body());
+
+        // The secrets are gone.
+        EXPECT_EQ(records[0].request_body.find("secret"), std::string::npos);
+        EXPECT_NE(records[0].request_body.find("\"password\":\"REDACTED\""), std::string::npos);
+        EXPECT_NE(records[0].response_body.find("\"access_token\":\"REDACTED\""),
+                  std::string::npos);
+
+        // Only the fields describing the body are kept.
+        EXPECT_NE(records[0].response_fields.find("Content-Type: application/json\r\n"),
+                  std::string::npos);
+        EXPECT_EQ(records[0].response_fields.find("Content-Length"), std::string::npos);
+
+        for (std::size_t i = 1; i < records.size(); ++i)
+                EXPECT_GE(records[i].start, records[i - 1].start + records[i - 1].duration);
+}
+
+TEST(TrafficRecorder, Replay)
+{
+        TempFile file;
+
+        {
+                MockHomeserver server;
+
+                boost::system::error_code ec;
+                auto recorder = TrafficRecorder::open(file.path(), ec);
+                ASSERT_TRUE(recorder) << ec.message();
+
+                auto client = std::make_shared<Client>(server.address());
+                client->set_recorder(recorder);
+
+                client->login("alice", "secret", boost::asio::use_future).get();
+                client->sync("", "", false, 0, boost::asio::use_future).get();
+
+                client->close();
+                recorder->close();
+        }
+
+        boost::system::error_code ec;
+        auto replay = TrafficReplay::load(file.path(), 0, ec);
+        ASSERT_TRUE(replay) << ec.message();
+        ASSERT_EQ(replay->records().size(), 2);
+
+        // The canned responses of this server differ from the recorded ones.
+        MockOptions options;
+        options.password   = "other";
+        options.sync_rooms = 1;
+        options.responder  = replay->responder();
+
+        MockHomeserver server(options);
+        auto client = std::make_shared<Client>(server.address());
+
+        // Concurrently, more times than they were recorded.
+        std::vector<std::future<mtx::responses::Sync>> syncs;
+        for (int i = 0; i < 8; ++i)
+                syncs.push_back(client->sync("", "", false, 0, boost::asio::use_future));
+
+        for (auto &sync : syncs)
+                EXPECT_EQ(sync.get().rooms.join.size(), 10);
+
+        const auto login = client->login("alice", "secret", boost::asio::use_future).get();
+        EXPECT_EQ(login.user_id.toString(), "@alice:localhost");
+        EXPECT_EQ(login.access_token, "REDACTED");
+
+        // What wasn't recorded gets the canned responses.
+        mtx::requests::CreateRoom req;
+        EXPECT_EQ(client->create_room(req, boost::asio::use_future).get().room_id.toString(),
+                  "!created0:localhost");
+
+        client->close();
+}
+
+TEST(TrafficRecorder, ScaledTiming)
+{
+        TempFile file;
+
+        {
+                MockOptions options;
+                options.latency = std::chrono::milliseconds(200);
+
+                MockHomeserver server(options);
+
+                boost::system::error_code ec;
+                auto recorder = TrafficRecorder::open(file.path(), ec);
+                ASSERT_TRUE(recorder) << ec.message();
+
+                auto client = std::make_shared<Client>(server.address());
+                client->set_recorder(recorder);
+                client->sync("", "", false, 0, boost::asio::use_future).get();
+                client->close();
+                recorder->close();
+        }
+
+        boost::system::error_code ec;
+        auto replay = TrafficReplay::load(file.path(), 0.5, ec);
+        ASSERT_TRUE(replay) << ec.message();
+        ASSERT_EQ(replay->records().size(), 1);
+        EXPECT_GE(replay->records()[0].duration, std::chrono::milliseconds(200));
+
+        MockOptions options;
+        options.responder = replay->responder();
+
+        MockHomeserver server(options);
+        auto client = std::make_shared<Client>(server.address());
+
+        const auto start = std::chrono::steady_clock::now();
+        client->sync("", "", false, 0, boost::asio::use_future).get();
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+
+        EXPECT_GE(elapsed, std::chrono::milliseconds(100));
+        EXPECT_LT(elapsed, replay->records()[0].duration);
+
+        client->close();
+}
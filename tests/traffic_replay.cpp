@@ -0,0 +1,105 @@
+#include "traffic_replay.hpp"
+
+using namespace mtx::client::testing;
+namespace http = boost::beast::http;
+
+namespace {
+
+//! The key of the routes: the method & the target without its query.
+std::string
+route_key(http::verb method, boost::beast::string_view target)
+{
+        target = target.substr(0, target.find('?'));
+
+        const auto name = http::to_string(method);
+        return std::string(name.data(), name.size()).append(" ").append(
+          target.data(), target.size());
+}
+}
+
+std::shared_ptr<TrafficReplay>
+TrafficReplay::load(const std::string &path, double time_scale, boost::system::error_code &ec)
+{
+        auto reader = TrafficReader::open(path, ec);
+        if (!reader)
+                return nullptr;
+
+        std::vector<TrafficRecord> records;
+
+        TrafficRecord record;
+        while (reader->next(record, ec))
+                records.push_back(std::move(record));
+
+        if (ec)
+                return nullptr;
+
+        return std::make_shared<TrafficReplay>(std::move(records), time_scale);
+}
+
+TrafficReplay::TrafficReplay(std::vector<TrafficRecord> records, double time_scale)
+  : records_{std::move(records)}
+  , time_scale_{time_scale}
+{
+        for (const auto &record : records_)
+                routes_[route_key(record.method, record.target)].records.push_back(&record);
+}
+
+bool
+TrafficReplay::respond(const MockRequest &request,
+                       MockResponse &response,
+                       std::chrono::microseconds &delay)
+{
+        const TrafficRecord *record = nullptr;
+
+        {
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                auto it = routes_.find(route_key(request.method(), request.target()));
+                if (it == routes_.end())
+                        return false;
+
+                auto &route = it->second;
+                record      = route.records[route.next];
+                route.next  = (route.next + 1) % route.records.size();
+        }
+
+        response.result(record->status);
+
+        // One "Name: value\r\n" line per field.
+        const boost::beast::string_view fields = record->response_fields;
+        std::size_t pos                        = 0;
+        while (pos < fields.size()) {
+                auto end = fields.find("\r\n", pos);
+                if (end == boost::beast::string_view::npos)
+                        end = fields.size();
+
+                const auto line  = fields.substr(pos, end - pos);
+                const auto colon = line.find(':');
+                if (colon != boost::beast::string_view::npos) {
+                        auto value = line.substr(colon + 1);
+                        while (!value.empty() && value.front() == ' ')
+                                value.remove_prefix(1);
+
+                        response.insert(line.substr(0, colon), value);
+                }
+
+                pos = end + 2;
+        }
+
+        response.body() = record->response_body;
+        response.prepare_payload();
+
+        delay = std::chrono::duration_cast<std::chrono::microseconds>(record->duration *
+                                                                      time_scale_);
+        return true;
+}
+
+MockResponder
+TrafficReplay::responder()
+{
+        return [self = shared_from_this()](const MockRequest &request,
+                                           MockResponse &response,
+                                           std::chrono::microseconds &delay) {
+                return self->respond(request, response, delay);
+        };
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/system/error_code.hpp>
+
+#include "mock_homeserver.hpp"
+#include "traffic_recorder.hpp"
+
+namespace mtx {
+namespace client {
+namespace testing {
+
+//! Serves the responses of a recording (see `TrafficRecorder`) from the mock homeserver.
+//! A request gets the next recorded response to the same method & path, in the order
+//! they were recorded, starting over once they've all been served. Its delay is the
+//! recorded duration of the request, scaled.
+class TrafficReplay : public std::enable_shared_from_this<TrafficReplay>
+{
+public:
+        //! Read the whole recording. Returns nullptr on failure.
+        static std::shared_ptr<TrafficReplay> load(const std::string &path,
+                                                   double time_scale,
+                                                   boost::system::error_code &ec);
+
+        //! The scale applies to the recorded durations: 0 answers right away,
+        //! while 1 reproduces the timing of the recording.
+        explicit TrafficReplay(std::vector<TrafficRecord> records, double time_scale = 1);
+
+        //! The records, in the order they were recorded.
+        const std::vector<TrafficRecord> &records() const { return records_; }
+
+        //! Answer the request with the next matching record, if there is one.
+        bool respond(const MockRequest &request,
+                     MockResponse &response,
+                     std::chrono::microseconds &delay);
+
+        //! A responder for the options of the mock homeserver, which keeps the replay alive.
+        MockResponder responder();
+
+private:
+        //! The records of each method & path, and the one served next.
+        struct Route
+        {
+                std::vector<const TrafficRecord *> records;
+                std::size_t next = 0;
+        };
+
+        std::vector<TrafficRecord> records_;
+        double time_scale_;
+
+        std::mutex mutex_;
+        std::map<std::string, Route> routes_;
+};
+}
+}
+}